@@ -0,0 +1,417 @@
+/*
+Contains the batch mode: the manifest reader, the asset cache the jobs share, and the loop that renders one job
+while the next one loads.
+
+*/
+
+#include "batch.h"
+#include "benchmark.h"
+#include "renderer.h"
+#include "scene.h"
+#include "image.h"
+#include "trace.h"
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <filesystem>
+
+using namespace std;
+
+// One obj file of a job, with the look the job gives it
+struct BatchObject
+{
+    string file;
+    string material = "diffuse";
+    int phongExponent = 10;
+    Color color = Color(0.8, 0.8, 0.8);
+    Color emission = Color(0, 0, 0);
+};
+
+struct BatchJob
+{
+    int line = 0;
+    string scene;
+    double stressScale = 1.0;
+    vector<BatchObject> objects;
+    string environment;
+    double environmentScale = 1.0;
+    int width, height, sampleCount, maxDepth;
+    unsigned int seed;
+    Vec3 cameraMove;
+    double cameraYaw = 0;
+    string output;
+};
+
+static double secondsSince(chrono::high_resolution_clock::time_point start)
+{
+    chrono::duration<double> elapsed = chrono::high_resolution_clock::now() - start;
+    return elapsed.count();
+}
+
+static vector<double> parseNumbers(const string& text)
+{
+    vector<double> numbers;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+        numbers.push_back(atof(item.c_str()));
+    return numbers;
+}
+
+// parses one manifest line into job; returns an error message, or an empty string
+static string parseJob(const string& line, BatchJob& job)
+{
+    istringstream iss(line);
+    string token;
+    while (iss >> token)
+    {
+        size_t equals = token.find('=');
+        if (equals == string::npos)
+            return "expected key=value, got " + token;
+        string key = token.substr(0, equals);
+        string value = token.substr(equals + 1);
+        vector<double> numbers = parseNumbers(value);
+        if (value.empty())
+            return "missing value for " + key;
+
+        // material, color and emission belong to the obj before them
+        if ((key == "material" || key == "color" || key == "emission") && job.objects.empty())
+            return key + " has no obj before it";
+
+        if (key == "obj")
+        {
+            BatchObject object;
+            object.file = value;
+            job.objects.push_back(object);
+        }
+        else if (key == "material")
+        {
+            BatchObject& object = job.objects.back();
+            object.material = value.substr(0, value.find(','));
+            if (object.material != "diffuse" && object.material != "mirror" && object.material != "phong")
+                return "unknown material " + object.material;
+            if (numbers.size() == 2)
+                object.phongExponent = int(numbers[1]);
+        }
+        else if (key == "color" && numbers.size() == 3)
+            job.objects.back().color = Color(numbers[0], numbers[1], numbers[2]);
+        else if (key == "emission" && numbers.size() == 3)
+            job.objects.back().emission = Color(numbers[0], numbers[1], numbers[2]);
+        else if (key == "scene") job.scene = value;
+        else if (key == "scale") job.stressScale = numbers[0];
+        else if (key == "env")
+        {
+            job.environment = value.substr(0, value.find(','));
+            if (numbers.size() == 2)
+                job.environmentScale = numbers[1];
+        }
+        else if (key == "width") job.width = int(numbers[0]);
+        else if (key == "height") job.height = int(numbers[0]);
+        else if (key == "spp") job.sampleCount = int(numbers[0]);
+        else if (key == "seed") job.seed = (unsigned int)numbers[0];
+        else if (key == "depth") job.maxDepth = int(numbers[0]);
+        else if (key == "yaw") job.cameraYaw = numbers[0];
+        else if (key == "camera" && numbers.size() == 3) job.cameraMove = Vec3(numbers[0], numbers[1], numbers[2]);
+        else if (key == "out") job.output = value;
+        else
+            return "bad option " + token;
+    }
+
+    if (job.output.empty())
+        return "missing out=";
+    if (job.scene.empty() && job.objects.empty())
+        return "no scene= or obj=";
+    if (job.width <= 0 || job.height <= 0 || job.sampleCount <= 0)
+        return "width, height and spp must be positive";
+    return "";
+}
+
+static bool readManifest(const BatchConfig& config, vector<BatchJob>& jobs)
+{
+    ifstream file(config.manifest);
+    if (!file.is_open())
+    {
+        cerr << "Error: Could not open manifest " << config.manifest << "\n";
+        return false;
+    }
+
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line))
+    {
+        lineNumber++;
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == string::npos)
+            continue;
+
+        BatchJob job;
+        job.line = lineNumber;
+        job.width = config.imageWidth;
+        job.height = config.imageHeight;
+        job.sampleCount = config.sampleCount;
+        job.maxDepth = config.integrator.maxDepth;
+        job.seed = config.seed;
+        string error = parseJob(line, job);
+        if (!error.empty())
+        {
+            cerr << "Error: " << config.manifest << " line " << lineNumber << ": " << error << "\n";
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// The meshes of obj files, shared by every job that uses the same contents with the same color and emission.
+// Jobs place them with instances, which carry each job's material.
+class AssetCache
+{
+    public:
+
+    AssetCache() : placeholder(make_unique<simpleDiffuseBSDF>()) {}
+
+    // The built mesh of the file, parsed the first time its contents are seen with this look. nullptr if the file
+    // can not be read or has no triangles.
+    const Mesh* mesh(const BatchObject& object);
+
+    int parsed() const { return int(meshes.size()); }
+    int uses() const { return lookups; }
+
+    private:
+
+    // The content hash of a file, which is only read again once its size or modification time changes
+    struct FileHash
+    {
+        filesystem::file_time_type modified;
+        uintmax_t size;
+        string hash;
+    };
+    bool hashFile(const string& file, string& hash);
+
+    mutex lock;
+    map<string, unique_ptr<Mesh>> meshes;
+    map<string, FileHash> fileHashes;
+    int lookups = 0;
+
+    // what the meshes' triangles point to; every instance replaces it with the job's material
+    unique_ptr<BSDF> placeholder;
+};
+
+// FNV-1a, which is plenty to tell files apart
+static unsigned long long hashContents(const string& contents)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    for (unsigned char c : contents)
+    {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool AssetCache::hashFile(const string& file, string& hash)
+{
+    error_code error;
+    FileHash current;
+    current.modified = filesystem::last_write_time(file, error);
+    current.size = error ? 0 : filesystem::file_size(file, error);
+    if (error)
+    {
+        cerr << "Error: Could not open OBJ file " << file << "\n";
+        return false;
+    }
+
+    auto known = fileHashes.find(file);
+    if (known != fileHashes.end() && known->second.modified == current.modified && known->second.size == current.size)
+    {
+        hash = known->second.hash;
+        return true;
+    }
+
+    ifstream in(file, ios::binary);
+    stringstream contents;
+    contents << in.rdbuf();
+
+    ostringstream text;
+    text << hex << hashContents(contents.str());
+
+    // mtllib and texture names are relative to the file, so the same text elsewhere may mean other textures
+    if (contents.str().find("mtllib") != string::npos)
+        text << " " << filesystem::absolute(file).parent_path().string();
+
+    current.hash = text.str();
+    fileHashes[file] = current;
+    hash = current.hash;
+    return true;
+}
+
+const Mesh* AssetCache::mesh(const BatchObject& object)
+{
+    lock_guard<mutex> guard(lock);
+    string hash;
+    if (!hashFile(object.file, hash))
+        return nullptr;
+
+    ostringstream key;
+    key << hash << " " << object.color << " " << object.emission;
+
+    lookups++;
+    auto found = meshes.find(key.str());
+    if (found != meshes.end())
+        return found->second.get();
+
+    auto mesh = make_unique<Mesh>();
+    readObj(object.file, *mesh, object.color, object.emission, placeholder.get());
+    if (mesh->triangles.empty())
+        return nullptr;
+    mesh->build();
+    return meshes.emplace(key.str(), std::move(mesh)).first->second.get();
+}
+
+static BSDF* addJobMaterial(Scene& scene, const BatchObject& object)
+{
+    if (object.material == "mirror")
+        return scene.addMaterial<mirrorBSDF>();
+    if (object.material == "phong")
+    {
+        phongBSDF* phong = scene.addMaterial<phongBSDF>();
+        phong->phongExponent = object.phongExponent;
+        return phong;
+    }
+    return scene.addMaterial<simpleDiffuseBSDF>();
+}
+
+struct PreparedJob
+{
+    unique_ptr<Scene> scene;    // null if it failed to load
+    double loadSeconds = 0;
+};
+
+static PreparedJob prepareJob(const BatchJob& job, AssetCache& assets)
+{
+    TRACE_SCOPE("load job", job.line);
+    auto start = chrono::high_resolution_clock::now();
+
+    PreparedJob prepared;
+    auto scene = make_unique<Scene>();
+    if (!job.scene.empty() && !loadBenchmarkScene(*scene, job.scene, job.stressScale))
+        return prepared;
+
+    for (const BatchObject& object : job.objects)
+    {
+        const Mesh* mesh = assets.mesh(object);
+        if (mesh == nullptr)
+            return prepared;
+        scene->addInstance(mesh, Transform(), addJobMaterial(*scene, object));
+    }
+
+    if (!job.environment.empty())
+    {
+        scene->environment = make_unique<EnvironmentLight>();
+        if (!scene->environment->load(job.environment, job.environmentScale))
+            return prepared;
+    }
+
+    // the shared meshes are built already, so this only builds the job's own triangles and the top level
+    scene->build();
+    prepared.scene = std::move(scene);
+    prepared.loadSeconds = secondsSince(start);
+    return prepared;
+}
+
+int runBatch(const BatchConfig& config)
+{
+    vector<BatchJob> jobs;
+    if (!readManifest(config, jobs))
+        return 1;
+    if (jobs.empty())
+    {
+        cerr << "Error: " << config.manifest << " has no jobs\n";
+        return 1;
+    }
+
+    cout << "Batch: " << jobs.size() << " jobs from " << config.manifest << ", " << resolveThreadCount(config.threads)
+        << " threads, " << (config.overlapLoading ? "loading the next job while rendering" : "loading between jobs")
+        << endl;
+    cout << setw(6) << "line" << setw(11) << "triangles" << setw(10) << "load(s)" << setw(10) << "wait(s)"
+        << setw(11) << "render(s)" << setw(10) << "write(s)" << "  output" << endl;
+
+    auto batchStart = chrono::high_resolution_clock::now();
+    AssetCache assets;
+    int failed = 0;
+    double renderSeconds = 0;
+
+    auto load = [&](size_t k) { return async(launch::async, prepareJob, cref(jobs[k]), ref(assets)); };
+    future<PreparedJob> next = load(0);
+
+    for (size_t k = 0; k < jobs.size(); k++)
+    {
+        const BatchJob& job = jobs[k];
+        TRACE_SCOPE("job", job.line);
+
+        auto waitStart = chrono::high_resolution_clock::now();
+        PreparedJob prepared = next.get();
+        double waitSeconds = secondsSince(waitStart);
+
+        if (config.overlapLoading && k + 1 < jobs.size())
+            next = load(k + 1);
+
+        if (prepared.scene == nullptr)
+        {
+            cerr << "Error: Could not load the scene of line " << job.line << ", skipping it\n";
+            failed++;
+        }
+        else
+        {
+            Camera camera;
+            camera.place(job.cameraMove, job.cameraYaw);
+
+            MISIntegrator integrator = config.integrator;
+            integrator.maxDepth = job.maxDepth;
+
+            RenderSettings settings;
+            settings.imageWidth = job.width;
+            settings.imageHeight = job.height;
+            settings.sampleCount = job.sampleCount;
+            settings.threads = config.threads;
+            settings.deterministic = true;
+            settings.seed = job.seed;
+            settings.showProgress = false;
+
+            Image image(job.width, job.height);
+            RenderStats stats = renderImage(*prepared.scene, integrator, camera, settings, image);
+            renderSeconds += stats.seconds;
+
+            auto writeStart = chrono::high_resolution_clock::now();
+            const string pfm = ".pfm";
+            const size_t length = job.output.size();
+            if (length > pfm.size() && job.output.compare(length - pfm.size(), pfm.size(), pfm) == 0)
+                image.saveImagePFM(job.output);
+            else
+                image.saveImageBMP(job.output);
+            double writeSeconds = secondsSince(writeStart);
+
+            cout << setw(6) << job.line << setw(11) << prepared.scene->instancedTriangleCount()
+                << setw(10) << fixed << setprecision(3) << prepared.loadSeconds << setw(10) << waitSeconds
+                << setw(11) << stats.seconds << setw(10) << writeSeconds << defaultfloat << "  " << job.output << endl;
+        }
+
+        if (!config.overlapLoading && k + 1 < jobs.size())
+            next = load(k + 1);
+    }
+
+    double totalSeconds = secondsSince(batchStart);
+    cout << "Rendered " << jobs.size() - failed << " of " << jobs.size() << " jobs in " << fixed << setprecision(2)
+        << totalSeconds << " seconds (" << (jobs.size() - failed) / totalSeconds << " jobs/s, "
+        << 100.0 * renderSeconds / totalSeconds << "% of the time rendering)" << defaultfloat << setprecision(6) << endl;
+    cout << "Asset cache: " << assets.uses() << " obj uses, " << assets.parsed() << " parsed" << endl;
+    return failed > 0 ? 1 : 0;
+}
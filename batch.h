@@ -0,0 +1,57 @@
+/*
+Contains the batch mode, which renders a manifest of jobs (each a scene, a camera, a sample count and an output
+file) in one process, for catalogs of many small renders that would otherwise cost a process launch each.
+
+The manifest has one job per line, as key=value words (# starts a comment):
+
+    obj=shoe.obj material=phong,40 color=0.8,0.2,0.2 obj=studio_lights.obj emission=40,40,40 camera=0,0,0.5
+        yaw=15 width=512 height=512 spp=64 out=shots/shoe_front.bmp
+
+    obj=file.obj        adds an obj file to the job's scene; material=diffuse|mirror|phong[,exponent], color=r,g,b
+                        and emission=r,g,b set how the obj before them looks (diffuse, 0.8 grey and no emission
+                        unless given)
+    scene=name          starts from loadBenchmarkScene's scene instead (default, stress, ..., file.obj), with
+                        scale=s for the stress scenes
+    env=file.pfm[,s]    an environment light (see environmentLight.h), scaled by s
+    camera=x,y,z yaw=d  moves and turns the camera as Camera::place does
+    width= height= spp= seed= depth=    as in RenderSettings and MISIntegrator, defaulting to BatchConfig's
+    out=file            required; a .pfm name saves floats, anything else a BMP
+
+Jobs share what they load. An obj file is parsed into a Mesh once per distinct content and color and emission,
+and every job that uses it places an instance of it with its own material, so the mesh's triangles and BVH are
+built once for the whole batch. Contents are told apart by a hash of the file, so copies and renames share a mesh
+and an edited file is parsed again; a file is only read again to hash it once its size or modification time
+changes. Scenes named with scene= are loaded per job.
+
+While a job renders, the next job's scene is loaded and built on another thread, so loading only costs time when
+it is slower than rendering. The render threads are OpenMP's, which keeps them alive between renders, so every
+job after the first starts on a warm pool.
+
+*/
+
+#pragma once
+
+#include <string>
+#include "lightTransport.h"
+
+struct BatchConfig
+{
+    std::string manifest;
+
+    // Defaults for the jobs that do not set them
+    int imageWidth = 256;
+    int imageHeight = 256;
+    int sampleCount = 16;
+    unsigned int seed = 12345;
+    MISIntegrator integrator;
+
+    // as in RenderSettings
+    int threads = 0;
+
+    // Loads the next job while the current one renders; off loads every job only once the one before is written
+    bool overlapLoading = true;
+};
+
+// Renders every job of the manifest and prints how long each one waited for its scene, rendered and wrote its
+// image. A job that fails to load is skipped. Returns 1 if the manifest could not be read or any job failed.
+int runBatch(const BatchConfig& config);
@@ -0,0 +1,590 @@
+/*
+Contains the subpath generation, the connections and their MIS weights, and the render loop of the bidirectional
+path tracer.
+
+The weights follow Veach's thesis as pbrt implements them: every vertex stores the area pdf with which its own
+subpath sampled it (pdfFwd) and the one with which the other direction would have (pdfRev), and the weight of a
+connection comes from the ratios of the two along the path. Only the pdfs at the connection change, so the
+connection temporarily overwrites those four and puts them back.
+
+*/
+
+#include "bdpt.h"
+#include "renderer.h"
+#include "scene.h"
+#include "image.h"
+#include "counters.h"
+#include "trace.h"
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <iomanip>
+#include <algorithm>
+
+#include <omp.h>
+
+const double PI = 3.14159265358979323846;
+
+// Splats are summed as integers in units of 1 / fixedPointScale, which keeps the atomic adds exact
+const double fixedPointScale = 65536.0;
+const double maxSplatValue = 1e6;
+
+enum class VertexType
+{
+    Camera,
+    Light,      // the start of the light subpath
+    Surface
+};
+
+struct PathVertex
+{
+    VertexType type = VertexType::Surface;
+    Point p;
+    Vec3 n;             // the surface (or light) normal, or the camera's forward direction
+    Color beta;         // throughput of the subpath up to and including this vertex
+    Color color;        // base color at a surface
+    BSDF* bsdf = nullptr;
+    Color emission;     // emitted radiance of an emissive surface or the light
+    double area = 0;    // world space area of an emissive triangle
+    bool delta = false;
+
+    // area pdfs of sampling this vertex from its subpath's previous vertex, and from the next one going the
+    // other way
+    double pdfFwd = 0;
+    double pdfRev = 0;
+
+    bool onSurface() const {return type != VertexType::Camera;}
+    bool isEmitter() const {return emission.lengthSquared() > 0;}
+    bool connectible() const {return !delta;}
+};
+
+// The pinhole camera of Camera::generateRay, with the inverse it needs to project points into the image. The
+// image plane is 1 away from the origin, and the camera's transform only moves and turns it.
+struct CameraModel
+{
+    Point position;
+    Vec3 forward, right, up;
+    double planeArea;
+    int width, height;
+
+    CameraModel(const Camera& camera, int imageWidth, int imageHeight)
+    {
+        position = camera.transform.applyPoint(camera.origin);
+        forward = unit(camera.transform.applyVector(Vec3(0, 0, -1)));
+        right = unit(camera.transform.applyVector(Vec3(1, 0, 0)));
+        up = unit(camera.transform.applyVector(Vec3(0, 1, 0)));
+        planeArea = camera.viewPortWidth * camera.viewPortHeight;
+        width = imageWidth;
+        height = imageHeight;
+        viewPortWidth = camera.viewPortWidth;
+        viewPortHeight = camera.viewPortHeight;
+    }
+
+    // The pixel p is seen in, and the cosine between the view direction and forward. False if p is not in the
+    // image.
+    bool project(const Point& p, int& x, int& y, double& cosTheta) const
+    {
+        Vec3 d = p - position;
+        double z = dot(d, forward);
+        if (z <= 0)
+            return false;
+        double px = dot(d, right) / z * width / viewPortWidth + width / 2.0;
+        double py = dot(d, up) / z * height / viewPortHeight + height / 2.0;
+
+        // generateRay puts pixel x's samples in [x - 0.5, x + 0.5)
+        x = int(std::floor(px + 0.5));
+        y = int(std::floor(py + 0.5));
+        if (x < 0 || x >= width || y < 0 || y >= height)
+            return false;
+        cosTheta = z / d.length();
+        return true;
+    }
+
+    // Solid angle pdf of the camera generating a ray in this direction (uniform over the image plane)
+    double directionPdf(double cosTheta) const
+    {
+        return 1.0 / (planeArea * cosTheta * cosTheta * cosTheta);
+    }
+
+    private:
+
+    double viewPortWidth, viewPortHeight;
+};
+
+// Turns a solid angle pdf at `from` into an area pdf at `to`
+static double convertDensity(double pdf, const PathVertex& from, const PathVertex& to)
+{
+    Vec3 w = to.p - from.p;
+    double distanceSQR = w.lengthSquared();
+    if (distanceSQR == 0)
+        return 0;
+    pdf /= distanceSQR;
+    if (to.onSurface())
+        pdf *= std::fabs(dot(to.n, w / std::sqrt(distanceSQR)));
+    return pdf;
+}
+
+// Area pdf at `next` of an emitter at v sending light towards it (cosine distributed, front side only)
+static double pdfLight(const PathVertex& v, const PathVertex& next)
+{
+    Vec3 w = unit(next.p - v.p);
+    double cosine = dot(v.n, w);
+    if (cosine <= 0)
+        return 0;
+    return convertDensity(cosine / PI, v, next);
+}
+
+// Area pdf of picking the point of the emitter at v when starting a light subpath
+static double pdfLightOrigin(const PathVertex& v, size_t lightCount)
+{
+    if (lightCount == 0 || v.area <= 0)
+        return 0;
+    return 1.0 / (lightCount * v.area);
+}
+
+// Area pdf at `next` of v's subpath continuing there, having arrived from prev
+static double pdfVertex(const PathVertex& v, const PathVertex* prev, const PathVertex& next, const CameraModel& camera)
+{
+    if (v.type == VertexType::Light)
+        return pdfLight(v, next);
+
+    if (v.type == VertexType::Camera)
+    {
+        int x, y;
+        double cosTheta;
+        if (!camera.project(next.p, x, y, cosTheta))
+            return 0;
+        return convertDensity(camera.directionPdf(cosTheta), v, next);
+    }
+
+    Vec3 toPrev, toNext;
+    toLocal(unit(prev->p - v.p), v.n, toPrev);
+    toLocal(unit(next.p - v.p), v.n, toNext);
+    return convertDensity(v.bsdf->pdf(toPrev, toNext), v, next);
+}
+
+// The BSDF at a surface vertex for light going between the directions to a and b, where a is on the camera's side
+// (the same order MISIntegrator calls BSDF::f in)
+static Color evaluateBSDF(const PathVertex& v, const Point& a, const Point& b)
+{
+    Vec3 toA, toB;
+    toLocal(unit(a - v.p), v.n, toA);
+    toLocal(unit(b - v.p), v.n, toB);
+    return v.bsdf->f(toA, toB, v.color);
+}
+
+// Extends the subpath in `path` (which holds its first vertex) along r for up to maxBounces more surfaces.
+// beta and pdf are the throughput and solid angle pdf of r. Light subpaths (importance) evaluate the BSDFs with
+// the directions the other way around, so both kinds of subpath see the same BSDF values. If the subpath leaves
+// the scene, `escaped` (when given) is set to the environment light it sees, times its throughput.
+static void randomWalk(const Scene& scene, Ray r, SimpleSampler& sample, Color beta, double pdf, int maxBounces,
+    bool importance, std::vector<PathVertex>& path, Color* escaped = nullptr)
+{
+    double pdfFwd = pdf;
+    for (int bounces = 0; bounces < maxBounces; )
+    {
+        COUNTER_INC(rays);
+        Intersection hit = sceneIntersection(scene, r);
+        if (!hit.valid)
+        {
+            COUNTER_INC(escaped);
+            if (escaped != nullptr && scene.environment)
+                *escaped = beta * scene.environment->Le(unit(r.direction()));
+            break;
+        }
+
+        PathVertex v;
+        v.p = hit.point;
+        v.n = unit(hit.normal);
+        v.beta = beta;
+        v.color = hit.baseColor;
+        v.bsdf = hit.hitTri.material;
+        v.emission = hit.hitTri.emission;
+        v.area = hit.area;
+        v.pdfFwd = convertDensity(pdfFwd, path.back(), v);
+        path.push_back(v);
+
+        if (++bounces >= maxBounces)
+            break;
+
+        PathVertex& current = path.back();
+        PathVertex& previous = path[path.size() - 2];
+
+        Vec3 wi_local, wo_local, wo_world;
+        toLocal(-unit(r.direction()), current.n, wi_local);
+
+        double pdfRev;
+        Color f = current.bsdf->sample_f(wi_local, wo_local, pdfFwd, current.color, sample);
+        if (pdfFwd <= 0)
+        {
+            COUNTER_INC(pdfTerminated);
+            break;
+        }
+        if (importance && !current.bsdf->isDelta())
+            f = current.bsdf->f(wo_local, wi_local, current.color);
+
+        beta *= f * std::fabs(wo_local.z()) / pdfFwd;
+        pdfRev = current.bsdf->pdf(wo_local, wi_local);
+        if (current.bsdf->isDelta())
+        {
+            current.delta = true;
+            pdfFwd = pdfRev = 0;
+        }
+        previous.pdfRev = convertDensity(pdfRev, current, previous);
+
+        toWorld(current.n, wo_local, wo_world);
+        r = bounceRay(hit, wo_world, current.bsdf->isDelta());
+    }
+}
+
+// escaped is set to the environment light the subpath sees if it leaves the scene, and to 0 otherwise
+static void cameraSubpath(const Scene& scene, const CameraModel& camera, const Ray& r, SimpleSampler& sample,
+    int maxVertices, std::vector<PathVertex>& path, Color& escaped)
+{
+    path.clear();
+    escaped = Color(0, 0, 0);
+    PathVertex v;
+    v.type = VertexType::Camera;
+    v.p = r.origin();
+    v.n = camera.forward;
+    v.beta = Color(1, 1, 1);
+    path.push_back(v);
+
+    // the camera's importance over its direction pdf is 1, so the camera subpath starts with a throughput of 1
+    double cosTheta = dot(unit(r.direction()), camera.forward);
+    randomWalk(scene, r, sample, Color(1, 1, 1), camera.directionPdf(cosTheta), maxVertices - 1, false, path,
+        &escaped);
+}
+
+static void lightSubpath(const Scene& scene, SimpleSampler& sample, int maxVertices, std::vector<PathVertex>& path)
+{
+    path.clear();
+    const std::vector<Triangle>& lights = scene.lights;
+    if (lights.empty())
+        return;
+
+    // the same choice of emitter and point as next event estimation
+    int index = std::min(static_cast<int>(sample.get1D() * lights.size()), int(lights.size()) - 1);
+    const Triangle& l = lights[index];
+    double u = sqrt(sample.get1D());
+    double v = sample.get1D();
+
+    PathVertex light;
+    light.type = VertexType::Light;
+    light.p = (1 - u) * l.a->pt + u * (1 - v) * l.b->pt + u * v * l.c->pt;
+    light.n = unit(l.a->n);
+    light.emission = l.emission;
+    light.area = 0.5 * cross(l.b->pt - l.a->pt, l.c->pt - l.a->pt).length();
+    light.pdfFwd = pdfLightOrigin(light, lights.size());
+    if (light.pdfFwd <= 0)
+        return;
+    light.beta = l.emission / light.pdfFwd;
+    path.push_back(light);
+
+    Vec3 local = sampleCosineHemisphere(sample);
+    double pdfDirection = cosineHemispherePdf(local);
+    if (pdfDirection <= 0)
+        return;
+    Vec3 direction;
+    toWorld(light.n, local, direction);
+
+    Color beta = light.beta * local.z() / pdfDirection;
+    randomWalk(scene, Ray(direction, light.p + light.n * 0.0001), sample, beta, pdfDirection, maxVertices - 1, true,
+        path);
+}
+
+static bool visible(const Scene& scene, const PathVertex& a, const PathVertex& b)
+{
+    // measured from the offset origin, or the ray would reach b's surface
+    Point origin = a.onSurface() ? a.p + a.n * 0.0001 : a.p;
+    Vec3 d = b.p - origin;
+    double distance = d.length();
+    COUNTER_INC(shadowRays);
+    return !sceneOccluded(scene, Ray(d / distance, origin), distance * 0.99999);
+}
+
+// Geometry term between two vertices, 0 if the segment leaves or enters a surface from behind
+static double geometry(const PathVertex& a, const PathVertex& b)
+{
+    Vec3 d = b.p - a.p;
+    double distanceSQR = d.lengthSquared();
+    if (distanceSQR == 0)
+        return 0;
+    Vec3 w = d / std::sqrt(distanceSQR);
+    double cosA = a.onSurface() ? dot(a.n, w) : 1.0;
+    double cosB = b.onSurface() ? -dot(b.n, w) : 1.0;
+    if (cosA <= 0 || cosB <= 0)
+        return 0;
+    return cosA * cosB / distanceSQR;
+}
+
+// The weight of the connection of s light and t camera vertices among every strategy that makes the same path
+static double misWeight(std::vector<PathVertex>& light, std::vector<PathVertex>& cameraPath, int s, int t,
+    size_t lightCount, const CameraModel& camera, MISHeuristic heuristic)
+{
+    if (s + t == 2)
+        return 1;
+
+    PathVertex* qs = s > 0 ? &light[s - 1] : nullptr;
+    PathVertex* pt = &cameraPath[t - 1];
+    PathVertex* qsMinus = s > 1 ? &light[s - 2] : nullptr;
+    PathVertex* ptMinus = t > 1 ? &cameraPath[t - 2] : nullptr;
+
+    // the pdfs the connection changes, put back before returning
+    const double savedPt = pt->pdfRev;
+    const double savedPtMinus = ptMinus != nullptr ? ptMinus->pdfRev : 0;
+    const double savedQs = qs != nullptr ? qs->pdfRev : 0;
+    const double savedQsMinus = qsMinus != nullptr ? qsMinus->pdfRev : 0;
+    const bool deltaPt = pt->delta;
+    const bool deltaQs = qs != nullptr && qs->delta;
+
+    pt->delta = false;
+    if (qs != nullptr)
+        qs->delta = false;
+
+    pt->pdfRev = s > 0 ? pdfVertex(*qs, qsMinus, *pt, camera) : pdfLightOrigin(*pt, lightCount);
+    if (ptMinus != nullptr)
+        ptMinus->pdfRev = s > 0 ? pdfVertex(*pt, qs, *ptMinus, camera) : pdfLight(*pt, *ptMinus);
+    if (qs != nullptr)
+        qs->pdfRev = pdfVertex(*pt, ptMinus, *qs, camera);
+    if (qsMinus != nullptr)
+        qsMinus->pdfRev = pdfVertex(*qs, pt, *qsMinus, camera);
+
+    // a delta pdf is stored as 0, which must not make a ratio 0 or infinite
+    auto remap = [](double pdf) {return pdf != 0 ? pdf : 1.0;};
+    auto add = [heuristic](double ri) {return heuristic == MISHeuristic::Power ? ri * ri : ri;};
+
+    double sumRi = 0;
+    double ri = 1;
+    for (int i = t - 1; i > 0; i--)
+    {
+        ri *= remap(cameraPath[i].pdfRev) / remap(cameraPath[i].pdfFwd);
+        if (!cameraPath[i].delta && !cameraPath[i - 1].delta)
+            sumRi += add(ri);
+    }
+
+    ri = 1;
+    for (int i = s - 1; i >= 0; i--)
+    {
+        ri *= remap(light[i].pdfRev) / remap(light[i].pdfFwd);
+        bool deltaBefore = i > 0 && light[i - 1].delta;
+        if (!light[i].delta && !deltaBefore)
+            sumRi += add(ri);
+    }
+
+    pt->pdfRev = savedPt;
+    if (ptMinus != nullptr)
+        ptMinus->pdfRev = savedPtMinus;
+    if (qs != nullptr)
+        qs->pdfRev = savedQs;
+    if (qsMinus != nullptr)
+        qsMinus->pdfRev = savedQsMinus;
+    pt->delta = deltaPt;
+    if (qs != nullptr)
+        qs->delta = deltaQs;
+
+    return 1.0 / (1.0 + sumRi);
+}
+
+// The weighted contribution of connecting s light and t camera vertices (t >= 2; light tracing is done by
+// splatLightVertex)
+static Color connect(const Scene& scene, std::vector<PathVertex>& light, std::vector<PathVertex>& cameraPath, int s,
+    int t, const CameraModel& camera, MISHeuristic heuristic)
+{
+    const PathVertex& pt = cameraPath[t - 1];
+    Color L = Color(0, 0, 0);
+
+    if (s == 0)
+    {
+        // the camera subpath hit a light by itself
+        if (!pt.isEmitter() || dot(pt.n, cameraPath[t - 2].p - pt.p) <= 0)
+            return L;
+        L = pt.beta * pt.emission;
+    }
+    else
+    {
+        const PathVertex& qs = light[s - 1];
+        if (!pt.connectible() || !qs.connectible())
+            return L;
+
+        double G = geometry(qs, pt);
+        if (G <= 0)
+            return L;
+
+        Color fPt = evaluateBSDF(pt, cameraPath[t - 2].p, qs.p);
+        Color fQs = qs.type == VertexType::Light ? Color(1, 1, 1) : evaluateBSDF(qs, pt.p, light[s - 2].p);
+        L = qs.beta * fQs * fPt * pt.beta * G;
+        if (L.lengthSquared() == 0 || !visible(scene, pt, qs))
+            return Color(0, 0, 0);
+    }
+
+    return L * misWeight(light, cameraPath, s, t, scene.lights.size(), camera, heuristic);
+}
+
+// Light tracing: connects light vertex s - 1 to the camera. Returns false if it is not seen in the image, or
+// carries no light.
+static bool splatLightVertex(const Scene& scene, std::vector<PathVertex>& light, std::vector<PathVertex>& cameraPath,
+    int s, const CameraModel& camera, MISHeuristic heuristic, int& x, int& y, Color& L)
+{
+    const PathVertex& qs = light[s - 1];
+    const PathVertex& eye = cameraPath[0];
+    if (!qs.connectible())
+        return false;
+
+    double cosTheta;
+    if (!camera.project(qs.p, x, y, cosTheta))
+        return false;
+
+    double G = geometry(qs, eye);
+    if (G <= 0)
+        return false;
+
+    // the pinhole's importance 1 / (A cos^4), times the cosine at the camera that G leaves out
+    double importance = 1.0 / (camera.planeArea * cosTheta * cosTheta * cosTheta);
+    L = qs.beta * evaluateBSDF(qs, eye.p, light[s - 2].p) * G * importance;
+    if (L.lengthSquared() == 0 || !visible(scene, qs, eye))
+        return false;
+
+    L *= misWeight(light, cameraPath, s, 1, scene.lights.size(), camera, heuristic);
+    return true;
+}
+
+RenderStats renderBDPT(const Scene& scene, const BDPTIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, Image& image)
+{
+    TRACE_SCOPE("render");
+    auto start = std::chrono::high_resolution_clock::now();
+
+    const int imageWidth = settings.imageWidth;
+    const int imageHeight = settings.imageHeight;
+    const int sampleCount = settings.sampleCount;
+    const int totalPixels = imageWidth * imageHeight;
+
+    RenderStats stats;
+    stats.threads = resolveThreadCount(settings.threads);
+    omp_set_num_threads(stats.threads);
+
+    const CameraModel cameraModel(camera, imageWidth, imageHeight);
+    const int maxDepth = std::max(integrator.maxDepth, 0);
+
+    // light tracing splats, in every pixel of the image
+    std::unique_ptr<std::atomic<unsigned long long>[]> splats(new std::atomic<unsigned long long>[totalPixels * 3]);
+    for (int i = 0; i < totalPixels * 3; i++)
+        splats[i].store(0, std::memory_order_relaxed);
+
+    std::atomic<int> pixelsDone(0);
+    std::atomic<unsigned long long> rays(0);
+
+    #pragma omp parallel
+    {
+        unsigned long long raysAtStart = threadRayCount();
+        std::random_device rd;
+        std::vector<PathVertex> cameraPath, lightPath;
+        cameraPath.reserve(maxDepth + 2);
+        lightPath.reserve(maxDepth + 1);
+
+        #pragma omp for schedule(dynamic)
+        for (int x = 0; x < imageWidth; x++)
+        {
+            if (settings.cancel != nullptr && settings.cancel->load(std::memory_order_relaxed))
+                continue;
+
+            TRACE_SCOPE("column", x);
+            for (int y = 0; y < imageHeight; y++)
+            {
+                unsigned int base = settings.deterministic ? settings.seed : rd();
+                SimpleSampler sampler(base + (unsigned int)settings.firstSample * totalPixels + y * imageWidth + x);
+                Color L = Color(0.0, 0.0, 0.0);
+                for (int k = 0; k < sampleCount; k++)
+                {
+                    auto [du, dv] = sampler.get2D();
+                    Ray r = camera.generateRay(x + du - 0.5, y + dv - 0.5, imageWidth, imageHeight);
+
+                    Color escaped;
+                    cameraSubpath(scene, cameraModel, r, sampler, maxDepth + 2, cameraPath, escaped);
+                    lightSubpath(scene, sampler, maxDepth + 1, lightPath);
+
+                    // only a camera subpath can find the environment, so it takes all of that light unweighted
+                    L += escaped;
+                    COUNTER_PATH_END(int(cameraPath.size() + lightPath.size()) - 1);
+
+                    const int cameraVertices = int(cameraPath.size());
+                    const int lightVertices = int(lightPath.size());
+                    for (int t = 1; t <= cameraVertices; t++)
+                    {
+                        for (int s = 0; s <= lightVertices; s++)
+                        {
+                            int depth = s + t - 2;
+                            if ((s == 1 && t == 1) || depth < 0 || depth > maxDepth)
+                                continue;
+
+                            if (t >= 2)
+                            {
+                                L += connect(scene, lightPath, cameraPath, s, t, cameraModel, integrator.heuristic);
+                                continue;
+                            }
+
+                            int sx, sy;
+                            Color splat;
+                            if (s >= 2 && splatLightVertex(scene, lightPath, cameraPath, s, cameraModel,
+                                integrator.heuristic, sx, sy, splat))
+                            {
+                                std::atomic<unsigned long long>* pixel = &splats[(sy * imageWidth + sx) * 3];
+                                for (int c = 0; c < 3; c++)
+                                {
+                                    double value = std::min(std::max(splat[c], 0.0), maxSplatValue);
+                                    pixel[c].fetch_add((unsigned long long)(value * fixedPointScale + 0.5),
+                                        std::memory_order_relaxed);
+                                }
+                            }
+                        }
+                    }
+                }
+                image.setColor(x, y, L / (double)sampleCount);
+
+                if (!settings.showProgress)
+                    continue;
+
+                int done = ++pixelsDone;
+                if (done % 100000 == 0 || done == totalPixels)
+                {
+                    #pragma omp critical
+                    {
+                        std::cout << "\rProgress: " << std::fixed << std::setprecision(2)
+                            << (done / float(totalPixels)) * 100.0f << "% " << std::flush;
+                    }
+                }
+            }
+        }
+
+        rays += threadRayCount() - raysAtStart;
+    }
+    if (settings.showProgress)
+        std::cout << std::endl;
+
+    // every pixel traced sampleCount light subpaths, and each one estimates every pixel of the image, so the
+    // splats are averaged the same way as the camera samples
+    for (int y = 0; y < imageHeight; y++)
+    {
+        for (int x = 0; x < imageWidth; x++)
+        {
+            std::atomic<unsigned long long>* pixel = &splats[(y * imageWidth + x) * 3];
+            Color splat = Color(pixel[0].load(std::memory_order_relaxed), pixel[1].load(std::memory_order_relaxed),
+                pixel[2].load(std::memory_order_relaxed)) / (fixedPointScale * sampleCount);
+            image.setColor(x, y, image.getColor(x, y) + splat);
+        }
+    }
+
+    stats.cancelled = settings.cancel != nullptr && settings.cancel->load();
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end - start;
+
+    stats.seconds = elapsed_seconds.count();
+    stats.samples = (unsigned long long)totalPixels * sampleCount;
+    stats.rays = rays;
+    return stats;
+}
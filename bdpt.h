@@ -0,0 +1,48 @@
+/*
+Contains the bidirectional path tracer, the integrator for light that MISIntegrator can hardly find: light seen in
+a mirror, and caustics that mirrors throw onto diffuse walls.
+
+Every sample traces a camera subpath and a light subpath, then connects every prefix of one to every prefix of the
+other. A connection with s light vertices and t camera vertices is one way of sampling the path it makes: t = 1
+is light tracing (the light subpath's vertex is projected into the image and splatted into whichever pixel it
+lands in), s = 1 is next event estimation, s = 0 is a camera path that hits a light by itself, and everything else
+joins two subpaths with a shadow ray. Every path of length k can be made by k + 2 of these, and each connection is
+weighed by the chances all of them had of making the same path (multiple importance sampling), so every path is
+counted once and by the strategies that are good at it. A caustic, which no camera path can connect to a light
+through the mirror, is found by light tracing instead.
+
+It uses the same BSDFs and emitters as MISIntegrator. Surfaces are one sided, like the triangle test that only
+hits front faces, so a connection to the back of a surface carries no light. The environment light is neither
+sampled by light subpaths nor connected to, so camera subpaths that leave the scene are the one strategy that finds
+it and take its light unweighted; BDPT is for scenes lit by their emitters.
+
+*/
+
+#pragma once
+
+#include "lightTransport.h"
+
+class Scene;
+struct Camera;
+struct RenderSettings;
+struct RenderStats;
+class Image;
+
+class BDPTIntegrator
+{
+    public:
+
+    // The longest path has maxDepth bounces (maxDepth + 1 segments), the same as MISIntegrator's with the same
+    // maxDepth, so the two render the same image at any depth
+    int maxDepth = 6;
+
+    // How the connections that could have made the same path are weighed against each other
+    MISHeuristic heuristic = MISHeuristic::Power;
+};
+
+// Renders the full image with BDPT. The threads, seeds, sample count, progress and cancel of the settings are used
+// like renderImage uses them; crops, the denoiser, kernels and NUMA replicas are not supported. Light tracing
+// splats into any pixel of the image, through fixed point atomic adds, so a seeded render is the same with any
+// number of threads.
+RenderStats renderBDPT(const Scene& scene, const BDPTIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, Image& image);
@@ -0,0 +1,544 @@
+/*
+Contains the benchmark modes.
+
+The throughput benchmark reloads and rebuilds the scene for every row so that the load and build phases are timed
+alongside the render and write phases. Seeds are fixed, so every row renders the exact same image regardless of the
+thread count, which keeps the timings comparable.
+
+The convergence benchmark renders in passes that double the sample count each time. Each pass only takes the new
+samples, so the image at a checkpoint is the average of every sample taken so far, and its time is the total time.
+
+*/
+
+#include "benchmark.h"
+#include "renderer.h"
+#include "scene.h"
+#include "image.h"
+#include "sceneGenerator.h"
+#include "threadGovernor.h"
+#include "integratorKernels.h"
+#include "bdpt.h"
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include <sys/resource.h>
+#include <omp.h>
+
+using namespace std;
+
+double peakMemoryMB()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0); // bytes on macOS
+#else
+    return usage.ru_maxrss / 1024.0; // kilobytes on Linux
+#endif
+}
+
+static double secondsSince(std::chrono::high_resolution_clock::time_point start)
+{
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    return elapsed.count();
+}
+
+bool loadBenchmarkScene(Scene& scene, const std::string& name, double stressScale)
+{
+    if (name == "default")
+    {
+        loadDefaultScene(scene);
+        return true;
+    }
+    if (name == "stress" || name == "stress-instanced")
+    {
+        StressSceneConfig config;
+        config.scale = stressScale;
+        config.instanceGrid = name == "stress-instanced";
+        generateStressScene(scene, config);
+        return true;
+    }
+
+    const string extension = ".obj";
+    if (name.size() > extension.size() && name.compare(name.size() - extension.size(), extension.size(), extension) == 0)
+    {
+        simpleDiffuseBSDF* diffuse = scene.addMaterial<simpleDiffuseBSDF>();
+        readObj(name, scene, Color(0.8,0.8,0.8), Color(0,0,0), diffuse);
+
+        string lightsFile = name.substr(0, name.size() - extension.size()) + "_lights.obj";
+        if (ifstream(lightsFile).good())
+            readObj(lightsFile, scene, Color(1,1,1), Color(50,50,50), diffuse);
+
+        string environmentFile = name.substr(0, name.size() - extension.size()) + "_env.pfm";
+        if (ifstream(environmentFile).good())
+        {
+            scene.environment = std::make_unique<EnvironmentLight>();
+            if (!scene.environment->load(environmentFile))
+                return false;
+        }
+        return !scene.objects.empty();
+    }
+
+    cerr << "Error: Unknown benchmark scene " << name << "\n";
+    return false;
+}
+
+struct ThroughputRow
+{
+    int threads;
+    int size;
+    double load, build, render, write;
+    double samplesPerSecond;
+    double raysPerSecond;
+    double efficiency;
+    double genericRender;   // only with compareKernels
+};
+
+int runThroughputBenchmark(ThroughputBenchmarkConfig config)
+{
+    if (config.threadCounts.empty())
+    {
+        // powers of two up to the machine size, plus the machine size itself
+        int maxThreads = std::min(omp_get_max_threads(), cpuTopology().usableCpus());
+        for (int t = 1; t < maxThreads; t *= 2)
+            config.threadCounts.push_back(t);
+        config.threadCounts.push_back(maxThreads);
+    }
+    if (config.imageSizes.empty())
+        config.imageSizes = {256, 512};
+
+    std::sort(config.threadCounts.begin(), config.threadCounts.end());
+
+    cout << "Throughput benchmark: " << config.scene << " scene, " << config.sampleCount << " spp, "
+        << describeIntegrator(config.integrator) << ", seed " << config.seed << ", best of " << config.repetitions << endl;
+    if (config.pinThreads || config.replicas)
+    {
+        printTopology(cout, cpuTopology());
+        cout << "Threads are pinned" << (config.replicas ? ", with one scene copy per NUMA node" : "") << endl;
+    }
+
+    vector<ThroughputRow> rows;
+
+    cout << setw(8) << "threads" << setw(7) << "size"
+        << setw(10) << "load(s)" << setw(10) << "build(s)" << setw(11) << "render(s)" << setw(10) << "write(s)"
+        << setw(14) << "samples/s" << setw(14) << "rays/s" << setw(12) << "efficiency";
+    if (config.compareKernels)
+        cout << setw(12) << "generic(s)" << setw(9) << "speedup";
+    cout << endl;
+
+    string kernelName;
+    bool kernelsMatch = true;
+
+    for (int size : config.imageSizes)
+    {
+        // efficiency is measured against the smallest thread count at this size
+        double baseWork = 0;
+
+        for (int threads : config.threadCounts)
+        {
+            ThroughputRow row = {};
+            row.threads = threads;
+            row.size = size;
+            row.render = 1e30;
+            row.genericRender = 1e30;
+
+            for (int rep = 0; rep < config.repetitions; rep++)
+            {
+                auto phase = std::chrono::high_resolution_clock::now();
+                Scene scene;
+                SceneReplicas replicas;
+                double load = 0, build = 0;
+                if (config.replicas)
+                {
+                    bool loaded = replicas.load(cpuTopology(), [&](Scene& copy)
+                    {
+                        if (!loadBenchmarkScene(copy, config.scene, config.stressScale))
+                            return false;
+                        copy.build();
+                        return true;
+                    });
+                    if (!loaded)
+                        return 1;
+                    load = secondsSince(phase);
+                }
+                else
+                {
+                    if (!loadBenchmarkScene(scene, config.scene, config.stressScale))
+                        return 1;
+                    load = secondsSince(phase);
+
+                    phase = std::chrono::high_resolution_clock::now();
+                    scene.build();
+                    build = secondsSince(phase);
+                }
+
+                MISIntegrator integrator = config.integrator;
+
+                RenderSettings settings;
+                settings.imageWidth = size;
+                settings.imageHeight = size;
+                settings.sampleCount = config.sampleCount;
+                settings.threads = threads;
+                settings.deterministic = true;
+                settings.seed = config.seed;
+                settings.showProgress = config.showProgress;
+                settings.pinThreads = config.pinThreads;
+                settings.replicas = config.replicas ? &replicas : nullptr;
+                settings.specializedKernels = config.specializedKernels;
+
+                const Scene& renderScene = config.replicas ? replicas.forNode(0) : scene;
+                if (kernelName.empty())
+                    kernelName = config.specializedKernels ? selectKernel(renderScene, integrator).name : "generic";
+
+                Image image(size, size);
+                RenderStats stats = renderImage(renderScene, integrator, Camera(), settings, image);
+
+                if (config.compareKernels)
+                {
+                    // same seeds, so the two images must agree exactly
+                    Image generic(size, size);
+                    settings.specializedKernels = false;
+                    RenderStats genericStats = renderImage(renderScene, integrator, Camera(), settings, generic);
+                    row.genericRender = std::min(row.genericRender, genericStats.seconds);
+                    for (int y = 0; y < size && kernelsMatch; y++)
+                    {
+                        for (int x = 0; x < size && kernelsMatch; x++)
+                        {
+                            Color a = image.getColor(x, y), b = generic.getColor(x, y);
+                            kernelsMatch = a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+                        }
+                    }
+                }
+
+                phase = std::chrono::high_resolution_clock::now();
+                image.saveImageBMP("benchmark.bmp");
+                double write = secondsSince(phase);
+
+                if (stats.seconds < row.render)
+                {
+                    row.load = load;
+                    row.build = build;
+                    row.render = stats.seconds;
+                    row.write = write;
+                    row.samplesPerSecond = stats.samples / stats.seconds;
+                    row.raysPerSecond = stats.rays / stats.seconds;
+                }
+            }
+
+            if (baseWork == 0)
+                baseWork = row.render * threads;
+            row.efficiency = baseWork / (row.render * threads);
+            rows.push_back(row);
+
+            cout << setw(8) << row.threads << setw(7) << row.size << fixed << setprecision(4)
+                << setw(10) << row.load << setw(10) << row.build << setw(11) << row.render << setw(10) << row.write
+                << setprecision(0) << setw(14) << row.samplesPerSecond << setw(14) << row.raysPerSecond
+                << setprecision(3) << setw(12) << row.efficiency;
+            if (config.compareKernels)
+            {
+                cout << setprecision(4) << setw(12) << row.genericRender << setprecision(3) << setw(9)
+                    << row.genericRender / row.render;
+            }
+            cout << defaultfloat << endl;
+        }
+    }
+
+    cout << "Kernel: " << kernelName << endl;
+    // the process's high-water mark, so it belongs to the sweep's largest configuration rather than to any one row
+    cout << "Peak RSS: " << fixed << setprecision(1) << peakMemoryMB() << defaultfloat << " MB" << endl;
+    if (config.compareKernels && !kernelsMatch)
+        cerr << "Warning: The specialized kernel's image differs from the generic integrator's\n";
+
+    if (!config.csvFile.empty())
+    {
+        ofstream csv(config.csvFile);
+        if (!csv.is_open())
+        {
+            cerr << "Error: Could not open " << config.csvFile << " for writing\n";
+            return 1;
+        }
+        csv << "threads,size,spp,load_s,build_s,render_s,write_s,samples_per_s,rays_per_s,efficiency"
+            << (config.compareKernels ? ",generic_render_s,kernel_speedup" : "") << "\n";
+        for (const ThroughputRow& row : rows)
+        {
+            csv << row.threads << "," << row.size << "," << config.sampleCount << "," << row.load << ","
+                << row.build << "," << row.render << "," << row.write << "," << row.samplesPerSecond << ","
+                << row.raysPerSecond << "," << row.efficiency;
+            if (config.compareKernels)
+                csv << "," << row.genericRender << "," << row.genericRender / row.render;
+            csv << "\n";
+        }
+    }
+    return 0;
+}
+
+static MISIntegrator makeIntegrator(int maxDepth)
+{
+    MISIntegrator integrator = MISIntegrator();
+    integrator.maxDepth = maxDepth;
+    return integrator;
+}
+
+std::string describeIntegrator(const MISIntegrator& integrator)
+{
+    std::ostringstream out;
+    out << "max depth " << integrator.maxDepth;
+    if (integrator.russianRoulette)
+        out << ", russian roulette from depth " << integrator.rrMinDepth;
+    if (integrator.maxSplit > 1)
+        out << ", splitting up to " << integrator.maxSplit << "x in the first " << integrator.splitDepth << " bounces";
+    if (!integrator.lightSampling)
+        out << ", no light sampling";
+    else if (integrator.heuristic == MISHeuristic::Balance)
+        out << ", balance heuristic";
+    return out.str();
+}
+
+struct ErrorMetrics
+{
+    double mse;
+    double rmse;
+    double relMSE;
+};
+
+// relMSE divides each squared error by the squared reference value (plus a small epsilon for black pixels),
+// so dark regions count as much as bright ones
+static ErrorMetrics compareImages(const Image& image, const Image& reference)
+{
+    double squared = 0, relative = 0;
+    int w = reference.getWidth(), h = reference.getHeight();
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            Color c = image.getColor(x, y);
+            Color r = reference.getColor(x, y);
+            for (int k = 0; k < 3; k++)
+            {
+                double diff = c[k] - r[k];
+                squared += diff * diff;
+                relative += diff * diff / (r[k] * r[k] + 0.01);
+            }
+        }
+    }
+    double n = 3.0 * w * h;
+    return {squared / n, sqrt(squared / n), relative / n};
+}
+
+// Goes up whenever a change to MISIntegrator changes the image a reference converges to, so references rendered
+// before it are rendered again
+static const int referenceVersion = 2;
+
+// What a reference was rendered from, kept next to it in referenceFile + ".txt"
+static string describeReference(const ConvergenceBenchmarkConfig& config)
+{
+    ostringstream out;
+    out << "scene " << config.scene << " scale " << config.stressScale << " size " << config.imageSize << " depth "
+        << config.referenceMaxDepth << " spp " << config.referenceSampleCount << " seed " << config.seed
+        << " version " << referenceVersion;
+    return out.str();
+}
+
+int runConvergenceBenchmark(const ConvergenceBenchmarkConfig& config)
+{
+    const int size = config.imageSize;
+
+    if (config.bdpt && (config.guiding || config.radianceCache || config.denoise))
+    {
+        cerr << "Error: BDPT can not be combined with path guiding, the radiance cache or the denoiser\n";
+        return 1;
+    }
+
+    Scene scene;
+    if (!loadBenchmarkScene(scene, config.scene, config.stressScale))
+        return 1;
+    scene.build();
+
+    RenderSettings settings;
+    settings.imageWidth = size;
+    settings.imageHeight = size;
+    settings.threads = config.threads;
+    settings.deterministic = true;
+    settings.showProgress = false;
+
+    const string referenceDescription = describeReference(config);
+    const string referenceSidecar = config.referenceFile + ".txt";
+    string cachedSettings;
+    ifstream sidecar(referenceSidecar);
+    getline(sidecar, cachedSettings);
+    sidecar.close();
+
+    Image reference(size, size);
+    bool haveReference = cachedSettings == referenceDescription && reference.loadImagePFM(config.referenceFile)
+        && reference.getWidth() == size && reference.getHeight() == size;
+
+    if (!haveReference)
+    {
+        if (!cachedSettings.empty() && cachedSettings != referenceDescription)
+        {
+            cout << "Reference " << config.referenceFile << " is of " << cachedSettings << ", not "
+                << referenceDescription << endl;
+        }
+        cout << "Rendering " << config.referenceSampleCount << " spp reference into " << config.referenceFile << endl;
+        reference = Image(size, size);
+
+        // the reference uses its own seed so its noise is not correlated with the measured renders
+        RenderSettings referenceSettings = settings;
+        referenceSettings.sampleCount = config.referenceSampleCount;
+        referenceSettings.seed = config.seed ^ 0x9e3779b9u;
+        referenceSettings.showProgress = true;
+
+        MISIntegrator referenceIntegrator = makeIntegrator(config.referenceMaxDepth);
+        RenderStats stats = renderImage(scene, referenceIntegrator, Camera(), referenceSettings, reference);
+        cout << "Reference took " << stats.seconds << " seconds" << endl;
+        reference.saveImagePFM(config.referenceFile);
+
+        ofstream settingsOut(referenceSidecar);
+        if (settingsOut.is_open())
+            settingsOut << referenceDescription << "\n";
+        else
+            cerr << "Error: Could not open " << referenceSidecar << " for writing\n";
+    }
+    else
+        cout << "Using reference " << config.referenceFile << endl;
+
+    MISIntegrator integrator = config.integrator;
+    PathGuide guide(config.guidingSettings);
+    if (config.guiding)
+    {
+        guide.reset(scene);
+        guide.setTraining(true);
+        integrator.guide = &guide;
+    }
+
+    Image accumulated(size, size);
+    Image pass(size, size);
+    AuxiliaryImages accumulatedAux(size, size);
+    AuxiliaryImages passAux(size, size);
+    Image result(size, size);
+    int samplesDone = 0;
+    double elapsed = 0;
+    double timeToTarget = -1;
+
+    ofstream csv;
+    if (!config.csvFile.empty())
+    {
+        csv.open(config.csvFile, ios::app);
+        if (!csv.is_open())
+        {
+            cerr << "Error: Could not open " << config.csvFile << " for writing\n";
+            return 1;
+        }
+        if (csv.tellp() == 0)
+            csv << "label,spp,time_s,rmse,relmse,efficiency\n";
+    }
+
+    cout << "Convergence benchmark '" << config.label << "': " << config.scene << " scene, " << size << "x" << size << ", "
+        << (config.bdpt ? "BDPT, " : "") << describeIntegrator(config.integrator) << (config.guiding ? ", path guiding" : "")
+        << (config.radianceCache ? ", radiance cache" : "") << ", seed " << config.seed
+        << (config.denoise ? ", denoised" : "") << endl;
+    cout << setw(8) << "spp" << setw(12) << "time(s)" << setw(14) << "RMSE" << setw(14) << "relMSE"
+        << setw(16) << "1/(MSE*time)" << endl;
+
+    // the cache is built from samples after all of the checkpoints' (and without the guide, which has not learned
+    // anything yet)
+    RadianceCache cache(config.cacheSettings);
+    if (config.radianceCache)
+    {
+        settings.sampleCount = config.maxSampleCount;
+        settings.firstSample = 0;
+        settings.seed = config.seed;
+        integrator.guide = nullptr;
+        cache.reset(scene);
+        elapsed += buildRadianceCache(scene, integrator, Camera(), settings, cache, config.cacheSampleCount).seconds;
+        if (config.guiding)
+            integrator.guide = &guide;
+    }
+
+    for (int target = 1; target <= config.maxSampleCount; target *= 2)
+    {
+        // render only the samples needed to reach the next checkpoint, then fold them into the running average
+        settings.sampleCount = target - samplesDone;
+        settings.firstSample = samplesDone;
+        settings.seed = config.seed;
+
+        RenderStats stats;
+        if (config.bdpt)
+        {
+            BDPTIntegrator bdpt;
+            bdpt.maxDepth = integrator.maxDepth;
+            bdpt.heuristic = integrator.heuristic;
+            stats = renderBDPT(scene, bdpt, Camera(), settings, pass);
+        }
+        else
+            stats = renderImage(scene, integrator, Camera(), settings, pass, config.denoise ? &passAux : nullptr);
+        elapsed += stats.seconds;
+
+        if (config.guiding)
+        {
+            auto updateStart = std::chrono::high_resolution_clock::now();
+            guide.update();
+            elapsed += secondsSince(updateStart);
+        }
+
+        auto accumulate = [&](Image& total, const Image& latest) {
+            for (int y = 0; y < size; y++)
+            {
+                for (int x = 0; x < size; x++)
+                {
+                    Color c = total.getColor(x, y) * samplesDone + latest.getColor(x, y) * settings.sampleCount;
+                    total.setColor(x, y, c / target);
+                }
+            }
+        };
+        accumulate(accumulated, pass);
+        if (config.denoise)
+        {
+            accumulate(accumulatedAux.albedo, passAux.albedo);
+            accumulate(accumulatedAux.normal, passAux.normal);
+            accumulate(accumulatedAux.depth, passAux.depth);
+        }
+        samplesDone = target;
+
+        result = accumulated;
+        if (config.denoise)
+        {
+            auto denoiseStart = std::chrono::high_resolution_clock::now();
+            denoiseImage(result, accumulatedAux, config.denoiseSettings);
+            elapsed += secondsSince(denoiseStart);
+        }
+
+        ErrorMetrics error = compareImages(result, reference);
+        double efficiency = 1.0 / (error.mse * elapsed);
+        if (timeToTarget < 0 && error.rmse <= config.targetRMSE)
+            timeToTarget = elapsed;
+
+        cout << setw(8) << target << fixed << setprecision(4) << setw(12) << elapsed
+            << scientific << setprecision(4) << setw(14) << error.rmse << setw(14) << error.relMSE
+            << setw(16) << efficiency << defaultfloat << endl;
+
+        if (csv.is_open())
+            csv << config.label << "," << target << "," << elapsed << "," << error.rmse << ","
+                << error.relMSE << "," << efficiency << "\n";
+    }
+
+    if (timeToTarget >= 0)
+        cout << "Time to reach RMSE " << config.targetRMSE << ": " << timeToTarget << " seconds" << endl;
+    else
+        cout << "RMSE " << config.targetRMSE << " not reached within " << config.maxSampleCount << " spp" << endl;
+
+    if (config.guiding)
+        printGuideSummary(cout, guide);
+    if (config.radianceCache)
+        printCacheSummary(cout, cache);
+
+    result.saveImageBMP("convergence.bmp");
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+Contains the benchmark modes, which render a fixed scene under controlled settings and report how fast the
+renderer is.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include "lightTransport.h"
+#include "denoiser.h"
+#include "pathGuiding.h"
+#include "radianceCache.h"
+
+struct ThroughputBenchmarkConfig
+{
+    // See loadBenchmarkScene
+    std::string scene = "default";
+    double stressScale = 1.0;
+
+    // Thread counts and square image sizes to sweep over; every combination is rendered
+    std::vector<int> threadCounts;
+    std::vector<int> imageSizes;
+
+    int sampleCount = 8;
+
+    // Integrator settings (max depth, russian roulette, splitting) used for every row
+    MISIntegrator integrator;
+    unsigned int seed = 12345;
+
+    // Renders each combination this many times and keeps the fastest
+    int repetitions = 1;
+
+    // Turns on the progress bar, to measure the cost of the shared progress counter
+    bool showProgress = false;
+
+    // Pins the render threads, and with replicas also loads one copy of the scene per NUMA node (the load column
+    // then covers loading and building every copy). See threadGovernor.h.
+    bool pinThreads = false;
+    bool replicas = false;
+
+    // Renders with the specialized integrator kernels (see integratorKernels.h), or only with the generic one.
+    // compareKernels renders every row both ways and adds the generic time and the kernel's speedup to the table.
+    bool specializedKernels = true;
+    bool compareKernels = false;
+
+    // If not empty, the results table is also written here as csv
+    std::string csvFile;
+};
+
+// Renders the scene for every thread count / image size combination with deterministic seeds, and prints
+// samples/s, rays/s, parallel efficiency and per-phase timings per configuration, then the peak memory of the whole
+// sweep. Returns 0 on success.
+int runThroughputBenchmark(ThroughputBenchmarkConfig config);
+
+struct ConvergenceBenchmarkConfig
+{
+    // See loadBenchmarkScene
+    std::string scene = "default";
+    double stressScale = 1.0;
+
+    // Square image size; small sizes are fine since only the error matters
+    int imageSize = 128;
+    int threads = 0;
+    unsigned int seed = 12345;
+
+    // The reference is read from referenceFile if referenceFile + ".txt" says it was rendered with these settings
+    // (scene, scale, size, depth, spp, seed and the integrator's version). Otherwise it is rendered with
+    // referenceSampleCount spp and written there, with its settings, for the next run.
+    std::string referenceFile = "reference.pfm";
+    int referenceSampleCount = 1024;
+    int referenceMaxDepth = 6;
+
+    // The configuration being measured. Checkpoints are taken at 1, 2, 4, ... spp up to maxSampleCount
+    MISIntegrator integrator;
+
+    // Renders with the bidirectional path tracer instead, at the integrator's depth and with its heuristic
+    bool bdpt = false;
+    int maxSampleCount = 64;
+
+    // Learns a path guide while converging: every checkpoint pass samples from the guide the earlier passes
+    // trained and records into it, and the guide is updated (on the clock) before the next pass
+    bool guiding = false;
+    GuidingSettings guidingSettings;
+
+    // Builds a radiance cache with cacheSampleCount spp (on the clock) before the first checkpoint, so the error
+    // includes the cache's bias
+    bool radianceCache = false;
+    RadianceCacheSettings cacheSettings;
+    int cacheSampleCount = 4;
+
+    // Denoises a copy of the image at every checkpoint and measures that instead (the denoise time counts too)
+    bool denoise = false;
+    DenoiseSettings denoiseSettings;
+
+    // "time to reach error" is reported for this RMSE
+    double targetRMSE = 0.05;
+
+    // Names the configuration in the output, so several runs can be compared in one csv
+    std::string label = "default";
+    std::string csvFile;
+};
+
+// Renders the scene progressively and measures its error against a high spp reference over time.
+// Reports RMSE and relMSE at every checkpoint, the time taken to reach the target RMSE, and the efficiency
+// 1 / (MSE * time). Returns 0 on success.
+int runConvergenceBenchmark(const ConvergenceBenchmarkConfig& config);
+
+// One line summary of the integrator settings, for benchmark output
+std::string describeIntegrator(const MISIntegrator& integrator);
+
+class Scene;
+
+// Fills the scene the benchmarks render. "default" is the box scene main renders and "stress" is the generated
+// stress scene at the given scale ("stress-instanced" places its sphere grid as instances of one mesh). Anything ending in .obj is read as white diffuse geometry, together with
+// <name>_lights.obj as emitters if it exists (the pair of files that render --generate writes), and lit by
+// <name>_env.pfm as an environment light (see environmentLight.h) if that exists.
+bool loadBenchmarkScene(Scene& scene, const std::string& name, double stressScale);
+
+// Peak resident set size of this process so far, in megabytes
+double peakMemoryMB();
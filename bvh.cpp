@@ -0,0 +1,238 @@
+/*
+Contains the BVH builder.
+
+*/
+
+#include "bvh.h"
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <limits>
+
+// number of centroid bins the SAH is evaluated at per axis
+const int SAH_BINS = 12;
+
+// leaves never hold more primitives than this, even where the SAH would rather stop splitting
+const int MAX_LEAF_SIZE = 8;
+
+// keeps the traversal stack (BVH_STACK_SIZE) from overflowing; deeper ranges just become big leaves
+const int MAX_BVH_DEPTH = BVH_STACK_SIZE - 2;
+
+// relative cost of visiting one more node compared to testing one primitive
+const double TRAVERSAL_COST = 1.0;
+
+void AABB::grow(const Point& p)
+{
+    lower = Point(std::min(lower.x(), p.x()), std::min(lower.y(), p.y()), std::min(lower.z(), p.z()));
+    upper = Point(std::max(upper.x(), p.x()), std::max(upper.y(), p.y()), std::max(upper.z(), p.z()));
+}
+
+void AABB::grow(const AABB& b)
+{
+    if (b.empty())
+        return;
+    grow(b.lower);
+    grow(b.upper);
+}
+
+double AABB::surfaceArea() const
+{
+    if (empty())
+        return 0.0;
+    Vec3 e = upper - lower;
+    return 2.0 * (e.x() * e.y() + e.y() * e.z() + e.z() * e.x());
+}
+
+double AABB::hit(const Point& origin, const Vec3& invDir, double maxT) const
+{
+    double tEnter = 0.0;
+    double tExit = maxT;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double t1 = (lower.coord[axis] - origin.coord[axis]) * invDir.coord[axis];
+        double t2 = (upper.coord[axis] - origin.coord[axis]) * invDir.coord[axis];
+        if (t1 > t2)
+            std::swap(t1, t2);
+        tEnter = std::max(tEnter, t1);
+        tExit = std::min(tExit, t2);
+    }
+    return tEnter <= tExit ? tEnter : std::numeric_limits<double>::infinity();
+}
+
+// padded a little, so flat axis aligned geometry (like the walls of the box scene) is not missed to rounding
+static AABB padded(AABB bounds)
+{
+    Vec3 pad = Vec3(1e-7, 1e-7, 1e-7) + (bounds.upper - bounds.lower) * 1e-7;
+    bounds.lower -= pad;
+    bounds.upper += pad;
+    return bounds;
+}
+
+void BVH::build(const std::vector<AABB>& primitiveBounds)
+{
+    nodes.clear();
+    indices.resize(primitiveBounds.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    if (primitiveBounds.empty())
+        return;
+
+    std::vector<Point> centers;
+    centers.reserve(primitiveBounds.size());
+    for (const AABB& b : primitiveBounds)
+        centers.push_back(b.center());
+
+    // a binary tree with n leaves has 2n - 1 nodes
+    nodes.reserve(2 * primitiveBounds.size());
+    nodes.push_back(BVHNode{AABB(), 0, (int)primitiveBounds.size()});
+    subdivide(0, primitiveBounds, centers, 0);
+    builtCost = sahCost();
+}
+
+void BVH::refit(const std::vector<AABB>& primitiveBounds)
+{
+    // children are always stored after their parent, so walking backwards visits them first
+    for (int node = (int)nodes.size() - 1; node >= 0; node--)
+    {
+        BVHNode& current = nodes[node];
+        AABB bounds;
+        if (current.count > 0)
+        {
+            for (int k = current.first; k < current.first + current.count; k++)
+                bounds.grow(primitiveBounds[indices[k]]);
+            bounds = padded(bounds);
+        }
+        else
+        {
+            bounds.grow(nodes[current.first].bounds);
+            bounds.grow(nodes[current.first + 1].bounds);
+        }
+        current.bounds = bounds;
+    }
+}
+
+double BVH::sahCost() const
+{
+    if (nodes.empty())
+        return 0.0;
+
+    double rootArea = nodes[0].bounds.surfaceArea();
+    if (rootArea <= 0)
+        return 0.0;
+
+    double cost = 0;
+    for (const BVHNode& node : nodes)
+        cost += node.bounds.surfaceArea() / rootArea * (node.count > 0 ? node.count : TRAVERSAL_COST);
+    return cost;
+}
+
+void BVH::subdivide(int node, const std::vector<AABB>& primitiveBounds, const std::vector<Point>& centers, int depth)
+{
+    const int first = nodes[node].first;
+    const int count = nodes[node].count;
+
+    AABB bounds, centerBounds;
+    for (int k = first; k < first + count; k++)
+    {
+        bounds.grow(primitiveBounds[indices[k]]);
+        centerBounds.grow(centers[indices[k]]);
+    }
+
+    bounds = padded(bounds);
+    nodes[node].bounds = bounds;
+
+    if (count <= 2 || depth >= MAX_BVH_DEPTH)
+        return;
+
+    // find the cheapest split plane between bins over all three axes
+    int bestAxis = -1;
+    int bestSplit = 0;
+    double bestCost = std::numeric_limits<double>::max();
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double lo = centerBounds.lower.coord[axis];
+        double extent = centerBounds.upper.coord[axis] - lo;
+        if (extent <= 0)
+            continue;
+
+        AABB binBounds[SAH_BINS];
+        int binCount[SAH_BINS] = {};
+        double binScale = SAH_BINS / extent;
+        for (int k = first; k < first + count; k++)
+        {
+            int bin = std::min(SAH_BINS - 1, int((centers[indices[k]].coord[axis] - lo) * binScale));
+            binCount[bin]++;
+            binBounds[bin].grow(primitiveBounds[indices[k]]);
+        }
+
+        // sweep from the right to get the cost of everything right of each plane, then from the left
+        double rightArea[SAH_BINS];
+        int rightCount[SAH_BINS];
+        AABB sweep;
+        int sweepCount = 0;
+        for (int bin = SAH_BINS - 1; bin > 0; bin--)
+        {
+            sweep.grow(binBounds[bin]);
+            sweepCount += binCount[bin];
+            rightArea[bin] = sweep.surfaceArea();
+            rightCount[bin] = sweepCount;
+        }
+
+        sweep = AABB();
+        sweepCount = 0;
+        for (int split = 1; split < SAH_BINS; split++)
+        {
+            sweep.grow(binBounds[split - 1]);
+            sweepCount += binCount[split - 1];
+            if (sweepCount == 0 || rightCount[split] == 0)
+                continue;
+
+            double cost = sweep.surfaceArea() * sweepCount + rightArea[split] * rightCount[split];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    // every centroid in the same spot, no plane can separate them
+    if (bestAxis == -1)
+    {
+        if (count <= MAX_LEAF_SIZE)
+            return;
+        bestAxis = 0;
+    }
+    else
+    {
+        double splitCost = TRAVERSAL_COST + bestCost / bounds.surfaceArea();
+        if (splitCost >= count && count <= MAX_LEAF_SIZE)
+            return;
+    }
+
+    int middle;
+    if (bestAxis != -1 && centerBounds.upper.coord[bestAxis] > centerBounds.lower.coord[bestAxis])
+    {
+        double lo = centerBounds.lower.coord[bestAxis];
+        double binScale = SAH_BINS / (centerBounds.upper.coord[bestAxis] - lo);
+        auto left = [&](int primitive) {
+            return std::min(SAH_BINS - 1, int((centers[primitive].coord[bestAxis] - lo) * binScale)) < bestSplit;
+        };
+        middle = std::partition(indices.begin() + first, indices.begin() + first + count, left) - indices.begin();
+    }
+    else
+    {
+        // stacked centroids in an oversized leaf: split the range in half so the leaves stay small
+        middle = first + count / 2;
+    }
+
+    int leftChild = nodes.size();
+    nodes.push_back(BVHNode{AABB(), first, middle - first});
+    nodes.push_back(BVHNode{AABB(), middle, first + count - middle});
+    nodes[node].first = leftChild;
+    nodes[node].count = 0;
+
+    subdivide(leftChild, primitiveBounds, centers, depth + 1);
+    subdivide(leftChild + 1, primitiveBounds, centers, depth + 1);
+}
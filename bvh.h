@@ -0,0 +1,152 @@
+/*
+Contains the bounding volume hierarchy that lets a ray skip most of the scene instead of testing every triangle.
+
+The tree is built top down with the surface area heuristic, evaluated over a fixed number of centroid bins per
+axis. Nodes are stored in one array, and the two children of an inner node sit next to each other, so a node only
+keeps one index. The same structure is used at both levels of the scene: over the triangles of a mesh, and over
+the instances placed in the world.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include "object.h"
+
+struct AABB
+{
+    Point lower = Point(std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+        std::numeric_limits<double>::max());
+    Point upper = Point(-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(),
+        -std::numeric_limits<double>::max());
+
+    void grow(const Point& p);
+    void grow(const AABB& b);
+
+    bool empty() const { return lower.x() > upper.x(); }
+    Point center() const { return (lower + upper) * 0.5; }
+    double surfaceArea() const;
+
+    // Distance along the ray to where it enters the box, or infinity if it misses the box or enters after maxT.
+    // invDir is 1 / direction per axis.
+    double hit(const Point& origin, const Vec3& invDir, double maxT) const;
+};
+
+struct BVHNode
+{
+    AABB bounds;
+    int first;  // leaf: first entry in BVH::indices, inner node: the left child (the right child is first + 1)
+    int count;  // number of primitives in a leaf, 0 for inner nodes
+};
+
+class BVH
+{
+    public:
+
+    std::vector<BVHNode> nodes;
+
+    // primitive indices, ordered so that every leaf covers a contiguous range
+    std::vector<int> indices;
+
+    // sahCost() right after the last build, to tell how far refits have degraded the tree since
+    double builtCost = 0;
+
+    // Builds the tree over primitives with the given bounds (replacing any previous tree)
+    void build(const std::vector<AABB>& primitiveBounds);
+
+    // Recomputes every node's bounds bottom up from the primitives' new bounds, keeping the tree layout. Much
+    // cheaper than a build, but the tree gets worse the further the primitives move from where they were built.
+    void refit(const std::vector<AABB>& primitiveBounds);
+
+    // Expected cost of a ray query under the surface area heuristic: every node's traversal and primitive test
+    // cost, weighted by its area relative to the root's
+    double sahCost() const;
+
+    bool empty() const { return nodes.empty(); }
+
+    // Walks the tree front to back, calling hit(primitive, maxT) for every primitive in a leaf the ray reaches
+    // before maxT. hit lowers maxT when it finds a closer hit, and returns true to stop the walk early
+    // (for shadow rays, where any hit will do).
+    template <typename HitFunction>
+    void intersect(const Ray& r, double& maxT, HitFunction hit) const;
+
+    private:
+
+    void subdivide(int node, const std::vector<AABB>& primitiveBounds, const std::vector<Point>& centers, int depth);
+};
+
+// deep enough for any tree the builder makes, see MAX_BVH_DEPTH in bvh.cpp
+const int BVH_STACK_SIZE = 64;
+
+template <typename HitFunction>
+void BVH::intersect(const Ray& r, double& maxT, HitFunction hit) const
+{
+    if (nodes.empty())
+        return;
+
+    const Point origin = r.origin();
+    const Vec3 d = r.direction();
+
+    // a huge finite value instead of infinity, so 0 * invDir stays 0 for rays starting on a slab plane
+    auto invert = [](double x) { return std::fabs(x) > 1e-300 ? 1.0 / x : (x < 0 ? -1e300 : 1e300); };
+    const Vec3 invDir = Vec3(invert(d.x()), invert(d.y()), invert(d.z()));
+
+    const double infinity = std::numeric_limits<double>::infinity();
+    if (nodes[0].bounds.hit(origin, invDir, maxT) == infinity)
+        return;
+
+    // entry distances are kept on the stack so nodes behind a hit found in the meantime can be skipped
+    int stack[BVH_STACK_SIZE];
+    double stackT[BVH_STACK_SIZE];
+    int stackSize = 0;
+    int node = 0;
+
+    while (true)
+    {
+        const BVHNode& current = nodes[node];
+        if (current.count > 0)
+        {
+            for (int k = current.first; k < current.first + current.count; k++)
+            {
+                if (hit(indices[k], maxT))
+                    return;
+            }
+        }
+        else
+        {
+            int nearChild = current.first;
+            int farChild = current.first + 1;
+            double tNear = nodes[nearChild].bounds.hit(origin, invDir, maxT);
+            double tFar = nodes[farChild].bounds.hit(origin, invDir, maxT);
+            if (tFar < tNear)
+            {
+                std::swap(nearChild, farChild);
+                std::swap(tNear, tFar);
+            }
+
+            if (tNear != infinity)
+            {
+                if (tFar != infinity)
+                {
+                    stack[stackSize] = farChild;
+                    stackT[stackSize] = tFar;
+                    stackSize++;
+                }
+                node = nearChild;
+                continue;
+            }
+        }
+
+        // nothing closer below this node, go back to the nearest node still worth visiting
+        do
+        {
+            if (stackSize == 0)
+                return;
+            stackSize--;
+        } while (stackT[stackSize] > maxT);
+        node = stack[stackSize];
+    }
+}
@@ -0,0 +1,126 @@
+/*
+Contains the counter registry and the end of render report.
+
+*/
+
+#include "counters.h"
+#include <vector>
+#include <mutex>
+#include <iomanip>
+#include <algorithm>
+
+// every live ThreadCounters block, plus the totals of threads that have already exited
+static std::mutex registryMutex;
+static std::vector<ThreadCounters*> registry;
+static CounterValues retiredCounters;
+
+#if COUNTERS_ENABLED
+thread_local ThreadCounters threadCounters;
+#endif
+
+void CounterValues::add(const CounterValues& other)
+{
+    rays += other.rays;
+    shadowRays += other.shadowRays;
+    triangleTests += other.triangleTests;
+    paths += other.paths;
+    bounces += other.bounces;
+    for (int i = 0; i < PATH_LENGTH_BUCKETS; i++)
+        pathLengths[i] += other.pathLengths[i];
+    neeUnoccluded += other.neeUnoccluded;
+    neeOccluded += other.neeOccluded;
+    neeMissedLight += other.neeMissedLight;
+    escaped += other.escaped;
+    pdfTerminated += other.pdfTerminated;
+    depthTerminated += other.depthTerminated;
+    rouletteTerminated += other.rouletteTerminated;
+    splitPaths += other.splitPaths;
+    cacheTerminated += other.cacheTerminated;
+}
+
+ThreadCounters::ThreadCounters()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.push_back(this);
+}
+
+ThreadCounters::~ThreadCounters()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.erase(std::remove(registry.begin(), registry.end(), this), registry.end());
+    retiredCounters.add(*this);
+}
+
+CounterValues mergeCounters()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    CounterValues total = retiredCounters;
+    for (const ThreadCounters* counters : registry)
+        total.add(*counters);
+    return total;
+}
+
+void resetCounters()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    retiredCounters = CounterValues();
+    for (ThreadCounters* counters : registry)
+        static_cast<CounterValues&>(*counters) = CounterValues();
+}
+
+unsigned long long threadTriangleTests()
+{
+#if COUNTERS_ENABLED
+    return threadCounters.triangleTests;
+#else
+    return 0;
+#endif
+}
+
+#if COUNTERS_ENABLED
+static double ratio(unsigned long long a, unsigned long long b)
+{
+    return b == 0 ? 0.0 : double(a) / double(b);
+}
+#endif
+
+void printCounterReport(std::ostream& out, double seconds)
+{
+#if COUNTERS_ENABLED
+    CounterValues c = mergeCounters();
+    unsigned long long neeTotal = c.neeUnoccluded + c.neeOccluded + c.neeMissedLight;
+
+    std::ios_base::fmtflags flags = out.flags();
+    out << std::fixed << std::setprecision(2);
+    out << "---- Ray statistics ----\n";
+    out << "Rays:              " << c.rays;
+    if (seconds > 0) out << " (" << c.rays / seconds / 1e6 << " M/s)";
+    out << "\n";
+    out << "Shadow rays:       " << c.shadowRays;
+    if (seconds > 0) out << " (" << c.shadowRays / seconds / 1e6 << " M/s)";
+    out << "\n";
+    out << "Triangle tests:    " << c.triangleTests << " (" << ratio(c.triangleTests, c.rays + c.shadowRays)
+        << " per ray)\n";
+    out << "Paths:             " << c.paths << " (" << ratio(c.bounces, c.paths) << " bounces per path, "
+        << c.splitPaths << " from splitting)\n";
+    out << "NEE samples:       " << neeTotal << " (unoccluded " << 100 * ratio(c.neeUnoccluded, neeTotal)
+        << "%, occluded " << 100 * ratio(c.neeOccluded, neeTotal) << "%, light facing away "
+        << 100 * ratio(c.neeMissedLight, neeTotal) << "%)\n";
+    out << "Path terminations: escaped " << 100 * ratio(c.escaped, c.paths) << "%, pdf_val <= 0 "
+        << 100 * ratio(c.pdfTerminated, c.paths) << "%, max depth " << 100 * ratio(c.depthTerminated, c.paths)
+        << "%, russian roulette " << 100 * ratio(c.rouletteTerminated, c.paths) << "%, radiance cache "
+        << 100 * ratio(c.cacheTerminated, c.paths) << "%\n";
+
+    out << "Path lengths:     ";
+    for (int i = 0; i < PATH_LENGTH_BUCKETS; i++)
+    {
+        if (c.pathLengths[i] > 0)
+            out << " " << i << (i == PATH_LENGTH_BUCKETS - 1 ? "+" : "") << ":" << 100 * ratio(c.pathLengths[i], c.paths) << "%";
+    }
+    out << "\n";
+    out.flags(flags);
+#else
+    (void)out;
+    (void)seconds;
+#endif
+}
@@ -0,0 +1,84 @@
+/*
+Contains the per-thread hot path counters (rays, shadow rays, triangle tests, path lengths, NEE results and path
+terminations).
+
+The counters only exist when compiled with -DPT_COUNTERS. Otherwise every COUNTER_ macro expands to nothing, so the
+hot paths are exactly what they were without them.
+
+Each thread increments its own cache line padded block, so counting never touches shared memory. The blocks are
+merged into a report after rendering, when no thread is writing to them.
+
+*/
+
+#pragma once
+
+#include <ostream>
+
+#ifdef PT_COUNTERS
+#define COUNTERS_ENABLED 1
+#else
+#define COUNTERS_ENABLED 0
+#endif
+
+const int PATH_LENGTH_BUCKETS = 64;
+
+struct CounterValues
+{
+    unsigned long long rays = 0;            // camera and bounce rays cast by the integrator
+    unsigned long long shadowRays = 0;      // visibility rays cast by next event estimation
+    unsigned long long triangleTests = 0;   // ray/triangle intersection tests, for both kinds of rays
+
+    unsigned long long paths = 0;
+    unsigned long long bounces = 0;         // surface hits summed over all paths
+    unsigned long long pathLengths[PATH_LENGTH_BUCKETS] = {};
+
+    unsigned long long neeUnoccluded = 0;   // light sample reached the light
+    unsigned long long neeOccluded = 0;     // something was in the way
+    unsigned long long neeMissedLight = 0;  // the shadow ray could not hit the sampled light (it faces away)
+
+    unsigned long long escaped = 0;         // path left the scene
+    unsigned long long pdfTerminated = 0;   // sampled direction had pdf_val <= 0
+    unsigned long long depthTerminated = 0; // path reached maxDepth
+    unsigned long long rouletteTerminated = 0; // path was ended by russian roulette
+    unsigned long long splitPaths = 0;      // extra branches started by path splitting
+    unsigned long long cacheTerminated = 0; // path was ended by a radiance cache lookup
+
+    void add(const CounterValues& other);
+};
+
+// One thread's counters. Each block registers itself so mergeCounters can find it.
+struct alignas(64) ThreadCounters : CounterValues
+{
+    ThreadCounters();
+    ~ThreadCounters();
+};
+
+#if COUNTERS_ENABLED
+
+extern thread_local ThreadCounters threadCounters;
+
+#define COUNTER_ADD(field, n) (threadCounters.field += (n))
+#define COUNTER_INC(field) (threadCounters.field++)
+#define COUNTER_PATH_END(length) \
+    (threadCounters.paths++, threadCounters.bounces += (length), \
+     threadCounters.pathLengths[(length) < PATH_LENGTH_BUCKETS ? (length) : PATH_LENGTH_BUCKETS - 1]++)
+
+#else
+
+#define COUNTER_ADD(field, n) ((void)0)
+#define COUNTER_INC(field) ((void)0)
+#define COUNTER_PATH_END(length) ((void)0)
+
+#endif
+
+// Sum of every thread's counters. Only call it while no render is running.
+CounterValues mergeCounters();
+
+// Zeroes every thread's counters
+void resetCounters();
+
+// Prints the merged counters as a readable report, with rates per second if seconds > 0
+void printCounterReport(std::ostream& out, double seconds);
+
+// Triangle tests done so far by the calling thread, used for the per-pixel cost heatmaps (0 when compiled out)
+unsigned long long threadTriangleTests();
@@ -0,0 +1,175 @@
+/*
+Contains the a-trous denoiser.
+
+*/
+
+#include "denoiser.h"
+#include "trace.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include <omp.h>
+
+using namespace std;
+
+// below this albedo a channel is not demodulated, since dividing by it would only blow up the noise
+const double MIN_ALBEDO = 0.01;
+
+static double demodulate(double c, double a) { return a > MIN_ALBEDO ? c / a : c; }
+static double remodulate(double c, double a) { return a > MIN_ALBEDO ? c * a : c; }
+
+// compresses HDR values into [0, 1) so a single color sigma works for both dim and very bright pixels
+static Color toneMap(const Color& c)
+{
+    return Color(c.x() / (1.0 + c.x()), c.y() / (1.0 + c.y()), c.z() / (1.0 + c.z()));
+}
+
+void denoiseImage(Image& color, const AuxiliaryImages& aux, const DenoiseSettings& settings)
+{
+    TRACE_SCOPE("denoise");
+
+    const int width = color.getWidth();
+    const int height = color.getHeight();
+    const int n = width * height;
+
+    // copy everything into flat arrays once, the passes read each pixel up to 25 times
+    vector<Color> albedo(n), normal(n), current(n), next(n), mapped(n);
+    vector<double> depth(n);
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int p = y * width + x;
+            albedo[p] = aux.albedo.getColor(x, y);
+            Vec3 nrm = aux.normal.getColor(x, y);
+            normal[p] = nrm.lengthSquared() > 0 ? unit(nrm) : nrm;
+            depth[p] = aux.depth.getColor(x, y).x();
+
+            Color c = color.getColor(x, y);
+            current[p] = Color(demodulate(c.x(), albedo[p].x()), demodulate(c.y(), albedo[p].y()),
+                demodulate(c.z(), albedo[p].z()));
+        }
+    }
+
+    if (settings.fireflyClamp > 0)
+    {
+        auto brightness = [](const Color& c) { return (c.x() + c.y() + c.z()) / 3.0; };
+
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                int p = y * width + x;
+                double sum = 0, sumSquares = 0;
+                int count = 0;
+                for (int qy = std::max(0, y - 2); qy <= std::min(height - 1, y + 2); qy++)
+                {
+                    for (int qx = std::max(0, x - 2); qx <= std::min(width - 1, x + 2); qx++)
+                    {
+                        int q = qy * width + qx;
+                        if (q == p)
+                            continue;
+                        double b = brightness(current[q]);
+                        sum += b;
+                        sumSquares += b * b;
+                        count++;
+                    }
+                }
+
+                double mean = sum / count;
+                double deviation = std::sqrt(std::max(0.0, sumSquares / count - mean * mean));
+                double limit = mean + settings.fireflyClamp * deviation;
+                double b = brightness(current[p]);
+                next[p] = b > limit && b > 0 ? current[p] * (limit / b) : current[p];
+            }
+        }
+        current.swap(next);
+    }
+
+    const double kernel[5] = {1.0/16, 1.0/4, 3.0/8, 1.0/4, 1.0/16};
+
+    for (int iteration = 0; iteration < settings.iterations; iteration++)
+    {
+        const int step = 1 << iteration;
+        const double colorSigma = settings.colorSigma / (1 << iteration);
+        const double invColor = 1.0 / (colorSigma * colorSigma);
+        const double invAlbedo = 1.0 / (settings.albedoSigma * settings.albedoSigma);
+
+        #pragma omp parallel for schedule(static)
+        for (int p = 0; p < n; p++)
+            mapped[p] = toneMap(current[p]);
+
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                int p = y * width + x;
+                bool pHit = depth[p] > 0;
+
+                Color sum = Color(0,0,0);
+                double weightSum = 0;
+
+                for (int l = -2; l <= 2; l++)
+                {
+                    int qy = y + l * step;
+                    if (qy < 0 || qy >= height)
+                        continue;
+
+                    for (int k = -2; k <= 2; k++)
+                    {
+                        int qx = x + k * step;
+                        if (qx < 0 || qx >= width)
+                            continue;
+
+                        int q = qy * width + qx;
+                        double w = kernel[k + 2] * kernel[l + 2];
+
+                        if (q != p)
+                        {
+                            // background only mixes with background, and surfaces only with surfaces
+                            bool qHit = depth[q] > 0;
+                            if (pHit != qHit)
+                                continue;
+
+                            w *= std::exp(-(mapped[p] - mapped[q]).lengthSquared() * invColor);
+
+                            if (pHit)
+                            {
+                                w *= std::exp(-(albedo[p] - albedo[q]).lengthSquared() * invAlbedo);
+                                w *= std::pow(std::max(0.0, dot(normal[p], normal[q])), settings.normalPower);
+
+                                double pixelDistance = step * std::sqrt(double(k * k + l * l));
+                                double relativeDepth = std::fabs(depth[p] - depth[q]) / depth[p];
+                                w *= std::exp(-relativeDepth / (settings.depthSigma * pixelDistance));
+                            }
+                        }
+
+                        sum += current[q] * w;
+                        weightSum += w;
+                    }
+                }
+
+                next[p] = sum / weightSum;
+            }
+        }
+
+        current.swap(next);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int p = y * width + x;
+            const Color& c = current[p];
+            color.setColor(x, y, Color(remodulate(c.x(), albedo[p].x()), remodulate(c.y(), albedo[p].y()),
+                remodulate(c.z(), albedo[p].z())));
+        }
+    }
+}
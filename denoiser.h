@@ -0,0 +1,45 @@
+/*
+Contains the edge-aware a-trous wavelet denoiser and the auxiliary (guide) buffers it uses.
+
+The filter blurs with a 5x5 B3-spline kernel whose taps are spread further apart each iteration (1, 2, 4, ...
+pixels), so a few cheap passes cover a wide area. Every tap is weighted by how similar the neighbour is to the
+center in color, first hit albedo, normal and depth, so the blur stops at edges and texture changes.
+
+The radiance is divided by the albedo before filtering and multiplied back afterwards, so surface color detail
+survives and only the lighting gets smoothed.
+
+*/
+
+#pragma once
+
+#include "image.h"
+
+// Per pixel averages of the AuxiliarySample data. The depth image stores the distance in every channel.
+struct AuxiliaryImages
+{
+    Image albedo;
+    Image normal;
+    Image depth;
+
+    AuxiliaryImages(int w, int h) : albedo(w, h), normal(w, h), depth(w, h) {}
+};
+
+struct DenoiseSettings
+{
+    // Before filtering, a pixel brighter than the mean plus fireflyClamp standard deviations of its 5x5
+    // neighbourhood is scaled down to that bound, so isolated fireflies do not survive the edge stopping.
+    // 0 turns this off.
+    double fireflyClamp = 2.0;
+
+    // Number of a-trous passes; the filter covers about 4 * 2^iterations pixels
+    int iterations = 5;
+
+    // Smaller sigmas keep more detail (and more noise). The color sigma is halved every pass.
+    double colorSigma = 1.5;
+    double albedoSigma = 0.1;
+    double normalPower = 64;   // neighbour weight is max(0, n.n')^normalPower
+    double depthSigma = 0.05;  // relative depth difference per pixel of distance
+};
+
+// Filters `color` in place, using multiple threads
+void denoiseImage(Image& color, const AuxiliaryImages& aux, const DenoiseSettings& settings);
@@ -0,0 +1,493 @@
+/*
+Contains the coordinator, worker and merge modes of distributed rendering.
+
+*/
+
+#include "distributed.h"
+#include "benchmark.h"
+#include "renderer.h"
+#include "scene.h"
+#include "image.h"
+#include "trace.h"
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+using namespace std;
+
+static bool makeDirectory(const string& path)
+{
+    if (mkdir(path.c_str(), 0755) == 0 || errno == EEXIST)
+        return true;
+    cerr << "Error: Could not create directory " << path << ": " << strerror(errno) << "\n";
+    return false;
+}
+
+// names of the files in `directory` ending in `extension`, sorted
+static vector<string> listFiles(const string& directory, const string& extension)
+{
+    vector<string> names;
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return names;
+
+    while (dirent* entry = readdir(dir))
+    {
+        string name = entry->d_name;
+        if (name.size() > extension.size() && name[0] != '.'
+            && name.compare(name.size() - extension.size(), extension.size(), extension) == 0)
+            names.push_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static string unitName(int index)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "unit_%04d", index);
+    return name;
+}
+
+// Files are written under a hidden temporary name and renamed into place, so nobody ever reads half a file
+static bool publish(const string& temporary, const string& fileName)
+{
+    if (std::rename(temporary.c_str(), fileName.c_str()) != 0)
+    {
+        cerr << "Error: Could not rename " << temporary << " to " << fileName << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+static bool writeJobFile(const WorkUnit& unit, const string& directory)
+{
+    string fileName = directory + "/" + unitName(unit.index) + ".job";
+    string temporary = directory + "/." + unitName(unit.index) + ".tmp";
+    ofstream out(temporary);
+    if (!out.is_open())
+    {
+        cerr << "Error: Could not open " << temporary << " for writing\n";
+        return false;
+    }
+
+    out.precision(17);
+    out << "index " << unit.index << "\n"
+        << "scene " << unit.scene << "\n"
+        << "scale " << unit.stressScale << "\n"
+        << "size " << unit.imageWidth << " " << unit.imageHeight << "\n"
+        << "crop " << unit.cropX << " " << unit.cropY << " " << unit.cropWidth << " " << unit.cropHeight << "\n"
+        << "samples " << unit.firstSample << " " << unit.sampleCount << "\n"
+        << "seed " << unit.seed << "\n"
+        << "depth " << unit.integrator.maxDepth << "\n"
+        << "rr " << unit.integrator.russianRoulette << " " << unit.integrator.rrMinDepth << "\n"
+        << "split " << unit.integrator.maxSplit << " " << unit.integrator.splitDepth << "\n"
+        << "nee " << unit.integrator.lightSampling << " " << (unit.integrator.heuristic == MISHeuristic::Balance) << "\n";
+    out.close();
+    return out.good() && publish(temporary, fileName);
+}
+
+static bool readJobFile(const string& fileName, WorkUnit& unit)
+{
+    ifstream in(fileName);
+    if (!in.is_open())
+    {
+        cerr << "Error: Could not open job file " << fileName << "\n";
+        return false;
+    }
+
+    string line;
+    while (getline(in, line))
+    {
+        istringstream iss(line);
+        string key;
+        iss >> key;
+        if (key == "index") iss >> unit.index;
+        else if (key == "scene") iss >> unit.scene;
+        else if (key == "scale") iss >> unit.stressScale;
+        else if (key == "size") iss >> unit.imageWidth >> unit.imageHeight;
+        else if (key == "crop") iss >> unit.cropX >> unit.cropY >> unit.cropWidth >> unit.cropHeight;
+        else if (key == "samples") iss >> unit.firstSample >> unit.sampleCount;
+        else if (key == "seed") iss >> unit.seed;
+        else if (key == "depth") iss >> unit.integrator.maxDepth;
+        else if (key == "rr") iss >> unit.integrator.russianRoulette >> unit.integrator.rrMinDepth;
+        else if (key == "split") iss >> unit.integrator.maxSplit >> unit.integrator.splitDepth;
+        else if (key == "nee")
+        {
+            bool balance = false;
+            iss >> unit.integrator.lightSampling >> balance;
+            unit.integrator.heuristic = balance ? MISHeuristic::Balance : MISHeuristic::Power;
+        }
+        else if (!key.empty())
+        {
+            cerr << "Error: Unknown key " << key << " in job file " << fileName << "\n";
+            return false;
+        }
+
+        if (iss.fail())
+        {
+            cerr << "Error: Bad line \"" << line << "\" in job file " << fileName << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PartialImage::save(const string& fileName) const
+{
+    ofstream out(fileName, std::ios::binary);
+    if (!out.is_open())
+    {
+        cerr << "Error: Could not open " << fileName << " for writing\n";
+        return false;
+    }
+
+    // text header like PFM, then for every pixel three little endian floats and an unsigned sample count
+    out << "PT\n" << fullWidth << " " << fullHeight << "\n" << x << " " << y << " " << width << " " << height << "\n";
+    for (int p = 0; p < width * height; p++)
+    {
+        out.write((const char*)&color[3 * p], 3 * sizeof(float));
+        out.write((const char*)&samples[p], sizeof(unsigned int));
+    }
+    return out.good();
+}
+
+bool PartialImage::load(const string& fileName)
+{
+    ifstream in(fileName, std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    string type;
+    in >> type >> fullWidth >> fullHeight >> x >> y >> width >> height;
+    in.get(); // single whitespace character before the data
+
+    if (type != "PT" || width <= 0 || height <= 0 || x < 0 || y < 0 || x + width > fullWidth || y + height > fullHeight)
+    {
+        cerr << "Error: " << fileName << " is not a valid partial image\n";
+        return false;
+    }
+
+    color.assign(3 * width * height, 0.0f);
+    samples.assign(width * height, 0);
+    for (int p = 0; p < width * height; p++)
+    {
+        in.read((char*)&color[3 * p], 3 * sizeof(float));
+        in.read((char*)&samples[p], sizeof(unsigned int));
+    }
+    if (!in)
+    {
+        cerr << "Error: " << fileName << " is truncated\n";
+        return false;
+    }
+    return true;
+}
+
+int runDistribute(const DistributeConfig& config)
+{
+    const string& jobs = config.jobsDirectory;
+    if (!makeDirectory(jobs) || !makeDirectory(jobs + "/pending") || !makeDirectory(jobs + "/running")
+        || !makeDirectory(jobs + "/done") || !makeDirectory(jobs + "/partials"))
+        return 1;
+
+    // mixing the units of two frames in one directory would merge them into one image
+    if (!listFiles(jobs + "/pending", ".job").empty() || !listFiles(jobs + "/running", ".job").empty()
+        || !listFiles(jobs + "/partials", ".partial").empty())
+    {
+        cerr << "Error: " << jobs << " already holds work units, use an empty directory\n";
+        return 1;
+    }
+
+    const WorkUnit& frame = config.frame;
+    int tileSize = std::max(1, config.tileSize);
+    int splits = std::clamp(config.sampleSplits, 1, std::max(1, frame.sampleCount));
+
+    int index = 0;
+    for (int y = 0; y < frame.imageHeight; y += tileSize)
+    {
+        for (int x = 0; x < frame.imageWidth; x += tileSize)
+        {
+            for (int s = 0; s < splits; s++)
+            {
+                WorkUnit unit = frame;
+                unit.index = index++;
+                unit.cropX = x;
+                unit.cropY = y;
+                unit.cropWidth = std::min(tileSize, frame.imageWidth - x);
+                unit.cropHeight = std::min(tileSize, frame.imageHeight - y);
+
+                // split the samples as evenly as possible, the first ranges taking the remainder
+                int begin = frame.sampleCount * s / splits;
+                int end = frame.sampleCount * (s + 1) / splits;
+                unit.firstSample = frame.firstSample + begin;
+                unit.sampleCount = end - begin;
+
+                if (!writeJobFile(unit, jobs + "/pending"))
+                    return 1;
+            }
+        }
+    }
+
+    cout << "Wrote " << index << " work units to " << jobs << "/pending (" << frame.imageWidth << "x"
+        << frame.imageHeight << ", " << frame.sampleCount << " spp, " << tileSize << " pixel tiles, " << splits
+        << " sample ranges per tile)" << endl;
+    return 0;
+}
+
+// Renders the unit claimed as running/<claimed> into its partial and moves it to done. scene and loadedScene carry
+// the last unit's scene over to the next. Returns false after printing an error, with the unit still in running.
+static bool renderUnit(const string& jobsDirectory, const string& claimed, int threads, Scene& scene,
+    string& loadedScene, double& renderTime)
+{
+    const string running = jobsDirectory + "/running";
+    const string partials = jobsDirectory + "/partials";
+
+    WorkUnit unit;
+    if (!readJobFile(running + "/" + claimed, unit))
+        return false;
+    TRACE_SCOPE("work unit", unit.index);
+
+    string sceneKey = unit.scene + " " + to_string(unit.stressScale);
+    if (sceneKey != loadedScene)
+    {
+        scene = Scene();
+        loadedScene.clear();
+        if (!loadBenchmarkScene(scene, unit.scene, unit.stressScale))
+            return false;
+        scene.build();
+        loadedScene = sceneKey;
+    }
+
+    RenderSettings settings;
+    settings.imageWidth = unit.imageWidth;
+    settings.imageHeight = unit.imageHeight;
+    settings.cropX = unit.cropX;
+    settings.cropY = unit.cropY;
+    settings.cropWidth = unit.cropWidth;
+    settings.cropHeight = unit.cropHeight;
+    settings.sampleCount = unit.sampleCount;
+    settings.firstSample = unit.firstSample;
+    settings.threads = threads;
+    settings.deterministic = true;
+    settings.seed = unit.seed;
+    settings.showProgress = false;
+
+    Image image(unit.cropWidth, unit.cropHeight);
+    MISIntegrator integrator = unit.integrator;
+    RenderStats stats = renderImage(scene, integrator, Camera(), settings, image);
+    renderTime += stats.seconds;
+
+    PartialImage partial;
+    partial.fullWidth = unit.imageWidth;
+    partial.fullHeight = unit.imageHeight;
+    partial.x = unit.cropX;
+    partial.y = unit.cropY;
+    partial.width = unit.cropWidth;
+    partial.height = unit.cropHeight;
+    partial.color.resize(3 * partial.width * partial.height);
+    partial.samples.assign(partial.width * partial.height, unit.sampleCount);
+    for (int y = 0; y < partial.height; y++)
+    {
+        for (int x = 0; x < partial.width; x++)
+        {
+            Color c = image.getColor(x, y);
+            int p = y * partial.width + x;
+            partial.color[3 * p + 0] = float(c.x());
+            partial.color[3 * p + 1] = float(c.y());
+            partial.color[3 * p + 2] = float(c.z());
+        }
+    }
+
+    string base = unitName(unit.index);
+    if (!partial.save(partials + "/." + base + ".tmp")
+        || !publish(partials + "/." + base + ".tmp", partials + "/" + base + ".partial")
+        || !publish(running + "/" + claimed, jobsDirectory + "/done/" + claimed))
+        return false;
+
+    cout << "Worker " << (long)getpid() << ": unit " << unit.index << " (" << unit.cropWidth << "x"
+        << unit.cropHeight << " at " << unit.cropX << "," << unit.cropY << ", samples " << unit.firstSample << "-"
+        << unit.firstSample + unit.sampleCount - 1 << ") in " << stats.seconds << " s" << endl;
+    return true;
+}
+
+int runWorker(const string& jobsDirectory, int threads)
+{
+    const string pending = jobsDirectory + "/pending";
+    const string running = jobsDirectory + "/running";
+    const long pid = (long)getpid();
+
+    // the scene is only reloaded when a unit asks for a different one
+    Scene scene;
+    string loadedScene;
+    int rendered = 0;
+    double renderTime = 0;
+
+    while (true)
+    {
+        vector<string> jobs = listFiles(pending, ".job");
+        if (jobs.empty())
+            break;
+
+        // take the first unit nobody else has renamed away yet
+        string claimed;
+        for (const string& name : jobs)
+        {
+            if (std::rename((pending + "/" + name).c_str(), (running + "/" + name).c_str()) == 0)
+            {
+                claimed = name;
+                break;
+            }
+        }
+        if (claimed.empty())
+            continue;
+
+        // the claim's time is the file's, which runRequeue goes by (a rename keeps the coordinator's)
+        utime((running + "/" + claimed).c_str(), nullptr);
+
+        if (!renderUnit(jobsDirectory, claimed, threads, scene, loadedScene, renderTime))
+        {
+            // give the unit back, so another worker (or this one, once the problem is fixed) can render it
+            if (std::rename((running + "/" + claimed).c_str(), (pending + "/" + claimed).c_str()) == 0)
+                cerr << "Worker " << pid << ": returned " << claimed << " to " << pending << "\n";
+            return 1;
+        }
+        rendered++;
+    }
+
+    cout << "Worker " << pid << ": no pending units left, rendered " << rendered << " in " << renderTime << " s"
+        << endl;
+    return 0;
+}
+
+int runRequeue(const string& jobsDirectory, double staleSeconds)
+{
+    const string pending = jobsDirectory + "/pending";
+    const string running = jobsDirectory + "/running";
+    const time_t now = time(nullptr);
+
+    int requeued = 0, kept = 0;
+    for (const string& name : listFiles(running, ".job"))
+    {
+        struct stat info;
+        if (stat((running + "/" + name).c_str(), &info) != 0)
+            continue;   // finished or requeued by someone else meanwhile
+        if (difftime(now, info.st_mtime) < staleSeconds)
+        {
+            kept++;
+            continue;
+        }
+        if (std::rename((running + "/" + name).c_str(), (pending + "/" + name).c_str()) == 0)
+            requeued++;
+    }
+
+    cout << "Returned " << requeued << " claimed units to " << pending;
+    if (kept > 0)
+        cout << ", " << kept << " claimed less than " << staleSeconds << " s ago are still running";
+    cout << endl;
+    return 0;
+}
+
+int runMerge(const string& jobsDirectory, const string& output)
+{
+    TRACE_SCOPE("merge");
+    const string partials = jobsDirectory + "/partials";
+    vector<string> files = listFiles(partials, ".partial");
+    if (files.empty())
+    {
+        cerr << "Error: No partial images in " << partials << "\n";
+        return 1;
+    }
+
+    size_t unfinished = listFiles(jobsDirectory + "/pending", ".job").size()
+        + listFiles(jobsDirectory + "/running", ".job").size();
+    if (unfinished > 0)
+        cerr << "Warning: " << unfinished << " work units are not finished yet (--requeue returns the claims of "
+            << "workers that died)\n";
+
+    int width = 0, height = 0;
+    vector<double> sum;
+    vector<unsigned long long> count;
+
+    for (const string& name : files)
+    {
+        PartialImage partial;
+        if (!partial.load(partials + "/" + name))
+            return 1;
+
+        if (sum.empty())
+        {
+            width = partial.fullWidth;
+            height = partial.fullHeight;
+            sum.assign(3 * width * height, 0.0);
+            count.assign(width * height, 0);
+        }
+        else if (partial.fullWidth != width || partial.fullHeight != height)
+        {
+            cerr << "Error: " << name << " belongs to a " << partial.fullWidth << "x" << partial.fullHeight
+                << " image, the others to a " << width << "x" << height << " one\n";
+            return 1;
+        }
+
+        // mean colors are weighted by their sample counts, so uneven sample ranges still average correctly
+        for (int y = 0; y < partial.height; y++)
+        {
+            for (int x = 0; x < partial.width; x++)
+            {
+                int p = y * partial.width + x;
+                int q = (partial.y + y) * width + partial.x + x;
+                for (int c = 0; c < 3; c++)
+                    sum[3 * q + c] += double(partial.color[3 * p + c]) * partial.samples[p];
+                count[q] += partial.samples[p];
+            }
+        }
+    }
+
+    Image image(width, height);
+    size_t missing = 0;
+    unsigned long long minSamples = ~0ull, maxSamples = 0;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int q = y * width + x;
+            minSamples = std::min(minSamples, count[q]);
+            maxSamples = std::max(maxSamples, count[q]);
+            if (count[q] == 0)
+            {
+                missing++;
+                continue;
+            }
+            image.setColor(x, y, Color(sum[3 * q], sum[3 * q + 1], sum[3 * q + 2]) / double(count[q]));
+        }
+    }
+
+    if (missing > 0)
+    {
+        cerr << "Error: " << missing << " pixels have no samples, some work units are missing (see --requeue for "
+            << "the units of workers that died)\n";
+        return 1;
+    }
+
+    image.saveImagePFM(output + ".pfm");
+    image.saveImageBMP(output + ".bmp");
+    cout << "Merged " << files.size() << " partial images into " << output << ".pfm and " << output << ".bmp ("
+        << width << "x" << height << ", " << minSamples;
+    if (maxSamples != minSamples)
+        cout << " to " << maxSamples;
+    cout << " spp)" << endl;
+    return 0;
+}
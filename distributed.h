@@ -0,0 +1,86 @@
+/*
+Contains the distributed render modes, which split one frame into work units that independent worker processes
+render, and the merge step that puts their results back together.
+
+Coordination goes through a shared directory, so the workers can run on one machine or on any number of nodes that
+mount the same filesystem:
+
+    <jobs>/pending/unit_0003.job    written by the coordinator, one per work unit
+    <jobs>/running/unit_0003.job    a worker claimed it, by renaming it out of pending
+    <jobs>/done/unit_0003.job       finished, its result is in partials
+    <jobs>/partials/unit_0003.partial
+
+Claiming is a rename, which is atomic within one filesystem, so two workers can never take the same unit. A worker
+that fails on a unit renames it back to pending before it exits. One that crashes or whose node goes down leaves
+its unit in running, where runRequeue (render --requeue) returns it to pending once its claim is old enough. A work
+unit is a crop window and a range of sample indices. Seeds depend only on the pixel's position in the full image
+and on the sample index, so the result does not depend on which worker rendered what. Splitting by tiles alone
+gives exactly the single process render.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include "lightTransport.h"
+
+// Everything a worker needs to render its part, written to the job files as "key value" lines
+struct WorkUnit
+{
+    int index = 0;
+
+    // See loadBenchmarkScene
+    std::string scene = "default";
+    double stressScale = 1.0;
+
+    int imageWidth = 512;
+    int imageHeight = 512;
+    int cropX = 0, cropY = 0, cropWidth = 0, cropHeight = 0;
+    int firstSample = 0;
+    int sampleCount = 16;
+    unsigned int seed = 12345;
+    MISIntegrator integrator;
+};
+
+struct DistributeConfig
+{
+    std::string jobsDirectory = "jobs";
+
+    // Describes the whole frame; the crop and sample range are filled in per unit
+    WorkUnit frame;
+
+    // Square tiles of this many pixels (the last row and column may be smaller)
+    int tileSize = 128;
+
+    // Each tile's samples are split into this many separate units
+    int sampleSplits = 1;
+};
+
+// Creates the jobs directory and writes one job file per work unit
+int runDistribute(const DistributeConfig& config);
+
+// Claims and renders pending units until there are none left. threads as in RenderSettings.
+int runWorker(const std::string& jobsDirectory, int threads);
+
+// Moves the units claimed at least staleSeconds ago from running back to pending, for workers that died on them.
+// The claim's age is the job file's modification time, which the worker sets when it claims the unit, so
+// staleSeconds has to be longer than a unit takes to render. A unit still being rendered when it is requeued is
+// rendered twice, which only costs time: both renders write the same partial.
+int runRequeue(const std::string& jobsDirectory, double staleSeconds);
+
+// Combines every partial in the jobs directory, weighting each by its sample counts, and saves <output>.pfm and
+// <output>.bmp. Fails if some pixel has no samples at all.
+int runMerge(const std::string& jobsDirectory, const std::string& output);
+
+// A crop window of the full image with the mean color and sample count of every pixel
+struct PartialImage
+{
+    int fullWidth = 0, fullHeight = 0;
+    int x = 0, y = 0, width = 0, height = 0;
+    std::vector<float> color;       // 3 per pixel, rows bottom to top
+    std::vector<unsigned int> samples;
+
+    bool save(const std::string& fileName) const;
+    bool load(const std::string& fileName);
+};
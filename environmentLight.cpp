@@ -0,0 +1,174 @@
+/*
+Contains the alias tables and the environment light's lookups and sampling.
+
+*/
+
+#include "environmentLight.h"
+#include "image.h"
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+const double PI = 3.14159265358979323846;
+
+bool AliasTable::build(const std::vector<double>& weights)
+{
+    probability.clear();
+    alias.clear();
+
+    double sum = 0;
+    for (double w : weights)
+        sum += std::max(w, 0.0);
+    if (!(sum > 0))
+        return false;
+
+    // weights scaled so the average is 1; slots below 1 are topped up by an alias from a slot above 1
+    const size_t n = weights.size();
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (size_t i = 0; i < n; i++)
+    {
+        scaled[i] = std::max(weights[i], 0.0) * n / sum;
+        (scaled[i] < 1.0 ? small : large).push_back(int(i));
+    }
+
+    probability.assign(n, 1.0);
+    alias.resize(n);
+    for (size_t i = 0; i < n; i++)
+        alias[i] = int(i);
+
+    while (!small.empty() && !large.empty())
+    {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        large.pop_back();
+
+        probability[s] = scaled[s];
+        alias[s] = l;
+        scaled[l] += scaled[s] - 1.0;
+        (scaled[l] < 1.0 ? small : large).push_back(l);
+    }
+
+    // what is left is 1 up to rounding, and keeps itself
+    return true;
+}
+
+int AliasTable::sample(double u) const
+{
+    const int n = int(probability.size());
+    double x = u * n;
+    int i = std::min(int(x), n - 1);
+    return x - i < probability[i] ? i : alias[i];
+}
+
+static double luminance(const Color& c)
+{
+    return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+}
+
+bool EnvironmentLight::load(const std::string& imageFile, double scale)
+{
+    Image image(1, 1);
+    if (!image.loadImagePFM(imageFile))
+    {
+        std::cerr << "Error: Could not load environment map " << imageFile << "\n";
+        return false;
+    }
+
+    imageWidth = image.getWidth();
+    imageHeight = image.getHeight();
+    pixels.resize(size_t(imageWidth) * imageHeight);
+
+    // PFM rows go bottom to top
+    for (int row = 0; row < imageHeight; row++)
+    {
+        for (int x = 0; x < imageWidth; x++)
+            pixels[size_t(row) * imageWidth + x] = image.getColor(x, imageHeight - 1 - row) * scale;
+    }
+
+    // a cell's weight is its brightness times the solid angle it covers, which shrinks towards the poles
+    std::vector<double> cellWeights(pixels.size());
+    std::vector<double> rowWeights(imageHeight, 0.0);
+    double total = 0;
+    for (int row = 0; row < imageHeight; row++)
+    {
+        double sinTheta = std::sin(PI * (row + 0.5) / imageHeight);
+        for (int x = 0; x < imageWidth; x++)
+        {
+            size_t cell = size_t(row) * imageWidth + x;
+            cellWeights[cell] = std::max(luminance(pixels[cell]), 0.0) * sinTheta;
+            rowWeights[row] += cellWeights[cell];
+        }
+        total += rowWeights[row];
+    }
+
+    columns.assign(imageHeight, AliasTable());
+    cellPdf.assign(pixels.size(), 0.0);
+    if (!rows.build(rowWeights))
+        return true; // a black image lights nothing, and is never sampled
+
+    for (int row = 0; row < imageHeight; row++)
+    {
+        std::vector<double> weights(cellWeights.begin() + size_t(row) * imageWidth,
+            cellWeights.begin() + size_t(row + 1) * imageWidth);
+        columns[row].build(weights);
+    }
+    for (size_t cell = 0; cell < pixels.size(); cell++)
+        cellPdf[cell] = cellWeights[cell] / total * pixels.size();
+    return true;
+}
+
+int EnvironmentLight::cellOf(const Vec3& direction, double& sinTheta) const
+{
+    double cosTheta = std::clamp(direction.y(), -1.0, 1.0);
+    sinTheta = std::sqrt(std::max(0.0, 1.0 - cosTheta * cosTheta));
+    double phi = std::atan2(direction.z(), direction.x());
+    if (phi < 0)
+        phi += 2 * PI;
+
+    int row = std::min(int(std::acos(cosTheta) / PI * imageHeight), imageHeight - 1);
+    int column = std::min(int(phi / (2 * PI) * imageWidth), imageWidth - 1);
+    return row * imageWidth + column;
+}
+
+Color EnvironmentLight::Le(const Vec3& direction) const
+{
+    if (pixels.empty())
+        return Color(0, 0, 0);
+    double sinTheta;
+    return pixels[cellOf(direction, sinTheta)];
+}
+
+double EnvironmentLight::pdf(const Vec3& direction) const
+{
+    if (rows.empty())
+        return 0.0;
+    double sinTheta;
+    int cell = cellOf(direction, sinTheta);
+    if (sinTheta <= 0)
+        return 0.0;
+
+    // uniform within the cell in (theta, phi), which covers 2 pi^2 / cells of that square
+    return cellPdf[cell] / (2 * PI * PI * sinTheta);
+}
+
+Color EnvironmentLight::sample(SimpleSampler& sample, Vec3& direction, double& pdf) const
+{
+    pdf = 0;
+    if (rows.empty())
+        return Color(0, 0, 0);
+
+    int row = rows.sample(sample.get1D());
+    int column = columns[row].sample(sample.get1D());
+    double theta = PI * (row + sample.get1D()) / imageHeight;
+    double phi = 2 * PI * (column + sample.get1D()) / imageWidth;
+
+    double sinTheta = std::sin(theta);
+    direction = Vec3(sinTheta * std::cos(phi), std::cos(theta), sinTheta * std::sin(phi));
+
+    // looked up again from the direction, so a sample that rounds into the next cell gets exactly what pdf() and
+    // Le() say for it
+    pdf = this->pdf(direction);
+    return Le(direction);
+}
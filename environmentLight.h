@@ -0,0 +1,76 @@
+/*
+Contains the environment light: light arriving from infinitely far away in every direction, read from a lat-long
+(equirectangular) HDR image, like a sky. Rays that leave the scene see it, and next event estimation samples it
+like one more emitter.
+
+Sampling follows the image's brightness. Every pixel is a cell of a 2D piecewise constant distribution, weighed by
+its luminance times the solid angle it covers, and two alias tables (one over the rows, one over the columns of
+each row) pick a cell in constant time. The pdf of a direction is the weight of the cell it falls in, which a BSDF
+sample that escapes looks up directly to weigh itself against next event estimation. A sun or a bright window in
+the image is found by almost every light sample instead of by the few BSDF samples that happen to point at it.
+
+A scene has at most one (Scene::environment); loadBenchmarkScene gives <name>.obj the one in <name>_env.pfm. The
+out of core renderer's cluster files do not carry it.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include "object.h"
+#include "lightTransport.h"
+
+// Walker's alias method: after build(weights), sample() returns index i with probability weights[i] / sum in
+// constant time, from one uniform number
+class AliasTable
+{
+    public:
+
+    // Returns false if no weight is above 0, which leaves the table empty
+    bool build(const std::vector<double>& weights);
+
+    int sample(double u) const;
+
+    bool empty() const { return probability.empty(); }
+    size_t size() const { return probability.size(); }
+
+    private:
+
+    std::vector<double> probability;    // of keeping the picked slot rather than taking its alias
+    std::vector<int> alias;
+};
+
+class EnvironmentLight
+{
+    public:
+
+    // Loads a lat-long PFM image: x goes once around the vertical (+y) axis, the top row looks straight up and the
+    // bottom row straight down. Every pixel is multiplied by `scale`. Returns false on errors.
+    bool load(const std::string& imageFile, double scale = 1.0);
+
+    // The radiance arriving from the (unit) world space direction
+    Color Le(const Vec3& direction) const;
+
+    // Picks a direction by the image's brightness, with its solid angle pdf. pdf is 0 if there is nothing to pick.
+    Color sample(SimpleSampler& sample, Vec3& direction, double& pdf) const;
+
+    // The solid angle pdf with which sample() picks the (unit) direction
+    double pdf(const Vec3& direction) const;
+
+    int width() const { return imageWidth; }
+    int height() const { return imageHeight; }
+
+    private:
+
+    // The pixel a direction falls in, and its angle from straight up
+    int cellOf(const Vec3& direction, double& sinTheta) const;
+
+    int imageWidth = 0;
+    int imageHeight = 0;
+    std::vector<Color> pixels;      // row 0 at the top
+
+    AliasTable rows;
+    std::vector<AliasTable> columns;
+    std::vector<double> cellPdf;    // every cell's probability times the cell count, 0 if it is never picked
+};
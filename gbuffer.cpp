@@ -0,0 +1,57 @@
+/*
+Contains the G-buffer's bookkeeping. renderImage does the recording and the shading from it.
+
+*/
+
+#include "gbuffer.h"
+#include <algorithm>
+
+void GBuffer::reset(int width, int height)
+{
+    bufferWidth = width;
+    bufferHeight = height;
+    filledSamples = 0;
+    hits.clear();
+    touched.assign(size_t(width) * height, 0);
+    kept.clear();
+    dirty.clear();
+}
+
+void GBuffer::invalidateAll()
+{
+    kept.clear();
+    dirty.clear();
+}
+
+void GBuffer::invalidate(unsigned long long groupMask)
+{
+    for (size_t pixel = 0; pixel < dirty.size(); pixel++)
+    {
+        if (touched[pixel] & groupMask)
+            dirty[pixel] = 1;
+    }
+}
+
+void GBuffer::keepResult(const Image& image)
+{
+    kept.resize(size_t(bufferWidth) * bufferHeight);
+    dirty.assign(kept.size(), 0);
+    for (int y = 0; y < bufferHeight; y++)
+    {
+        for (int x = 0; x < bufferWidth; x++)
+            kept[size_t(y) * bufferWidth + x] = image.getColor(x, y);
+    }
+}
+
+void GBuffer::reserveSamples(int sampleCount)
+{
+    while (int(hits.size()) < sampleCount)
+        hits.emplace_back(size_t(bufferWidth) * bufferHeight);
+}
+
+void GBuffer::recorded(int firstSample, int count)
+{
+    // a gap would leave samples in between unrecorded
+    if (firstSample <= filledSamples)
+        filledSamples = std::max(filledSamples, firstSample + count);
+}
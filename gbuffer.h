@@ -0,0 +1,90 @@
+/*
+Contains the G-buffer, which keeps what every camera ray hit first, so a scene can be shaded again after an edit
+without tracing its camera rays again.
+
+Look development changes colors, materials and lights over and over while the geometry and the camera stay where
+they are, so the first hit of every sample stays the same from one render to the next. When renderImage is given a
+G-buffer (RenderSettings::gbuffer), it records the triangle, barycentric coordinates and distance of every sample's
+first hit, and later renders of the same samples rebuild the hit from them (Scene::hitAt) instead of tracing the
+ray through the BVH. Position, normal, color and material are looked up from the scene again, so edits to them
+show.
+
+The camera ray of a sample is the recorded one, as the hit is only valid for it. A pixel's samples draw from one
+sampler, so this is also the ray a full render would trace as long as the edits leave the number of random numbers
+every path draws alone: after color and emission edits, the image is exactly the one a full render would give.
+Edits that change how paths continue (a mirror that becomes diffuse, another depth) shift the numbers later
+samples get; the image is then a full render's with other noise, as every sample is still an independent one.
+
+The buffer also remembers, per pixel, the groups of triangles the pixel's paths hit (bits from Scene::groupBit)
+and the color the last finished render gave it (keepResult). After an edit to the color or material of some
+groups, invalidate() marks only the pixels whose paths hit them; renderImage shades those and gives every other
+pixel its kept color. Edits that change what next event estimation picks from (the emission of triangles) touch
+pixels no mask records, and need invalidateAll().
+
+Whoever owns the buffer has to reset it whenever first hits move: when the geometry, the camera, the image size,
+the crop window or the seed change. The render server keys its buffer on all of them. A first hit takes 48 bytes,
+so 256 x 256 pixels with 16 samples each take 50 MB.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include "object.h"
+#include "image.h"
+
+struct FirstHit
+{
+    Vec3 barycentrics;
+    double t = 0;
+    int primitive = -1;     // -1 if the ray hit nothing
+    int instance = -1;
+    float jitterX = 0, jitterY = 0;     // where in the pixel the camera ray went through
+};
+
+class GBuffer
+{
+    public:
+
+    // Empties the buffer for renders into width x height images (the crop window's size, if there is one)
+    void reset(int width, int height);
+
+    // Forgets the last render's colors, so the next render shades every pixel
+    void invalidateAll();
+
+    // Makes the next render shade the pixels whose paths hit any of the groups in groupMask. The others keep the
+    // colors of the last render.
+    void invalidate(unsigned long long groupMask);
+
+    // Keeps the colors of a finished render (of every sample up to the last), for the pixels that later edits do
+    // not invalidate
+    void keepResult(const Image& image);
+
+    int width() const { return bufferWidth; }
+    int height() const { return bufferHeight; }
+
+    // Samples 0 to cachedSamples() - 1 of every pixel have their first hit stored
+    int cachedSamples() const { return filledSamples; }
+
+    // Makes room for the first hits of samples up to sampleCount - 1. Not thread safe.
+    void reserveSamples(int sampleCount);
+
+    // Called after a render stored the first hits of samples firstSample to firstSample + count - 1 of every pixel
+    void recorded(int firstSample, int count);
+
+    // Pixels are numbered y * width + x. Safe to use from several threads, one pixel per thread.
+    FirstHit& hit(int pixel, int sample) { return hits[sample][pixel]; }
+    unsigned long long& touchedGroups(int pixel) { return touched[pixel]; }
+    bool keeps(int pixel) const { return !dirty.empty() && !dirty[pixel]; }
+    const Color& keptColor(int pixel) const { return kept[pixel]; }
+
+    private:
+
+    int bufferWidth = 0;
+    int bufferHeight = 0;
+    int filledSamples = 0;
+    std::vector<std::vector<FirstHit>> hits;    // by sample, then pixel; only the first filledSamples are complete
+    std::vector<unsigned long long> touched;
+    std::vector<Color> kept;
+    std::vector<char> dirty;                    // empty while no colors are kept
+};
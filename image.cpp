@@ -8,6 +8,7 @@ Uses a 1d vector of pixels instead of 2d for minor optimization.
 #include "image.h"
 #include "bmp.h"
 #include "object.h"
+#include "trace.h"
 #include <vector>
 #include <string>
 #include <fstream>
@@ -20,7 +21,7 @@ Image::Image(int w, int h) : width(w), height(h), pixels(std::vector<Color>(w *
 
 Image::~Image() {}
 
-int Image::toIndex(int x, int y) {
+int Image::toIndex(int x, int y) const {
     return y * width + x;
 }
 
@@ -28,11 +29,12 @@ void Image::setColor(int x, int y, Color c) {
     pixels[toIndex(x, y)] = c;
 }
 
-Color Image::getColor(int x, int y) {
+Color Image::getColor(int x, int y) const {
     return pixels[toIndex(x, y)];
 }
 
 void Image::saveImageBMP(std::string fileName) {
+    TRACE_SCOPE("write image");
     BMPFileHeader fileHeader;
     BMPInfoHeader infoHeader;
 
@@ -70,6 +72,95 @@ void Image::saveImageBMP(std::string fileName) {
     out.close();
 }
 
+bool Image::loadImageBMP(std::string fileName) {
+    std::ifstream in(fileName, std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    BMPFileHeader fileHeader;
+    BMPInfoHeader infoHeader;
+    if (!in.read((char*)&fileHeader, sizeof(fileHeader)) || !in.read((char*)&infoHeader, sizeof(infoHeader)))
+        return false;
+
+    int bytesPerPixel = infoHeader.biBitCount / 8;
+    if (fileHeader.bfType != 0x4D42 || infoHeader.biCompression != 0 || (bytesPerPixel != 3 && bytesPerPixel != 4)
+        || infoHeader.biWidth <= 0 || infoHeader.biHeight == 0) {
+        std::cerr << "Error: " << fileName << " is not an uncompressed 24 or 32 bit BMP file\n";
+        return false;
+    }
+
+    // a negative height stores the rows top to bottom instead
+    bool topDown = infoHeader.biHeight < 0;
+    width = infoHeader.biWidth;
+    height = topDown ? -infoHeader.biHeight : infoHeader.biHeight;
+    pixels.assign(width * height, Color());
+
+    int rowSize = (bytesPerPixel * width + 3) & (~3);
+    std::vector<unsigned char> row(rowSize);
+    in.seekg(fileHeader.bfOffBits);
+    for (int i = 0; i < height; i++) {
+        if (!in.read((char*)row.data(), rowSize))
+            return false;
+        int y = topDown ? height - 1 - i : i;
+        for (int x = 0; x < width; x++) {
+            const unsigned char* bgr = &row[x * bytesPerPixel];
+            setColor(x, y, Color(bgr[2] / 255.0, bgr[1] / 255.0, bgr[0] / 255.0));
+        }
+    }
+    return true;
+}
+
+void Image::saveImagePFM(std::string fileName) {
+    TRACE_SCOPE("write image");
+    std::ofstream out(fileName, std::ios::binary);
+    // a negative scale marks the data as little endian
+    out << "PF\n" << width << " " << height << "\n-1.0\n";
+
+    // rows go bottom to top, like the BMP output
+    std::vector<float> row(3 * width);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            Color c = getColor(x, y);
+            row[x*3 + 0] = static_cast<float>(c[0]);
+            row[x*3 + 1] = static_cast<float>(c[1]);
+            row[x*3 + 2] = static_cast<float>(c[2]);
+        }
+        out.write((char*)row.data(), row.size() * sizeof(float));
+    }
+
+    out.close();
+}
+
+bool Image::loadImagePFM(std::string fileName) {
+    std::ifstream in(fileName, std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    std::string type;
+    int w, h;
+    double scale;
+    in >> type >> w >> h >> scale;
+    in.get(); // single whitespace character before the data
+
+    if (type != "PF" || w <= 0 || h <= 0 || scale > 0) {
+        std::cerr << "Error: " << fileName << " is not a little endian color PFM file\n";
+        return false;
+    }
+
+    width = w;
+    height = h;
+    pixels.assign(w * h, Color());
+
+    std::vector<float> row(3 * width);
+    for (int y = 0; y < height; y++) {
+        if (!in.read((char*)row.data(), row.size() * sizeof(float)))
+            return false;
+        for (int x = 0; x < width; x++)
+            setColor(x, y, Color(row[x*3 + 0], row[x*3 + 1], row[x*3 + 2]));
+    }
+    return true;
+}
+
 void createBMPHeaders(int width, int height, BMPFileHeader &fileHeader, BMPInfoHeader &infoHeader) {
     int rowSize = (3 * width + 3) & (~3);
     int imageSize = rowSize * height;
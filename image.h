@@ -21,11 +21,21 @@ public:
     ~Image();
 
     void setColor(int x, int y, Color c);
-    Color getColor(int x, int y);
+    Color getColor(int x, int y) const;
     void saveImageBMP(std::string fileName);
 
+    // Loads an uncompressed 24 or 32 bit BMP file, with every channel scaled to [0, 1] like saveImageBMP writes it
+    bool loadImageBMP(std::string fileName);
+
+    // Saves/loads the raw floating point colors as a PFM file, which keeps values above 1
+    void saveImagePFM(std::string fileName);
+    bool loadImagePFM(std::string fileName);
+
+    int getWidth() const {return width;}
+    int getHeight() const {return height;}
+
 private:
     int width, height;
     std::vector<Color> pixels;
-    int toIndex(int x, int y);
+    int toIndex(int x, int y) const;
 };
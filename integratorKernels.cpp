@@ -0,0 +1,207 @@
+/*
+Contains the kernel template, its instantiations and the table selectKernel chooses from.
+
+*/
+
+#include "integratorKernels.h"
+#include <vector>
+#include <algorithm>
+
+static double maxComponent(const Vec3& v)
+{
+    return std::max(v.x(), std::max(v.y(), v.z()));
+}
+
+// MISIntegrator::tracePath without splitting, guiding or the radiance cache, with the policies fixed at compile
+// time. Any change to one of the two has to be made to the other, or the kernels stop matching the generic
+// integrator.
+template <typename Materials, bool LightSampling, MISHeuristic Heuristic, int MaxDepth>
+static Color pathKernel(const MISIntegrator& integrator, const Scene& scene, Ray r, SimpleSampler& sample,
+    AuxiliarySample* aux)
+{
+    const int maxDepth = MaxDepth > 0 ? MaxDepth : integrator.maxDepth;
+
+    Vec3 Li = Vec3();
+    Vec3 beta = Vec3(1.0, 1.0, 1.0);
+    Vec3 wi_local, wo_local, wo_world;
+    double bsdf_pdf = 0;
+
+    int depth = 0;
+    for (;; depth++)
+    {
+        COUNTER_INC(rays);
+        Intersection intersectPt = sceneIntersection(scene, r);
+
+        if (!intersectPt.valid)
+        {
+            COUNTER_INC(escaped);
+            if (scene.environment)
+            {
+                Vec3 direction = unit(r.direction());
+                double lightWeight, bsdfWeight = 1.0;
+                if (LightSampling && bsdf_pdf > 0)
+                    misWeights(Heuristic, scene.environment->pdf(direction) / scene.emitterCount(), bsdf_pdf, lightWeight, bsdfWeight);
+                Li += beta * scene.environment->Le(direction) * bsdfWeight;
+            }
+            break;
+        }
+
+        if (aux != nullptr)
+        {
+            aux->albedo = intersectPt.baseColor;
+            aux->normal = unit(intersectPt.normal);
+            aux->depth = (intersectPt.point - r.origin()).length();
+            aux = nullptr;
+        }
+
+        if (intersectPt.hitTri.emission.lengthSquared() > 0)
+        {
+            double lightWeight, bsdfWeight = 1.0;
+            if (LightSampling && bsdf_pdf > 0)
+                misWeights(Heuristic, emitterPdf(scene.emitterCount(), intersectPt, r.origin()), bsdf_pdf, lightWeight, bsdfWeight);
+            Li += beta * intersectPt.hitTri.emission * bsdfWeight;
+        }
+
+        if (depth == maxDepth)
+        {
+            COUNTER_INC(depthTerminated);
+            depth++;
+            break;
+        }
+
+        BSDF* reflector = intersectPt.hitTri.material;
+        const Vec3 normal = unit(intersectPt.normal);
+
+        toLocal(-r.direction(), normal, wi_local);
+
+        if (LightSampling && !Materials::isDelta(reflector))
+        {
+            double light_pdf = 0, nee_bsdf_pdf = 0;
+            Color nee = sampleEmitter(scene, sample, intersectPt, light_pdf, nee_bsdf_pdf,
+                [&](const Vec3& toLight, const Color& color, double& pdf) {
+                    pdf = Materials::pdf(reflector, wi_local, toLight);
+                    return Materials::f(reflector, wi_local, toLight, color);
+                });
+
+            // light_pdf stays 0 if the light was not reached
+            if (light_pdf > 0)
+            {
+                double neeWeight, bsdfWeight;
+                misWeights(Heuristic, light_pdf, nee_bsdf_pdf, neeWeight, bsdfWeight);
+                Li += beta * nee * neeWeight;
+            }
+        }
+
+        wo_local = Vec3(0,0,0);
+
+        double pdf_val;
+        Vec3 f_val = Materials::sample_f(reflector, wi_local, wo_local, pdf_val, intersectPt.baseColor, sample);
+        if (pdf_val <= 0)
+        {
+            COUNTER_INC(pdfTerminated);
+            depth++;
+            break;
+        }
+
+        toWorld(normal, wo_local, wo_world);
+        r = bounceRay(intersectPt, wo_world, Materials::isDelta(reflector));
+
+        beta *= (f_val * fabs(wo_local.z()) / pdf_val);
+        bsdf_pdf = Materials::isDelta(reflector) ? 0.0 : pdf_val;
+
+        if (integrator.russianRoulette && depth + 1 >= integrator.rrMinDepth)
+        {
+            double q = std::min(1.0, maxComponent(beta));
+            if (sample.get1D() >= q)
+            {
+                COUNTER_INC(rouletteTerminated);
+                depth++;
+                break;
+            }
+            beta /= q;
+        }
+    }
+    COUNTER_PATH_END(depth);
+    return Li;
+}
+
+enum class MaterialSet
+{
+    Diffuse,
+    DiffuseMirror,
+    Any
+};
+
+struct KernelEntry
+{
+    MaterialSet materials;
+    bool lightSampling;
+    MISHeuristic heuristic;
+    int maxDepth;   // 0 for any depth
+    PathKernel kernel;
+};
+
+template <typename Materials, MaterialSet Set>
+static void addKernels(std::vector<KernelEntry>& table)
+{
+    // depth 6 is what main renders with. Without light sampling the heuristic never matters, since every light
+    // pdf is 0.
+    table.push_back({Set, true, MISHeuristic::Power, 6, &pathKernel<Materials, true, MISHeuristic::Power, 6>});
+    table.push_back({Set, true, MISHeuristic::Power, 0, &pathKernel<Materials, true, MISHeuristic::Power, 0>});
+    table.push_back({Set, true, MISHeuristic::Balance, 0, &pathKernel<Materials, true, MISHeuristic::Balance, 0>});
+    table.push_back({Set, false, MISHeuristic::Power, 0, &pathKernel<Materials, false, MISHeuristic::Power, 0>});
+}
+
+static const std::vector<KernelEntry>& kernelTable()
+{
+    static const std::vector<KernelEntry> table = []() {
+        std::vector<KernelEntry> entries;
+        addKernels<DiffuseMaterials, MaterialSet::Diffuse>(entries);
+        addKernels<DiffuseMirrorMaterials, MaterialSet::DiffuseMirror>(entries);
+        addKernels<AnyMaterials, MaterialSet::Any>(entries);
+        return entries;
+    }();
+    return table;
+}
+
+// The smallest material set that covers every material of the scene (instance overrides are owned by the scene
+// too, so they are included)
+static MaterialSet sceneMaterials(const Scene& scene)
+{
+    MaterialSet set = MaterialSet::Diffuse;
+    for (const std::unique_ptr<BSDF>& material : scene.materials)
+    {
+        if (material->type() == BSDFType::Mirror)
+            set = MaterialSet::DiffuseMirror;
+        else if (material->type() != BSDFType::Diffuse)
+            return MaterialSet::Any;
+    }
+    return set;
+}
+
+KernelChoice selectKernel(const Scene& scene, const MISIntegrator& integrator)
+{
+    KernelChoice choice;
+    if (integrator.maxSplit > 1 || integrator.guide != nullptr || integrator.radianceCache != nullptr)
+        return choice;
+
+    const MaterialSet materials = sceneMaterials(scene);
+    const MISHeuristic heuristic = integrator.lightSampling ? integrator.heuristic : MISHeuristic::Power;
+
+    // the table lists the fixed depth kernels first, so they win over the any depth ones
+    for (const KernelEntry& entry : kernelTable())
+    {
+        if (entry.materials != materials || entry.lightSampling != integrator.lightSampling
+            || entry.heuristic != heuristic || (entry.maxDepth != 0 && entry.maxDepth != integrator.maxDepth))
+            continue;
+
+        const char* materialNames[] = {"diffuse", "diffuse+mirror", "any material"};
+        choice.kernel = entry.kernel;
+        choice.name = std::string(materialNames[int(materials)])
+            + (integrator.lightSampling ? (heuristic == MISHeuristic::Power ? ", power MIS" : ", balance MIS")
+                : ", no NEE")
+            + (entry.maxDepth > 0 ? ", depth " + std::to_string(entry.maxDepth) : "");
+        return choice;
+    }
+    return choice;
+}
@@ -0,0 +1,195 @@
+/*
+Contains the specialized integrator kernels: copies of MISIntegrator's path loop that are compiled for one
+configuration each, so the per bounce decisions (which BSDF, whether to sample a light, which MIS heuristic, how
+deep to go) are made by the compiler instead of at every bounce.
+
+A kernel is a template over
+    - a material set: AnyMaterials calls the BSDFs' virtual functions like MISIntegrator does, DiffuseMaterials
+      inlines the Lambert lobe, and DiffuseMirrorMaterials switches between the diffuse and mirror lobes on
+      BSDF::type() instead of making virtual calls
+    - whether next event estimation is on
+    - the MIS heuristic
+    - the maximum depth (0 reads it from the integrator at run time)
+and a small table instantiates the common combinations. selectKernel picks one for a scene and integrator, and a
+kernel gives exactly the same result as MISIntegrator::Li for the same settings, samples included.
+
+Path splitting, path guiding and the radiance cache are only done by MISIntegrator::Li, so no kernel is picked
+when any of them is on.
+
+*/
+
+#pragma once
+
+#include <string>
+#include "lightTransport.h"
+#include "scene.h"
+#include "counters.h"
+
+// The light sampling half of next event estimation, shared by MISIntegrator and the kernels: picks one emitter
+// and a point on it (or the environment and a direction), traces the shadow ray and returns the unweighted
+// contribution, with light_pdf and bsdf_pdf set if the light was reached. evaluate(toLight, color, pdf) returns the
+// BSDF at the surface for the local space direction to the light (the direction the path arrived from is the
+// caller's to capture) and sets pdf to the pdf the path's own sampling has for that direction.
+template <typename Evaluate>
+Color sampleEmitter(const Scene& scene, SimpleSampler& sample, const Intersection& intersect, double& light_pdf,
+    double& bsdf_pdf, Evaluate evaluate)
+{
+    const std::vector<Triangle>& lights = scene.lights;
+    const size_t emitters = scene.emitterCount();
+    Color contribution = Color(0,0,0);
+    if (emitters == 0)
+        return contribution;
+
+    int index = std::min(static_cast<int>(sample.get1D() * emitters), int(emitters) - 1);
+    if (index == int(lights.size()))
+    {
+        Vec3 wi;
+        double pdf;
+        Color Le = scene.environment->sample(sample, wi, pdf);
+        Vec3 n = intersect.normal;
+        double cosine = dot(n, wi);
+        if (pdf <= 0 || cosine <= 0)
+        {
+            COUNTER_INC(neeMissedLight);
+            return contribution;
+        }
+
+        COUNTER_INC(shadowRays);
+        if (sceneOccluded(scene, Ray(wi, intersect.point + n * 0.0001), 99999999.0))
+        {
+            COUNTER_INC(neeOccluded);
+            return contribution;
+        }
+        COUNTER_INC(neeUnoccluded);
+
+        light_pdf = pdf / emitters;
+        Vec3 wi_local;
+        toLocal(wi, unit(n), wi_local);
+        Color f_val = evaluate(wi_local, intersect.baseColor, bsdf_pdf);
+        return f_val * Le * cosine / light_pdf;
+    }
+
+    const Triangle& l = lights.at(index);
+    double u = sqrt(sample.get1D());
+    double v = sample.get1D();
+
+    Point p = (1 - u) * l.a->pt + u * (1 - v) * l.b->pt + u * v * l.c->pt;
+    Vec3 n = intersect.normal;
+
+    Vec3 surfaceToLight = p-intersect.point;
+
+    Vec3 wi = unit(surfaceToLight);
+    Ray r = Ray(wi, intersect.point + n * 0.0001);
+
+    auto [t, _] = triangleIntersect(l, r);
+    COUNTER_INC(triangleTests);
+
+    // the light faces away, so there is nothing to trace a shadow ray for
+    if (t == -1.0)
+    {
+        COUNTER_INC(neeMissedLight);
+        return contribution;
+    }
+
+    COUNTER_INC(shadowRays);
+    if (sceneOccluded(scene, r, t*0.99999))
+        COUNTER_INC(neeOccluded);
+    else
+    {
+        COUNTER_INC(neeUnoccluded);
+        double distanceSQR = surfaceToLight.lengthSquared();
+        Vec3 lightNormal = l.a->n;
+
+        // light_pdf is per solid angle, so it already holds the light's cosine and the distance and only the
+        // surface's cosine is left
+        double cosine = dot(n, wi);
+        double area = 0.5 * cross(l.b->pt - l.a->pt, l.c->pt - l.a->pt).length();
+
+        light_pdf = distanceSQR/(emitters*dot(lightNormal, -wi) * area);
+        Color Le = l.emission;
+
+        Vec3 wi_local;
+        toLocal(wi, unit(n), wi_local);
+        Color f_val = evaluate(wi_local, intersect.baseColor, bsdf_pdf);
+
+        contribution = f_val * Le * cosine / light_pdf;
+    }
+    return contribution;
+}
+
+// Every material, through the BSDF's virtual functions
+struct AnyMaterials
+{
+    static bool isDelta(const BSDF* material) {return material->isDelta();}
+
+    static Color f(BSDF* material, const Vec3& wi, const Vec3& wo, const Color& color)
+    {
+        return material->f(wi, wo, color);
+    }
+
+    static double pdf(BSDF* material, const Vec3& wi, const Vec3& wo) {return material->pdf(wi, wo);}
+
+    static Color sample_f(BSDF* material, const Vec3& wi, Vec3& wo, double& pdf, const Color& color,
+        SimpleSampler& sample)
+    {
+        return material->sample_f(wi, wo, pdf, color, sample);
+    }
+};
+
+// Only simpleDiffuseBSDF, so there is nothing to decide
+struct DiffuseMaterials
+{
+    static bool isDelta(const BSDF*) {return false;}
+
+    static Color f(BSDF*, const Vec3&, const Vec3&, const Color& color) {return lambertF(color);}
+
+    static double pdf(BSDF*, const Vec3&, const Vec3& wo) {return cosineHemispherePdf(wo);}
+
+    static Color sample_f(BSDF*, const Vec3&, Vec3& wo, double& pdf, const Color& color, SimpleSampler& sample)
+    {
+        wo = sampleCosineHemisphere(sample);
+        pdf = cosineHemispherePdf(wo);
+        return lambertF(color);
+    }
+};
+
+// simpleDiffuseBSDF and mirrorBSDF, told apart by their type
+struct DiffuseMirrorMaterials
+{
+    static bool isDelta(const BSDF* material) {return material->type() == BSDFType::Mirror;}
+
+    static Color f(BSDF* material, const Vec3&, const Vec3&, const Color& color)
+    {
+        return material->type() == BSDFType::Mirror ? color : lambertF(color);
+    }
+
+    static double pdf(BSDF* material, const Vec3&, const Vec3& wo)
+    {
+        return material->type() == BSDFType::Mirror ? 1.0 : cosineHemispherePdf(wo);
+    }
+
+    static Color sample_f(BSDF* material, const Vec3& wi, Vec3& wo, double& pdf, const Color& color,
+        SimpleSampler& sample)
+    {
+        if (material->type() == BSDFType::Mirror)
+        {
+            wo = mirrorReflect(wi);
+            pdf = 1.0;
+            return color;
+        }
+        return DiffuseMaterials::sample_f(material, wi, wo, pdf, color, sample);
+    }
+};
+
+// Same arguments as MISIntegrator::Li, with the integrator's settings passed in
+using PathKernel = Color (*)(const MISIntegrator& integrator, const Scene& scene, Ray r, SimpleSampler& sample,
+    AuxiliarySample* aux);
+
+struct KernelChoice
+{
+    PathKernel kernel = nullptr;    // null: use MISIntegrator::Li
+    std::string name = "generic";
+};
+
+// The most specialized kernel that renders this scene with these settings
+KernelChoice selectKernel(const Scene& scene, const MISIntegrator& integrator);
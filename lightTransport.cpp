@@ -9,13 +9,29 @@ the triangle intersection code.
 #include <vector>
 #include <cmath>
 #include <random>
+#include <algorithm>
 #include "object.h"
 #include "lightTransport.h"
+#include "scene.h"
+#include "counters.h"
+#include "integratorKernels.h"
+#include "pathGuiding.h"
+#include "radianceCache.h"
 
 const double PI = 3.14159265358979323846;
 
 Intersection::Intersection(Point p, Vec3 n, Color c) : point{p}, normal{n}, baseColor{c} {}
 
+// counts every ray cast against the scene on this thread, for the rays/s numbers in the benchmarks
+thread_local unsigned long long raysTraced = 0;
+
+unsigned long long threadRayCount() {return raysTraced;}
+
+// the mask of groups the paths of this thread's current pixel hit, while a G-buffer is recording them
+thread_local unsigned long long* touchedGroups = nullptr;
+
+void trackTouchedGroups(unsigned long long* mask) {touchedGroups = mask;}
+
 std::pair<double, Vec3> triangleIntersect(const Triangle& tri, const Ray& r)
 {
     Vec3 e1 = tri.b->pt-tri.a->pt;
@@ -44,35 +60,22 @@ std::pair<double, Vec3> triangleIntersect(const Triangle& tri, const Ray& r)
         return {-1.0, Vec3(0,0,0)};
 }
 
-Intersection sceneIntersection(const std::vector<Triangle>& tris, const Ray& r, double max_t = 99999999.0)
+Intersection sceneIntersection(const Scene& scene, const Ray& r, double max_t)
 {
-    double minT = std::numeric_limits<double>::max();
-    Intersection closest = Intersection();
-
-    for (const Triangle& tri : tris)
-    {
-        auto [t, P] = triangleIntersect(tri, r);
-        if (t != -1.0)
-        {
-            if (t < minT && t < max_t)
-            {
-    
-                minT = t;
-
-                closest.point = r.pointAt(t);
-                closest.normal = tri.a->n; // replace with averaged normal
-                closest.baseColor = tri.a->c * P[0] + tri.b->c * P[1] + tri.c->c * P[2];
-                closest.ray = r;
-                closest.hitTri = tri;
-                closest.valid = true;
-                closest.backface = false;
+    raysTraced++;
+    return scene.intersect(r, max_t);
+}
 
-            }
-        }
-    }
+bool sceneOccluded(const Scene& scene, const Ray& r, double max_t)
+{
+    raysTraced++;
+    return scene.occluded(r, max_t);
+}
 
-    return closest;
-    
+Ray bounceRay(const Intersection& hit, const Vec3& direction, bool delta)
+{
+    double spread = delta ? hit.ray.coneSpread() : std::max(hit.ray.coneSpread(), roughConeSpread);
+    return Ray(direction, hit.point + hit.normal*0.0001, hit.footprint, spread);
 }
 
 Color phongBSDF::f(const Vec3& wi, const Vec3& wo, const Color& color) 
@@ -122,21 +125,12 @@ double phongBSDF::pdf(const Vec3& wi, const Vec3& wo)
 
 Color simpleDiffuseBSDF::f(const Vec3& wi, const Vec3& wo, const Color& color) 
 {
-    return color/PI;
+    return lambertF(color);
 }
 
 Color simpleDiffuseBSDF::sample_f(const Vec3& wi, Vec3& wo, double& pdf, const Color& color, SimpleSampler& sample) 
 {
-    auto [u1, u2] = sample.get2D();
-    //Vec3 wr = (Vec3(0,0,1) * (2.0 * dot(wi, Vec3(0,0,1))))-wi;
-    double theta = std::acos(std::sqrt(u1));
-    double phi = 2*PI*u2;
-
-    double x = std::sin(theta) * std::cos(phi);
-    double y = std::sin(theta) * std::sin(phi);
-    double z = std::cos(theta);
-
-    wo = Vec3(x, y, z);
+    wo = sampleCosineHemisphere(sample);
     pdf = simpleDiffuseBSDF::pdf(wi, wo);
 
     return f(wi, wo, color);
@@ -144,107 +138,245 @@ Color simpleDiffuseBSDF::sample_f(const Vec3& wi, Vec3& wo, double& pdf, const C
 
 double simpleDiffuseBSDF::pdf(const Vec3& wi, const Vec3& wo) 
 {
-    if (wo.z() <= 0.0) return 0.0;
-    return wo.z() / PI;
-    
+    return cosineHemispherePdf(wo);
 }
 
 Color mirrorBSDF::f(const Vec3& wi, const Vec3& wo, const Color& color) {return color;}
 
 Color mirrorBSDF::sample_f(const Vec3& wi, Vec3& wo, double& pdf, const Color& color, SimpleSampler& sample) 
 {
-    wo =  (Vec3(0,0,1) * (2.0 * dot(wi, Vec3(0,0,1))))- wi;
+    wo = mirrorReflect(wi);
     pdf = mirrorBSDF::pdf(wi, wo);
     return f(wi, wo, color);
 }
 
 double mirrorBSDF::pdf(const Vec3& wi, const Vec3& wo) {return 1.0;}
 
-Color nextEventEstimation( const Vec3& wo, const std::vector<Triangle>& objects, const std::vector<Triangle>& lights, SimpleSampler& sample, BSDF& reflector, Intersection& intersect, double& light_pdf)
+Color nextEventEstimation( const Vec3& wo, const Scene& scene, SimpleSampler& sample, BSDF& reflector, Intersection& intersect, double& light_pdf, double& bsdf_pdf)
 {
-    Color contribution = Color(0,0,0);
-    int index = static_cast<int>(sample.get1D() * lights.size());
-    Triangle l = lights.at(index); 
-    double u = sqrt(sample.get1D());
-    double v = sample.get1D();
-
-    Point p = (1 - u) * l.a->pt + u * (1 - v) * l.b->pt + u * v * l.c->pt;
-    Vec3 n = intersect.hitTri.a->n;
-
-    Vec3 surfaceToLight = p-intersect.point;
-    
-    
-    Vec3 wi = unit(surfaceToLight);
-    Ray r = Ray(wi, intersect.point + n * 0.0001);
-    
-    auto [t, _] = triangleIntersect(l, r);
-    
-    Intersection lightIntersect = sceneIntersection(objects, r, t*0.99999);
-
-    if (!lightIntersect.valid && t != -1.0)
-    {
-        double distanceSQR = surfaceToLight.lengthSquared();
-        Vec3 lightNormal = l.a->n;
-
-        double G = dot(lightNormal, -wi) * dot (n, wi)/distanceSQR;
-        double area = 0.5 * cross(l.b->pt - l.a->pt, l.c->pt - l.a->pt).length();
-        
-        
-        light_pdf = distanceSQR/(lights.size()*dot(lightNormal, -wi) * area);
-        Color Le = l.emission;
-        Color f_val = reflector.f(wi, wo, intersect.baseColor);
+    return sampleEmitter(scene, sample, intersect, light_pdf, bsdf_pdf,
+        [&](const Vec3& toLight, const Color& color, double& pdf) {
+            pdf = reflector.pdf(wo, toLight);
+            return reflector.f(wo, toLight, color);
+        });
+}
 
-        contribution = f_val * Le * G /light_pdf;
-    }
-    return contribution;
+static double maxComponent(const Vec3& v)
+{
+    return std::max(v.x(), std::max(v.y(), v.z()));
 }
 
-// const std::vector<Triangle>& objects - stores all scene triangles
-// const std::vector<Triangle>& lights - stores all emissive triangles
+// const Scene& scene - the built scene, with its triangles, instances and emissive triangles
 // Ray r - initial ray out of camera
 // SimpleSampler& sample - the random sampler
-Color MISIntegrator::Li(const std::vector<Triangle>& objects, const std::vector<Triangle>& lights, Ray r, SimpleSampler& sample)
+// AuxiliarySample* aux - optional first hit data for the denoiser
+Color MISIntegrator::Li(const Scene& scene, Ray r, SimpleSampler& sample, AuxiliarySample* aux)
+{
+    return tracePath(scene, r, Vec3(1.0,1.0,1.0), 0, sample, nullptr, false, aux);
+}
+
+Color MISIntegrator::shade(const Scene& scene, const Ray& r, const Intersection& firstHit, SimpleSampler& sample,
+    AuxiliarySample* aux)
+{
+    return tracePath(scene, r, Vec3(1.0,1.0,1.0), 0, sample, &firstHit, false, aux);
+}
+
+// Traces the path from ray r, which has already hit `depth` surfaces with throughput beta. If knownHit is set, it
+// is the intersection of r, which the caller already found. splitBranch means the caller split the path at that
+// hit, and already counted its emission. aux is filled at the next hit.
+Color MISIntegrator::tracePath(const Scene& scene, Ray r, Vec3 beta, int depth, SimpleSampler& sample,
+    const Intersection* knownHit, bool splitBranch, AuxiliarySample* aux)
 {
     Vec3 Li = Vec3();  
-    Vec3 beta = Vec3(1.0,1.0,1.0);  
 
     Intersection intersectPt;
     Vec3 wi_local, wo_local, wo_world;
 
-    for (int depth = 0; depth < maxDepth; depth++)
+    // pdf of the BSDF sample that r came from, or 0 if light sampling could not have found what it hits (camera
+    // rays and mirror bounces)
+    double bsdf_pdf = 0;
+
+    // the guided vertices of this path, while the guide is training
+    std::vector<GuideVertex> guidePath;
+
+    // the vertex this path records into the radiance cache, while it is being built
+    bool cacheRecord = false;
+    Point cachePoint;
+    Vec3 cacheNormal, cacheThroughput;
+    Color cacheCollected;
+    auto recordCache = [&]() {
+        if (cacheRecord)
+            radianceCache->record(cachePoint, cacheNormal, Li - cacheCollected, cacheThroughput);
+    };
+
+    for (;; depth++)
     {
-        intersectPt = sceneIntersection(objects,r);
+        if (knownHit != nullptr)
+        {
+            intersectPt = *knownHit;
+            knownHit = nullptr;
+        }
+        else
+        {
+            COUNTER_INC(rays);
+            intersectPt = sceneIntersection(scene, r);
+        }
         
         if (!intersectPt.valid)
         {
+            COUNTER_INC(escaped);
+
+            // the environment the BSDF sample found, weighed against next event estimation like an emitter
+            if (scene.environment)
+            {
+                Vec3 direction = unit(r.direction());
+                double lightWeight, bsdfWeight = 1.0;
+                if (lightSampling && bsdf_pdf > 0)
+                    misWeights(heuristic, scene.environment->pdf(direction) / scene.emitterCount(), bsdf_pdf, lightWeight, bsdfWeight);
+                Li += beta * scene.environment->Le(direction) * bsdfWeight;
+            }
             break;
         }
+
+        if (aux != nullptr)
+        {
+            aux->albedo = intersectPt.baseColor;
+            aux->normal = unit(intersectPt.normal);
+            aux->depth = (intersectPt.point - r.origin()).length();
+            aux = nullptr;
+        }
+
+        if (touchedGroups != nullptr)
+            *touchedGroups |= scene.groupBit(intersectPt);
+
+        // light the BSDF sample found, weighed against next event estimation at the previous surface
+        if (!splitBranch && intersectPt.hitTri.emission.lengthSquared() > 0)
+        {
+            double lightWeight, bsdfWeight = 1.0;
+            if (lightSampling && bsdf_pdf > 0)
+                misWeights(heuristic, emitterPdf(scene.emitterCount(), intersectPt, r.origin()), bsdf_pdf, lightWeight, bsdfWeight);
+            Li += beta * intersectPt.hitTri.emission * bsdfWeight;
+        }
+
+        // the BSDF sample of the last bounce is traced only for the light it finds, which completes the MIS
+        // weights of the light sample taken next to it
+        if (depth == maxDepth)
+        {
+            COUNTER_INC(depthTerminated);
+            depth++;
+            break;
+        }
+
+        // Splitting: continue from this hit in several independent branches that share the throughput
+        if (!splitBranch && maxSplit > 1 && depth < splitDepth)
+        {
+            int splits = std::clamp(int(std::lround(maxSplit * maxComponent(beta))), 1, maxSplit);
+            if (splits > 1)
+            {
+                COUNTER_ADD(splitPaths, splits - 1);
+                for (int k = 0; k < splits; k++)
+                    Li += tracePath(scene, r, beta / splits, depth, sample, &intersectPt, true, nullptr);
+                if (!guidePath.empty())
+                    recordGuidePath(*guide, guidePath, Li);
+                recordCache();
+                return Li;
+            }
+        }
+        splitBranch = false;
+
         BSDF* reflector = intersectPt.hitTri.material;
+        const Vec3 normal = unit(intersectPt.normal);
         
-        toLocal(-r.direction(), unit(intersectPt.normal) , wi_local);
+        toLocal(-r.direction(), normal, wi_local);
+
+        if (radianceCache != nullptr && radianceCache->caches(*reflector, depth))
+        {
+            if (radianceCache->isRecording())
+            {
+                cacheRecord = true;
+                cachePoint = intersectPt.point;
+                cacheNormal = normal;
+                cacheThroughput = beta * intersectPt.baseColor;
+                cacheCollected = Li;
+            }
+            else
+            {
+                Color cached;
+                if (radianceCache->lookup(intersectPt.point, normal, cached))
+                {
+                    Li += beta * intersectPt.baseColor * cached;
+                    COUNTER_INC(cacheTerminated);
+                    depth++;
+                    break;
+                }
+            }
+        }
 
-        double light_pdf = 0;
-        Color nee = nextEventEstimation(wi_local, objects, lights, sample, *reflector, intersectPt, light_pdf);
+        int guideRegion = guide != nullptr && PathGuide::guides(*reflector) ? guide->regionAt(intersectPt.point) : -1;
+
+        if (lightSampling && !reflector->isDelta())
+        {
+            double light_pdf = 0, nee_bsdf_pdf = 0;
+            Color nee = sampleEmitter(scene, sample, intersectPt, light_pdf, nee_bsdf_pdf,
+                [&](const Vec3& toLight, const Color& color, double& pdf) {
+                    pdf = guideRegion >= 0 ? guidedPdf(*guide, guideRegion, *reflector, normal, wi_local, toLight)
+                        : reflector->pdf(wi_local, toLight);
+                    return reflector->f(wi_local, toLight, color);
+                });
+
+            // light_pdf stays 0 if the light was not reached
+            if (light_pdf > 0)
+            {
+                double neeWeight, bsdfWeight;
+                misWeights(heuristic, light_pdf, nee_bsdf_pdf, neeWeight, bsdfWeight);
+                Li += beta * nee * neeWeight;
+            }
+        }
         
         wo_local = Vec3(0,0,0);
 
         double pdf_val;
-        Vec3 f_val = reflector->sample_f(wi_local, wo_local, pdf_val, intersectPt.baseColor, sample);
+        Vec3 f_val;
+        if (guideRegion >= 0)
+            f_val = sampleGuided(*guide, guideRegion, *reflector, normal, wi_local, wo_local, pdf_val, intersectPt.baseColor, sample);
+        else
+            f_val = reflector->sample_f(wi_local, wo_local, pdf_val, intersectPt.baseColor, sample);
         if (pdf_val <= 0) 
+        {
+            COUNTER_INC(pdfTerminated);
+            depth++;
             break;
+        }
 
-        // MIS STUFF - power heuristic?
-        double neeWeight = light_pdf * light_pdf / (light_pdf * light_pdf + pdf_val * pdf_val);
-        double bsdfWeight = pdf_val * pdf_val / (light_pdf * light_pdf + pdf_val * pdf_val);
-
-        toWorld(unit(intersectPt.normal), wo_local, wo_world);
-        r = Ray(wo_world, intersectPt.point + intersectPt.normal*0.0001);
+        toWorld(normal, wo_local, wo_world);
+        r = bounceRay(intersectPt, wo_world, reflector->isDelta());
 
-        Li += beta * nee * neeWeight;
         beta *= (f_val * fabs(wo_local.z()) / pdf_val);
-        Li += beta * intersectPt.hitTri.emission * bsdfWeight;
-        
+        bsdf_pdf = reflector->isDelta() ? 0.0 : pdf_val;
 
+        const bool recording = guideRegion >= 0 && guide->isTraining();
+        if (recording)
+            guidePath.push_back({guideRegion, wo_world, beta, Li, pdf_val});
+
+        // Russian roulette: unbiased because surviving paths are scaled up by 1/q
+        if (russianRoulette && depth + 1 >= rrMinDepth)
+        {
+            double q = std::min(1.0, maxComponent(beta));
+            if (sample.get1D() >= q)
+            {
+                COUNTER_INC(rouletteTerminated);
+                depth++;
+                break;
+            }
+            beta /= q;
+            if (recording)
+                guidePath.back().throughput = beta;
+        }
     }
+    // depth is now the number of surfaces the path hit
+    COUNTER_PATH_END(depth);
+    if (!guidePath.empty())
+        recordGuidePath(*guide, guidePath, Li);
+    recordCache();
     return Li;
 }
@@ -10,6 +10,10 @@ Contains the class definitions for the BSDF and Integrator functions.
 #include <random>
 #include "object.h"
 
+class Scene;
+class PathGuide;
+class RadianceCache;
+
 class SimpleSampler 
 {
     public:
@@ -35,23 +39,96 @@ struct Intersection
     bool valid;
     bool backface;
 
+    // World space area of the hit triangle, only set when it is an emitter (see emitterPdf)
+    double area = 0;
+
+    // Width of the ray's cone at the hit (see Ray::footprint), where the cones of bounce rays start
+    double footprint = 0;
+
+    // Which triangle was hit and where, so Scene::hitAt can rebuild the hit: the index of the triangle in
+    // Scene::objects, or in its mesh if `instance` (the index in Scene::instances) is not -1, triangleIntersect's
+    // barycentric coordinates and the distance along the ray in units of its direction
+    int primitive = -1;
+    int instance = -1;
+    Vec3 barycentrics;
+    double t = 0;
+
     Intersection(Point p, Vec3 n, Color c);
     Intersection() {valid = false;};
 };
 
+// Which of the built in BSDFs a material is. Anything else is Other.
+enum class BSDFType
+{
+    Diffuse,
+    Phong,
+    Mirror,
+    Other
+};
+
 class BSDF
 {
     public:
 
+    BSDF(BSDFType t = BSDFType::Other) : bsdfType(t) {}
+    virtual ~BSDF() {}
+
+    // Not virtual, so hot loops can tell the materials apart without a virtual call
+    BSDFType type() const {return bsdfType;}
+
+    // A delta BSDF (the perfect mirror) only reflects into one direction, which a light sample never hits, so
+    // next event estimation is skipped on it
+    bool isDelta() const {return bsdfType == BSDFType::Mirror;}
+
     virtual Color f(const Vec3& wi, const Vec3& wo, const Color& color) { return Vec3(0,0,0);}
 
     virtual Color sample_f(const Vec3& wi, Vec3& wo, double& pdf, const Color& color, SimpleSampler& sample) {return Vec3(0,0,0);}
 
     virtual double pdf(const Vec3& wi, const Vec3& wo) {return 0.0;}
+
+    private:
+
+    BSDFType bsdfType;
 };
 
+// The lobes of the diffuse and mirror BSDFs. They are inline so the specialized integrator kernels can use them
+// without virtual calls, and the BSDF classes use them too, so both give exactly the same values.
+inline Color lambertF(const Color& color)
+{
+    return color / 3.14159265358979323846;
+}
+
+inline double cosineHemispherePdf(const Vec3& wo)
+{
+    if (wo.z() <= 0.0) return 0.0;
+    return wo.z() / 3.14159265358979323846;
+}
+
+inline Vec3 sampleCosineHemisphere(SimpleSampler& sample)
+{
+    auto [u1, u2] = sample.get2D();
+    double theta = std::acos(std::sqrt(u1));
+    double phi = 2*3.14159265358979323846*u2;
+
+    double x = std::sin(theta) * std::cos(phi);
+    double y = std::sin(theta) * std::sin(phi);
+    double z = std::cos(theta);
+    return Vec3(x, y, z);
+}
+
+inline Vec3 mirrorReflect(const Vec3& wi)
+{
+    return (Vec3(0,0,1) * (2.0 * dot(wi, Vec3(0,0,1))))- wi;
+}
+
 class simpleDiffuseBSDF : public BSDF
 {
+    public:
+
+    simpleDiffuseBSDF() : BSDF(BSDFType::Diffuse) {}
+
+    private:
+
     Color f(const Vec3& wi, const Vec3& wo, const Color& color) override;
     Color sample_f(const Vec3& wi, Vec3& wo, double& pdf, const Color& color, SimpleSampler& sample) override;
     double pdf(const Vec3& wi, const Vec3& wo) override;
@@ -61,6 +138,8 @@ class phongBSDF : public BSDF
 {
     public:
 
+    phongBSDF() : BSDF(BSDFType::Phong) {}
+
     int phongExponent;
     
     Color f(const Vec3& wi, const Vec3& wo, const Color& color);
@@ -71,20 +150,123 @@ class phongBSDF : public BSDF
 class mirrorBSDF : public BSDF
 {
     public:
+
+    mirrorBSDF() : BSDF(BSDFType::Mirror) {}
     
     Color f(const Vec3& wi, const Vec3& wo, const Color& color);
     Color sample_f(const Vec3& wi, Vec3& wo, double& pdf, const Color& color, SimpleSampler& sample);
     double pdf(const Vec3& wi, const Vec3& wo);
 };
 
-Color nextEventEstimation(const Vec3& wo, const std::vector<Triangle>& objects, const std::vector<Triangle>& lights, SimpleSampler& sample, BSDF& reflector, Intersection& intersect);
+// number of rays this thread has cast with sceneIntersection and sceneOccluded so far
+unsigned long long threadRayCount();
+
+// Distance along r to the front face of tri and the barycentric coordinates of the hit, or -1 if it misses
+std::pair<double, Vec3> triangleIntersect(const Triangle& tri, const Ray& r);
+
+Intersection sceneIntersection(const Scene& scene, const Ray& r, double max_t = 99999999.0);
+
+// The least spread of the cone of a ray leaving a surface that is not a mirror. What such a bounce sees is blurred
+// by the BSDF anyway, so it reads smaller texture levels than the camera would.
+const double roughConeSpread = 0.1;
+
+// The ray that leaves a hit in `direction`, off the surface. Its cone starts as wide as the incoming ray's was at the
+// hit, and keeps its spread after a delta (mirror) bounce or widens to at least roughConeSpread after any other.
+Ray bounceRay(const Intersection& hit, const Vec3& direction, bool delta);
+bool sceneOccluded(const Scene& scene, const Ray& r, double max_t);
+
+// While mask is set, every surface that MISIntegrator's paths on this thread hit adds its Scene::groupBit to it,
+// which is how the G-buffer learns what each pixel depends on. nullptr stops it.
+void trackTouchedGroups(unsigned long long* mask);
+
+// What the camera ray saw first, for the denoiser's guide buffers. Left at zero when the ray hits nothing.
+struct AuxiliarySample
+{
+    Color albedo;
+    Vec3 normal;
+    double depth = 0;
+};
+
+// bsdf_pdf is set to the BSDF's pdf of the direction to the sampled light, for the MIS weight
+Color nextEventEstimation(const Vec3& wo, const Scene& scene, SimpleSampler& sample, BSDF& reflector, Intersection& intersect, double& light_pdf, double& bsdf_pdf);
+
+// The pdf with which next event estimation from `from` would have picked the point of the emitter that was hit,
+// for weighing light found by a BSDF sample against it (the same solid angle pdf sampleEmitter computes)
+inline double emitterPdf(size_t lightCount, const Intersection& hit, const Point& from)
+{
+    Vec3 toLight = hit.point - from;
+    double distanceSQR = toLight.lengthSquared();
+    double cosine = dot(hit.normal, -unit(toLight));
+    if (lightCount == 0 || cosine <= 0 || hit.area <= 0)
+        return 0.0;
+    return distanceSQR / (lightCount * cosine * hit.area);
+}
 
 
+// How MISIntegrator weighs a light sample against a BSDF sample of the same direction, from the pdfs the two
+// strategies have for it
+enum class MISHeuristic
+{
+    Power,      // pdf^2 / (pdf_light^2 + pdf_bsdf^2)
+    Balance     // pdf / (pdf_light + pdf_bsdf)
+};
+
+inline void misWeights(MISHeuristic heuristic, double lightPdf, double bsdfPdf, double& lightWeight, double& bsdfWeight)
+{
+    if (heuristic == MISHeuristic::Power)
+    {
+        lightWeight = lightPdf * lightPdf / (lightPdf * lightPdf + bsdfPdf * bsdfPdf);
+        bsdfWeight = bsdfPdf * bsdfPdf / (lightPdf * lightPdf + bsdfPdf * bsdfPdf);
+    }
+    else
+    {
+        lightWeight = lightPdf / (lightPdf + bsdfPdf);
+        bsdfWeight = bsdfPdf / (lightPdf + bsdfPdf);
+    }
+}
+
 class MISIntegrator 
 {
     public:
 
-    int maxDepth;
+    // Bounces a path makes at most. The last bounce's BSDF sample is still traced to the light it hits, so light
+    // arrives over up to maxDepth + 1 segments, and the light samples of every bounce keep their MIS partner.
+    int maxDepth = 6;
+
+    // Next event estimation: at every non delta surface, one emitter is sampled. Its light, and light that a BSDF
+    // sample finds by hitting an emitter, are each weighed with `heuristic` by the pdfs both strategies have for
+    // that direction, so every light path is counted once. Without it, light is only found by BSDF sampling.
+    bool lightSampling = true;
+    MISHeuristic heuristic = MISHeuristic::Power;
+
+    // Russian roulette: from rrMinDepth bounces on, a path survives with probability min(1, max component of beta)
+    // and beta is divided by that probability, so dark paths stop early without biasing the image
+    bool russianRoulette = false;
+    int rrMinDepth = 3;
+
+    // Splitting: at the first splitDepth bounces, the path continues in n = round(maxSplit * max component of beta)
+    // independently sampled directions (at least 1), each weighted by 1/n, so bright paths get more samples
+    int maxSplit = 1;
+    int splitDepth = 1;
+
+    // Path guiding (see pathGuiding.h): diffuse and Phong vertices sample from a mix of their BSDF and the guide's
+    // learned distribution, and while the guide is training every path records what it found into it
+    PathGuide* guide = nullptr;
+
+    // Radiance cache (see radianceCache.h): paths end at the cache's depth on a diffuse surface and take the light
+    // cached for it, or record what they find there while the cache is being built
+    RadianceCache* radianceCache = nullptr;
+
+    // If aux is given, it is filled with the first hit's albedo, normal and distance
+    Color Li(const Scene& scene, Ray r, SimpleSampler& sample, AuxiliarySample* aux = nullptr);
+
+    // Li for a camera ray whose first hit is already known (sceneIntersection's result for r, or Scene::hitAt's),
+    // so r is not traced again. Gives exactly what Li would.
+    Color shade(const Scene& scene, const Ray& r, const Intersection& firstHit, SimpleSampler& sample,
+        AuxiliarySample* aux = nullptr);
+
+    private:
 
-    Color Li(const std::vector<Triangle>& objects, const std::vector<Triangle>& lights, Ray r, SimpleSampler& sample);
+    Color tracePath(const Scene& scene, Ray r, Vec3 beta, int depth, SimpleSampler& sample,
+        const Intersection* knownHit, bool splitBranch, AuxiliarySample* aux);
 };
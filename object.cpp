@@ -89,6 +89,8 @@ Ray::~Ray() {}
 
 Ray::Ray(const Vec3& d, const Point& o) : dir{d}, orig{o} {}
 
+Ray::Ray(const Vec3& d, const Point& o, double w, double s) : dir{d}, orig{o}, width{w}, spread{s} {}
+
 Point Ray::pointAt(double t) const
 {
     return Point(orig + dir*t);
@@ -190,6 +192,100 @@ Triangle::Triangle(Vertex* v1, Vertex* v2, Vertex* v3) : a{v1}, b{v2}, c{v3}, em
 Triangle::Triangle(Vertex* v1, Vertex* v2, Vertex* v3, Color e) : a{v1}, b{v2}, c{v3} , emission{e} {}
 Triangle::Triangle(Vertex* v1, Vertex* v2, Vertex* v3, Color e, BSDF* m) : a{v1}, b{v2}, c{v3} , emission{e}, material{m}{}
 
+Transform::Transform() : m{{1,0,0,0},{0,1,0,0},{0,0,1,0}} {}
+
+Transform Transform::translate(const Vec3& offset)
+{
+    Transform t;
+    t.m[0][3] = offset.x();
+    t.m[1][3] = offset.y();
+    t.m[2][3] = offset.z();
+    return t;
+}
+
+Transform Transform::scale(double sx, double sy, double sz)
+{
+    Transform t;
+    t.m[0][0] = sx;
+    t.m[1][1] = sy;
+    t.m[2][2] = sz;
+    return t;
+}
+
+Transform Transform::rotateY(double degrees)
+{
+    double radians = degrees * 3.14159265358979323846 / 180.0;
+    double c = std::cos(radians), s = std::sin(radians);
+    Transform t;
+    t.m[0][0] = c;  t.m[0][2] = s;
+    t.m[2][0] = -s; t.m[2][2] = c;
+    return t;
+}
+
+Point Transform::applyPoint(const Point& p) const
+{
+    return Point(m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+        m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+        m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]);
+}
+
+Vec3 Transform::applyVector(const Vec3& v) const
+{
+    return Vec3(m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+        m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+        m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+}
+
+Vec3 Transform::applyNormal(const Transform& inverse, const Vec3& n)
+{
+    const auto& m = inverse.m;
+    return Vec3(m[0][0]*n.x() + m[1][0]*n.y() + m[2][0]*n.z(),
+        m[0][1]*n.x() + m[1][1]*n.y() + m[2][1]*n.z(),
+        m[0][2]*n.x() + m[1][2]*n.y() + m[2][2]*n.z());
+}
+
+Transform Transform::inverse() const
+{
+    // invert the 3x3 part with cofactors, then move the translation back through it
+    double a = m[0][0], b = m[0][1], c = m[0][2];
+    double d = m[1][0], e = m[1][1], f = m[1][2];
+    double g = m[2][0], h = m[2][1], i = m[2][2];
+    double det = a*(e*i - f*h) - b*(d*i - f*g) + c*(d*h - e*g);
+    double invDet = 1.0 / det;
+
+    Transform r;
+    r.m[0][0] = (e*i - f*h) * invDet;
+    r.m[0][1] = (c*h - b*i) * invDet;
+    r.m[0][2] = (b*f - c*e) * invDet;
+    r.m[1][0] = (f*g - d*i) * invDet;
+    r.m[1][1] = (a*i - c*g) * invDet;
+    r.m[1][2] = (c*d - a*f) * invDet;
+    r.m[2][0] = (d*h - e*g) * invDet;
+    r.m[2][1] = (b*g - a*h) * invDet;
+    r.m[2][2] = (a*e - b*d) * invDet;
+
+    Vec3 t = r.applyVector(Vec3(m[0][3], m[1][3], m[2][3]));
+    r.m[0][3] = -t.x();
+    r.m[1][3] = -t.y();
+    r.m[2][3] = -t.z();
+    return r;
+}
+
+Transform operator*(const Transform& a, const Transform& b)
+{
+    Transform r;
+    for (int row = 0; row < 3; row++)
+    {
+        for (int col = 0; col < 4; col++)
+        {
+            r.m[row][col] = a.m[row][0]*b.m[0][col] + a.m[row][1]*b.m[1][col] + a.m[row][2]*b.m[2][col];
+            if (col == 3)
+                r.m[row][col] += a.m[row][3];
+        }
+    }
+    return r;
+}
+
 Vec3 barycentricCoordinate(const Triangle& t, const Point& i) 
 {
     Point pt1 = t.a->pt;
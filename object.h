@@ -10,6 +10,7 @@ Contains the class data for the basic Vector, Ray, Vertex, Triangle classes, wit
 #include "image.h"
 
 class BSDF;
+class Texture;
 struct Intersection;
 
 
@@ -52,17 +53,28 @@ class Ray
     private:
     Vec3 dir;
     Point orig;
+    double width = 0;
+    double spread = 0;
     public:
 
     Ray();
     ~Ray();
     Ray(const Vec3& dir, const Point& orig);
 
+    // A ray with a cone around it, `width` across at the origin and widening by `spread` per unit of distance,
+    // which picks the MIP level of the textures it hits (see texture.h). Rays made without one are as thin as a
+    // line and read the full resolution.
+    Ray(const Vec3& dir, const Point& orig, double width, double spread);
+
     Point pointAt(double t) const;
 
     Vec3 direction() const{return dir;}
     Point origin() const{return orig;}
 
+    // Width of the cone at this distance from the origin (not t: the direction need not be unit length)
+    double footprint(double distance) const {return width + spread * distance;}
+    double coneSpread() const {return spread;}
+
 };
 
 struct Vertex {
@@ -70,6 +82,10 @@ struct Vertex {
     Color c;
     Vec3 n;
 
+    // texture coordinates, 0 for meshes without any
+    double u = 0;
+    double v = 0;
+
     Vertex();
     Vertex(Point point, Color color, Vec3 norm);
     ~Vertex();
@@ -82,6 +98,9 @@ struct Triangle {
     Color emission;
     BSDF* material;
 
+    // multiplies the vertex colors at the UV of a hit, if set
+    const Texture* texture = nullptr;
+
     // for use in flat shading
     Vec3 surfaceNormal;
 
@@ -95,6 +114,30 @@ struct Triangle {
     
 };
 
+// Affine transform stored as a 3x4 matrix (rotation/scale in the first three columns, translation in the last)
+class Transform
+{
+    public:
+    double m[3][4];
+
+    Transform(); // identity
+
+    static Transform translate(const Vec3& offset);
+    static Transform scale(double sx, double sy, double sz);
+    static Transform rotateY(double degrees);
+
+    Point applyPoint(const Point& p) const;
+    Vec3 applyVector(const Vec3& v) const;
+
+    // Transforms a normal by the inverse transpose, given this transform's inverse
+    static Vec3 applyNormal(const Transform& inverse, const Vec3& n);
+
+    Transform inverse() const;
+};
+
+// a * b applies b first, then a
+Transform operator*(const Transform& a, const Transform& b);
+
 std::ostream& operator<< (std::ostream& out, const Vec3& v );
 
 Vec3 operator+(const Vec3& v1, const Vec3& v2);
@@ -0,0 +1,1020 @@
+/*
+Contains the cluster file writer, the cluster cache with its batched ray queries, and the wavefront renderer for
+out of core scenes.
+
+The cluster file starts with a text header like PFM, followed by binary tables and then the clusters:
+
+    PC
+    <clusters> <triangles> <materials> <emitters>
+    materials   (int type, int phong exponent) each
+    emitters    PackedTriangle each
+    clusters    PackedCluster each
+    ...         every cluster's BVH nodes and then its triangles, starting on a 4096 byte boundary
+
+Each cluster's BVH is built when the file is written, with the triangles stored in the order of its leaves, so
+loading a cluster is one read and no build.
+
+*/
+
+#include "outOfCore.h"
+#include "scene.h"
+#include "renderer.h"
+#include "benchmark.h"
+#include "image.h"
+#include "trace.h"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+#include <future>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+
+const unsigned long long CLUSTER_ALIGNMENT = 4096;
+
+enum MaterialType
+{
+    DiffuseMaterial = 0,
+    PhongMaterial = 1,
+    MirrorMaterial = 2
+};
+
+// A triangle with its own copy of its three vertices, as it is stored in the file
+struct PackedTriangle
+{
+    double position[3][3];
+    double color[3][3];
+    double normal[3][3];
+    double emission[3];
+    int material;
+    int unused;
+};
+
+struct PackedCluster
+{
+    double lower[3];
+    double upper[3];
+    unsigned long long offset;
+    unsigned int triangleCount;
+    unsigned int nodeCount;
+};
+
+struct PackedNode
+{
+    double lower[3];
+    double upper[3];
+    int first;
+    int count;
+};
+
+static void packVec3(double* out, const Vec3& v)
+{
+    out[0] = v.x();
+    out[1] = v.y();
+    out[2] = v.z();
+}
+
+static Vec3 unpackVec3(const double* v)
+{
+    return Vec3(v[0], v[1], v[2]);
+}
+
+size_t Cluster::bytes() const
+{
+    return sizeof(Cluster) + vertices.capacity() * sizeof(Vertex) + triangles.capacity() * sizeof(Triangle)
+        + bvh.nodes.capacity() * sizeof(BVHNode) + bvh.indices.capacity() * sizeof(int);
+}
+
+void printClusterCacheStats(std::ostream& out, const ClusterCacheStats& stats)
+{
+    unsigned long long loads = stats.requests - stats.hits;
+    out << "Cluster cache: " << stats.requests << " fetches, " << std::fixed << std::setprecision(1)
+        << 100.0 * stats.hitRate() << "% hits, " << loads << " loads (" << stats.bytesRead / (1024.0 * 1024.0)
+        << " MB read, " << std::setprecision(3) << stats.loadSeconds << " s), " << stats.evictions << " evictions"
+        << std::endl;
+    out << "Peak resident clusters: " << std::setprecision(1) << stats.peakResidentBytes / (1024.0 * 1024.0)
+        << " MB, " << std::setprecision(2) << (stats.requests > 0 ? double(stats.rayVisits) / stats.requests : 0.0)
+        << " rays per fetch" << std::defaultfloat << std::endl;
+}
+
+bool writeClusterFile(const Scene& scene, const std::string& fileName, int clusterSize)
+{
+    TRACE_SCOPE("write clusters");
+    clusterSize = std::max(clusterSize, 1);
+
+    std::unordered_map<const BSDF*, int> materialIndex;
+    std::vector<int> materialTypes, phongExponents;
+    for (const std::unique_ptr<BSDF>& material : scene.materials)
+    {
+        int type = DiffuseMaterial, exponent = 0;
+        if (material->type() == BSDFType::Phong)
+        {
+            type = PhongMaterial;
+            exponent = static_cast<const phongBSDF*>(material.get())->phongExponent;
+        }
+        else if (material->type() == BSDFType::Mirror)
+            type = MirrorMaterial;
+        else if (material->type() != BSDFType::Diffuse)
+        {
+            std::cerr << "Error: The scene has a material the cluster file cannot store\n";
+            return false;
+        }
+        materialIndex[material.get()] = int(materialTypes.size());
+        materialTypes.push_back(type);
+        phongExponents.push_back(exponent);
+    }
+
+    bool missingMaterial = false;
+    auto pack = [&](const Vertex& a, const Vertex& b, const Vertex& c, const Color& emission, const BSDF* material) {
+        PackedTriangle packed = {};
+        const Vertex* v[3] = {&a, &b, &c};
+        for (int k = 0; k < 3; k++)
+        {
+            packVec3(packed.position[k], v[k]->pt);
+            packVec3(packed.color[k], v[k]->c);
+            packVec3(packed.normal[k], v[k]->n);
+        }
+        packVec3(packed.emission, emission);
+        auto it = materialIndex.find(material);
+        if (it == materialIndex.end())
+            missingMaterial = true;
+        packed.material = it == materialIndex.end() ? 0 : it->second;
+        return packed;
+    };
+
+    // every triangle in world space; instances are flattened the way Scene::intersect sees them
+    std::vector<PackedTriangle> triangles;
+    triangles.reserve(scene.instancedTriangleCount());
+    for (const Triangle& tri : scene.objects)
+        triangles.push_back(pack(*tri.a, *tri.b, *tri.c, tri.emission, tri.material));
+
+    for (const Instance& instance : scene.instances)
+    {
+        auto toWorld = [&](const Vertex* v) {
+            return Vertex(instance.objectToWorld.applyPoint(v->pt), v->c,
+                unit(Transform::applyNormal(instance.worldToObject, v->n)));
+        };
+        for (const Triangle& tri : instance.mesh->triangles)
+        {
+            BSDF* material = instance.material != nullptr ? instance.material : tri.material;
+            triangles.push_back(pack(toWorld(tri.a), toWorld(tri.b), toWorld(tri.c), tri.emission, material));
+        }
+    }
+
+    std::vector<PackedTriangle> emitters;
+    for (const Triangle& tri : scene.lights)
+        emitters.push_back(pack(*tri.a, *tri.b, *tri.c, tri.emission, tri.material));
+
+    if (missingMaterial)
+    {
+        std::cerr << "Error: The scene has a triangle whose material it does not own\n";
+        return false;
+    }
+
+    // split at the centroid median of the longest axis until every range fits in a cluster. Ranges come out in
+    // depth first order, so clusters that are close in space are also close in the file.
+    std::vector<Point> centers(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++)
+    {
+        const PackedTriangle& t = triangles[i];
+        centers[i] = (unpackVec3(t.position[0]) + unpackVec3(t.position[1]) + unpackVec3(t.position[2])) / 3.0;
+    }
+
+    std::vector<int> order(triangles.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = int(i);
+
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::vector<std::pair<size_t, size_t>> stack = {{0, order.size()}};
+    while (!stack.empty())
+    {
+        auto [first, last] = stack.back();
+        stack.pop_back();
+        if (last - first <= size_t(clusterSize))
+        {
+            if (last > first)
+                ranges.push_back({first, last});
+            continue;
+        }
+
+        AABB centerBounds;
+        for (size_t k = first; k < last; k++)
+            centerBounds.grow(centers[order[k]]);
+        Vec3 extent = centerBounds.upper - centerBounds.lower;
+        int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+
+        size_t middle = first + (last - first) / 2;
+        std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last,
+            [&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+
+        // pushed second half first, so the first half is written first
+        stack.push_back({middle, last});
+        stack.push_back({first, middle});
+    }
+
+    std::ofstream out(fileName, std::ios::binary);
+    if (!out.is_open())
+    {
+        std::cerr << "Error: Could not open " << fileName << " for writing\n";
+        return false;
+    }
+
+    out << "PC\n" << ranges.size() << " " << triangles.size() << " " << materialTypes.size() << " "
+        << emitters.size() << "\n";
+    for (size_t m = 0; m < materialTypes.size(); m++)
+    {
+        out.write((const char*)&materialTypes[m], sizeof(int));
+        out.write((const char*)&phongExponents[m], sizeof(int));
+    }
+    out.write((const char*)emitters.data(), emitters.size() * sizeof(PackedTriangle));
+
+    unsigned long long offset = (unsigned long long)out.tellp() + ranges.size() * sizeof(PackedCluster);
+    std::vector<PackedCluster> table(ranges.size());
+    std::vector<std::vector<PackedNode>> clusterNodes(ranges.size());
+    for (size_t c = 0; c < ranges.size(); c++)
+    {
+        const size_t first = ranges[c].first, count = ranges[c].second - ranges[c].first;
+
+        AABB bounds;
+        std::vector<AABB> triangleBounds(count);
+        for (size_t k = 0; k < count; k++)
+        {
+            for (int v = 0; v < 3; v++)
+                triangleBounds[k].grow(unpackVec3(triangles[order[first + k]].position[v]));
+            bounds.grow(triangleBounds[k]);
+        }
+
+        BVH bvh;
+        bvh.build(triangleBounds);
+        std::vector<int> leafOrder(count);
+        for (size_t k = 0; k < count; k++)
+            leafOrder[k] = order[first + bvh.indices[k]];
+        std::copy(leafOrder.begin(), leafOrder.end(), order.begin() + first);
+
+        for (const BVHNode& node : bvh.nodes)
+        {
+            PackedNode packed = {};
+            packVec3(packed.lower, node.bounds.lower);
+            packVec3(packed.upper, node.bounds.upper);
+            packed.first = node.first;
+            packed.count = node.count;
+            clusterNodes[c].push_back(packed);
+        }
+
+        packVec3(table[c].lower, bounds.lower);
+        packVec3(table[c].upper, bounds.upper);
+        offset = (offset + CLUSTER_ALIGNMENT - 1) / CLUSTER_ALIGNMENT * CLUSTER_ALIGNMENT;
+        table[c].offset = offset;
+        table[c].triangleCount = (unsigned int)count;
+        table[c].nodeCount = (unsigned int)clusterNodes[c].size();
+        offset += table[c].nodeCount * sizeof(PackedNode) + table[c].triangleCount * sizeof(PackedTriangle);
+    }
+    out.write((const char*)table.data(), table.size() * sizeof(PackedCluster));
+
+    for (size_t c = 0; c < ranges.size(); c++)
+    {
+        unsigned long long position = out.tellp();
+        std::vector<char> padding(table[c].offset - position, 0);
+        out.write(padding.data(), padding.size());
+        out.write((const char*)clusterNodes[c].data(), clusterNodes[c].size() * sizeof(PackedNode));
+        for (size_t k = ranges[c].first; k < ranges[c].second; k++)
+            out.write((const char*)&triangles[order[k]], sizeof(PackedTriangle));
+    }
+
+    if (!out.good())
+    {
+        std::cerr << "Error: Could not write " << fileName << "\n";
+        return false;
+    }
+    return true;
+}
+
+OutOfCoreScene::~OutOfCoreScene()
+{
+    if (file >= 0)
+        close(file);
+}
+
+static std::unique_ptr<BSDF> makeMaterial(int type, int exponent)
+{
+    if (type == PhongMaterial)
+    {
+        std::unique_ptr<phongBSDF> phong = std::make_unique<phongBSDF>();
+        phong->phongExponent = exponent;
+        return phong;
+    }
+    if (type == MirrorMaterial)
+        return std::make_unique<mirrorBSDF>();
+    return std::make_unique<simpleDiffuseBSDF>();
+}
+
+bool OutOfCoreScene::open(const std::string& fileName, size_t memoryBudget)
+{
+    std::ifstream in(fileName, std::ios::binary);
+    if (!in.is_open())
+    {
+        std::cerr << "Error: Could not open " << fileName << "\n";
+        return false;
+    }
+
+    std::string type;
+    size_t clusters = 0, materialCount = 0, emitterCount = 0;
+    in >> type >> clusters >> totalTriangles >> materialCount >> emitterCount;
+    in.get(); // single whitespace character before the data
+    if (type != "PC" || !in.good())
+    {
+        std::cerr << "Error: " << fileName << " is not a cluster file\n";
+        return false;
+    }
+
+    materials.clear();
+    for (size_t m = 0; m < materialCount; m++)
+    {
+        int materialType = 0, exponent = 0;
+        in.read((char*)&materialType, sizeof(int));
+        in.read((char*)&exponent, sizeof(int));
+        materials.push_back(makeMaterial(materialType, exponent));
+    }
+
+    auto material = [&](int index) { return index >= 0 && index < int(materials.size()) ? materials[index].get() : nullptr; };
+
+    std::vector<PackedTriangle> emitters(emitterCount);
+    in.read((char*)emitters.data(), emitterCount * sizeof(PackedTriangle));
+    lightVertices.clear();
+    lightTriangles.clear();
+    lightVertices.reserve(3 * emitterCount);
+    for (const PackedTriangle& packed : emitters)
+    {
+        for (int v = 0; v < 3; v++)
+        {
+            lightVertices.push_back(Vertex(unpackVec3(packed.position[v]), unpackVec3(packed.color[v]),
+                unpackVec3(packed.normal[v])));
+        }
+        Vertex* v = &lightVertices[lightVertices.size() - 3];
+        lightTriangles.push_back(Triangle(v, v + 1, v + 2, unpackVec3(packed.emission), material(packed.material)));
+    }
+
+    std::vector<PackedCluster> table(clusters);
+    in.read((char*)table.data(), clusters * sizeof(PackedCluster));
+    if (!in.good())
+    {
+        std::cerr << "Error: " << fileName << " is truncated\n";
+        return false;
+    }
+
+    clusterBounds.resize(clusters);
+    clusterOffsets.resize(clusters);
+    clusterSizes.resize(clusters);
+    clusterNodeCounts.resize(clusters);
+    for (size_t c = 0; c < clusters; c++)
+    {
+        // padded like the BVH's nodes, so a triangle lying in a face of the box is not skipped by rounding
+        clusterBounds[c].lower = unpackVec3(table[c].lower) - Vec3(1e-7, 1e-7, 1e-7);
+        clusterBounds[c].upper = unpackVec3(table[c].upper) + Vec3(1e-7, 1e-7, 1e-7);
+        clusterOffsets[c] = table[c].offset;
+        clusterSizes[c] = table[c].triangleCount;
+        clusterNodeCounts[c] = table[c].nodeCount;
+    }
+    clusterBVH.build(clusterBounds);
+
+    if (file >= 0)
+        close(file);
+    file = ::open(fileName.c_str(), O_RDONLY);
+    if (file < 0)
+    {
+        std::cerr << "Error: Could not open " << fileName << "\n";
+        return false;
+    }
+
+    budget = memoryBudget;
+    cache.clear();
+    lru.clear();
+    residentBytes = 0;
+    counters = ClusterCacheStats();
+    return true;
+}
+
+std::shared_ptr<const Cluster> OutOfCoreScene::load(int cluster)
+{
+    TRACE_SCOPE("load cluster", cluster);
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // the nodes and triangles are one contiguous block
+    const size_t nodeBytes = clusterNodeCounts[cluster] * sizeof(PackedNode);
+    const size_t size = nodeBytes + clusterSizes[cluster] * sizeof(PackedTriangle);
+    std::vector<char> block(size);
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t count = pread(file, block.data() + done, size - done, off_t(clusterOffsets[cluster] + done));
+        if (count <= 0)
+            break;
+        done += size_t(count);
+    }
+
+    std::shared_ptr<Cluster> result = std::make_shared<Cluster>();
+    if (done < size)
+    {
+        // an empty cluster just has no hits, so the render goes on without it
+        std::cerr << "Error: Could not read cluster " << cluster << " from the cluster file\n";
+        return result;
+    }
+
+    const PackedNode* nodes = (const PackedNode*)block.data();
+    result->bvh.nodes.resize(clusterNodeCounts[cluster]);
+    for (size_t n = 0; n < result->bvh.nodes.size(); n++)
+    {
+        BVHNode& node = result->bvh.nodes[n];
+        node.bounds.lower = unpackVec3(nodes[n].lower);
+        node.bounds.upper = unpackVec3(nodes[n].upper);
+        node.first = nodes[n].first;
+        node.count = nodes[n].count;
+    }
+
+    const PackedTriangle* packed = (const PackedTriangle*)(block.data() + nodeBytes);
+    const size_t triangleCount = clusterSizes[cluster];
+    result->vertices.reserve(3 * triangleCount);
+    result->triangles.reserve(triangleCount);
+    result->bvh.indices.resize(triangleCount);
+    for (size_t i = 0; i < triangleCount; i++)
+    {
+        const PackedTriangle& p = packed[i];
+        for (int v = 0; v < 3; v++)
+            result->vertices.push_back(Vertex(unpackVec3(p.position[v]), unpackVec3(p.color[v]), unpackVec3(p.normal[v])));
+        Vertex* v = &result->vertices[3 * i];
+        BSDF* material = p.material >= 0 && p.material < int(materials.size()) ? materials[p.material].get() : nullptr;
+        result->triangles.push_back(Triangle(v, v + 1, v + 2, unpackVec3(p.emission), material));
+
+        // the triangles are stored in leaf order already
+        result->bvh.indices[i] = int(i);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    counters.bytesRead += done;
+    counters.loadSeconds += elapsed.count();
+    return result;
+}
+
+std::shared_ptr<const Cluster> OutOfCoreScene::fetch(int cluster)
+{
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        counters.requests++;
+        auto it = cache.find(cluster);
+        if (it != cache.end())
+        {
+            counters.hits++;
+            lru.splice(lru.begin(), lru, it->second.position);
+            return it->second.cluster;
+        }
+    }
+
+    // read without holding the lock, so other threads keep using the cache meanwhile
+    std::shared_ptr<const Cluster> loaded = load(cluster);
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto it = cache.find(cluster);
+    if (it != cache.end())
+        return it->second.cluster; // another thread loaded it in the meantime
+
+    lru.push_front(cluster);
+    cache[cluster] = {loaded, lru.begin()};
+    residentBytes += loaded->bytes();
+
+    // evicted clusters that a query still holds stay alive until it lets go of them
+    while (residentBytes > budget && lru.size() > 1)
+    {
+        int victim = lru.back();
+        lru.pop_back();
+        residentBytes -= cache[victim].cluster->bytes();
+        cache.erase(victim);
+        counters.evictions++;
+    }
+    counters.peakResidentBytes = std::max(counters.peakResidentBytes, residentBytes);
+    return loaded;
+}
+
+ClusterCacheStats OutOfCoreScene::stats() const
+{
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return counters;
+}
+
+void OutOfCoreScene::resetStats()
+{
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    counters = ClusterCacheStats();
+    counters.peakResidentBytes = residentBytes;
+}
+
+void OutOfCoreScene::findVisits(const std::vector<Ray>& rays, const std::vector<double>& maxT,
+    std::vector<Visit>& visits) const
+{
+    const double infinity = std::numeric_limits<double>::infinity();
+    std::vector<std::vector<Visit>> perRay(rays.size());
+
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (int i = 0; i < int(rays.size()); i++)
+    {
+        const Ray& r = rays[i];
+        const Vec3 d = r.direction();
+        auto invert = [](double x) { return std::fabs(x) > 1e-300 ? 1.0 / x : (x < 0 ? -1e300 : 1e300); };
+        const Vec3 invDir = Vec3(invert(d.x()), invert(d.y()), invert(d.z()));
+
+        double t = maxT[i];
+        clusterBVH.intersect(r, t, [&](int c, double&) {
+            double entry = clusterBounds[c].hit(r.origin(), invDir, maxT[i]);
+            if (entry != infinity)
+                perRay[i].push_back({entry, c, i});
+            return false;
+        });
+    }
+
+    visits.clear();
+    for (const std::vector<Visit>& v : perRay)
+        visits.insert(visits.end(), v.begin(), v.end());
+
+    // grouped by cluster, and front to back within a cluster
+    std::sort(visits.begin(), visits.end(), [](const Visit& a, const Visit& b) {
+        return a.cluster != b.cluster ? a.cluster < b.cluster : a.entryT < b.entryT;
+    });
+}
+
+template <typename Wanted, typename Trace>
+void OutOfCoreScene::traceByCluster(const std::vector<Visit>& visits, Wanted wanted, Trace trace)
+{
+    std::vector<std::pair<size_t, size_t>> groups;
+    for (size_t v = 0; v < visits.size(); v++)
+    {
+        if (v == 0 || visits[v].cluster != visits[v - 1].cluster)
+            groups.push_back({v, v});
+        groups.back().second = v + 1;
+    }
+
+    // Clusters already in memory go first, then the others in the order of the nearest entry into them (which is
+    // first in each group). Going front to back every time would make consecutive batches walk the clusters in
+    // the same order, which is the worst case for an LRU cache smaller than the scene.
+    std::vector<char> resident(groups.size(), 0);
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        for (size_t g = 0; g < groups.size(); g++)
+            resident[g] = cache.count(visits[groups[g].first].cluster) > 0;
+    }
+    std::vector<size_t> order(groups.size());
+    for (size_t g = 0; g < order.size(); g++)
+        order[g] = g;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (resident[a] != resident[b])
+            return resident[a] > resident[b];
+        return visits[groups[a].first].entryT < visits[groups[b].first].entryT;
+    });
+    std::vector<std::pair<size_t, size_t>> sorted(groups.size());
+    for (size_t g = 0; g < order.size(); g++)
+        sorted[g] = groups[order[g]];
+    groups.swap(sorted);
+
+    // a group is skipped without a fetch once none of its rays need it any more
+    auto needed = [&](const std::pair<size_t, size_t>& group) {
+        for (size_t v = group.first; v < group.second; v++)
+        {
+            if (wanted(visits[v]))
+                return true;
+        }
+        return false;
+    };
+
+    unsigned long long rayVisits = 0;
+    std::future<std::shared_ptr<const Cluster>> prefetch;
+    int prefetched = -1;
+
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        const std::pair<size_t, size_t>& group = groups[g];
+        const int id = visits[group.first].cluster;
+        if (!needed(group))
+            continue;
+
+        std::shared_ptr<const Cluster> cluster = prefetched == id ? prefetch.get() : fetch(id);
+        if (prefetched != id && prefetch.valid())
+            prefetch.wait();
+        prefetched = -1;
+
+        // read the next cluster that is still needed while this one is traced
+        for (size_t next = g + 1; next < groups.size(); next++)
+        {
+            if (needed(groups[next]))
+            {
+                prefetched = visits[groups[next].first].cluster;
+                prefetch = std::async(std::launch::async, [this, prefetched]() { return fetch(prefetched); });
+                break;
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic, 64) reduction(+:rayVisits)
+        for (long long v = (long long)group.first; v < (long long)group.second; v++)
+        {
+            if (wanted(visits[v]))
+            {
+                trace(*cluster, visits[v].ray);
+                rayVisits++;
+            }
+        }
+    }
+    if (prefetch.valid())
+        prefetch.wait();
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    counters.rayVisits += rayVisits;
+}
+
+void OutOfCoreScene::intersect(const std::vector<Ray>& rays, std::vector<Intersection>& hits, double maxT)
+{
+    TRACE_SCOPE("batch intersect", int(rays.size()));
+    hits.assign(rays.size(), Intersection());
+    std::vector<double> closest(rays.size(), maxT);
+
+    std::vector<Visit> visits;
+    findVisits(rays, closest, visits);
+
+    // a cluster the ray enters behind the closest hit so far cannot hold a closer one
+    auto wanted = [&](const Visit& visit) { return visit.entryT < closest[visit.ray]; };
+
+    auto trace = [&](const Cluster& cluster, int i) {
+        const Ray& r = rays[i];
+        const std::vector<Triangle>& triangles = cluster.triangles;
+        cluster.bvh.intersect(r, closest[i], [&](int k, double& closestT) {
+            auto [t, P] = triangleIntersect(triangles[k], r);
+            if (t != -1.0 && t < closestT)
+            {
+                closestT = t;
+                const Triangle& tri = triangles[k];
+                Intersection& hit = hits[i];
+                hit.baseColor = tri.a->c * P[0] + tri.b->c * P[1] + tri.c->c * P[2];
+                hit.normal = tri.a->n;
+                hit.hitTri = tri;
+                hit.hitTri.a = hit.hitTri.b = hit.hitTri.c = nullptr;
+                hit.area = tri.emission.lengthSquared() > 0
+                    ? 0.5 * cross(tri.b->pt - tri.a->pt, tri.c->pt - tri.a->pt).length() : 0;
+                hit.valid = true;
+                hit.backface = false;
+            }
+            return false;
+        });
+    };
+
+    traceByCluster(visits, wanted, trace);
+
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        if (hits[i].valid)
+        {
+            hits[i].point = rays[i].pointAt(closest[i]);
+            hits[i].ray = rays[i];
+        }
+    }
+}
+
+void OutOfCoreScene::occluded(const std::vector<Ray>& rays, const std::vector<double>& maxT, std::vector<char>& blocked)
+{
+    TRACE_SCOPE("batch occluded", int(rays.size()));
+    blocked.assign(rays.size(), 0);
+
+    std::vector<Visit> visits;
+    findVisits(rays, maxT, visits);
+
+    auto wanted = [&](const Visit& visit) { return blocked[visit.ray] == 0; };
+
+    auto trace = [&](const Cluster& cluster, int i) {
+        const Ray& r = rays[i];
+        const std::vector<Triangle>& triangles = cluster.triangles;
+        double t = maxT[i];
+        cluster.bvh.intersect(r, t, [&](int k, double& closestT) {
+            double hitT = triangleIntersect(triangles[k], r).first;
+            blocked[i] = hitT != -1.0 && hitT < closestT;
+            return blocked[i] != 0;
+        });
+    };
+
+    traceByCluster(visits, wanted, trace);
+}
+
+static double maxComponent(const Vec3& v)
+{
+    return std::max(v.x(), std::max(v.y(), v.z()));
+}
+
+// One path of the wavefront, with everything MISIntegrator::tracePath keeps in locals between its steps
+struct WavefrontPath
+{
+    int pixel;
+    Ray r;
+    Vec3 beta;
+    Color L;
+    bool alive;
+    double bsdfPdf;     // of the BSDF sample r came from, 0 for camera rays and mirror bounces
+
+    // the light sample of the current bounce, waiting on its shadow ray
+    bool shadowed;
+    Triangle light;
+    Vec3 wi;
+    Vec3 surfaceToLight;
+    Vec3 wiLocal;
+};
+
+RenderStats renderOutOfCore(OutOfCoreScene& scene, const MISIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, Image& image, int tilePixels)
+{
+    TRACE_SCOPE("render out of core");
+    auto start = std::chrono::high_resolution_clock::now();
+
+    const int imageWidth = settings.imageWidth;
+    const int imageHeight = settings.imageHeight;
+    const int totalPixels = imageWidth * imageHeight;
+    const int cropX = settings.cropWidth > 0 ? settings.cropX : 0;
+    const int cropY = settings.cropHeight > 0 ? settings.cropY : 0;
+    const int outWidth = settings.cropWidth > 0 ? settings.cropWidth : imageWidth;
+    const int outHeight = settings.cropHeight > 0 ? settings.cropHeight : imageHeight;
+
+    RenderStats stats;
+    stats.threads = resolveThreadCount(settings.threads);
+    omp_set_num_threads(stats.threads);
+
+    const std::vector<Triangle>& lights = scene.lights();
+    const int rowsPerTile = std::max(1, tilePixels / std::max(outWidth, 1));
+    std::random_device rd;
+
+    unsigned long long rays = 0;
+    for (int tileY = 0; tileY < outHeight; tileY += rowsPerTile)
+    {
+        if (settings.cancel != nullptr && settings.cancel->load())
+            break;
+
+        const int rows = std::min(rowsPerTile, outHeight - tileY);
+        const int pixels = rows * outWidth;
+
+        // every pixel keeps its sampler across its samples, as in renderImage, so a seeded render matches it
+        std::vector<SimpleSampler> samplers;
+        samplers.reserve(pixels);
+        for (int p = 0; p < pixels; p++)
+        {
+            const int x = cropX + p % outWidth;
+            const int y = cropY + tileY + p / outWidth;
+            unsigned int base = settings.deterministic ? settings.seed : rd();
+            samplers.emplace_back(base + (unsigned int)settings.firstSample * totalPixels + y * imageWidth + x);
+        }
+        std::vector<Color> sum(pixels, Color(0, 0, 0));
+
+        std::vector<WavefrontPath> paths(pixels);
+        std::vector<int> active;
+        std::vector<Ray> batch;
+        std::vector<Intersection> hits;
+        std::vector<Ray> shadowRays;
+        std::vector<double> shadowMaxT;
+        std::vector<int> shadowPath;
+        std::vector<char> blocked;
+
+        for (int k = 0; k < settings.sampleCount; k++)
+        {
+            for (int p = 0; p < pixels; p++)
+            {
+                auto [du, dv] = samplers[p].get2D();
+                const int x = cropX + p % outWidth;
+                const int y = cropY + tileY + p / outWidth;
+                paths[p].pixel = p;
+                paths[p].r = camera.generateRay(x + du - 0.5, y + dv - 0.5, imageWidth, imageHeight);
+                paths[p].beta = Vec3(1.0, 1.0, 1.0);
+                paths[p].L = Color(0, 0, 0);
+                paths[p].alive = true;
+                paths[p].bsdfPdf = 0;
+            }
+
+            for (int depth = 0; depth <= integrator.maxDepth; depth++)
+            {
+                active.clear();
+                batch.clear();
+                for (int p = 0; p < pixels; p++)
+                {
+                    if (paths[p].alive)
+                    {
+                        active.push_back(p);
+                        batch.push_back(paths[p].r);
+                    }
+                }
+                if (active.empty())
+                    break;
+
+                scene.intersect(batch, hits);
+                rays += batch.size();
+
+                // the first half of the bounce: the light sample, up to its shadow ray
+                #pragma omp parallel for schedule(dynamic, 256)
+                for (int a = 0; a < int(active.size()); a++)
+                {
+                    WavefrontPath& path = paths[active[a]];
+                    const Intersection& hit = hits[a];
+                    path.shadowed = false;
+                    if (!hit.valid)
+                    {
+                        path.alive = false;
+                        continue;
+                    }
+                    toLocal(-path.r.direction(), unit(hit.normal), path.wiLocal);
+
+                    if (hit.hitTri.emission.lengthSquared() > 0)
+                    {
+                        double lightWeight, bsdfWeight = 1.0;
+                        if (integrator.lightSampling && path.bsdfPdf > 0)
+                        {
+                            misWeights(integrator.heuristic, emitterPdf(lights.size(), hit, path.r.origin()),
+                                path.bsdfPdf, lightWeight, bsdfWeight);
+                        }
+                        path.L += path.beta * hit.hitTri.emission * bsdfWeight;
+                    }
+
+                    // the last bounce's BSDF sample only looks for light, as in MISIntegrator::tracePath
+                    if (depth == integrator.maxDepth)
+                    {
+                        path.alive = false;
+                        continue;
+                    }
+
+                    if (lights.empty() || !integrator.lightSampling || hit.hitTri.material->isDelta())
+                        continue;
+
+                    SimpleSampler& sample = samplers[path.pixel];
+                    int index = static_cast<int>(sample.get1D() * lights.size());
+                    path.light = lights.at(index);
+                    double u = sqrt(sample.get1D());
+                    double v = sample.get1D();
+
+                    const Triangle& l = path.light;
+                    Point p = (1 - u) * l.a->pt + u * (1 - v) * l.b->pt + u * v * l.c->pt;
+                    path.surfaceToLight = p - hit.point;
+                    path.wi = unit(path.surfaceToLight);
+                    path.shadowed = true;
+                }
+
+                shadowRays.clear();
+                shadowMaxT.clear();
+                shadowPath.clear();
+                for (int a = 0; a < int(active.size()); a++)
+                {
+                    WavefrontPath& path = paths[active[a]];
+                    if (!path.alive || !path.shadowed)
+                        continue;
+
+                    Ray r = Ray(path.wi, hits[a].point + hits[a].normal * 0.0001);
+                    auto [t, _] = triangleIntersect(path.light, r);
+
+                    // the light faces away, so there is nothing to trace a shadow ray for
+                    if (t == -1.0)
+                    {
+                        path.shadowed = false;
+                        continue;
+                    }
+                    shadowRays.push_back(r);
+                    shadowMaxT.push_back(t * 0.99999);
+                    shadowPath.push_back(a);
+                }
+
+                scene.occluded(shadowRays, shadowMaxT, blocked);
+                rays += shadowRays.size();
+
+                // shadowed now means the light sample reached the light
+                for (size_t s = 0; s < shadowPath.size(); s++)
+                {
+                    if (blocked[s])
+                        paths[active[shadowPath[s]]].shadowed = false;
+                }
+
+                // the second half: weigh the light sample, sample the BSDF and continue the path
+                #pragma omp parallel for schedule(dynamic, 256)
+                for (int a = 0; a < int(active.size()); a++)
+                {
+                    WavefrontPath& path = paths[active[a]];
+                    if (!path.alive)
+                        continue;
+
+                    const Intersection& hit = hits[a];
+                    SimpleSampler& sample = samplers[path.pixel];
+                    BSDF* reflector = hit.hitTri.material;
+
+                    double light_pdf = 0, nee_bsdf_pdf = 0;
+                    Color nee = Color(0, 0, 0);
+                    if (path.shadowed)
+                    {
+                        const Triangle& l = path.light;
+                        double distanceSQR = path.surfaceToLight.lengthSquared();
+                        Vec3 lightNormal = l.a->n;
+
+                        double cosine = dot(hit.normal, path.wi);
+                        double area = 0.5 * cross(l.b->pt - l.a->pt, l.c->pt - l.a->pt).length();
+
+                        light_pdf = distanceSQR / (lights.size() * dot(lightNormal, -path.wi) * area);
+                        Vec3 toLight;
+                        toLocal(path.wi, unit(hit.normal), toLight);
+                        nee_bsdf_pdf = reflector->pdf(path.wiLocal, toLight);
+                        Color f_val = reflector->f(path.wiLocal, toLight, hit.baseColor);
+                        nee = f_val * l.emission * cosine / light_pdf;
+                    }
+                    if (light_pdf > 0)
+                    {
+                        double neeWeight, bsdfWeight;
+                        misWeights(integrator.heuristic, light_pdf, nee_bsdf_pdf, neeWeight, bsdfWeight);
+                        path.L += path.beta * nee * neeWeight;
+                    }
+
+                    Vec3 wo_local = Vec3(0, 0, 0), wo_world;
+                    double pdf_val;
+                    Vec3 f_val = reflector->sample_f(path.wiLocal, wo_local, pdf_val, hit.baseColor, sample);
+                    if (pdf_val <= 0)
+                    {
+                        path.alive = false;
+                        continue;
+                    }
+
+                    toWorld(unit(hit.normal), wo_local, wo_world);
+                    path.r = Ray(wo_world, hit.point + hit.normal * 0.0001);
+
+                    path.beta *= (f_val * fabs(wo_local.z()) / pdf_val);
+                    path.bsdfPdf = reflector->isDelta() ? 0.0 : pdf_val;
+
+                    if (integrator.russianRoulette && depth + 1 >= integrator.rrMinDepth)
+                    {
+                        double q = std::min(1.0, maxComponent(path.beta));
+                        if (sample.get1D() >= q)
+                        {
+                            path.alive = false;
+                            continue;
+                        }
+                        path.beta /= q;
+                    }
+                }
+            }
+
+            for (int p = 0; p < pixels; p++)
+                sum[p] += paths[p].L;
+        }
+
+        for (int p = 0; p < pixels; p++)
+            image.setColor(p % outWidth, tileY + p / outWidth, sum[p] / (double)settings.sampleCount);
+
+        if (settings.showProgress)
+        {
+            std::cout << "\rProgress: " << std::fixed << std::setprecision(2)
+                << 100.0 * (tileY + rows) / outHeight << "% " << std::defaultfloat << std::flush;
+        }
+    }
+    if (settings.showProgress)
+        std::cout << std::endl;
+
+    stats.cancelled = settings.cancel != nullptr && settings.cancel->load();
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    stats.seconds = elapsed.count();
+    stats.samples = (unsigned long long)outWidth * outHeight * settings.sampleCount;
+    stats.rays = rays;
+    return stats;
+}
+
+int runOutOfCore(const OutOfCoreConfig& config)
+{
+    OutOfCoreScene scene;
+    size_t budget = size_t(config.memoryMB * 1024.0 * 1024.0);
+    if (!scene.open(config.clusterFile, budget))
+        return 1;
+
+    std::cout << "Out of core: " << scene.triangleCount() << " triangles in " << scene.clusterCount() << " clusters, "
+        << scene.lights().size() << " emitters, " << config.memoryMB << " MB cluster budget" << std::endl;
+    if (config.integrator.maxSplit > 1)
+        std::cout << "Path splitting is not supported out of core, rendering without it" << std::endl;
+
+    RenderSettings settings;
+    settings.imageWidth = config.imageWidth;
+    settings.imageHeight = config.imageHeight;
+    settings.sampleCount = config.sampleCount;
+    settings.threads = config.threads;
+    settings.deterministic = true;
+    settings.seed = config.seed;
+
+    Image image(config.imageWidth, config.imageHeight);
+    RenderStats stats = renderOutOfCore(scene, config.integrator, Camera(), settings, image, config.tilePixels);
+
+    std::cout << "Rendered " << stats.samples << " samples with " << stats.threads << " threads in " << stats.seconds
+        << " seconds (" << std::fixed << std::setprecision(0) << stats.rays / stats.seconds << " rays/s)"
+        << std::defaultfloat << std::endl;
+    printClusterCacheStats(std::cout, scene.stats());
+    std::cout << "Peak RSS: " << peakMemoryMB() << " MB" << std::endl;
+
+    image.saveImageBMP(config.output);
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+Contains the out of core geometry mode, for scenes whose triangles do not fit in memory at once.
+
+The geometry is packed into a cluster file ahead of time: the world space triangles are split into spatially
+compact clusters of a few thousand triangles, and each cluster is written to its own page aligned block. Only the
+cluster bounds, the materials and the emitters stay in memory while rendering. Clusters are read on demand into
+an LRU cache that is kept under a memory budget. Each cluster carries its own BVH, built when the file is written.
+
+Rays are traced in batches. Every ray of a batch first finds the clusters it passes through, and the visits are
+grouped by cluster, so each cluster is fetched at most once per batch for all of the rays that need it instead of
+once per ray. Clusters already in the cache are visited first, then the rest in the order of their nearest entry
+distance, which is close to front to back for rays that start near each other. A ray skips a cluster it enters
+behind its closest hit so far. The next cluster is read in the background while the current one is traced.
+
+The renderer is a wavefront version of MISIntegrator (same estimator and the same order of sampler calls, so a
+seeded render of an untransformed scene matches renderImage), which keeps a whole tile of paths in flight so
+that every bounce and every set of shadow rays is one batch. Path splitting, path guiding, the radiance cache and
+the denoiser guide buffers are not supported in this mode.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <iostream>
+#include "lightTransport.h"
+#include "bvh.h"
+
+class Scene;
+struct Camera;
+struct RenderSettings;
+struct RenderStats;
+class Image;
+
+// One loaded cluster. The triangles point into `vertices`, and their materials into the OutOfCoreScene.
+struct Cluster
+{
+    std::vector<Vertex> vertices;
+    std::vector<Triangle> triangles;
+    BVH bvh;
+
+    // Memory the cluster holds, which is what the cache budget counts
+    size_t bytes() const;
+};
+
+struct ClusterCacheStats
+{
+    unsigned long long requests = 0;    // cluster fetches by the batched queries
+    unsigned long long hits = 0;        // fetches that found the cluster already in memory
+    unsigned long long evictions = 0;
+    unsigned long long bytesRead = 0;
+    double loadSeconds = 0;             // reading and unpacking loaded clusters, summed over threads
+
+    // Ray / cluster pairs tested, so rays per fetch shows how much the batching saved
+    unsigned long long rayVisits = 0;
+
+    size_t peakResidentBytes = 0;
+
+    double hitRate() const { return requests > 0 ? double(hits) / requests : 0.0; }
+};
+
+void printClusterCacheStats(std::ostream& out, const ClusterCacheStats& stats);
+
+// Splits the scene's world space geometry (instances are flattened) into clusters of at most clusterSize triangles
+// and writes them to fileName. Returns false on errors. The scene needs build() first, for its emitters.
+bool writeClusterFile(const Scene& scene, const std::string& fileName, int clusterSize);
+
+class OutOfCoreScene
+{
+    public:
+
+    OutOfCoreScene() {}
+    ~OutOfCoreScene();
+    OutOfCoreScene(const OutOfCoreScene&) = delete;
+    OutOfCoreScene& operator=(const OutOfCoreScene&) = delete;
+
+    // Reads the cluster table, materials and emitters of a cluster file. Clusters are only read when a query
+    // needs them, and are evicted least recently used first once the cache holds more than memoryBudget bytes.
+    bool open(const std::string& fileName, size_t memoryBudget);
+
+    // Closest hit of every ray closer than maxT. The hits' hitTri vertex pointers are cleared, since the cluster
+    // they pointed into may be evicted; everything else is filled in as by Scene::intersect.
+    void intersect(const std::vector<Ray>& rays, std::vector<Intersection>& hits, double maxT = 99999999.0);
+
+    // Whether each ray hits anything closer than its maxT, as Scene::occluded
+    void occluded(const std::vector<Ray>& rays, const std::vector<double>& maxT, std::vector<char>& blocked);
+
+    // The emitters, which always stay in memory, in the same form as Scene::lights
+    const std::vector<Triangle>& lights() const { return lightTriangles; }
+
+    int clusterCount() const { return int(clusterBounds.size()); }
+    size_t triangleCount() const { return totalTriangles; }
+
+    ClusterCacheStats stats() const;
+    void resetStats();
+
+    private:
+
+    struct CacheEntry
+    {
+        std::shared_ptr<const Cluster> cluster;
+        std::list<int>::iterator position;  // in lru, most recently used at the front
+    };
+
+    // The cluster from the cache, reading it from the file on a miss
+    std::shared_ptr<const Cluster> fetch(int cluster);
+    std::shared_ptr<const Cluster> load(int cluster);
+
+    // One cluster a ray passes through before its maxT
+    struct Visit
+    {
+        double entryT;
+        int cluster;
+        int ray;
+    };
+
+    // Every ray's visits, grouped by cluster
+    void findVisits(const std::vector<Ray>& rays, const std::vector<double>& maxT, std::vector<Visit>& visits) const;
+
+    // Goes through the clusters once (resident ones first, then nearest entry first) and calls trace(cluster, ray) for every visit that is
+    // still wanted(visit) when its cluster comes up
+    template <typename Wanted, typename Trace>
+    void traceByCluster(const std::vector<Visit>& visits, Wanted wanted, Trace trace);
+
+    int file = -1;
+    size_t budget = 0;
+
+    std::vector<AABB> clusterBounds;
+    std::vector<unsigned long long> clusterOffsets;
+    std::vector<unsigned int> clusterSizes;
+    std::vector<unsigned int> clusterNodeCounts;
+    size_t totalTriangles = 0;
+    BVH clusterBVH;
+
+    std::vector<std::unique_ptr<BSDF>> materials;
+    std::vector<Vertex> lightVertices;
+    std::vector<Triangle> lightTriangles;
+
+    mutable std::mutex cacheMutex;
+    std::unordered_map<int, CacheEntry> cache;
+    std::list<int> lru;
+    size_t residentBytes = 0;
+    ClusterCacheStats counters;
+};
+
+// Renders like renderImage (crop windows, seeds, threads and cancelling work the same), tracing a tile of at most
+// tilePixels pixels at a time as one wavefront. Bigger tiles share more of each fetch, but every pixel of the tile
+// keeps its own sampler (about 5 KB).
+RenderStats renderOutOfCore(OutOfCoreScene& scene, const MISIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, Image& image, int tilePixels = 128 * 128);
+
+struct OutOfCoreConfig
+{
+    std::string clusterFile = "scene.clusters";
+
+    // Cache budget for loaded clusters, in megabytes
+    double memoryMB = 256;
+
+    int imageWidth = 512;
+    int imageHeight = 512;
+    int sampleCount = 8;
+    int threads = 0;
+    unsigned int seed = 12345;
+    int tilePixels = 128 * 128;
+    MISIntegrator integrator;
+
+    std::string output = "render.bmp";
+};
+
+// Renders a cluster file and prints the cache statistics. Returns 0 on success.
+int runOutOfCore(const OutOfCoreConfig& config);
@@ -0,0 +1,483 @@
+/*
+Contains the SD-tree and the training loop.
+
+Both quadtrees of a region (the distribution being sampled and the layout being recorded into) are flat arrays of
+nodes, with every child stored after its parent, so sums can be built bottom up by walking the array backwards.
+
+*/
+
+#include "pathGuiding.h"
+#include "renderer.h"
+#include "scene.h"
+#include "image.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+
+const double PI = 3.14159265358979323846;
+
+// Recordings are summed as integers in units of 1 / fixedPointScale, which keeps the atomic adds exact
+const double fixedPointScale = 65536.0;
+const double maxRecordedValue = 1e9;
+
+// Quadrant q of a node covers x = q & 1, y = q >> 1 of the node's square
+struct QuadNode
+{
+    double energy[4] = {0, 0, 0, 0};
+    int child[4] = {0, 0, 0, 0};    // 0 for a leaf quadrant, since the root is never anyone's child
+};
+
+struct PathGuide::Region
+{
+    // The distribution sampled during a pass. Empty until the region has recorded some light.
+    std::vector<QuadNode> sampling;
+    double samplingTotal = 0;
+
+    // The layout recorded into during a pass, and the fixed point sum of every leaf quadrant (node * 4 + q)
+    std::vector<QuadNode> layout;
+    std::unique_ptr<std::atomic<unsigned long long>[]> recorded;
+    std::atomic<unsigned long long> records{0};
+
+    void resetRecording()
+    {
+        recorded = std::make_unique<std::atomic<unsigned long long>[]>(layout.size() * 4);
+        for (size_t i = 0; i < layout.size() * 4; i++)
+            recorded[i].store(0, std::memory_order_relaxed);
+        records.store(0, std::memory_order_relaxed);
+    }
+};
+
+// Cylindrical mapping between directions and the unit square: u is cos theta and v is phi, both scaled to [0, 1).
+// It preserves area, so a density over the square is 4 pi times the solid angle density.
+static void directionToSquare(const Vec3& d, double& u, double& v)
+{
+    u = std::clamp((d.z() + 1.0) * 0.5, 0.0, std::nextafter(1.0, 0.0));
+    v = std::atan2(d.y(), d.x()) / (2 * PI);
+    if (v < 0)
+        v += 1.0;
+    v = std::clamp(v, 0.0, std::nextafter(1.0, 0.0));
+}
+
+static Vec3 squareToDirection(double u, double v)
+{
+    double cosTheta = 2.0 * u - 1.0;
+    double sinTheta = std::sqrt(std::max(0.0, 1.0 - cosTheta * cosTheta));
+    double phi = 2 * PI * v;
+    return Vec3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+}
+
+static int quadrant(double& u, double& v)
+{
+    int x = u >= 0.5 ? 1 : 0;
+    int y = v >= 0.5 ? 1 : 0;
+    u = 2.0 * u - x;
+    v = 2.0 * v - y;
+    return x + 2 * y;
+}
+
+// Density over the unit square
+static double quadtreePdf(const std::vector<QuadNode>& tree, double u, double v)
+{
+    double density = 1.0;
+    int node = 0;
+    while (true)
+    {
+        const QuadNode& n = tree[node];
+        double total = n.energy[0] + n.energy[1] + n.energy[2] + n.energy[3];
+        if (total <= 0)
+            return 0.0;
+
+        int q = quadrant(u, v);
+        density *= 4.0 * n.energy[q] / total;
+        if (n.child[q] == 0 || density == 0)
+            return density;
+        node = n.child[q];
+    }
+}
+
+// Picks a leaf in proportion to its energy, then a uniform point in it. Every level takes fresh random numbers:
+// rescaling one pair from level to level runs out of the sampler's float precision a few levels down, and the
+// deep leaves around small lights would then be sampled unevenly.
+static void quadtreeSample(const std::vector<QuadNode>& tree, SimpleSampler& sample, double& u, double& v)
+{
+    double x0 = 0, y0 = 0, size = 1.0;
+    int node = 0;
+    while (true)
+    {
+        const QuadNode& n = tree[node];
+        auto [r1, r2] = sample.get2D();
+
+        double bottom = n.energy[0] + n.energy[1];
+        double top = n.energy[2] + n.energy[3];
+        int y = r2 * (bottom + top) < bottom ? 0 : 1;
+
+        double left = n.energy[2 * y];
+        double right = n.energy[2 * y + 1];
+        int x = r1 * (left + right) < left ? 0 : 1;
+
+        size *= 0.5;
+        x0 += x * size;
+        y0 += y * size;
+
+        int q = x + 2 * y;
+        if (n.child[q] == 0)
+        {
+            auto [s1, s2] = sample.get2D();
+            u = std::min(x0 + s1 * size, std::nextafter(1.0, 0.0));
+            v = std::min(y0 + s2 * size, std::nextafter(1.0, 0.0));
+            return;
+        }
+        node = n.child[q];
+    }
+}
+
+// Index into Region::recorded of the leaf quadrant containing (u, v)
+static int leafQuadrant(const std::vector<QuadNode>& tree, double u, double v)
+{
+    int node = 0;
+    while (true)
+    {
+        int q = quadrant(u, v);
+        if (tree[node].child[q] == 0)
+            return node * 4 + q;
+        node = tree[node].child[q];
+    }
+}
+
+// Appends a layout node for a square whose quadrants hold `energy`, subdividing every quadrant that holds more than
+// the threshold's share of `total`. The energy of a quadrant the source tree has no children for is spread evenly
+// over the new ones. Returns the node's index.
+static int buildLayout(std::vector<QuadNode>& out, const std::vector<QuadNode>& source, int sourceNode,
+    const double energy[4], double total, int depth, const GuidingSettings& settings)
+{
+    int index = int(out.size());
+    out.push_back(QuadNode());
+    for (int q = 0; q < 4; q++)
+    {
+        if (depth >= settings.maxDirectionalDepth || energy[q] <= total * settings.directionalThreshold)
+            continue;
+
+        int sourceChild = sourceNode >= 0 ? source[sourceNode].child[q] : 0;
+        double childEnergy[4];
+        for (int k = 0; k < 4; k++)
+            childEnergy[k] = sourceChild != 0 ? source[sourceChild].energy[k] : energy[q] / 4;
+
+        int child = buildLayout(out, source, sourceChild != 0 ? sourceChild : -1, childEnergy, total, depth + 1,
+            settings);
+        out[index].child[q] = child;
+    }
+    return index;
+}
+
+PathGuide::PathGuide(const GuidingSettings& settings) : config(settings) {}
+
+PathGuide::~PathGuide() {}
+
+void PathGuide::reset(const Scene& scene)
+{
+    AABB sceneBounds;
+    if (!scene.objectBVH.empty())
+        sceneBounds.grow(scene.objectBVH.nodes[0].bounds);
+    if (!scene.instanceBVH.empty())
+        sceneBounds.grow(scene.instanceBVH.nodes[0].bounds);
+    if (sceneBounds.empty())
+        sceneBounds.grow(Point(0, 0, 0));
+
+    // a slightly larger cube, so halving along x, y and z in turn keeps the regions cubes
+    Point center = sceneBounds.center();
+    Vec3 extent = sceneBounds.upper - sceneBounds.lower;
+    double half = 0.5 * std::max(extent.x(), std::max(extent.y(), extent.z())) * 1.01 + 1e-4;
+    bounds = AABB();
+    bounds.grow(center - Vec3(half, half, half));
+    bounds.grow(center + Vec3(half, half, half));
+
+    regions.clear();
+    regions.push_back(std::make_unique<Region>());
+    regions[0]->layout.push_back(QuadNode());
+    regions[0]->resetRecording();
+
+    nodes.assign(1, SpatialNode());
+    nodes[0].region = 0;
+    pass = 0;
+}
+
+int PathGuide::regionAt(const Point& p) const
+{
+    double lower[3] = {bounds.lower.x(), bounds.lower.y(), bounds.lower.z()};
+    double upper[3] = {bounds.upper.x(), bounds.upper.y(), bounds.upper.z()};
+
+    int node = 0;
+    for (int depth = 0; nodes[node].children >= 0; depth++)
+    {
+        int axis = depth % 3;
+        double middle = 0.5 * (lower[axis] + upper[axis]);
+        if (p[axis] < middle)
+        {
+            upper[axis] = middle;
+            node = nodes[node].children;
+        }
+        else
+        {
+            lower[axis] = middle;
+            node = nodes[node].children + 1;
+        }
+    }
+    return nodes[node].region;
+}
+
+bool PathGuide::hasDistribution(int region) const
+{
+    return regions[region]->samplingTotal > 0;
+}
+
+Vec3 PathGuide::sample(int region, SimpleSampler& sample) const
+{
+    double u, v;
+    quadtreeSample(regions[region]->sampling, sample, u, v);
+    return squareToDirection(u, v);
+}
+
+double PathGuide::pdf(int region, const Vec3& direction) const
+{
+    const Region& r = *regions[region];
+    if (r.samplingTotal <= 0)
+        return 0.0;
+
+    double u, v;
+    directionToSquare(direction, u, v);
+    return quadtreePdf(r.sampling, u, v) / (4 * PI);
+}
+
+void PathGuide::record(int region, const Vec3& direction, double value)
+{
+    Region& r = *regions[region];
+    r.records.fetch_add(1, std::memory_order_relaxed);
+    if (!(value > 0))
+        return;
+
+    double u, v;
+    directionToSquare(direction, u, v);
+    unsigned long long amount = (unsigned long long)(std::min(value, maxRecordedValue) * fixedPointScale + 0.5);
+    r.recorded[leafQuadrant(r.layout, u, v)].fetch_add(amount, std::memory_order_relaxed);
+}
+
+// Splits a leaf while it holds more records than the threshold allows. The two halves start out with the leaf's
+// distribution and share its records evenly.
+void PathGuide::splitRegions(int node, int depth, unsigned long long records)
+{
+    double threshold = config.spatialThreshold * std::sqrt(std::pow(2.0, pass));
+    if (double(records) <= threshold || depth >= config.maxSpatialDepth)
+        return;
+
+    int region = nodes[node].region;
+    auto copy = std::make_unique<Region>();
+    copy->sampling = regions[region]->sampling;
+    copy->samplingTotal = regions[region]->samplingTotal;
+    int newRegion = int(regions.size());
+    regions.push_back(std::move(copy));
+
+    int first = int(nodes.size());
+    nodes.push_back(SpatialNode());
+    nodes.push_back(SpatialNode());
+    nodes[first].region = region;
+    nodes[first + 1].region = newRegion;
+    nodes[node].children = first;
+    nodes[node].region = -1;
+
+    splitRegions(first, depth + 1, records / 2);
+    splitRegions(first + 1, depth + 1, records / 2);
+}
+
+void PathGuide::update()
+{
+    // the recordings become the distribution, on the layout they were recorded with
+    std::vector<unsigned long long> records(regions.size());
+    for (size_t i = 0; i < regions.size(); i++)
+    {
+        Region& r = *regions[i];
+        records[i] = r.records.load(std::memory_order_relaxed);
+
+        std::vector<QuadNode> tree = r.layout;
+        for (int n = int(tree.size()) - 1; n >= 0; n--)
+        {
+            for (int q = 0; q < 4; q++)
+            {
+                if (tree[n].child[q] == 0)
+                    tree[n].energy[q] = r.recorded[n * 4 + q].load(std::memory_order_relaxed) / fixedPointScale;
+                else
+                {
+                    const QuadNode& child = tree[tree[n].child[q]];
+                    tree[n].energy[q] = child.energy[0] + child.energy[1] + child.energy[2] + child.energy[3];
+                }
+            }
+        }
+
+        double total = tree[0].energy[0] + tree[0].energy[1] + tree[0].energy[2] + tree[0].energy[3];
+        // a region that found no light this pass keeps what it learned before
+        if (total > 0)
+        {
+            r.sampling = std::move(tree);
+            r.samplingTotal = total;
+        }
+    }
+
+    // split the leaves that were busy, depth first so every leaf knows its depth
+    std::vector<std::pair<int, int>> leaves;
+    std::vector<std::pair<int, int>> stack = {{0, 0}};
+    while (!stack.empty())
+    {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+        if (nodes[node].children < 0)
+            leaves.push_back({node, depth});
+        else
+        {
+            stack.push_back({nodes[node].children, depth + 1});
+            stack.push_back({nodes[node].children + 1, depth + 1});
+        }
+    }
+    for (auto [node, depth] : leaves)
+        splitRegions(node, depth, records[nodes[node].region]);
+
+    // refine every region's layout for its new distribution, and start recording afresh
+    for (std::unique_ptr<Region>& region : regions)
+    {
+        Region& r = *region;
+        r.layout.clear();
+        if (r.samplingTotal > 0)
+            buildLayout(r.layout, r.sampling, 0, r.sampling[0].energy, r.samplingTotal, 1, config);
+        else
+            r.layout.push_back(QuadNode());
+        r.resetRecording();
+    }
+    pass++;
+}
+
+bool PathGuide::guides(const BSDF& bsdf)
+{
+    return bsdf.type() == BSDFType::Diffuse || bsdf.type() == BSDFType::Phong;
+}
+
+Color sampleGuided(const PathGuide& guide, int region, BSDF& bsdf, const Vec3& normal, const Vec3& wi, Vec3& wo,
+    double& pdf, const Color& color, SimpleSampler& sample)
+{
+    if (!guide.hasDistribution(region))
+        return bsdf.sample_f(wi, wo, pdf, color, sample);
+
+    const double bsdfFraction = guide.settings().bsdfFraction;
+    Vec3 woWorld;
+    if (sample.get1D() < bsdfFraction)
+    {
+        double bsdfPdf;
+        Color f = bsdf.sample_f(wi, wo, bsdfPdf, color, sample);
+        if (bsdfPdf <= 0)
+        {
+            pdf = 0;
+            return f;
+        }
+        toWorld(normal, wo, woWorld);
+        pdf = bsdfFraction * bsdfPdf + (1 - bsdfFraction) * guide.pdf(region, woWorld);
+        return f;
+    }
+
+    woWorld = guide.sample(region, sample);
+    toLocal(woWorld, normal, wo);
+
+    // the guide knows nothing about the surface, so directions into it are wasted
+    if (wo.z() <= 0)
+    {
+        pdf = 0;
+        return Color(0,0,0);
+    }
+    pdf = bsdfFraction * bsdf.pdf(wi, wo) + (1 - bsdfFraction) * guide.pdf(region, woWorld);
+    return bsdf.f(wi, wo, color);
+}
+
+double guidedPdf(const PathGuide& guide, int region, BSDF& bsdf, const Vec3& normal, const Vec3& wi, const Vec3& wo)
+{
+    if (!guide.hasDistribution(region))
+        return bsdf.pdf(wi, wo);
+
+    const double bsdfFraction = guide.settings().bsdfFraction;
+    Vec3 woWorld;
+    toWorld(normal, wo, woWorld);
+    return bsdfFraction * bsdf.pdf(wi, wo) + (1 - bsdfFraction) * guide.pdf(region, woWorld);
+}
+
+void recordGuidePath(PathGuide& guide, const std::vector<GuideVertex>& path, const Color& Li)
+{
+    for (const GuideVertex& vertex : path)
+    {
+        // the light that reached the vertex from its outgoing direction, averaged over the channels
+        Color found = Li - vertex.collected;
+        double radiance = 0;
+        int channels = 0;
+        for (int c = 0; c < 3; c++)
+        {
+            if (vertex.throughput[c] > 0)
+            {
+                radiance += found[c] / vertex.throughput[c];
+                channels++;
+            }
+        }
+        if (channels > 0)
+            radiance /= channels;
+        guide.record(vertex.region, vertex.direction, radiance / vertex.pdf);
+    }
+}
+
+void printGuideSummary(std::ostream& out, const PathGuide& guide)
+{
+    int learned = 0;
+    for (int r = 0; r < guide.regionCount(); r++)
+    {
+        if (guide.hasDistribution(r))
+            learned++;
+    }
+    out << "Guide: " << guide.passes() << " passes, " << guide.regionCount() << " regions (" << learned
+        << " with a learned distribution)" << std::endl;
+}
+
+RenderStats trainGuide(const Scene& scene, MISIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, PathGuide& guide, int passes)
+{
+    RenderSettings train = settings;
+    train.showProgress = false;
+    train.progressiveOutput.clear();
+    train.heatmapPrefix.clear();
+    train.denoise = false;
+
+    bool cropped = settings.cropWidth > 0 && settings.cropHeight > 0;
+    Image image(cropped ? settings.cropWidth : settings.imageWidth, cropped ? settings.cropHeight : settings.imageHeight);
+
+    integrator.guide = &guide;
+    guide.setTraining(true);
+
+    RenderStats total;
+    int samples = 0;
+    for (int k = 0; k < passes; k++)
+    {
+        train.sampleCount = 1 << k;
+        train.firstSample = settings.firstSample + settings.sampleCount + samples;
+        RenderStats stats = renderImage(scene, integrator, camera, train, image);
+        samples += train.sampleCount;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        guide.update();
+        std::chrono::duration<double> updateTime = std::chrono::high_resolution_clock::now() - start;
+
+        total.threads = stats.threads;
+        total.seconds += stats.seconds + updateTime.count();
+        total.samples += stats.samples;
+        total.rays += stats.rays;
+        if (stats.cancelled)
+        {
+            total.cancelled = true;
+            break;
+        }
+    }
+
+    guide.setTraining(false);
+    return total;
+}
@@ -0,0 +1,148 @@
+/*
+Contains path guiding: a distribution of incident light that is learned while rendering, which MISIntegrator
+samples directions from alongside the BSDF (see MISIntegrator::guide).
+
+The distribution is a spatio-directional tree (SD-tree). A binary tree splits the scene's bounds into regions,
+halving along x, y and z in turn, and every region has a quadtree over the sphere of directions, mapped to the unit
+square by (cos theta, phi) so that equal areas of the square are equal solid angles. A quadtree node is subdivided
+where a lot of light arrives, so its leaves are small around the directions of the lights (and of bright walls and
+mirrors) and large everywhere else.
+
+It is learned in passes. During a pass paths sample from the distribution built by the previous passes, and every
+vertex records the light the rest of its path found into the region's training quadtree. update() then turns the
+recordings into the distribution the next pass samples from, splits regions that have recorded enough vertices and
+refines the quadtrees for the new distribution. Regions that have learned nothing yet are sampled with the BSDF
+alone.
+
+Recording is lock free: the tree's layout only changes in update(), and the recordings are added to fixed point
+atomic counters, so threads never wait for each other and the sums do not depend on the order the threads add them
+in. A seeded render therefore learns the same tree with any number of threads.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <iostream>
+#include "lightTransport.h"
+#include "bvh.h"
+
+class Scene;
+struct Camera;
+struct RenderSettings;
+struct RenderStats;
+
+struct GuidingSettings
+{
+    // Chance that a guided vertex samples its BSDF instead of the learned distribution. Both are always weighed
+    // into the pdf, so this only moves variance around; the BSDF part keeps glossy lobes and newly found light
+    // from being starved by a distribution that has not learned them yet.
+    double bsdfFraction = 0.5;
+
+    // A region is split once it has recorded more than spatialThreshold * sqrt(2^pass) vertices in one pass
+    double spatialThreshold = 4000;
+    int maxSpatialDepth = 24;
+
+    // A quadtree node is subdivided while it holds more than this fraction of its region's light
+    double directionalThreshold = 0.01;
+    int maxDirectionalDepth = 20;
+};
+
+class PathGuide
+{
+    public:
+
+    explicit PathGuide(const GuidingSettings& settings = GuidingSettings());
+    ~PathGuide();
+    PathGuide(const PathGuide&) = delete;
+    PathGuide& operator=(const PathGuide&) = delete;
+
+    // Starts over with one region over the scene's bounds that has learned nothing. The scene needs build() first.
+    void reset(const Scene& scene);
+
+    // While training, MISIntegrator records every guided vertex into the tree
+    void setTraining(bool on) { training = on; }
+    bool isTraining() const { return training; }
+
+    // Builds the distribution from what was recorded since the last update, then splits and refines the tree
+    // for the next pass. Must not run while a render is using the guide.
+    void update();
+
+    const GuidingSettings& settings() const { return config; }
+    int passes() const { return pass; }
+    int regionCount() const { return int(regions.size()); }
+
+    // Whether vertices on this material are guided. Only the diffuse and Phong BSDFs have pdfs to weigh the
+    // guide's samples against, and a mirror has only one direction to go anyway.
+    static bool guides(const BSDF& bsdf);
+
+    // The region containing p. Points outside the scene's bounds go to the nearest region.
+    int regionAt(const Point& p) const;
+
+    // Whether the region has learned a distribution to sample from
+    bool hasDistribution(int region) const;
+
+    // Samples a world space direction from the region's distribution, and the solid angle pdf of a direction
+    Vec3 sample(int region, SimpleSampler& sample) const;
+    double pdf(int region, const Vec3& direction) const;
+
+    // Adds the light arriving at a point from a direction to the training tree. `value` is the radiance estimate
+    // divided by the pdf it was sampled with.
+    void record(int region, const Vec3& direction, double value);
+
+    private:
+
+    struct Region;
+    struct SpatialNode
+    {
+        int children = -1;  // first of the two children, -1 for a leaf
+        int region = -1;    // leaves only
+    };
+
+    void splitRegions(int node, int depth, unsigned long long records);
+
+    GuidingSettings config;
+    bool training = true;
+    int pass = 0;
+
+    AABB bounds;
+    std::vector<SpatialNode> nodes;
+    std::vector<std::unique_ptr<Region>> regions;
+};
+
+// Samples a direction at a guided vertex from the mix of the BSDF and the region's distribution, like
+// BSDF::sample_f (wi and wo are local to the surface with this normal). pdf is the pdf of the mix, which is the
+// balance heuristic between the two ways of sampling, so either one's samples are weighed correctly. Directions
+// below the surface get a pdf of 0, like the BSDFs' own.
+Color sampleGuided(const PathGuide& guide, int region, BSDF& bsdf, const Vec3& normal, const Vec3& wi, Vec3& wo,
+    double& pdf, const Color& color, SimpleSampler& sample);
+
+// The pdf sampleGuided has for the local direction wo, which next event estimation weighs its light samples by
+double guidedPdf(const PathGuide& guide, int region, BSDF& bsdf, const Vec3& normal, const Vec3& wi, const Vec3& wo);
+
+// A guided vertex of a path being recorded: the radiance the path had collected before it followed the vertex's
+// outgoing direction, and its throughput after it, so the light found along that direction is
+// (Li at the end - collected) / throughput
+struct GuideVertex
+{
+    int region;
+    Vec3 direction;     // world space
+    Vec3 throughput;
+    Color collected;
+    double pdf;
+};
+
+// Records what every vertex of a finished path found, given the path's final radiance
+void recordGuidePath(PathGuide& guide, const std::vector<GuideVertex>& path, const Color& Li);
+
+// One line about the tree's size and the light it learned, for after training
+void printGuideSummary(std::ostream& out, const PathGuide& guide);
+
+// Trains the guide for a render with these settings: `passes` passes of 1, 2, 4, ... spp at the render's
+// resolution and crop, each followed by update(). The images are thrown away, and the passes are seeded after
+// the render's own samples so they do not share any. Leaves the guide in the integrator, not training, and returns
+// the totals of all passes.
+RenderStats trainGuide(const Scene& scene, MISIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, PathGuide& guide, int passes);
@@ -0,0 +1,216 @@
+/*
+Contains the hash grid of the radiance cache and the build pass.
+
+*/
+
+#include "radianceCache.h"
+#include "renderer.h"
+#include "scene.h"
+#include "image.h"
+#include <cmath>
+#include <algorithm>
+
+// Recordings are summed as integers in units of 1 / fixedPointScale, which keeps the atomic adds exact
+const double fixedPointScale = 65536.0;
+const double maxRecordedValue = 1e6;
+
+// Grid coordinates get 20 bits per axis in a key, which leaves 3 bits for the facing axis
+const int coordinateBits = 20;
+const long long maxCoordinate = (1LL << coordinateBits) - 1;
+
+// A cell further than this from where its key hashes to is not looked for
+const int maxProbes = 32;
+
+struct RadianceCache::Cell
+{
+    std::atomic<unsigned long long> key{0};     // 0 for an unused cell
+    std::atomic<unsigned long long> sum[3] = {{0}, {0}, {0}};
+    std::atomic<unsigned int> records{0};
+};
+
+RadianceCache::RadianceCache(const RadianceCacheSettings& settings) : config(settings) {}
+
+RadianceCache::~RadianceCache() = default;
+
+void RadianceCache::reset(const Scene& scene)
+{
+    bounds = AABB();
+    if (!scene.objectBVH.empty())
+        bounds.grow(scene.objectBVH.nodes[0].bounds);
+    if (!scene.instanceBVH.empty())
+        bounds.grow(scene.instanceBVH.nodes[0].bounds);
+    if (bounds.empty())
+        bounds.grow(Point(0, 0, 0));
+
+    Vec3 extent = bounds.upper - bounds.lower;
+    double largest = std::max(extent.x(), std::max(extent.y(), extent.z()));
+    cellEdge = std::max(largest * config.cellSize, 1e-6);
+
+    config.tableBits = std::clamp(config.tableBits, 4, 28);
+    cells = std::make_unique<Cell[]>(size_t(1) << config.tableBits);
+    dropped.store(0, std::memory_order_relaxed);
+}
+
+// splitmix64's finalizer, which spreads neighbouring grid coordinates over the whole table
+static unsigned long long mixBits(unsigned long long x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+unsigned long long RadianceCache::cellKey(const Point& p, const Vec3& normal) const
+{
+    Vec3 offset = p - bounds.lower;
+    unsigned long long key = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        long long c = std::clamp((long long)std::floor(offset[axis] / cellEdge), 0LL, maxCoordinate);
+        key |= (unsigned long long)c << (axis * coordinateBits);
+    }
+
+    // the axis the normal points along most, and which way
+    int axis = 0;
+    for (int i = 1; i < 3; i++)
+    {
+        if (std::fabs(normal[i]) > std::fabs(normal[axis]))
+            axis = i;
+    }
+    unsigned long long facing = axis * 2 + (normal[axis] < 0 ? 1 : 0);
+    key |= facing << (3 * coordinateBits);
+
+    // 0 marks an unused cell
+    return key + 1;
+}
+
+const RadianceCache::Cell* RadianceCache::findCell(unsigned long long key) const
+{
+    if (!cells)
+        return nullptr;
+
+    const size_t mask = (size_t(1) << config.tableBits) - 1;
+    size_t slot = mixBits(key) & mask;
+    for (int probe = 0; probe < maxProbes; probe++, slot = (slot + 1) & mask)
+    {
+        unsigned long long found = cells[slot].key.load(std::memory_order_acquire);
+        if (found == key)
+            return &cells[slot];
+        if (found == 0)
+            return nullptr;
+    }
+    return nullptr;
+}
+
+RadianceCache::Cell* RadianceCache::claimCell(unsigned long long key)
+{
+    if (!cells)
+        return nullptr;
+
+    const size_t mask = (size_t(1) << config.tableBits) - 1;
+    size_t slot = mixBits(key) & mask;
+    for (int probe = 0; probe < maxProbes; probe++, slot = (slot + 1) & mask)
+    {
+        unsigned long long found = cells[slot].key.load(std::memory_order_acquire);
+        if (found == 0 && cells[slot].key.compare_exchange_strong(found, key, std::memory_order_acq_rel))
+            return &cells[slot];
+
+        // either the slot was used already, or another thread just claimed it (found is now its key)
+        if (found == key)
+            return &cells[slot];
+    }
+    return nullptr;
+}
+
+bool RadianceCache::lookup(const Point& p, const Vec3& normal, Color& value) const
+{
+    const Cell* cell = findCell(cellKey(p, normal));
+    if (cell == nullptr)
+        return false;
+
+    unsigned int records = cell->records.load(std::memory_order_relaxed);
+    if (records == 0 || int(records) < config.minRecords)
+        return false;
+
+    double scale = 1.0 / (fixedPointScale * records);
+    value = Color(cell->sum[0].load(std::memory_order_relaxed) * scale,
+        cell->sum[1].load(std::memory_order_relaxed) * scale,
+        cell->sum[2].load(std::memory_order_relaxed) * scale);
+    return true;
+}
+
+void RadianceCache::record(const Point& p, const Vec3& normal, const Color& reflected, const Vec3& throughput)
+{
+    Cell* cell = claimCell(cellKey(p, normal));
+    if (cell == nullptr)
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    for (int c = 0; c < 3; c++)
+    {
+        // a channel the vertex does not reflect says nothing about the light arriving in it
+        double value = throughput[c] > 1e-12 ? std::max(0.0, reflected[c] / throughput[c]) : 0.0;
+        unsigned long long amount = (unsigned long long)(std::min(value, maxRecordedValue) * fixedPointScale + 0.5);
+        cell->sum[c].fetch_add(amount, std::memory_order_relaxed);
+    }
+    cell->records.fetch_add(1, std::memory_order_relaxed);
+}
+
+int RadianceCache::usableCells() const
+{
+    int usable = 0;
+    const size_t count = cells ? size_t(1) << config.tableBits : 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned int records = cells[i].records.load(std::memory_order_relaxed);
+        if (records > 0 && int(records) >= config.minRecords)
+            usable++;
+    }
+    return usable;
+}
+
+unsigned long long RadianceCache::recordCount() const
+{
+    unsigned long long total = 0;
+    const size_t count = cells ? size_t(1) << config.tableBits : 0;
+    for (size_t i = 0; i < count; i++)
+        total += cells[i].records.load(std::memory_order_relaxed);
+    return total;
+}
+
+void printCacheSummary(std::ostream& out, const RadianceCache& cache)
+{
+    out << "Radiance cache: " << cache.usableCells() << " usable cells, " << cache.recordCount()
+        << " recordings, " << cache.droppedCount() << " dropped, looked up at depth " << cache.settings().depth
+        << std::endl;
+    if (cache.droppedCount() > 0)
+    {
+        std::cerr << "Warning: The radiance cache's table of 2^" << cache.settings().tableBits << " cells is full, "
+            << cache.droppedCount() << " recordings were dropped (raise --cache-bits or --cache-cell)\n";
+    }
+}
+
+RenderStats buildRadianceCache(const Scene& scene, MISIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, RadianceCache& cache, int samples)
+{
+    RenderSettings build = settings;
+    build.showProgress = false;
+    build.progressiveOutput.clear();
+    build.heatmapPrefix.clear();
+    build.denoise = false;
+    build.sampleCount = std::max(samples, 1);
+    build.firstSample = settings.firstSample + settings.sampleCount;
+
+    bool cropped = settings.cropWidth > 0 && settings.cropHeight > 0;
+    Image image(cropped ? settings.cropWidth : settings.imageWidth, cropped ? settings.cropHeight : settings.imageHeight);
+
+    integrator.radianceCache = &cache;
+    cache.setRecording(true);
+    RenderStats stats = renderImage(scene, integrator, camera, build, image);
+    cache.setRecording(false);
+    return stats;
+}
@@ -0,0 +1,114 @@
+/*
+Contains the radiance cache: a spatial hash grid of the light that diffuse surfaces reflect, which lets
+MISIntegrator end paths early (see MISIntegrator::radianceCache).
+
+A cell is a cube of the grid together with the axis its surfaces face, so the floor and the ceiling of a thin slab
+do not share one. Every cell holds the average of the light that paths found after a diffuse vertex in it, divided
+by the vertex's albedo so that it can be multiplied by the albedo of the vertex looking it up.
+
+The cache is built by a short render that records, at the surface a path would look the cache up at, what the rest
+of the path found. The paths of the real render then stop at that surface and take the cell's average instead of
+tracing the remaining bounces. This is biased: a cell returns the same value all over its cube, so light is
+blurred across the cell and a few recordings are noisy. Smaller cells and more recording samples trade speed for
+quality, and looking up later in the path hides more of the blur behind the bounces before it.
+
+Recording is lock free, like the path guide's: cells are claimed in an open addressing table with compare and
+swap, and the sums are fixed point atomic counters, so a seeded build gives the same cache with any number of
+threads.
+
+*/
+
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <iostream>
+#include "lightTransport.h"
+#include "bvh.h"
+
+class Scene;
+struct Camera;
+struct RenderSettings;
+struct RenderStats;
+
+struct RadianceCacheSettings
+{
+    // Edge of a grid cell as a fraction of the largest extent of the scene's bounds
+    double cellSize = 0.02;
+
+    // Paths look the cache up at their depth-th surface (1 is the first hit), if that surface is diffuse. The
+    // default is the second bounce, so the directly visible surfaces keep their own detail.
+    int depth = 2;
+
+    // A cell with fewer recordings than this is treated as missing, and paths through it trace on
+    int minRecords = 8;
+
+    // The table has 2^tableBits cells. Recordings into a full table are dropped.
+    int tableBits = 18;
+};
+
+class RadianceCache
+{
+    public:
+
+    explicit RadianceCache(const RadianceCacheSettings& settings = RadianceCacheSettings());
+    ~RadianceCache();
+    RadianceCache(const RadianceCache&) = delete;
+    RadianceCache& operator=(const RadianceCache&) = delete;
+
+    // Empties the cache and fits its grid to the scene's bounds. The scene needs build() first.
+    void reset(const Scene& scene);
+
+    // While recording, MISIntegrator records into the cache instead of looking it up
+    void setRecording(bool on) { recording = on; }
+    bool isRecording() const { return recording; }
+
+    const RadianceCacheSettings& settings() const { return config; }
+
+    // Whether MISIntegrator looks up (or records) at this vertex: a diffuse surface at the configured depth
+    bool caches(const BSDF& bsdf, int depth) const
+    {
+        return bsdf.type() == BSDFType::Diffuse && depth + 1 == config.depth;
+    }
+
+    // The light reflected by the cell of this point and normal, per unit albedo. False if the cell has not
+    // recorded enough to be used.
+    bool lookup(const Point& p, const Vec3& normal, Color& value) const;
+
+    // Adds the light a path found after a vertex to the cell. `reflected` is what the path collected after the
+    // vertex and `throughput` the path's throughput at the vertex times its albedo, so reflected / throughput
+    // (per channel) is the vertex's reflected light per unit albedo.
+    void record(const Point& p, const Vec3& normal, const Color& reflected, const Vec3& throughput);
+
+    // Cells that have recorded at least minRecords, and recordings in total
+    int usableCells() const;
+    unsigned long long recordCount() const;
+
+    // Recordings lost because the table was full. The cells they missed trace on, so they only cost time.
+    unsigned long long droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+    private:
+
+    struct Cell;
+
+    unsigned long long cellKey(const Point& p, const Vec3& normal) const;
+    const Cell* findCell(unsigned long long key) const;
+    Cell* claimCell(unsigned long long key);
+
+    RadianceCacheSettings config;
+    bool recording = false;
+
+    AABB bounds;
+    double cellEdge = 1;
+    std::unique_ptr<Cell[]> cells;
+    std::atomic<unsigned long long> dropped{0};
+};
+
+// One line about the cache's size, for after building it, and a warning on std::cerr if recordings were dropped
+void printCacheSummary(std::ostream& out, const RadianceCache& cache);
+
+// Builds the cache for a render with these settings: renders `samples` spp at the render's resolution and crop
+// while recording, seeded after the render's own samples. The image is thrown away. Leaves the cache in the
+// integrator, not recording, and returns the render's totals.
+RenderStats buildRadianceCache(const Scene& scene, MISIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, RadianceCache& cache, int samples);
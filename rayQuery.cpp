@@ -0,0 +1,217 @@
+/*
+Contains the ray query scene and its batched queries.
+
+*/
+
+#include "rayQuery.h"
+#include <iostream>
+
+#include <omp.h>
+
+void RayBatch::resize(size_t count)
+{
+    for (std::vector<double>* column : {&originX, &originY, &originZ, &directionX, &directionY, &directionZ})
+        column->resize(count, 0.0);
+    maxT.resize(count, 99999999.0);
+}
+
+void RayBatch::set(size_t i, const Ray& r, double rayMaxT)
+{
+    originX[i] = r.origin().x();
+    originY[i] = r.origin().y();
+    originZ[i] = r.origin().z();
+    directionX[i] = r.direction().x();
+    directionY[i] = r.direction().y();
+    directionZ[i] = r.direction().z();
+    maxT[i] = rayMaxT;
+}
+
+Ray RayBatch::ray(size_t i) const
+{
+    return Ray(Vec3(directionX[i], directionY[i], directionZ[i]), Point(originX[i], originY[i], originZ[i]));
+}
+
+void HitBatch::resize(size_t count)
+{
+    for (std::vector<double>* column : {&t, &u, &v, &normalX, &normalY, &normalZ})
+        column->resize(count);
+    for (std::vector<int>* column : {&geometry, &instance, &primitive})
+        column->resize(count);
+}
+
+// Appends the vertices and triangles of an indexed triangle list, through reserve so the owner can keep the
+// pointers of its earlier triangles valid (see Scene::reserveVertices)
+template <typename ReserveFunction>
+static void appendTriangles(std::vector<Vertex>& vertices, std::vector<Triangle>& triangles,
+    const std::vector<double>& positions, const std::vector<int>& indices, BSDF* material, ReserveFunction reserve)
+{
+    const size_t first = vertices.size();
+    reserve(positions.size() / 3);
+    for (size_t i = 0; i + 2 < positions.size(); i += 3)
+        vertices.push_back(Vertex(Point(positions[i], positions[i + 1], positions[i + 2]), Color(1, 1, 1), Vec3()));
+
+    for (size_t i = 0; i + 2 < indices.size(); i += 3)
+    {
+        triangles.push_back(Triangle(&vertices[first + indices[i]], &vertices[first + indices[i + 1]],
+            &vertices[first + indices[i + 2]], Color(0, 0, 0), material));
+    }
+}
+
+RayQueryScene::RayQueryScene()
+{
+    material = world.addMaterial<simpleDiffuseBSDF>();
+}
+
+bool RayQueryScene::checkTriangles(const std::vector<double>& positions, const std::vector<int>& indices) const
+{
+    if (positions.size() % 3 != 0 || indices.size() % 3 != 0)
+    {
+        std::cerr << "Error: Triangle positions and indices must come in threes\n";
+        return false;
+    }
+    for (int index : indices)
+    {
+        if (index < 0 || size_t(index) >= positions.size() / 3)
+        {
+            std::cerr << "Error: Triangle index " << index << " is out of range\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+int RayQueryScene::addTriangles(const std::vector<double>& positions, const std::vector<int>& indices)
+{
+    if (!checkTriangles(positions, indices))
+        return -1;
+
+    ObjectGroup group;
+    group.name = "geometry " + std::to_string(world.groups.size());
+    group.firstVertex = world.vertices.size();
+    group.firstTriangle = world.objects.size();
+
+    appendTriangles(world.vertices, world.objects, positions, indices, material,
+        [&](size_t n) { world.reserveVertices(n); });
+
+    group.vertexCount = world.vertices.size() - group.firstVertex;
+    group.triangleCount = world.objects.size() - group.firstTriangle;
+    world.groups.push_back(group);
+    return int(world.groups.size()) - 1;
+}
+
+int RayQueryScene::addObj(const std::string& file)
+{
+    readObj(file, world, Color(1, 1, 1), Color(0, 0, 0), material);
+    if (world.groups.back().triangleCount == 0)
+    {
+        world.groups.pop_back();
+        return -1;
+    }
+    return int(world.groups.size()) - 1;
+}
+
+int RayQueryScene::addMesh(const std::vector<double>& positions, const std::vector<int>& indices)
+{
+    if (!checkTriangles(positions, indices))
+        return -1;
+
+    Mesh* mesh = world.addMesh();
+    appendTriangles(mesh->vertices, mesh->triangles, positions, indices, material,
+        [&](size_t n) { mesh->reserveVertices(n); });
+    return int(world.meshes.size()) - 1;
+}
+
+int RayQueryScene::addInstance(int mesh, const Transform& objectToWorld)
+{
+    if (mesh < 0 || size_t(mesh) >= world.meshes.size())
+    {
+        std::cerr << "Error: There is no mesh " << mesh << "\n";
+        return -1;
+    }
+    world.addInstance(world.meshes[mesh].get(), objectToWorld);
+    instanceMeshes.push_back(mesh);
+    return int(world.instances.size()) - 1;
+}
+
+void RayQueryScene::build()
+{
+    world.build();
+}
+
+bool RayQueryScene::setInstanceTransform(int instance, const Transform& objectToWorld)
+{
+    if (instance < 0 || size_t(instance) >= world.instances.size())
+    {
+        std::cerr << "Error: There is no instance " << instance << "\n";
+        return false;
+    }
+    Instance& placed = world.instances[instance];
+    placed.objectToWorld = objectToWorld;
+    placed.worldToObject = objectToWorld.inverse();
+    return true;
+}
+
+void RayQueryScene::update()
+{
+    world.refit(1.5, false);
+}
+
+void RayQueryScene::intersect(const RayBatch& rays, HitBatch& hits) const
+{
+    const long count = long(rays.size());
+    hits.resize(count);
+
+    #pragma omp parallel for schedule(dynamic, 256) num_threads(threads > 0 ? threads : omp_get_max_threads())
+    for (long i = 0; i < count; i++)
+    {
+        double t = rays.maxT[i];
+        int primitive, instance;
+        Vec3 barycentrics;
+        if (!world.closestHit(rays.ray(i), t, primitive, instance, barycentrics))
+        {
+            hits.t[i] = -1.0;
+            hits.geometry[i] = hits.instance[i] = hits.primitive[i] = -1;
+            hits.u[i] = hits.v[i] = 0.0;
+            hits.normalX[i] = hits.normalY[i] = hits.normalZ[i] = 0.0;
+            continue;
+        }
+
+        const Triangle& tri = instance < 0 ? world.objects[primitive]
+            : world.instances[instance].mesh->triangles[primitive];
+
+        // rays only hit the front, which faces the way of the edges' cross product
+        Vec3 normal = cross(tri.b->pt - tri.a->pt, tri.c->pt - tri.a->pt);
+        int geometry;
+        if (instance < 0)
+        {
+            geometry = world.groupOf(size_t(primitive));
+            primitive -= int(world.groups[geometry].firstTriangle);
+        }
+        else
+        {
+            geometry = instanceMeshes[instance];
+            normal = Transform::applyNormal(world.instances[instance].worldToObject, normal);
+        }
+        normal = unit(normal);
+
+        hits.t[i] = t;
+        hits.geometry[i] = geometry;
+        hits.instance[i] = instance;
+        hits.primitive[i] = primitive;
+        hits.u[i] = barycentrics[0];
+        hits.v[i] = barycentrics[1];
+        hits.normalX[i] = normal.x();
+        hits.normalY[i] = normal.y();
+        hits.normalZ[i] = normal.z();
+    }
+}
+
+void RayQueryScene::occluded(const RayBatch& rays, std::vector<char>& blocked) const
+{
+    const long count = long(rays.size());
+    blocked.resize(count);
+
+    #pragma omp parallel for schedule(dynamic, 256) num_threads(threads > 0 ? threads : omp_get_max_threads())
+    for (long i = 0; i < count; i++)
+        blocked[i] = world.occluded(rays.ray(i), rays.maxT[i]) ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+/*
+Contains the ray query interface: the renderer's ray casting (the two level BVH of Scene and its triangle test)
+without any of its shading, for tools like bakers and collision checks that only need to know what rays hit.
+
+A RayQueryScene is filled with triangles from arrays or obj files, placed directly or through instances of shared
+meshes, and built once. Queries then go in batches: a RayBatch of rays in, a HitBatch (or one flag per ray) out,
+both stored as structures of arrays so callers can hand whole columns to their own vectorized code. A batch is
+split over the threads with OpenMP, and the results do not depend on the thread count.
+
+Only render.cpp has a main, so every other file compiles into a library whose interface is this header.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include "object.h"
+#include "scene.h"
+
+// Rays as a structure of arrays. A ray's hits count from its origin up to maxT, in units of the direction's length.
+struct RayBatch
+{
+    std::vector<double> originX, originY, originZ;
+    std::vector<double> directionX, directionY, directionZ;
+    std::vector<double> maxT;
+
+    size_t size() const { return originX.size(); }
+
+    // New rays are left zero, with maxT at 99999999 like the renderer's rays
+    void resize(size_t count);
+
+    void set(size_t i, const Ray& r, double rayMaxT = 99999999.0);
+    Ray ray(size_t i) const;
+};
+
+// What the rays of a RayBatch hit first, as a structure of arrays with one entry per ray
+struct HitBatch
+{
+    std::vector<double> t;              // distance in units of the ray's direction, -1 if the ray hit nothing
+    std::vector<int> geometry;          // id from addTriangles or addObj, or the instance's mesh id; -1 on a miss
+    std::vector<int> instance;          // id from addInstance, -1 for triangles placed directly
+    std::vector<int> primitive;         // the triangle's index in its geometry or mesh
+    std::vector<double> u, v;           // the barycentric weights of the triangle's second and third vertex
+    std::vector<double> normalX, normalY, normalZ;     // unit world space normal of the side that was hit
+
+    size_t size() const { return t.size(); }
+    void resize(size_t count);
+};
+
+class RayQueryScene
+{
+    public:
+
+    RayQueryScene();
+
+    // Threads a batch is split over; 0 uses OpenMP's default
+    int threads = 0;
+
+    // Adds world space triangles. positions holds x, y, z of every vertex and every three indices make a
+    // triangle, whose front (the only side rays hit) is the one its vertices go counterclockwise around. Returns
+    // the geometry's id, or -1 after printing an error.
+    int addTriangles(const std::vector<double>& positions, const std::vector<int>& indices);
+
+    // Adds the triangles of an obj file to the world. Returns the geometry's id, or -1 if it has no triangles.
+    int addObj(const std::string& file);
+
+    // Adds triangles in their own space that are only placed by addInstance; same arguments as addTriangles.
+    // Returns the mesh's id, or -1.
+    int addMesh(const std::vector<double>& positions, const std::vector<int>& indices);
+
+    // Places a mesh in the world. Returns the instance's id, or -1.
+    int addInstance(int mesh, const Transform& objectToWorld);
+
+    // Builds the BVHs. Call it once everything is added, before any query.
+    void build();
+
+    // Moves an instance. Call update() after moving instances and before the next query. Returns false after
+    // printing an error if there is no such instance.
+    bool setInstanceTransform(int instance, const Transform& objectToWorld);
+    void update();
+
+    // The closest hit of every ray
+    void intersect(const RayBatch& rays, HitBatch& hits) const;
+
+    // Whether anything is hit by each ray before its maxT (1) or not (0), which is cheaper than intersect since
+    // the search stops at the first hit
+    void occluded(const RayBatch& rays, std::vector<char>& blocked) const;
+
+    const Scene& scene() const { return world; }
+
+    private:
+
+    bool checkTriangles(const std::vector<double>& positions, const std::vector<int>& indices) const;
+
+    Scene world;
+    BSDF* material;                     // Scene's triangles need one; queries never look at it
+    std::vector<int> instanceMeshes;
+};
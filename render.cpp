@@ -19,276 +19,733 @@ Currently, it is very easily to change out what materials are used for what mesh
 #include "bmp.h"
 #include "object.h"
 #include "lightTransport.h"
+#include "scene.h"
+#include "renderer.h"
+#include "benchmark.h"
+#include "sceneGenerator.h"
+#include "sequence.h"
+#include "distributed.h"
+#include "server.h"
+#include "timeBudget.h"
+#include "outOfCore.h"
+#include "pathGuiding.h"
+#include "radianceCache.h"
+#include "bdpt.h"
+#include "batch.h"
+#include "texture.h"
+#include "counters.h"
+#include "trace.h"
 #include <vector>
 #include <iostream>
 #include <chrono>
-#include <limits>
-#include <fstream>
+#include <string>
 #include <sstream>
 
-#include <atomic>
-#include <iomanip>
+using namespace std;
 
-#include <omp.h>
+// parses a comma separated list like "1,2,4,8"
+static vector<int> parseIntList(const string& text)
+{
+    vector<int> values;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        if (!item.empty())
+            values.push_back(stoi(item));
+    }
+    return values;
+}
 
-using namespace std;
+// parses a vector like "0,0.5,-1"
+static Vec3 parseVec3(const string& text)
+{
+    double v[3] = {0, 0, 0};
+    stringstream ss(text);
+    string item;
+    for (int i = 0; i < 3 && getline(ss, item, ','); i++)
+        v[i] = stod(item);
+    return Vec3(v[0], v[1], v[2]);
+}
 
+// handles the options that configure the integrator, shared by the modes that render
+static bool parseIntegratorOption(const string& arg, int& a, int argc, char** argv, MISIntegrator& integrator)
+{
+    bool hasValue = a + 1 < argc;
+    if (arg == "--depth" && hasValue) integrator.maxDepth = stoi(argv[++a]);
+    else if (arg == "--rr") integrator.russianRoulette = true;
+    else if (arg == "--rr-depth" && hasValue) integrator.rrMinDepth = stoi(argv[++a]);
+    else if (arg == "--split" && hasValue) integrator.maxSplit = stoi(argv[++a]);
+    else if (arg == "--split-depth" && hasValue) integrator.splitDepth = stoi(argv[++a]);
+    else if (arg == "--no-nee") integrator.lightSampling = false;
+    else if (arg == "--balance") integrator.heuristic = MISHeuristic::Balance;
+    else return false;
+    return true;
+}
 
-void readObj(string filename, vector<Vertex>& vertices, vector<Triangle>& mesh, vector<Triangle>& lights, Color c, Color e, BSDF& material);
+static const char* integratorUsage = "[--depth n] [--rr] [--rr-depth n] [--split n] [--split-depth n] [--no-nee] [--balance]";
 
-int main () {
-    auto start = std::chrono::high_resolution_clock::now();
+// handles the path guiding options of the modes that can train a guide
+static bool parseGuidingOption(const string& arg, int& a, int argc, char** argv, bool& guiding,
+    GuidingSettings& settings)
+{
+    bool hasValue = a + 1 < argc;
+    if (arg == "--guide") guiding = true;
+    else if (arg == "--guide-fraction" && hasValue) settings.bsdfFraction = stod(argv[++a]);
+    else if (arg == "--guide-threshold" && hasValue) settings.spatialThreshold = stod(argv[++a]);
+    else return false;
+    return true;
+}
 
-    // Image setup
-    int imageWidth = 2000;
-    int imageHeight = 2000;
+static const char* guidingUsage = "[--guide [--guide-fraction f] [--guide-threshold n]]";
 
-    Image testImage(imageWidth,imageHeight);
+// handles the radiance cache options of the modes that can build a cache
+static bool parseCacheOption(const string& arg, int& a, int argc, char** argv, bool& caching,
+    RadianceCacheSettings& settings, int& samples)
+{
+    bool hasValue = a + 1 < argc;
+    if (arg == "--cache") caching = true;
+    else if (arg == "--cache-spp" && hasValue) samples = stoi(argv[++a]);
+    else if (arg == "--cache-cell" && hasValue) settings.cellSize = stod(argv[++a]);
+    else if (arg == "--cache-depth" && hasValue) settings.depth = stoi(argv[++a]);
+    else if (arg == "--cache-min" && hasValue) settings.minRecords = stoi(argv[++a]);
+    else if (arg == "--cache-bits" && hasValue) settings.tableBits = stoi(argv[++a]);
+    else return false;
+    return true;
+}
 
-    // Camera setup
-    double viewPortWidth = 1;
-    double viewPortHeight = 1;
-    Point cameraOrigin(0,0,1.0);
+static const char* cacheUsage =
+    "[--cache [--cache-spp n] [--cache-cell f] [--cache-depth n] [--cache-min n] [--cache-bits n]]";
 
-    // Number of samples per pixel
-    int sampleCount = 30;
+// handles the texture cache option of the modes that load obj files, whose materials may have textures
+static bool parseTextureOption(const string& arg, int& a, int argc, char** argv)
+{
+    bool hasValue = a + 1 < argc;
+    if (arg == "--texture-budget" && hasValue) setTextureCacheBudget(size_t(stod(argv[++a]) * 1024 * 1024));
+    else return false;
+    return true;
+}
 
-    // Initialization of data structures to store scene
-    // (Triangle objects contain pointers to vertices)
-    vector<Triangle> objects;
-    vector<Triangle> lights;
+static const char* textureUsage = "[--texture-budget MB]";
 
-    // Stores all vertices continguously in memory for performance
-    vector<Vertex> vertices;
+// one line about the texture cache, if the scene had any textures
+static void printTextureSummary()
+{
+    TextureCacheStats stats = textureCacheStats();
+    if (stats.textures > 0)
+        printTextureCacheStats(cout, stats);
+}
 
-    // Pre allocates space, since the file reading does not work well when it has to dynamically allocate memory
-    vertices.reserve(20000);
+static int runBenchmarkMode(int argc, char** argv)
+{
+    ThroughputBenchmarkConfig config;
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--scene" && hasValue) config.scene = argv[++a];
+        else if (arg == "--scale" && hasValue) config.stressScale = stod(argv[++a]);
+        else if (arg == "--threads" && hasValue) config.threadCounts = parseIntList(argv[++a]);
+        else if (arg == "--sizes" && hasValue) config.imageSizes = parseIntList(argv[++a]);
+        else if (arg == "--spp" && hasValue) config.sampleCount = stoi(argv[++a]);
+        else if (parseIntegratorOption(arg, a, argc, argv, config.integrator)) {}
+        else if (arg == "--seed" && hasValue) config.seed = stoul(argv[++a]);
+        else if (arg == "--repeat" && hasValue) config.repetitions = stoi(argv[++a]);
+        else if (arg == "--csv" && hasValue) config.csvFile = argv[++a];
+        else if (arg == "--progress") config.showProgress = true;
+        else if (arg == "--pin") config.pinThreads = true;
+        else if (arg == "--numa-replicas") config.replicas = true;
+        else if (arg == "--generic") config.specializedKernels = false;
+        else if (arg == "--compare-kernels") config.compareKernels = true;
+        else if (parseTextureOption(arg, a, argc, argv)) {}
+        else
+        {
+            cerr << "Unknown benchmark option " << arg << "\n"
+                << "usage: render --benchmark [--scene default|stress|stress-instanced|file.obj] [--scale s] [--threads 1,2,4] [--sizes 256,512] [--spp n] "
+                << "[--seed n] [--repeat n] [--csv file] [--progress] [--pin] [--numa-replicas] [--generic] [--compare-kernels] " << integratorUsage << " "
+                << textureUsage << "\n";
+            return 1;
+        }
+    }
+    int result = runThroughputBenchmark(config);
+    printTextureSummary();
+    return result;
+}
 
-    //Material (BSDF) initialization
+static int runConvergenceMode(int argc, char** argv)
+{
+    ConvergenceBenchmarkConfig config;
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--scene" && hasValue) config.scene = argv[++a];
+        else if (arg == "--scale" && hasValue) config.stressScale = stod(argv[++a]);
+        else if (arg == "--size" && hasValue) config.imageSize = stoi(argv[++a]);
+        else if (arg == "--threads" && hasValue) config.threads = stoi(argv[++a]);
+        else if (arg == "--seed" && hasValue) config.seed = stoul(argv[++a]);
+        else if (arg == "--reference" && hasValue) config.referenceFile = argv[++a];
+        else if (arg == "--reference-spp" && hasValue) config.referenceSampleCount = stoi(argv[++a]);
+        else if (arg == "--reference-depth" && hasValue) config.referenceMaxDepth = stoi(argv[++a]);
+        else if (parseIntegratorOption(arg, a, argc, argv, config.integrator)) {}
+        else if (parseGuidingOption(arg, a, argc, argv, config.guiding, config.guidingSettings)) {}
+        else if (parseCacheOption(arg, a, argc, argv, config.radianceCache, config.cacheSettings,
+            config.cacheSampleCount)) {}
+        else if (arg == "--max-spp" && hasValue) config.maxSampleCount = stoi(argv[++a]);
+        else if (arg == "--target-rmse" && hasValue) config.targetRMSE = stod(argv[++a]);
+        else if (arg == "--label" && hasValue) config.label = argv[++a];
+        else if (arg == "--denoise") config.denoise = true;
+        else if (arg == "--bdpt") config.bdpt = true;
+        else if (arg == "--csv" && hasValue) config.csvFile = argv[++a];
+        else if (parseTextureOption(arg, a, argc, argv)) {}
+        else
+        {
+            cerr << "Unknown convergence option " << arg << "\n"
+                << "usage: render --convergence [--scene default|stress|stress-instanced|file.obj] [--scale s] [--size n] [--threads n] [--seed n] [--reference file.pfm] "
+                << "[--reference-spp n] [--reference-depth n] [--max-spp n] [--target-rmse e] "
+                << "[--label name] [--csv file] [--denoise] [--bdpt] " << integratorUsage << " " << guidingUsage << " "
+                << cacheUsage << " " << textureUsage << "\n";
+            return 1;
+        }
+    }
+    int result = runConvergenceBenchmark(config);
+    printTextureSummary();
+    return result;
+}
 
-    //phongBSDF DiffuseReflector = phongBSDF();
-    //DiffuseReflector.phongExponent = 1;
-    mirrorBSDF ShinyReflector = mirrorBSDF();
+// Generates the stress scene and writes it out as <out>.obj and <out>_lights.obj
+static int runGenerateMode(int argc, char** argv)
+{
+    StressSceneConfig config;
+    string out = "stress";
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--scale" && hasValue) config.scale = stod(argv[++a]);
+        else if (arg == "--seed" && hasValue) config.seed = stoul(argv[++a]);
+        else if (arg == "--lights" && hasValue) config.lightCount = stoi(argv[++a]);
+        else if (arg == "--grid" && hasValue) config.gridSize = stoi(argv[++a]);
+        else if (arg == "--out" && hasValue) out = argv[++a];
+        else
+        {
+            cerr << "Unknown generate option " << arg << "\n"
+                << "usage: render --generate [--scale s] [--seed n] [--lights n] [--grid n] [--out name]\n";
+            return 1;
+        }
+    }
 
-    simpleDiffuseBSDF DiffuseReflector = simpleDiffuseBSDF();
+    auto start = std::chrono::high_resolution_clock::now();
+    Scene scene;
+    generateStressScene(scene, config);
+    scene.build();
+    std::chrono::duration<double> generateTime = std::chrono::high_resolution_clock::now() - start;
+
+    cout << "Generated " << scene.objects.size() << " triangles (" << scene.lights.size() << " emissive) and "
+        << scene.vertices.size() << " vertices in " << generateTime.count() << " seconds" << endl;
+
+    start = std::chrono::high_resolution_clock::now();
+    if (!writeObj(scene, out + ".obj", ObjContents::NonEmissive) || !writeObj(scene, out + "_lights.obj", ObjContents::Emissive))
+        return 1;
+    std::chrono::duration<double> writeTime = std::chrono::high_resolution_clock::now() - start;
+    cout << "Wrote " << out << ".obj and " << out << "_lights.obj in " << writeTime.count() << " seconds" << endl;
+    return 0;
+}
 
-    MISIntegrator integrator = MISIntegrator();
-    integrator.maxDepth = 6;
+static int runSequenceMode(int argc, char** argv)
+{
+    SequenceConfig config;
+    bool spinGiven = false;
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--scene" && hasValue) config.scene = argv[++a];
+        else if (arg == "--scale" && hasValue) config.stressScale = stod(argv[++a]);
+        else if (arg == "--frames" && hasValue) config.frames = stoi(argv[++a]);
+        else if (arg == "--width" && hasValue) config.imageWidth = stoi(argv[++a]);
+        else if (arg == "--height" && hasValue) config.imageHeight = stoi(argv[++a]);
+        else if (arg == "--spp" && hasValue) config.sampleCount = stoi(argv[++a]);
+        else if (arg == "--threads" && hasValue) config.threads = stoi(argv[++a]);
+        else if (arg == "--seed" && hasValue) config.seed = stoul(argv[++a]);
+        else if (parseIntegratorOption(arg, a, argc, argv, config.integrator)) {}
+        else if (arg == "--camera-move" && hasValue) config.cameraMove = parseVec3(argv[++a]);
+        else if (arg == "--camera-yaw" && hasValue) config.cameraYaw = stod(argv[++a]);
+        else if (arg == "--spin" && hasValue)
+        {
+            // the first --spin replaces the default group
+            if (!spinGiven)
+                config.spinGroups.clear();
+            spinGiven = true;
+            config.spinGroups.push_back(argv[++a]);
+        }
+        else if (arg == "--spin-degrees" && hasValue) config.spinDegrees = stod(argv[++a]);
+        else if (arg == "--bob" && hasValue) config.instanceBob = stod(argv[++a]);
+        else if (arg == "--max-cost-ratio" && hasValue) config.maxCostRatio = stod(argv[++a]);
+        else if (arg == "--rebuild-every" && hasValue) config.rebuildInterval = stoi(argv[++a]);
+        else if (arg == "--out" && hasValue) config.outputPrefix = argv[++a];
+        else if (arg == "--csv" && hasValue) config.csvFile = argv[++a];
+        else if (arg == "--progress") config.showProgress = true;
+        else if (parseTextureOption(arg, a, argc, argv)) {}
+        else
+        {
+            cerr << "Unknown sequence option " << arg << "\n"
+                << "usage: render --sequence [--scene default|stress|stress-instanced|file.obj] [--scale s] [--frames n] "
+                << "[--width n] [--height n] [--spp n] [--threads n] [--seed n] [--camera-move x,y,z] [--camera-yaw deg] "
+                << "[--spin group.obj] [--spin-degrees deg] [--bob height] [--max-cost-ratio r] [--rebuild-every n] "
+                << "[--out prefix] [--csv file] [--progress] " << integratorUsage << " " << textureUsage << "\n";
+            return 1;
+        }
+    }
+    int result = runSequence(config);
+    printTextureSummary();
+    return result;
+}
 
+// Splits a frame into work units in a jobs directory, for --worker processes to render and --merge to combine
+static int runDistributeMode(int argc, char** argv)
+{
+    DistributeConfig config;
+    WorkUnit& frame = config.frame;
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--jobs" && hasValue) config.jobsDirectory = argv[++a];
+        else if (arg == "--scene" && hasValue) frame.scene = argv[++a];
+        else if (arg == "--scale" && hasValue) frame.stressScale = stod(argv[++a]);
+        else if (arg == "--width" && hasValue) frame.imageWidth = stoi(argv[++a]);
+        else if (arg == "--height" && hasValue) frame.imageHeight = stoi(argv[++a]);
+        else if (arg == "--spp" && hasValue) frame.sampleCount = stoi(argv[++a]);
+        else if (arg == "--seed" && hasValue) frame.seed = stoul(argv[++a]);
+        else if (parseIntegratorOption(arg, a, argc, argv, frame.integrator)) {}
+        else if (arg == "--tile-size" && hasValue) config.tileSize = stoi(argv[++a]);
+        else if (arg == "--sample-splits" && hasValue) config.sampleSplits = stoi(argv[++a]);
+        else
+        {
+            cerr << "Unknown distribute option " << arg << "\n"
+                << "usage: render --distribute [--jobs dir] [--scene default|stress|stress-instanced|file.obj] [--scale s] "
+                << "[--width n] [--height n] [--spp n] [--seed n] [--tile-size n] [--sample-splits n] " << integratorUsage << "\n";
+            return 1;
+        }
+    }
+    return runDistribute(config);
+}
 
-    //Mesh creation
-    readObj("largebox.obj", vertices, objects, lights, Color(1.0,1.0,1.0), Color(0,0,0), DiffuseReflector);
-    readObj("leftwall.obj", vertices, objects, lights, Color(1.0,0.0,0.0), Color(0,0,0), DiffuseReflector);
-    readObj("rightwall.obj", vertices, objects, lights , Color(0.0,1.0,0.0), Color(0,0,0), DiffuseReflector);
+static int runWorkerMode(int argc, char** argv)
+{
+    string jobs = "jobs";
+    int threads = 0;
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--jobs" && hasValue) jobs = argv[++a];
+        else if (arg == "--threads" && hasValue) threads = stoi(argv[++a]);
+        else
+        {
+            cerr << "Unknown worker option " << arg << "\n" << "usage: render --worker [--jobs dir] [--threads n]\n";
+            return 1;
+        }
+    }
+    return runWorker(jobs, threads);
+}
 
-    readObj("box1.obj", vertices, objects, lights, Color(1.0,1.0,1.0), Color(0,0,0), DiffuseReflector);
-    readObj("widebox.obj", vertices, objects, lights, Color(1.0,1.0,0.6), Color(0,0,0), ShinyReflector);
-    
-    //
-    //readObj("light.obj", vertices, objects, lights, Color(1.0,1.0,0.6), 1*Color(10,10,6), DiffuseReflector);
-    readObj("smalllight.obj", vertices, objects, lights, Color(1.0,1.0,0.6), 30*Color(10,10,6), DiffuseReflector);
+// Returns the units of workers that died to pending
+static int runRequeueMode(int argc, char** argv)
+{
+    string jobs = "jobs";
+    double staleSeconds = 0;
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--jobs" && hasValue) jobs = argv[++a];
+        else if (arg == "--older-than" && hasValue) staleSeconds = stod(argv[++a]);
+        else
+        {
+            cerr << "Unknown requeue option " << arg << "\n"
+                << "usage: render --requeue [--jobs dir] [--older-than seconds]\n";
+            return 1;
+        }
+    }
+    return runRequeue(jobs, staleSeconds);
+}
 
+static int runMergeMode(int argc, char** argv)
+{
+    string jobs = "jobs";
+    string out = "merged";
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--jobs" && hasValue) jobs = argv[++a];
+        else if (arg == "--out" && hasValue) out = argv[++a];
+        else
+        {
+            cerr << "Unknown merge option " << arg << "\n" << "usage: render --merge [--jobs dir] [--out name]\n";
+            return 1;
+        }
+    }
+    return runMerge(jobs, out);
+}
 
-    // to handle progress bar 
-    std::atomic<int> pixelsDone(0);
-    
-    // Multithreading setup
-    int maxThreads = omp_get_max_threads();      
-    int useThreads = int(maxThreads * 0.9); // Set the float value to the % of CPU you want to use
-    if (useThreads < 1) useThreads = 1;
-    omp_set_num_threads(useThreads);
-
-    #pragma omp parallel for schedule(dynamic)
-    for (int i = 0; i < imageWidth; i++)
+static int runServeMode(int argc, char** argv)
+{
+    ServerConfig config;
+    for (int a = 2; a < argc; a++)
     {
-        for(int j = 0; j < imageHeight; j++)
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--socket" && hasValue) config.socketPath = argv[++a];
+        else if (arg == "--threads" && hasValue) config.threads = stoi(argv[++a]);
+        else
         {
-            std::random_device rd;
-            SimpleSampler sampler(rd() + j * imageWidth + i);
-            Color L = Color(0.0, 0.0, 0.0);
-            for (int k = 0; k < sampleCount; k++)
-            {
-                auto [du, dv] = sampler.get2D();
-                Point a = Point((i + 1.0*du - 0.5 - imageWidth/2.0) * (viewPortWidth / imageWidth), 
-                    (j + 1.0*dv - 0.5 - imageHeight/2.0) * (viewPortHeight / imageHeight), 0);
-                Ray r = Ray(a - cameraOrigin, cameraOrigin);
-                Color l = integrator.Li(objects, lights, r, sampler);
-                L += l;
-            }
-            L /= (double)sampleCount;
-            testImage.setColor(i, j, L);
-
-            // Progressively save the image as it renders, and update progress bar
-            int done = ++pixelsDone;
-            if (done % 100000 == 0 || done == imageHeight*imageWidth) {
-                float progress = (done / float(imageHeight*imageWidth)) * 100.0f;
-                #pragma omp critical
-                {
-                    std::cout << "\rProgress: " << std::fixed << std::setprecision(2)
-                            << progress << "% " << std::flush;
-                }
-            }
-
-            if (done % 1000000 == 0 || done == imageHeight*imageWidth) {
-                testImage.saveImageBMP("render.bmp");
-            }
+            cerr << "Unknown serve option " << arg << "\n" << "usage: render --serve [--socket path] [--threads n]\n";
+            return 1;
         }
     }
-    cout << endl;
-    
-    // output timekeeping stuff
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end - start;
-    std::cout << "Elapsed time: " << elapsed_seconds.count() << " seconds" << std::endl;
+    return runServer(config);
+}
 
-    auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-    std::cout << "Elapsed time: " << elapsed_ms.count() << " milliseconds" << std::endl;
+// Everything that is not a client option is passed on as part of the request, like "width=128 spp=64"
+static int runClientMode(int argc, char** argv)
+{
+    string socketPath = ServerConfig().socketPath;
+    string out = "client";
+    string request;
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--socket" && hasValue) socketPath = argv[++a];
+        else if (arg == "--out" && hasValue) out = argv[++a];
+        else if (arg.find('=') != string::npos) request += (request.empty() ? "" : " ") + arg;
+        else
+        {
+            cerr << "Unknown client option " << arg << "\n"
+                << "usage: render --client [--socket path] [--out name] [key=value ...] (see server.h for the keys)\n";
+            return 1;
+        }
+    }
+    return runClient(socketPath, request, out);
+}
 
-    // Save image
-    testImage.saveImageBMP("render.bmp");
+// Packs a scene into a cluster file for --out-of-core
+static int runPackMode(int argc, char** argv)
+{
+    string sceneName = "default";
+    double stressScale = 1.0;
+    int clusterSize = 4096;
+    string out = "scene.clusters";
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--scene" && hasValue) sceneName = argv[++a];
+        else if (arg == "--scale" && hasValue) stressScale = stod(argv[++a]);
+        else if (arg == "--cluster-size" && hasValue) clusterSize = stoi(argv[++a]);
+        else if (arg == "--out" && hasValue) out = argv[++a];
+        else
+        {
+            cerr << "Unknown pack option " << arg << "\n"
+                << "usage: render --pack [--scene default|stress|stress-instanced|file.obj] [--scale s] "
+                << "[--cluster-size triangles] [--out file.clusters]\n";
+            return 1;
+        }
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    Scene scene;
+    if (!loadBenchmarkScene(scene, sceneName, stressScale))
+        return 1;
+    scene.build();
+    if (!writeClusterFile(scene, out, clusterSize))
+        return 1;
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    cout << "Packed " << scene.instancedTriangleCount() << " triangles into " << out << " in " << elapsed.count()
+        << " seconds" << endl;
+    return 0;
+}
+
+static int runOutOfCoreMode(int argc, char** argv)
+{
+    OutOfCoreConfig config;
+    config.integrator.maxDepth = 6;
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--file" && hasValue) config.clusterFile = argv[++a];
+        else if (arg == "--memory" && hasValue) config.memoryMB = stod(argv[++a]);
+        else if (arg == "--width" && hasValue) config.imageWidth = stoi(argv[++a]);
+        else if (arg == "--height" && hasValue) config.imageHeight = stoi(argv[++a]);
+        else if (arg == "--spp" && hasValue) config.sampleCount = stoi(argv[++a]);
+        else if (arg == "--threads" && hasValue) config.threads = stoi(argv[++a]);
+        else if (arg == "--seed" && hasValue) config.seed = stoul(argv[++a]);
+        else if (arg == "--tile" && hasValue) config.tilePixels = stoi(argv[++a]);
+        else if (arg == "--out" && hasValue) config.output = argv[++a];
+        else if (parseIntegratorOption(arg, a, argc, argv, config.integrator)) {}
+        else
+        {
+            cerr << "Unknown out of core option " << arg << "\n"
+                << "usage: render --out-of-core [--file scene.clusters] [--memory MB] [--width n] [--height n] [--spp n] "
+                << "[--threads n] [--seed n] [--tile pixels] [--out file.bmp] " << integratorUsage << "\n";
+            return 1;
+        }
+    }
+    return runOutOfCore(config);
 }
 
-// reads in obj files and assigns the data to triangles
-void readObj(string filename, vector<Vertex>& vertices, vector<Triangle>& mesh, vector<Triangle>& lights, Color c, Color e, BSDF& material)
+// Renders the jobs of a manifest file (see batch.h)
+static int runBatchMode(int argc, char** argv)
 {
-    std::ifstream file(filename);
+    BatchConfig config;
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--manifest" && hasValue) config.manifest = argv[++a];
+        else if (arg == "--width" && hasValue) config.imageWidth = stoi(argv[++a]);
+        else if (arg == "--height" && hasValue) config.imageHeight = stoi(argv[++a]);
+        else if (arg == "--spp" && hasValue) config.sampleCount = stoi(argv[++a]);
+        else if (arg == "--seed" && hasValue) config.seed = stoul(argv[++a]);
+        else if (arg == "--threads" && hasValue) config.threads = stoi(argv[++a]);
+        else if (arg == "--no-overlap") config.overlapLoading = false;
+        else if (parseIntegratorOption(arg, a, argc, argv, config.integrator)) {}
+        else if (parseTextureOption(arg, a, argc, argv)) {}
+        else
+        {
+            cerr << "Unknown batch option " << arg << "\n"
+                << "usage: render --batch --manifest jobs.txt [--width n] [--height n] [--spp n] [--seed n] [--threads n] "
+                << "[--no-overlap] " << integratorUsage << " " << textureUsage << "\n";
+            return 1;
+        }
+    }
+    if (config.manifest.empty())
+    {
+        cerr << "Error: --batch needs --manifest jobs.txt\n";
+        return 1;
+    }
+    int result = runBatch(config);
+    printTextureSummary();
+    return result;
+}
+
+static int runMode(int argc, char** argv);
 
-    if (!file.is_open()) {
-        std::cerr << "Error: Could not open OBJ file\n";
-        return;
+int main (int argc, char** argv) {
+    // --trace <file.json> works with every mode, so it is taken out before the mode sees the arguments
+    string traceFile;
+    vector<char*> args;
+    for (int a = 0; a < argc; a++)
+    {
+        if (string(argv[a]) == "--trace" && a + 1 < argc)
+            traceFile = argv[++a];
+        else
+            args.push_back(argv[a]);
     }
 
-    vector<Point> points;
-    vector<Vec3> normals;
+    if (!traceFile.empty())
+        startTracing();
 
-    std::string line;
-    while (std::getline(file, line)) {
-        if (line.empty() || line[0] == '#') continue; // skip comments
+    int result = runMode(args.size(), args.data());
 
-        std::istringstream iss(line);
-        std::string prefix;
-        
-        iss >> prefix;
+    if (!traceFile.empty())
+    {
+        stopTracing();
+        if (writeTrace(traceFile))
+            cout << "Wrote trace to " << traceFile << endl;
+    }
+    return result;
+}
 
-        if (prefix == "v") {
-            double x, y, z;
-            iss >> x >> y >> z;
-            Point p(x,y,z);
-            points.push_back(p);
-        }
-        else if (prefix == "vt") {}
-        else if (prefix == "vn") {
-            double x, y, z;
-            iss >> x >> y >> z;
-            Vec3 n(x,y,z);
-            normals.push_back(n);
-        }
-        else if (prefix == "f") {
-            vector<string> items;
-
-            string vertinfo;
-            vector<int> vertexIndices;
-            vector<int> normalIndices;
-            while (iss >> vertinfo) 
-            {
-                istringstream vss(vertinfo);
-                string idx;
-
-                if (getline(vss, idx, '/'))
-                {
-                    if (!idx.empty())
-                        vertexIndices.push_back(stoi(idx) - 1);
-                }
-                if (getline(vss, idx, '/'))
-                {
-
-                }
-                if (getline(vss, idx, '/'))
-                {
-                    if (!idx.empty())
-                        normalIndices.push_back(stoi(idx) - 1);
-                }
-            }
-            int n = vertexIndices.size();
-            if (n == 3)
-            {
-                int startIndex = vertices.size(); // current end of vector
-
-                // create vertices and store them in the vector
-                vertices.push_back(Vertex(points[vertexIndices[0]], c, normals[normalIndices[0]]));
-                vertices.push_back(Vertex(points[vertexIndices[1]], c, normals[normalIndices[1]]));
-                vertices.push_back(Vertex(points[vertexIndices[2]], c, normals[normalIndices[2]]));
-
-                // pointers to the vertices stored in the vector
-                Vertex* v1 = &vertices[startIndex];
-                Vertex* v2 = &vertices[startIndex + 1];
-                Vertex* v3 = &vertices[startIndex + 2];
-
-                // create triangle using the pointers
-                mesh.push_back(Triangle(v1, v2, v3, e, &material));
-                if (e.lengthSquared() > 0)
-                    lights.push_back(Triangle(v1, v2, v3, e, &material));
-            }
-            else if (n == 4)
-            {
-                int startIndex = vertices.size();
-
-                vertices.push_back(Vertex(points[vertexIndices[0]], c, normals[normalIndices[0]]));
-                vertices.push_back(Vertex(points[vertexIndices[1]], c, normals[normalIndices[1]]));
-                vertices.push_back(Vertex(points[vertexIndices[2]], c, normals[normalIndices[2]]));
-                vertices.push_back(Vertex(points[vertexIndices[3]], c, normals[normalIndices[3]]));
-
-                Vertex* v1 = &vertices[startIndex];
-                Vertex* v2 = &vertices[startIndex + 1];
-                Vertex* v3 = &vertices[startIndex + 2];
-                Vertex* v4 = &vertices[startIndex + 3];
-
-                // split quad into two triangles
-                mesh.push_back(Triangle(v1, v2, v3, e, &material));
-                mesh.push_back(Triangle(v1, v3, v4, e, &material));
-
-                if (e.lengthSquared() > 0)
-                {
-                    lights.push_back(Triangle(v1, v2, v3, e, &material));
-                    lights.push_back(Triangle(v1, v3, v4, e, &material));
-                }
-
-            }
-            else if (n > 4) 
-            {
-                int startIndex = vertices.size();
-                std::vector<Vertex*> polyVertices;
-                polyVertices.reserve(n);
-
-                for (int i = 0; i < n; ++i)
-                {
-                    // Create the vertex and add it to the main list
-                    vertices.push_back(Vertex(
-                        points[vertexIndices[i]], 
-                        c, 
-                        normals[normalIndices[i]]
-                    ));
-                    polyVertices.push_back(&vertices[startIndex + i]);
-                }
-
-                for (int i = 1; i < n - 1; ++i)
-                {
-                    Vertex* v1 = polyVertices[0];
-                    Vertex* v2 = polyVertices[i];
-                    Vertex* v3 = polyVertices[i + 1];
-                    
-                    mesh.push_back(Triangle(v1, v2, v3, e, &material));
-
-                    if (e.lengthSquared() > 0)
-                    {
-                        lights.push_back(Triangle(v1, v2, v3, e, &material));
-                    }
-                }
-            }
+static int runMode(int argc, char** argv)
+{
+    if (argc > 1 && string(argv[1]) == "--benchmark")
+        return runBenchmarkMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--convergence")
+        return runConvergenceMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--generate")
+        return runGenerateMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--sequence")
+        return runSequenceMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--distribute")
+        return runDistributeMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--worker")
+        return runWorkerMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--requeue")
+        return runRequeueMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--merge")
+        return runMergeMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--serve")
+        return runServeMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--client")
+        return runClientMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--pack")
+        return runPackMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--out-of-core")
+        return runOutOfCoreMode(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--batch")
+        return runBatchMode(argc, argv);
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Image and sampling setup (see RenderSettings for the defaults)
+    RenderSettings settings;
+    settings.progressiveOutput = "render.bmp";
+    settings.heatmapPrefix = "render";
+
+    MISIntegrator integrator = MISIntegrator();
+    integrator.maxDepth = 6;
+
+    // with --time, the sample count is whatever fits in the budget
+    BudgetSettings budget;
+    bool useBudget = false;
+
+    // with --numa-replicas, every NUMA node gets its own copy of the scene
+    bool useReplicas = false;
+
+    // with --guide, a path guide is trained in guidePasses short passes before the render
+    bool useGuide = false;
+    GuidingSettings guiding;
+    int guidePasses = 5;
+
+    // with --cache, a radiance cache is built by a cacheSamples spp render before the real one
+    bool useCache = false;
+    RadianceCacheSettings caching;
+    int cacheSamples = 4;
+
+    // with --bdpt, the image is rendered by the bidirectional path tracer with the integrator's depth and heuristic
+    bool useBDPT = false;
+
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+        if (arg == "--width" && hasValue) settings.imageWidth = stoi(argv[++a]);
+        else if (arg == "--height" && hasValue) settings.imageHeight = stoi(argv[++a]);
+        else if (arg == "--spp" && hasValue) settings.sampleCount = stoi(argv[++a]);
+        else if (arg == "--seed" && hasValue) { settings.seed = stoul(argv[++a]); settings.deterministic = true; }
+        else if (arg == "--denoise") settings.denoise = true;
+        else if (arg == "--time" && hasValue) { budget.seconds = stod(argv[++a]); useBudget = true; }
+        else if (arg == "--snapshot" && hasValue) budget.snapshotFile = argv[++a];
+        else if (arg == "--snapshot-interval" && hasValue) budget.snapshotInterval = stod(argv[++a]);
+        else if (arg == "--preview-scale" && hasValue) budget.previewScale = stoi(argv[++a]);
+        else if (arg == "--threads" && hasValue) settings.threads = stoi(argv[++a]);
+        else if (arg == "--pin") settings.pinThreads = true;
+        else if (arg == "--numa-replicas") useReplicas = true;
+        else if (arg == "--generic") settings.specializedKernels = false;
+        else if (parseIntegratorOption(arg, a, argc, argv, integrator)) {}
+        else if (parseGuidingOption(arg, a, argc, argv, useGuide, guiding)) {}
+        else if (arg == "--guide-passes" && hasValue) guidePasses = stoi(argv[++a]);
+        else if (parseCacheOption(arg, a, argc, argv, useCache, caching, cacheSamples)) {}
+        else if (arg == "--bdpt") useBDPT = true;
+        else
+        {
+            cerr << "Unknown option " << arg << "\n"
+                << "usage: render [--width n] [--height n] [--spp n] [--seed n] [--denoise] "
+                << "[--time seconds [--snapshot file.bmp] [--snapshot-interval s] [--preview-scale n]] "
+                << "[--threads n] [--pin] [--numa-replicas] [--generic] [--bdpt] " << integratorUsage << "\n"
+                << "       [--guide [--guide-passes n] [--guide-fraction f] [--guide-threshold n]] " << cacheUsage << "\n"
+                << "       render --benchmark | --convergence | --generate | --sequence [options]\n"
+                << "       render --distribute | --worker | --requeue | --merge [options]\n"
+                << "       render --serve | --client [options]\n"
+                << "       render --pack | --out-of-core [options]\n"
+                << "       render --batch --manifest jobs.txt [options]\n";
+            return 1;
         }
     }
 
-    file.close();
+    if (useBDPT && (useBudget || useGuide || useCache || useReplicas || settings.denoise))
+    {
+        cerr << "Error: --bdpt can not be combined with --time, --guide, --cache, --numa-replicas or --denoise\n";
+        return 1;
+    }
+
+    Image testImage(settings.imageWidth, settings.imageHeight);
+
+    // Camera setup
+    Camera camera;
+
+    // Initialization of the scene, which owns all the triangles, vertices and materials
+    Scene ownScene;
+    SceneReplicas replicas;
+    if (useReplicas)
+    {
+        replicas.load(cpuTopology(), [](Scene& copy)
+        {
+            loadDefaultScene(copy);
+            copy.build();
+            return true;
+        });
+        settings.replicas = &replicas;
+    }
+    else
+    {
+        loadDefaultScene(ownScene);
+        ownScene.build();
+    }
+    const Scene& scene = useReplicas ? replicas.forNode(0) : ownScene;
+
+    if (settings.pinThreads || useReplicas)
+        printTopology(cout, cpuTopology());
+
+    PathGuide guide(guiding);
+    if (useGuide)
+    {
+        guide.reset(scene);
+        RenderStats training = trainGuide(scene, integrator, camera, settings, guide, guidePasses);
+        cout << "Trained the guide with " << (1 << guidePasses) - 1 << " spp in " << training.seconds << " seconds"
+            << endl;
+        printGuideSummary(cout, guide);
+    }
+
+    RadianceCache cache(caching);
+    if (useCache)
+    {
+        // seeded after the guide's training passes, so the two do not share samples either
+        RenderSettings cacheSettings = settings;
+        if (useGuide)
+            cacheSettings.firstSample += (1 << guidePasses) - 1;
+
+        cache.reset(scene);
+        RenderStats building = buildRadianceCache(scene, integrator, camera, cacheSettings, cache, cacheSamples);
+        cout << "Built the radiance cache with " << cacheSamples << " spp in " << building.seconds << " seconds"
+            << endl;
+        printCacheSummary(cout, cache);
+    }
+
+    RenderStats stats;
+    if (useBudget)
+    {
+        stats = renderWithBudget(scene, integrator, camera, settings, budget, testImage);
+        cout << "Fit " << stats.samples / ((unsigned long long)settings.imageWidth * settings.imageHeight)
+            << " spp into the " << budget.seconds << " second budget" << endl;
+    }
+    else if (useBDPT)
+    {
+        BDPTIntegrator bdpt;
+        bdpt.maxDepth = integrator.maxDepth;
+        bdpt.heuristic = integrator.heuristic;
+        stats = renderBDPT(scene, bdpt, camera, settings, testImage);
+    }
+    else
+        stats = renderImage(scene, integrator, camera, settings, testImage);
+    printCounterReport(cout, stats.seconds);
+
+    // output timekeeping stuff
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end - start;
+    std::cout << "Elapsed time: " << elapsed_seconds.count() << " seconds" << std::endl;
+
+    auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+    std::cout << "Elapsed time: " << elapsed_ms.count() << " milliseconds" << std::endl;
+
+    // Save image
+    testImage.saveImageBMP("render.bmp");
+    return 0;
 }
 
 
@@ -0,0 +1,307 @@
+/*
+Contains the render loop, which is parallelized over image columns with OpenMP.
+
+*/
+
+#include "renderer.h"
+#include "counters.h"
+#include "trace.h"
+#include "integratorKernels.h"
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <iomanip>
+#include <algorithm>
+#include <memory>
+
+#include <omp.h>
+
+Ray Camera::generateRay(double px, double py, int imageWidth, int imageHeight) const
+{
+    Point a = Point((px - imageWidth/2.0) * (viewPortWidth / imageWidth),
+        (py - imageHeight/2.0) * (viewPortHeight / imageHeight), 0);
+
+    // the cone starts at the pinhole and is one pixel wide where it crosses the image plane
+    double spread = (viewPortWidth / imageWidth) / (a - origin).length();
+    return Ray(transform.applyVector(a - origin), transform.applyPoint(origin), 0, spread);
+}
+
+void Camera::place(const Vec3& move, double yawDegrees)
+{
+    transform = Transform::translate(move) * Transform::translate(origin) * Transform::rotateY(yawDegrees)
+        * Transform::translate(-origin);
+}
+
+int resolveThreadCount(int requested)
+{
+    if (requested > 0)
+        return requested;
+
+    // omp_get_max_threads() follows the affinity mask but not a cgroup quota, which would oversubscribe a container
+    int maxThreads = std::min(omp_get_max_threads(), cpuTopology().usableCpus());
+    int useThreads = int(maxThreads * 0.9); // Set the float value to the % of CPU you want to use
+    if (useThreads < 1) useThreads = 1;
+    return useThreads;
+}
+
+#if COUNTERS_ENABLED
+// Saves a per-pixel cost as a false color image, going black -> blue -> green -> yellow -> red. The scale tops out
+// at the 99th percentile so a few very expensive pixels do not wash out the rest.
+static void saveHeatmap(const std::vector<double>& cost, int width, int height, std::string fileName)
+{
+    std::vector<double> sorted = cost;
+    size_t top = std::min(sorted.size() - 1, size_t(sorted.size() * 0.99));
+    std::nth_element(sorted.begin(), sorted.begin() + top, sorted.end());
+    double maxCost = std::max(sorted[top], 1.0);
+
+    const Color ramp[5] = {Color(0,0,0), Color(0,0,1), Color(0,1,0), Color(1,1,0), Color(1,0,0)};
+
+    Image heatmap(width, height);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            double t = std::min(cost[y * width + x] / maxCost, 1.0) * 4.0;
+            int k = std::min(int(t), 3);
+            double f = t - k;
+            heatmap.setColor(x, y, ramp[k] * (1.0 - f) + ramp[k + 1] * f);
+        }
+    }
+    heatmap.saveImageBMP(fileName);
+    std::cout << "Saved " << fileName << " (full scale is " << maxCost << " per pixel)" << std::endl;
+}
+#endif
+
+RenderStats renderImage(const Scene& scene, MISIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, Image& image, AuxiliaryImages* aux)
+{
+    TRACE_SCOPE("render");
+    auto start = std::chrono::high_resolution_clock::now();
+
+    const int imageWidth = settings.imageWidth;
+    const int imageHeight = settings.imageHeight;
+    const int sampleCount = settings.sampleCount;
+    const int totalPixels = imageWidth * imageHeight;
+
+    // the window being rendered, in pixels of the full image. The image (and aux) only covers the window.
+    const int cropX = settings.cropWidth > 0 ? settings.cropX : 0;
+    const int cropY = settings.cropHeight > 0 ? settings.cropY : 0;
+    const int outWidth = settings.cropWidth > 0 ? settings.cropWidth : imageWidth;
+    const int outHeight = settings.cropHeight > 0 ? settings.cropHeight : imageHeight;
+    const int outPixels = outWidth * outHeight;
+
+    RenderStats stats;
+    stats.threads = resolveThreadCount(settings.threads);
+    omp_set_num_threads(stats.threads);
+
+    // the kernels trace camera rays themselves, so the G-buffer needs the generic integrator. Without fixed seeds
+    // the camera rays would not be the ones whose hits it recorded.
+    GBuffer* gbuffer = settings.deterministic ? settings.gbuffer : nullptr;
+    const KernelChoice kernel = settings.specializedKernels && gbuffer == nullptr ? selectKernel(scene, integrator)
+        : KernelChoice();
+
+    // Shades every sample from the G-buffer's first hits if it has them all, or else records them, if the samples
+    // before this render's are there already
+    bool reshade = false, record = false;
+    if (gbuffer != nullptr)
+    {
+        if (gbuffer->width() != outWidth || gbuffer->height() != outHeight)
+            gbuffer->reset(outWidth, outHeight);
+        reshade = settings.firstSample + sampleCount <= gbuffer->cachedSamples();
+        record = !reshade && settings.firstSample <= gbuffer->cachedSamples();
+        if (record)
+            gbuffer->reserveSamples(settings.firstSample + sampleCount);
+    }
+
+    const bool pin = settings.pinThreads || settings.replicas != nullptr;
+    ThreadPlacement placement;
+    if (pin)
+        placement = placeThreads(cpuTopology(), stats.threads);
+
+    // the denoiser needs guide buffers even if the caller does not want them
+    std::unique_ptr<AuxiliaryImages> ownAux;
+    if (aux == nullptr && settings.denoise)
+    {
+        ownAux = std::make_unique<AuxiliaryImages>(outWidth, outHeight);
+        aux = ownAux.get();
+    }
+
+    // to handle progress bar
+    std::atomic<int> pixelsDone(0);
+    std::atomic<unsigned long long> rays(0);
+
+#if COUNTERS_ENABLED
+    bool heatmaps = !settings.heatmapPrefix.empty();
+    std::vector<double> rayCost(heatmaps ? outPixels : 0);
+    std::vector<double> testCost(heatmaps ? outPixels : 0);
+#endif
+
+    #pragma omp parallel
+    {
+        unsigned long long raysAtStart = threadRayCount();
+        std::random_device rd;
+
+        const Scene* threadScene = &scene;
+        const int thread = omp_get_thread_num();
+        if (pin && thread < int(placement.cpus.size()))
+        {
+            pinCurrentThread(placement.cpus[thread]);
+            if (settings.replicas != nullptr)
+                threadScene = &settings.replicas->forNode(placement.nodes[thread]);
+        }
+
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < outWidth; i++)
+        {
+            if (settings.cancel != nullptr && settings.cancel->load(std::memory_order_relaxed))
+                continue;
+
+            TRACE_SCOPE("column", cropX + i);
+            for(int j = 0; j < outHeight; j++)
+            {
+                unsigned int base = settings.deterministic ? settings.seed : rd();
+#if COUNTERS_ENABLED
+                unsigned long long raysBefore = threadRayCount();
+                unsigned long long testsBefore = threadTriangleTests();
+#endif
+                // seeds and rays come from the pixel's position in the full image, so a crop renders exactly what
+                // the same pixels of a full render would
+                const int x = cropX + i;
+                const int y = cropY + j;
+                SimpleSampler sampler(base + (unsigned int)settings.firstSample * totalPixels + y * imageWidth + x);
+                Color L = Color(0.0, 0.0, 0.0);
+                AuxiliarySample auxSum, auxSample;
+
+                // a pixel no edit touched since the last render keeps its color; it can only be skipped when the
+                // G-buffer does not need its first hits either
+                const int pixel = j * outWidth + i;
+                const bool keep = reshade && gbuffer->keeps(pixel);
+                if (gbuffer != nullptr && !keep)
+                {
+                    if (settings.firstSample == 0)
+                        gbuffer->touchedGroups(pixel) = 0;
+                    trackTouchedGroups(&gbuffer->touchedGroups(pixel));
+                }
+
+                for (int k = 0; k < sampleCount && !keep; k++)
+                {
+                    auto [du, dv] = sampler.get2D();
+                    if (reshade)
+                    {
+                        // the recorded ray's position in the pixel, which is the sampler's unless an edit changed
+                        // how many numbers the earlier samples' paths drew
+                        const FirstHit& first = gbuffer->hit(pixel, settings.firstSample + k);
+                        du = first.jitterX;
+                        dv = first.jitterY;
+                    }
+                    Ray r = camera.generateRay(x + du - 0.5, y + dv - 0.5, imageWidth, imageHeight);
+                    auxSample = AuxiliarySample();
+                    AuxiliarySample* auxOut = aux != nullptr ? &auxSample : nullptr;
+                    Color l;
+                    if (reshade)
+                    {
+                        const FirstHit& first = gbuffer->hit(pixel, settings.firstSample + k);
+                        Intersection hit = threadScene->hitAt(r, first.primitive, first.instance, first.barycentrics,
+                            first.t);
+                        l = integrator.shade(*threadScene, r, hit, sampler, auxOut);
+                    }
+                    else if (record)
+                    {
+                        COUNTER_INC(rays);
+                        Intersection hit = sceneIntersection(*threadScene, r);
+                        FirstHit& first = gbuffer->hit(pixel, settings.firstSample + k);
+                        first.jitterX = du;
+                        first.jitterY = dv;
+                        first.barycentrics = hit.barycentrics;
+                        first.t = hit.t;
+                        first.primitive = hit.valid ? hit.primitive : -1;
+                        first.instance = hit.instance;
+                        l = integrator.shade(*threadScene, r, hit, sampler, auxOut);
+                    }
+                    else
+                    {
+                        l = kernel.kernel != nullptr ? kernel.kernel(integrator, *threadScene, r, sampler, auxOut)
+                            : integrator.Li(*threadScene, r, sampler, auxOut);
+                    }
+                    L += l;
+
+                    auxSum.albedo += auxSample.albedo;
+                    auxSum.normal += auxSample.normal;
+                    auxSum.depth += auxSample.depth;
+                }
+                trackTouchedGroups(nullptr);
+
+                L /= (double)sampleCount;
+                image.setColor(i, j, keep ? gbuffer->keptColor(pixel) : L);
+
+                if (aux != nullptr && !keep)
+                {
+                    aux->albedo.setColor(i, j, auxSum.albedo / sampleCount);
+                    aux->normal.setColor(i, j, auxSum.normal / sampleCount);
+                    double depth = auxSum.depth / sampleCount;
+                    aux->depth.setColor(i, j, Color(depth, depth, depth));
+                }
+
+#if COUNTERS_ENABLED
+                if (heatmaps)
+                {
+                    rayCost[j * outWidth + i] = double(threadRayCount() - raysBefore);
+                    testCost[j * outWidth + i] = double(threadTriangleTests() - testsBefore);
+                }
+#endif
+
+                // the shared counter is only touched when something needs it, so it can be benchmarked both ways
+                if (!settings.showProgress && settings.progressiveOutput.empty())
+                    continue;
+
+                // Progressively save the image as it renders, and update progress bar
+                int done = ++pixelsDone;
+                if (settings.showProgress && (done % 100000 == 0 || done == outPixels)) {
+                    float progress = (done / float(outPixels)) * 100.0f;
+                    #pragma omp critical
+                    {
+                        std::cout << "\rProgress: " << std::fixed << std::setprecision(2)
+                                << progress << "% " << std::flush;
+                    }
+                }
+
+                if (!settings.progressiveOutput.empty() && (done % 1000000 == 0 || done == outPixels)) {
+                    image.saveImageBMP(settings.progressiveOutput);
+                }
+            }
+        }
+
+        rays += threadRayCount() - raysAtStart;
+
+        // OpenMP keeps its threads for the next parallel region, which should not inherit the pinning
+        if (pin)
+            unpinCurrentThread();
+    }
+    if (settings.showProgress)
+        std::cout << std::endl;
+
+    stats.cancelled = settings.cancel != nullptr && settings.cancel->load();
+    if (record && !stats.cancelled)
+        gbuffer->recorded(settings.firstSample, sampleCount);
+
+#if COUNTERS_ENABLED
+    if (heatmaps)
+    {
+        saveHeatmap(rayCost, outWidth, outHeight, settings.heatmapPrefix + "_rays.bmp");
+        saveHeatmap(testCost, outWidth, outHeight, settings.heatmapPrefix + "_tests.bmp");
+    }
+#endif
+
+    if (settings.denoise && !stats.cancelled)
+        denoiseImage(image, *aux, settings.denoiseSettings);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end - start;
+
+    stats.seconds = elapsed_seconds.count();
+    stats.samples = (unsigned long long)outPixels * sampleCount;
+    stats.rays = rays;
+    return stats;
+}
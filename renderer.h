@@ -0,0 +1,119 @@
+/*
+Contains the Camera and the render loop that turns a Scene into an Image.
+
+The loop used to live directly in main. It is shared by the normal render and by the benchmark modes, so every knob
+that main used to hard-code lives in RenderSettings.
+
+*/
+
+#pragma once
+
+#include <string>
+#include <atomic>
+#include "object.h"
+#include "image.h"
+#include "lightTransport.h"
+#include "scene.h"
+#include "denoiser.h"
+#include "threadGovernor.h"
+#include "gbuffer.h"
+
+struct Camera
+{
+    Point origin;
+    double viewPortWidth;
+    double viewPortHeight;
+
+    // Moves the whole camera, origin and image plane together. The identity keeps the original view down -z.
+    Transform transform;
+
+    Camera() : origin(0,0,1.0), viewPortWidth(1), viewPortHeight(1) {}
+
+    // Sets the transform to turn the camera yawDegrees around its own origin, then move it by `move`
+    void place(const Vec3& move, double yawDegrees);
+
+    // Makes the ray through the image position (px, py), measured in pixels from the bottom left corner
+    Ray generateRay(double px, double py, int imageWidth, int imageHeight) const;
+};
+
+struct RenderSettings
+{
+    int imageWidth = 2000;
+    int imageHeight = 2000;
+
+    // Number of samples per pixel
+    int sampleCount = 30;
+
+    // 0 uses 90% of the CPUs the process may use (see CpuTopology::usableCpus)
+    int threads = 0;
+
+    // Pins every thread to its own CPU for the render, spread over the NUMA nodes (see placeThreads)
+    bool pinThreads = false;
+
+    // If set, threads are pinned and each one traces the copy of the scene on its own node instead of `scene`.
+    // The replicas must be loaded with cpuTopology().
+    const SceneReplicas* replicas = nullptr;
+
+    // When deterministic, every pixel's sampler is seeded from `seed` instead of std::random_device,
+    // so the same settings always give the same image no matter how many threads are used
+    bool deterministic = false;
+    unsigned int seed = 12345;
+
+    // Index of the first sample this render takes, so progressive renders that are split into several calls
+    // seed each call differently
+    int firstSample = 0;
+
+    // If cropWidth and cropHeight are above 0, only that window of the full image is rendered, into an image
+    // (and aux buffers) of the window's size. Rays and seeds are the full image's, so with the same settings the
+    // tiles of a split render put together give exactly the full render.
+    int cropX = 0;
+    int cropY = 0;
+    int cropWidth = 0;
+    int cropHeight = 0;
+
+    bool showProgress = true;
+
+    // If not empty, the image is saved here every million pixels while rendering
+    std::string progressiveOutput;
+
+    // Traces with the kernel selectKernel picks for the scene and integrator (see integratorKernels.h), which
+    // renders the same image as MISIntegrator::Li, only faster. Off forces the generic integrator.
+    bool specializedKernels = true;
+
+    // Runs the denoiser on the finished image, guided by the first hit albedo, normal and depth
+    bool denoise = false;
+    DenoiseSettings denoiseSettings;
+
+    // If set, the render checks it before every column and skips the rest of the image once it is true
+    // (see RenderStats::cancelled), so another thread can stop a render that is no longer wanted
+    const std::atomic<bool>* cancel = nullptr;
+
+    // If set, the first hit of every sample is recorded into it, and a render whose samples are all recorded
+    // already shades them from it without tracing the camera rays; pixels it keeps colors for are not shaded at all
+    // (see gbuffer.h). Only used by deterministic renders, which then use the generic integrator and leave the aux
+    // buffers of kept pixels alone.
+    GBuffer* gbuffer = nullptr;
+
+    // If not empty and the counters are compiled in (-DPT_COUNTERS), per-pixel cost heatmaps are saved as
+    // <prefix>_rays.bmp and <prefix>_tests.bmp (rays and triangle tests per pixel)
+    std::string heatmapPrefix;
+};
+
+struct RenderStats
+{
+    int threads = 0;
+    double seconds = 0;
+    unsigned long long samples = 0;
+    unsigned long long rays = 0;
+
+    // The render was stopped through RenderSettings::cancel, and the image is incomplete
+    bool cancelled = false;
+};
+
+// Turns the requested thread count into the one actually used (see RenderSettings::threads)
+int resolveThreadCount(int requested);
+
+// `image` (and aux, if given) must be the size of the crop window, or of the full image without one.
+// If aux is given, it receives the per pixel average of the first hit albedo, normal and depth
+RenderStats renderImage(const Scene& scene, MISIntegrator& integrator, const Camera& camera,
+    const RenderSettings& settings, Image& image, AuxiliaryImages* aux = nullptr);
@@ -0,0 +1,665 @@
+/*
+Contains the Scene implementation and the obj file reader.
+
+*/
+
+#include "scene.h"
+#include "trace.h"
+#include "counters.h"
+#include "texture.h"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <filesystem>
+
+using namespace std;
+
+// Makes room for `count` more vertices, and if the storage moved, points the triangles of every list in `users`
+// at the new copies. Only pointers into the old storage are moved, as a list may also hold triangles whose vertices
+// live elsewhere (like the lights that point into Scene::lightVertices).
+static void reserveVertices(vector<Vertex>& vertices, size_t count, std::initializer_list<vector<Triangle>*> users)
+{
+    size_t needed = vertices.size() + count;
+    if (needed <= vertices.capacity())
+        return;
+
+    const Vertex* oldData = vertices.data();
+    vertices.reserve(std::max(needed, vertices.capacity() * 2));
+    Vertex* newData = vertices.data();
+
+    if (oldData == nullptr || oldData == newData)
+        return;
+
+    const Vertex* oldEnd = oldData + vertices.size();
+    auto rebase = [&](Vertex*& v)
+    {
+        if (v >= oldData && v < oldEnd)
+            v = newData + (v - oldData);
+    };
+    for (vector<Triangle>* triangles : users)
+    {
+        for (Triangle& tri : *triangles)
+        {
+            rebase(tri.a);
+            rebase(tri.b);
+            rebase(tri.c);
+        }
+    }
+}
+
+static AABB triangleBounds(const Triangle& tri)
+{
+    AABB b;
+    b.grow(tri.a->pt);
+    b.grow(tri.b->pt);
+    b.grow(tri.c->pt);
+    return b;
+}
+
+static vector<AABB> triangleBounds(const vector<Triangle>& triangles)
+{
+    vector<AABB> bounds;
+    bounds.reserve(triangles.size());
+    for (const Triangle& tri : triangles)
+        bounds.push_back(triangleBounds(tri));
+    return bounds;
+}
+
+// Refits bvh, or rebuilds it if refitting made it more than maxCostRatio times as expensive as when it was built.
+// Returns whether it was rebuilt.
+static bool refitOrRebuild(BVH& bvh, const vector<AABB>& bounds, double maxCostRatio)
+{
+    bvh.refit(bounds);
+    if (bvh.sahCost() > maxCostRatio * bvh.builtCost)
+    {
+        bvh.build(bounds);
+        return true;
+    }
+    return false;
+}
+
+void Mesh::reserveVertices(size_t count)
+{
+    ::reserveVertices(vertices, count, {&triangles});
+}
+
+void Mesh::build()
+{
+    bvh.build(triangleBounds(triangles));
+    bounds = bvh.empty() ? AABB() : bvh.nodes[0].bounds;
+}
+
+Mesh* Scene::addMesh()
+{
+    meshes.push_back(std::make_unique<Mesh>());
+    return meshes.back().get();
+}
+
+Instance& Scene::addInstance(const Mesh* mesh, const Transform& objectToWorld, BSDF* material)
+{
+    instances.push_back(Instance{mesh, objectToWorld, objectToWorld.inverse(), material, AABB()});
+    return instances.back();
+}
+
+void Scene::reserveVertices(size_t count)
+{
+    ::reserveVertices(vertices, count, {&objects, &lights});
+}
+
+void Scene::build()
+{
+    TRACE_SCOPE("build scene");
+
+    {
+        TRACE_SCOPE("build bvh");
+        for (auto& mesh : meshes)
+            mesh->build();
+
+        objectBVH.build(triangleBounds(objects));
+
+        vector<AABB> bounds;
+        updateInstanceBounds(bounds);
+        instanceBVH.build(bounds);
+    }
+
+    collectLights();
+}
+
+int Scene::refit(double maxCostRatio, bool verticesMoved)
+{
+    TRACE_SCOPE("refit scene");
+    int rebuilt = 0;
+
+    if (verticesMoved)
+    {
+        for (auto& mesh : meshes)
+        {
+            rebuilt += refitOrRebuild(mesh->bvh, triangleBounds(mesh->triangles), maxCostRatio);
+            mesh->bounds = mesh->bvh.empty() ? AABB() : mesh->bvh.nodes[0].bounds;
+        }
+
+        rebuilt += refitOrRebuild(objectBVH, triangleBounds(objects), maxCostRatio);
+    }
+
+    vector<AABB> bounds;
+    updateInstanceBounds(bounds);
+    rebuilt += refitOrRebuild(instanceBVH, bounds, maxCostRatio);
+
+    // the world space copies of instanced lights have to follow their instances
+    collectLights();
+    return rebuilt;
+}
+
+ObjectGroup* Scene::findGroup(const std::string& name)
+{
+    for (ObjectGroup& group : groups)
+    {
+        if (group.name == name)
+            return &group;
+    }
+    return nullptr;
+}
+
+int Scene::groupOf(size_t triangle) const
+{
+    // groups are added in order, so their triangle ranges are sorted
+    auto after = std::upper_bound(groups.begin(), groups.end(), triangle,
+        [](size_t t, const ObjectGroup& group) { return t < group.firstTriangle; });
+    if (after == groups.begin())
+        return -1;
+    const ObjectGroup& group = *(after - 1);
+    if (triangle >= group.firstTriangle + group.triangleCount)
+        return -1;
+    return int(after - 1 - groups.begin());
+}
+
+unsigned long long Scene::groupBit(const Intersection& hit) const
+{
+    int group = hit.instance >= 0 || hit.primitive < 0 ? -1 : groupOf(size_t(hit.primitive));
+    return group < 0 ? 1ull << 63 : 1ull << (group % 63);
+}
+
+// Sets every instance's world bounds, which enclose the corners of its mesh's bounds after the transform
+void Scene::updateInstanceBounds(vector<AABB>& bounds)
+{
+    bounds.clear();
+    bounds.reserve(instances.size());
+    for (Instance& instance : instances)
+    {
+        instance.bounds = AABB();
+        const AABB& local = instance.mesh->bounds;
+        if (!local.empty())
+        {
+            for (int corner = 0; corner < 8; corner++)
+            {
+                Point p = Point(corner & 1 ? local.upper.x() : local.lower.x(),
+                    corner & 2 ? local.upper.y() : local.lower.y(),
+                    corner & 4 ? local.upper.z() : local.lower.z());
+                instance.bounds.grow(instance.objectToWorld.applyPoint(p));
+            }
+        }
+        bounds.push_back(instance.bounds);
+    }
+}
+
+void Scene::collectLights()
+{
+    lights.clear();
+    for (const Triangle& tri : objects)
+    {
+        if (tri.emission.lengthSquared() > 0)
+            lights.push_back(tri);
+    }
+
+    // light sampling needs world space positions, so emissive instanced triangles are copied out once here.
+    // The storage is sized up front so the pointers taken below stay valid.
+    size_t emissive = 0;
+    for (const Instance& instance : instances)
+    {
+        for (const Triangle& tri : instance.mesh->triangles)
+            emissive += tri.emission.lengthSquared() > 0;
+    }
+    lightVertices.clear();
+    lightVertices.reserve(3 * emissive);
+
+    for (const Instance& instance : instances)
+    {
+        for (const Triangle& tri : instance.mesh->triangles)
+        {
+            if (tri.emission.lengthSquared() <= 0)
+                continue;
+
+            size_t startIndex = lightVertices.size();
+            for (const Vertex* v : {tri.a, tri.b, tri.c})
+            {
+                Vec3 n = unit(Transform::applyNormal(instance.worldToObject, v->n));
+                lightVertices.push_back(Vertex(instance.objectToWorld.applyPoint(v->pt), v->c, n));
+            }
+            lights.push_back(Triangle(&lightVertices[startIndex], &lightVertices[startIndex + 1],
+                &lightVertices[startIndex + 2], tri.emission,
+                instance.material != nullptr ? instance.material : tri.material));
+        }
+    }
+}
+
+bool Scene::closestHit(const Ray& r, double& maxT, int& primitive, int& instanceIndex, Vec3& barycentrics) const
+{
+    const Triangle* hitTri = nullptr;
+    const Instance* hitInstance = nullptr;
+    Vec3 hitP;
+
+    objectBVH.intersect(r, maxT, [&](int i, double& closestT) {
+        COUNTER_INC(triangleTests);
+        auto [t, P] = triangleIntersect(objects[i], r);
+        if (t != -1.0 && t < closestT)
+        {
+            closestT = t;
+            hitTri = &objects[i];
+            hitInstance = nullptr;
+            hitP = P;
+        }
+        return false;
+    });
+
+    instanceBVH.intersect(r, maxT, [&](int k, double& closestT) {
+        const Instance& instance = instances[k];
+
+        // an affine transform keeps distances along the ray proportional, so t carries over between the spaces
+        Ray local = Ray(instance.worldToObject.applyVector(r.direction()), instance.worldToObject.applyPoint(r.origin()));
+        const vector<Triangle>& triangles = instance.mesh->triangles;
+
+        instance.mesh->bvh.intersect(local, closestT, [&](int i, double& meshT) {
+            COUNTER_INC(triangleTests);
+            auto [t, P] = triangleIntersect(triangles[i], local);
+            if (t != -1.0 && t < meshT)
+            {
+                meshT = t;
+                hitTri = &triangles[i];
+                hitInstance = &instance;
+                hitP = P;
+            }
+            return false;
+        });
+        return false;
+    });
+
+    if (hitTri == nullptr)
+        return false;
+
+    primitive = hitInstance == nullptr ? int(hitTri - objects.data())
+        : int(hitTri - hitInstance->mesh->triangles.data());
+    instanceIndex = hitInstance == nullptr ? -1 : int(hitInstance - instances.data());
+    barycentrics = hitP;
+    return true;
+}
+
+Intersection Scene::intersect(const Ray& r, double maxT) const
+{
+    int primitive, instance;
+    Vec3 barycentrics;
+    if (!closestHit(r, maxT, primitive, instance, barycentrics))
+        return Intersection();
+    return surfaceHit(r, primitive, instance, barycentrics, maxT);
+}
+
+Intersection Scene::hitAt(const Ray& r, int primitive, int instance, const Vec3& barycentrics, double t) const
+{
+    if (primitive < 0)
+        return Intersection();
+    return surfaceHit(r, primitive, instance, barycentrics, t);
+}
+
+Intersection Scene::surfaceHit(const Ray& r, int primitive, int instance, const Vec3& hitP, double t) const
+{
+    const Instance* hitInstance = instance >= 0 ? &instances[instance] : nullptr;
+    const Triangle& tri = hitInstance == nullptr ? objects[primitive] : hitInstance->mesh->triangles[primitive];
+
+    Intersection closest = Intersection();
+    closest.primitive = primitive;
+    closest.instance = instance;
+    closest.barycentrics = hitP;
+    closest.t = t;
+
+    // triangleIntersect's coordinates are the weights of b, c and a, in that order
+    const double wa = hitP[2], wb = hitP[0], wc = hitP[1];
+    closest.point = r.pointAt(t);
+    closest.baseColor = tri.a->c * wa + tri.b->c * wb + tri.c->c * wc;
+    closest.ray = r;
+    closest.hitTri = tri;
+    closest.valid = true;
+    closest.backface = false;
+    closest.footprint = r.footprint(t * r.direction().length());
+
+    auto worldArea = [&]() {
+        Vec3 e1 = tri.b->pt - tri.a->pt, e2 = tri.c->pt - tri.a->pt;
+        if (hitInstance != nullptr)
+        {
+            e1 = hitInstance->objectToWorld.applyVector(e1);
+            e2 = hitInstance->objectToWorld.applyVector(e2);
+        }
+        return 0.5 * cross(e1, e2).length();
+    };
+
+    if (hitInstance == nullptr)
+    {
+        closest.normal = tri.a->n; // replace with averaged normal
+    }
+    else
+    {
+        closest.normal = unit(Transform::applyNormal(hitInstance->worldToObject, tri.a->n));
+        if (hitInstance->material != nullptr)
+            closest.hitTri.material = hitInstance->material;
+    }
+    if (tri.emission.lengthSquared() > 0)
+        closest.area = worldArea();
+
+    if (tri.texture != nullptr)
+    {
+        double u = tri.a->u * wa + tri.b->u * wb + tri.c->u * wc;
+        double v = tri.a->v * wa + tri.b->v * wb + tri.c->v * wc;
+
+        // the footprint in texture space, through the triangle's ratio of UV area to world area
+        double uvArea = 0.5 * std::fabs((tri.b->u - tri.a->u) * (tri.c->v - tri.a->v)
+            - (tri.c->u - tri.a->u) * (tri.b->v - tri.a->v));
+        double area = worldArea();
+        double footprint = area > 0 ? closest.footprint * std::sqrt(uvArea / area) : 0.0;
+        closest.baseColor *= tri.texture->sample(u, v, footprint);
+    }
+    return closest;
+}
+
+bool Scene::occluded(const Ray& r, double maxT) const
+{
+    bool hit = false;
+
+    objectBVH.intersect(r, maxT, [&](int i, double& closestT) {
+        COUNTER_INC(triangleTests);
+        double t = triangleIntersect(objects[i], r).first;
+        hit = t != -1.0 && t < closestT;
+        return hit;
+    });
+    if (hit)
+        return true;
+
+    instanceBVH.intersect(r, maxT, [&](int k, double& closestT) {
+        const Instance& instance = instances[k];
+        Ray local = Ray(instance.worldToObject.applyVector(r.direction()), instance.worldToObject.applyPoint(r.origin()));
+        const vector<Triangle>& triangles = instance.mesh->triangles;
+
+        instance.mesh->bvh.intersect(local, closestT, [&](int i, double& meshT) {
+            COUNTER_INC(triangleTests);
+            double t = triangleIntersect(triangles[i], local).first;
+            hit = t != -1.0 && t < meshT;
+            return hit;
+        });
+        return hit;
+    });
+    return hit;
+}
+
+size_t Scene::instancedTriangleCount() const
+{
+    size_t count = objects.size();
+    for (const Instance& instance : instances)
+        count += instance.mesh->triangles.size();
+    return count;
+}
+
+void loadDefaultScene(Scene& scene)
+{
+    //Material (BSDF) initialization
+
+    //phongBSDF* DiffuseReflector = scene.addMaterial<phongBSDF>();
+    //DiffuseReflector->phongExponent = 1;
+    mirrorBSDF* ShinyReflector = scene.addMaterial<mirrorBSDF>();
+
+    simpleDiffuseBSDF* DiffuseReflector = scene.addMaterial<simpleDiffuseBSDF>();
+
+    //Mesh creation
+    readObj("largebox.obj", scene, Color(1.0,1.0,1.0), Color(0,0,0), DiffuseReflector);
+    readObj("leftwall.obj", scene, Color(1.0,0.0,0.0), Color(0,0,0), DiffuseReflector);
+    readObj("rightwall.obj", scene, Color(0.0,1.0,0.0), Color(0,0,0), DiffuseReflector);
+
+    readObj("box1.obj", scene, Color(1.0,1.0,1.0), Color(0,0,0), DiffuseReflector);
+    readObj("widebox.obj", scene, Color(1.0,1.0,0.6), Color(0,0,0), ShinyReflector);
+
+    //
+    //readObj("light.obj", scene, Color(1.0,1.0,0.6), 1*Color(10,10,6), DiffuseReflector);
+    readObj("smalllight.obj", scene, Color(1.0,1.0,0.6), 30*Color(10,10,6), DiffuseReflector);
+}
+
+// A file named relative to the directory another file is in, like the mtllib and texture names of an obj file
+static string siblingPath(const string& file, const string& name)
+{
+    std::filesystem::path path(name);
+    if (path.is_absolute())
+        return name;
+    return (std::filesystem::path(file).parent_path() / path).string();
+}
+
+// Adds the diffuse texture (map_Kd) of every material in an mtl file to textures, by material name. Everything
+// else in the file is ignored: the color and BSDF come from the readObj call.
+static void readMaterialTextures(const string& filename, std::map<string, string>& textures)
+{
+    // exporters name an mtl file even when they do not write one, so a missing one just means no textures
+    std::ifstream file(filename);
+    if (!file.is_open())
+        return;
+
+    string line, material;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        string prefix;
+        iss >> prefix;
+
+        if (prefix == "newmtl")
+            iss >> material;
+        else if (prefix == "map_Kd")
+        {
+            // the file name is the last word, after any options
+            string name, word;
+            while (iss >> word)
+                name = word;
+            if (!name.empty())
+                textures[material] = siblingPath(filename, name);
+        }
+    }
+}
+
+// reads in obj files and appends the data to vertices and triangles. reserve(n) is called before a face adds its n
+// vertices, so the owner of the vertices can make room without leaving earlier triangles dangling.
+template <typename ReserveFunction>
+static void parseObj(const string& filename, vector<Vertex>& vertices, vector<Triangle>& mesh, Color c, Color e,
+    BSDF* material, ReserveFunction reserve)
+{
+    TRACE_SCOPE(filename.c_str());
+    std::ifstream file(filename);
+
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not open OBJ file " << filename << "\n";
+        return;
+    }
+
+    vector<Point> points;
+    vector<Vec3> normals;
+    vector<std::pair<double, double>> uvs;
+
+    // the texture of every material in the mtllib files, and the one the faces use at the moment
+    std::map<string, string> textureFiles;
+    const Texture* texture = nullptr;
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue; // skip comments
+
+        std::istringstream iss(line);
+        std::string prefix;
+
+        iss >> prefix;
+
+        if (prefix == "v") {
+            double x, y, z;
+            iss >> x >> y >> z;
+            Point p(x,y,z);
+            points.push_back(p);
+        }
+        else if (prefix == "vt") {
+            double u = 0, v = 0;
+            iss >> u >> v;
+            uvs.push_back({u, v});
+        }
+        else if (prefix == "vn") {
+            double x, y, z;
+            iss >> x >> y >> z;
+            Vec3 n(x,y,z);
+            normals.push_back(n);
+        }
+        else if (prefix == "mtllib") {
+            string library;
+            iss >> library;
+            readMaterialTextures(siblingPath(filename, library), textureFiles);
+        }
+        else if (prefix == "usemtl") {
+            string name;
+            iss >> name;
+            auto found = textureFiles.find(name);
+            texture = found != textureFiles.end() ? loadTexture(found->second) : nullptr;
+        }
+        else if (prefix == "f") {
+            vector<string> items;
+
+            string vertinfo;
+            vector<int> vertexIndices;
+            vector<int> uvIndices;
+            vector<int> normalIndices;
+            while (iss >> vertinfo)
+            {
+                istringstream vss(vertinfo);
+                string idx;
+
+                if (getline(vss, idx, '/'))
+                {
+                    if (!idx.empty())
+                        vertexIndices.push_back(stoi(idx) - 1);
+                }
+                if (getline(vss, idx, '/'))
+                {
+                    if (!idx.empty())
+                        uvIndices.push_back(stoi(idx) - 1);
+                }
+                if (getline(vss, idx, '/'))
+                {
+                    if (!idx.empty())
+                        normalIndices.push_back(stoi(idx) - 1);
+                }
+            }
+            int n = vertexIndices.size();
+            if (n < 3)
+                continue;
+
+            // make sure pushing this face's vertices can not leave earlier triangles pointing at freed memory
+            reserve(n);
+
+            // the face's i-th vertex, with its texture coordinates if every vertex of the face has them
+            auto faceVertex = [&](int i) {
+                Vertex vertex(points[vertexIndices[i]], c, normals[normalIndices[i]]);
+                if ((int)uvIndices.size() == n)
+                {
+                    vertex.u = uvs[uvIndices[i]].first;
+                    vertex.v = uvs[uvIndices[i]].second;
+                }
+                return vertex;
+            };
+            auto addTriangle = [&](Vertex* v1, Vertex* v2, Vertex* v3) {
+                mesh.push_back(Triangle(v1, v2, v3, e, material));
+                mesh.back().texture = texture;
+            };
+
+            if (n == 3)
+            {
+                int startIndex = vertices.size(); // current end of vector
+
+                // create vertices and store them in the vector
+                vertices.push_back(faceVertex(0));
+                vertices.push_back(faceVertex(1));
+                vertices.push_back(faceVertex(2));
+
+                // pointers to the vertices stored in the vector
+                Vertex* v1 = &vertices[startIndex];
+                Vertex* v2 = &vertices[startIndex + 1];
+                Vertex* v3 = &vertices[startIndex + 2];
+
+                // create triangle using the pointers
+                addTriangle(v1, v2, v3);
+            }
+            else if (n == 4)
+            {
+                int startIndex = vertices.size();
+
+                vertices.push_back(faceVertex(0));
+                vertices.push_back(faceVertex(1));
+                vertices.push_back(faceVertex(2));
+                vertices.push_back(faceVertex(3));
+
+                Vertex* v1 = &vertices[startIndex];
+                Vertex* v2 = &vertices[startIndex + 1];
+                Vertex* v3 = &vertices[startIndex + 2];
+                Vertex* v4 = &vertices[startIndex + 3];
+
+                // split quad into two triangles
+                addTriangle(v1, v2, v3);
+                addTriangle(v1, v3, v4);
+            }
+            else
+            {
+                int startIndex = vertices.size();
+                std::vector<Vertex*> polyVertices;
+                polyVertices.reserve(n);
+
+                for (int i = 0; i < n; ++i)
+                {
+                    // Create the vertex and add it to the main list
+                    vertices.push_back(faceVertex(i));
+                    polyVertices.push_back(&vertices[startIndex + i]);
+                }
+
+                for (int i = 1; i < n - 1; ++i)
+                {
+                    Vertex* v1 = polyVertices[0];
+                    Vertex* v2 = polyVertices[i];
+                    Vertex* v3 = polyVertices[i + 1];
+
+                    addTriangle(v1, v2, v3);
+                }
+            }
+        }
+    }
+
+    file.close();
+}
+
+void readObj(string filename, Scene& scene, Color c, Color e, BSDF* material)
+{
+    ObjectGroup group;
+    group.name = filename;
+    group.firstVertex = scene.vertices.size();
+    group.firstTriangle = scene.objects.size();
+
+    parseObj(filename, scene.vertices, scene.objects, c, e, material,
+        [&](size_t n) { scene.reserveVertices(n); });
+
+    group.vertexCount = scene.vertices.size() - group.firstVertex;
+    group.triangleCount = scene.objects.size() - group.firstTriangle;
+    scene.groups.push_back(group);
+}
+
+void readObj(string filename, Mesh& mesh, Color c, Color e, BSDF* material)
+{
+    parseObj(filename, mesh.vertices, mesh.triangles, c, e, material,
+        [&](size_t n) { mesh.reserveVertices(n); });
+}
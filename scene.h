@@ -0,0 +1,173 @@
+/*
+Contains the Scene class, which owns all of the geometry, lights and materials used by a render, along with the
+obj file reader that fills it.
+
+Geometry comes in two forms. Triangles in `objects` are in world space, each with its own vertices. A Mesh is
+stored once in its own (object) space and placed any number of times by instances, each with a transform and an
+optional material override, so repeated objects only cost one copy of their triangles.
+
+Rays are traced through a two level structure: one BVH over the world space triangles and one over the instances'
+world bounds. A ray that reaches an instance is moved into the instance's object space and continues down the
+mesh's own BVH, which every instance of that mesh shares.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+#include "object.h"
+#include "lightTransport.h"
+#include "bvh.h"
+#include "environmentLight.h"
+
+// Geometry shared by instances. The vertices are in object space.
+struct Mesh
+{
+    std::vector<Vertex> vertices;
+    std::vector<Triangle> triangles;
+
+    BVH bvh;
+    AABB bounds;
+
+    // Same as Scene::reserveVertices
+    void reserveVertices(size_t count);
+
+    // Builds the BVH over the triangles. Called by Scene::build.
+    void build();
+};
+
+// One placement of a mesh in the world
+struct Instance
+{
+    const Mesh* mesh;
+    Transform objectToWorld;
+    Transform worldToObject;
+    BSDF* material;     // replaces the material of the mesh's triangles, unless it is null
+    AABB bounds;        // world space, set by Scene::build
+};
+
+// The world space vertices and triangles added by one readObj call, so they can be found again (for example to
+// animate them)
+struct ObjectGroup
+{
+    std::string name;
+    size_t firstVertex = 0;
+    size_t vertexCount = 0;
+    size_t firstTriangle = 0;
+    size_t triangleCount = 0;
+};
+
+class Scene
+{
+    public:
+
+    // Stores all vertices continguously in memory for performance
+    // (Triangle objects contain pointers to vertices)
+    std::vector<Vertex> vertices;
+    std::vector<Triangle> objects;
+    std::vector<Triangle> lights;
+
+    // Materials are owned by the scene so triangles can keep raw pointers to them
+    std::vector<std::unique_ptr<BSDF>> materials;
+
+    // Meshes are owned the same way, so instances can point at them
+    std::vector<std::unique_ptr<Mesh>> meshes;
+    std::vector<Instance> instances;
+
+    // Built by build(): the BVH over `objects` and the top level BVH over `instances`
+    BVH objectBVH;
+    BVH instanceBVH;
+
+    // World space copies of the emissive triangles of instances, which their entries in `lights` point into
+    std::vector<Vertex> lightVertices;
+
+    // Light from every direction that rays leaving the scene see, if set
+    std::unique_ptr<EnvironmentLight> environment;
+
+    // Named after the file each group was read from
+    std::vector<ObjectGroup> groups;
+
+    Scene() {}
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+    Scene(Scene&&) = default;
+    Scene& operator=(Scene&&) = default;
+
+    template <typename T>
+    T* addMaterial()
+    {
+        materials.push_back(std::make_unique<T>());
+        return static_cast<T*>(materials.back().get());
+    }
+
+    Mesh* addMesh();
+
+    // Places `mesh` in the world. A material replaces the one of every triangle of this instance.
+    Instance& addInstance(const Mesh* mesh, const Transform& objectToWorld, BSDF* material = nullptr);
+
+    // Makes room for `count` more vertices. If the vertex storage has to move, the triangle pointers are fixed up,
+    // so callers never have to guess a big enough reserve up front.
+    void reserveVertices(size_t count);
+
+    // Prepares the scene for rendering once all geometry has been added: builds the BVHs and collects the
+    // emissive triangles (instanced ones are copied into world space)
+    void build();
+
+    // Call after moving vertices or changing instance transforms (but not adding or removing anything) since the
+    // last build. The BVHs are refitted to the new positions, except that one whose SAH cost has grown past
+    // maxCostRatio times its cost when it was built is rebuilt. Returns how many BVHs were rebuilt.
+    // If only instance transforms changed, verticesMoved = false skips everything below the top level.
+    int refit(double maxCostRatio = 1.5, bool verticesMoved = true);
+
+    // Null if no group has that name
+    ObjectGroup* findGroup(const std::string& name);
+
+    // The index in `groups` of the group a triangle of `objects` belongs to, or -1
+    int groupOf(size_t triangle) const;
+
+    // The bit of the group whose triangle a hit is on, for masks of groups: group k has bit k % 63, and every
+    // triangle outside the groups (including those of instances) has bit 63
+    unsigned long long groupBit(const Intersection& hit) const;
+
+    // Closest hit closer than maxT, through both levels of the BVH. Only valid after build().
+    Intersection intersect(const Ray& r, double maxT) const;
+
+    // The traversal of intersect() without the shading data: false if nothing is hit closer than maxT, or else maxT
+    // becomes the hit's distance and the rest say which triangle it is (see Intersection::primitive) and where
+    bool closestHit(const Ray& r, double& maxT, int& primitive, int& instance, Vec3& barycentrics) const;
+
+    // The intersection intersect() gave for r, rebuilt from the triangle, barycentrics and distance it recorded
+    // (Intersection::primitive, instance, barycentrics and t) without tracing r again. The hit's color, normal and
+    // material are read from the scene as it is now. A primitive below 0 is a miss.
+    Intersection hitAt(const Ray& r, int primitive, int instance, const Vec3& barycentrics, double t) const;
+
+    // Whether anything is hit closer than maxT; stops at the first hit it finds
+    bool occluded(const Ray& r, double maxT) const;
+
+    // Triangles the renderer sees, counting every instance separately
+    size_t instancedTriangleCount() const;
+
+    // What next event estimation picks from, uniformly: every emissive triangle, and the environment as one more
+    size_t emitterCount() const { return lights.size() + (environment ? 1 : 0); }
+
+    // Collects the emissive triangles into `lights` again, which build() does. Call it after changing the emission
+    // of triangles, so light sampling sees the change.
+    void collectLights();
+
+    private:
+
+    void updateInstanceBounds(std::vector<AABB>& bounds);
+    Intersection surfaceHit(const Ray& r, int primitive, int instance, const Vec3& hitP, double t) const;
+};
+
+// Reads an obj file into the world. Faces with texture coordinates (vt) whose material (usemtl, from an mtllib
+// file) has a diffuse texture (map_Kd) get that texture, which multiplies the color c.
+void readObj(std::string filename, Scene& scene, Color c, Color e, BSDF* material);
+
+// Reads an obj file into a mesh instead of the world, so it can be placed with instances
+void readObj(std::string filename, Mesh& mesh, Color c, Color e, BSDF* material);
+
+// The box scene with the small light that main renders by default
+void loadDefaultScene(Scene& scene);
@@ -0,0 +1,337 @@
+/*
+Contains the procedural scene generator and the obj writer.
+
+*/
+
+#include "sceneGenerator.h"
+#include "trace.h"
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+
+static const double PI = 3.14159265358979323846;
+
+// adds a triangle wound so that its front face (the one triangleIntersect can hit) points along `outward`
+static void addTriangle(Scene& scene, Vertex* v1, Vertex* v2, Vertex* v3, Color e, BSDF* material, const Vec3& outward)
+{
+    if (dot(cross(v2->pt - v1->pt, v3->pt - v1->pt), outward) < 0)
+        std::swap(v2, v3);
+    scene.objects.push_back(Triangle(v1, v2, v3, e, material));
+}
+
+void generateSphere(Scene& scene, Point center, double radius, int segments, Color c, Color e, BSDF* material)
+{
+    int slices = std::max(3, segments);
+    int rings = std::max(2, segments / 2);
+
+    // the seam column is duplicated so every ring has slices + 1 vertices
+    scene.reserveVertices((rings + 1) * (slices + 1));
+    scene.objects.reserve(scene.objects.size() + 2 * rings * slices);
+
+    size_t startIndex = scene.vertices.size();
+    for (int r = 0; r <= rings; r++)
+    {
+        double theta = PI * r / rings;
+        for (int s = 0; s <= slices; s++)
+        {
+            double phi = 2 * PI * s / slices;
+            Vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            scene.vertices.push_back(Vertex(center + n * radius, c, n));
+        }
+    }
+
+    auto at = [&](int r, int s) { return &scene.vertices[startIndex + r * (slices + 1) + s]; };
+
+    for (int r = 0; r < rings; r++)
+    {
+        for (int s = 0; s < slices; s++)
+        {
+            Vertex* v00 = at(r, s);
+            Vertex* v10 = at(r + 1, s);
+            Vertex* v11 = at(r + 1, s + 1);
+            Vertex* v01 = at(r, s + 1);
+            Vec3 outward = (v00->n + v10->n + v11->n + v01->n) / 4.0;
+
+            // the triangles touching a pole would be degenerate, so the pole rings only get one each
+            if (r != 0)
+                addTriangle(scene, v00, v10, v01, e, material, outward);
+            if (r != rings - 1)
+                addTriangle(scene, v10, v11, v01, e, material, outward);
+        }
+    }
+}
+
+void generateTerrain(Scene& scene, Point center, double size, int resolution, double amplitude, unsigned int seed,
+    Color c, BSDF* material)
+{
+    resolution = std::max(1, resolution);
+
+    // a handful of waves with random directions, doubling in frequency and halving in height
+    struct Wave { double dx, dz, frequency, phase, height; };
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    vector<Wave> waves;
+    double totalHeight = 0;
+    for (int k = 0; k < 8; k++)
+    {
+        double angle = 2 * PI * dist(rng);
+        Wave w = {std::cos(angle), std::sin(angle), (1 << k) * 2 * PI / size, 2 * PI * dist(rng), 1.0 / (1 << k)};
+        totalHeight += w.height;
+        waves.push_back(w);
+    }
+
+    auto height = [&](double x, double z) {
+        double h = 0;
+        for (const Wave& w : waves)
+            h += w.height * std::sin((w.dx * x + w.dz * z) * w.frequency + w.phase);
+        return h * amplitude / totalHeight;
+    };
+
+    int side = resolution + 1;
+    double step = size / resolution;
+    scene.reserveVertices(side * side);
+    scene.objects.reserve(scene.objects.size() + 2 * resolution * resolution);
+
+    size_t startIndex = scene.vertices.size();
+    for (int i = 0; i < side; i++)
+    {
+        for (int k = 0; k < side; k++)
+        {
+            double x = -size / 2 + i * step;
+            double z = -size / 2 + k * step;
+
+            // normal from central differences of the height function
+            double dhdx = (height(x + step, z) - height(x - step, z)) / (2 * step);
+            double dhdz = (height(x, z + step) - height(x, z - step)) / (2 * step);
+            Vec3 n = unit(Vec3(-dhdx, 1.0, -dhdz));
+
+            scene.vertices.push_back(Vertex(center + Vec3(x, height(x, z), z), c, n));
+        }
+    }
+
+    auto at = [&](int i, int k) { return &scene.vertices[startIndex + i * side + k]; };
+    Color noEmission = Color(0,0,0);
+
+    for (int i = 0; i < resolution; i++)
+    {
+        for (int k = 0; k < resolution; k++)
+        {
+            addTriangle(scene, at(i, k), at(i + 1, k), at(i + 1, k + 1), noEmission, material, Vec3(0,1,0));
+            addTriangle(scene, at(i, k), at(i + 1, k + 1), at(i, k + 1), noEmission, material, Vec3(0,1,0));
+        }
+    }
+}
+
+void generateLights(Scene& scene, int count, Point min, Point max, double size, double minPower, double maxPower,
+    unsigned int seed, BSDF* material)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+
+    scene.reserveVertices(3 * count);
+    scene.objects.reserve(scene.objects.size() + count);
+
+    Vec3 down = Vec3(0,-1,0);
+    for (int i = 0; i < count; i++)
+    {
+        Point p = Point(min.x() + dist(rng) * (max.x() - min.x()),
+            min.y() + dist(rng) * (max.y() - min.y()),
+            min.z() + dist(rng) * (max.z() - min.z()));
+        Color c = Color(0.5 + 0.5 * dist(rng), 0.5 + 0.5 * dist(rng), 0.5 + 0.5 * dist(rng));
+        double power = minPower * std::pow(maxPower / minPower, dist(rng));
+
+        size_t startIndex = scene.vertices.size();
+        scene.vertices.push_back(Vertex(p, c, down));
+        scene.vertices.push_back(Vertex(p + Vec3(size, 0, 0), c, down));
+        scene.vertices.push_back(Vertex(p + Vec3(0, 0, size), c, down));
+
+        addTriangle(scene, &scene.vertices[startIndex], &scene.vertices[startIndex + 1],
+            &scene.vertices[startIndex + 2], c * power, material, down);
+    }
+}
+
+void generateGrid(Scene& scene, size_t first, size_t count, int nx, int ny, int nz, Vec3 spacing)
+{
+    if (count == 0 || first + count > scene.objects.size())
+        return;
+
+    size_t copies = (size_t)nx * ny * nz - 1;
+
+    // find the distinct vertices of the template so the copies share vertices the same way
+    unordered_map<const Vertex*, size_t> localIndex;
+    vector<size_t> templateVertices;
+    for (size_t t = first; t < first + count; t++)
+    {
+        const Triangle& tri = scene.objects[t];
+        for (const Vertex* v : {tri.a, tri.b, tri.c})
+        {
+            if (localIndex.emplace(v, templateVertices.size()).second)
+                templateVertices.push_back(v - scene.vertices.data());
+        }
+    }
+
+    // the vertex storage may move while making room for the copies, so the template is remembered by index
+    vector<size_t> triangleCorners;
+    for (size_t t = first; t < first + count; t++)
+    {
+        const Triangle& tri = scene.objects[t];
+        triangleCorners.push_back(localIndex[tri.a]);
+        triangleCorners.push_back(localIndex[tri.b]);
+        triangleCorners.push_back(localIndex[tri.c]);
+    }
+    localIndex.clear();
+
+    scene.reserveVertices(copies * templateVertices.size());
+    scene.objects.reserve(scene.objects.size() + copies * count);
+
+    for (int x = 0; x < nx; x++)
+    for (int y = 0; y < ny; y++)
+    for (int z = 0; z < nz; z++)
+    {
+        if (x == 0 && y == 0 && z == 0)
+            continue;
+
+        Vec3 offset = Vec3(x * spacing.x(), y * spacing.y(), z * spacing.z());
+        size_t startIndex = scene.vertices.size();
+        for (size_t v : templateVertices)
+        {
+            Vertex copy = scene.vertices[v];
+            copy.pt += offset;
+            scene.vertices.push_back(copy);
+        }
+
+        for (size_t t = 0; t < count; t++)
+        {
+            Triangle tri = scene.objects[first + t];
+            tri.a = &scene.vertices[startIndex + triangleCorners[3 * t]];
+            tri.b = &scene.vertices[startIndex + triangleCorners[3 * t + 1]];
+            tri.c = &scene.vertices[startIndex + triangleCorners[3 * t + 2]];
+            scene.objects.push_back(tri);
+        }
+    }
+}
+
+void generateStressScene(Scene& scene, const StressSceneConfig& config)
+{
+    TRACE_SCOPE("generate stress scene");
+    simpleDiffuseBSDF* diffuse = scene.addMaterial<simpleDiffuseBSDF>();
+    mirrorBSDF* mirror = scene.addMaterial<mirrorBSDF>();
+
+    // scale the triangle counts, which go with the square of the resolutions
+    double s = std::sqrt(std::max(config.scale, 0.0));
+    auto scaled = [&](int resolution) { return std::max(2, int(resolution * s)); };
+
+    generateTerrain(scene, Point(0,-1.5,-6), 12, scaled(config.terrainResolution), 0.6, config.seed,
+        Color(0.8,0.8,0.7), diffuse);
+    generateSphere(scene, Point(0,-0.3,-5), 1.0, scaled(config.sphereSegments), Color(1.0,1.0,0.8), Color(0,0,0),
+        mirror);
+
+    Point gridCorner = Point(-2.7,-0.8,-2.5);
+    Vec3 gridSpacing = Vec3(6.0 / config.gridSize, 0, -6.0 / config.gridSize);
+    if (config.instanceGrid)
+    {
+        // generate the sphere once around the origin, then move its storage into a mesh (moving a vector keeps
+        // its buffer, so the triangle pointers stay valid)
+        Scene sphere;
+        generateSphere(sphere, Point(0,0,0), 0.2, scaled(config.gridSphereSegments), Color(0.9,0.3,0.3),
+            Color(0,0,0), diffuse);
+        Mesh* mesh = scene.addMesh();
+        mesh->vertices = std::move(sphere.vertices);
+        mesh->triangles = std::move(sphere.objects);
+
+        for (int x = 0; x < config.gridSize; x++)
+        for (int z = 0; z < config.gridSize; z++)
+        {
+            Vec3 offset = Vec3(x * gridSpacing.x(), 0, z * gridSpacing.z());
+            scene.addInstance(mesh, Transform::translate(gridCorner + offset));
+        }
+    }
+    else
+    {
+        size_t first = scene.objects.size();
+        generateSphere(scene, gridCorner, 0.2, scaled(config.gridSphereSegments), Color(0.9,0.3,0.3),
+            Color(0,0,0), diffuse);
+        generateGrid(scene, first, scene.objects.size() - first, config.gridSize, 1, config.gridSize, gridSpacing);
+    }
+
+    generateLights(scene, config.lightCount, Point(-5,3,-10), Point(5,4,-1), 0.2, 5, 500, config.seed + 1, diffuse);
+}
+
+bool writeObj(const Scene& scene, std::string filename, ObjContents contents)
+{
+    FILE* out = std::fopen(filename.c_str(), "w");
+    if (out == nullptr)
+    {
+        std::cerr << "Error: Could not open " << filename << " for writing\n";
+        return false;
+    }
+
+    std::fprintf(out, "# written by the scene generator\n");
+
+    // vertices are written the first time a face uses them, so a filtered file only contains what it needs
+    vector<long> objIndex(scene.vertices.size(), 0);
+    long written = 0;
+
+    auto index = [&](const Vertex* v) {
+        long& idx = objIndex[v - scene.vertices.data()];
+        if (idx == 0)
+        {
+            std::fprintf(out, "v %.6g %.6g %.6g\nvn %.6g %.6g %.6g\n", v->pt.x(), v->pt.y(), v->pt.z(),
+                v->n.x(), v->n.y(), v->n.z());
+            idx = ++written;
+        }
+        return idx;
+    };
+
+    auto wanted = [&](const Triangle& tri) {
+        bool emissive = tri.emission.lengthSquared() > 0;
+        return !((contents == ObjContents::Emissive && !emissive) || (contents == ObjContents::NonEmissive && emissive));
+    };
+
+    for (const Triangle& tri : scene.objects)
+    {
+        if (!wanted(tri))
+            continue;
+
+        long a = index(tri.a), b = index(tri.b), c = index(tri.c);
+        std::fprintf(out, "f %ld//%ld %ld//%ld %ld//%ld\n", a, a, b, b, c, c);
+    }
+
+    for (const Instance& instance : scene.instances)
+    {
+        const Mesh& mesh = *instance.mesh;
+        vector<long> meshIndex(mesh.vertices.size(), 0);
+
+        auto instanceIndex = [&](const Vertex* v) {
+            long& idx = meshIndex[v - mesh.vertices.data()];
+            if (idx == 0)
+            {
+                Point p = instance.objectToWorld.applyPoint(v->pt);
+                Vec3 n = unit(Transform::applyNormal(instance.worldToObject, v->n));
+                std::fprintf(out, "v %.6g %.6g %.6g\nvn %.6g %.6g %.6g\n", p.x(), p.y(), p.z(), n.x(), n.y(), n.z());
+                idx = ++written;
+            }
+            return idx;
+        };
+
+        for (const Triangle& tri : mesh.triangles)
+        {
+            if (!wanted(tri))
+                continue;
+
+            long a = instanceIndex(tri.a), b = instanceIndex(tri.b), c = instanceIndex(tri.c);
+            std::fprintf(out, "f %ld//%ld %ld//%ld %ld//%ld\n", a, a, b, b, c, c);
+        }
+    }
+
+    bool ok = std::ferror(out) == 0;
+    std::fclose(out);
+    return ok;
+}
@@ -0,0 +1,64 @@
+/*
+Contains the procedural scene generator, which builds large parameterized scenes straight into a Scene for
+stress testing, and the obj writer that can save them.
+
+Generated meshes share vertices between neighbouring triangles, unlike readObj, so a scene with millions of
+triangles does not need three vertices per triangle.
+
+*/
+
+#pragma once
+
+#include <string>
+#include "object.h"
+#include "scene.h"
+
+// Sphere tessellated into `segments` slices around and segments/2 rings, so about segments^2 triangles
+void generateSphere(Scene& scene, Point center, double radius, int segments, Color c, Color e, BSDF* material);
+
+// Square heightfield centered on `center` in the xz plane, facing +y, with 2 * resolution^2 triangles.
+// The height is a sum of randomly oriented waves picked from `seed`, at most `amplitude` high.
+void generateTerrain(Scene& scene, Point center, double size, int resolution, double amplitude, unsigned int seed,
+    Color c, BSDF* material);
+
+// `count` small emissive triangles facing -y, scattered in the box [min, max]. Each gets a random color and a
+// power picked log-uniformly between minPower and maxPower, so light selection sees a wide range of emitters.
+void generateLights(Scene& scene, int count, Point min, Point max, double size, double minPower, double maxPower,
+    unsigned int seed, BSDF* material);
+
+// Repeats the `count` triangles starting at objects[first] on an nx * ny * nz grid with the given spacing.
+// The original copy stays where it is and is the grid's first cell.
+void generateGrid(Scene& scene, size_t first, size_t count, int nx, int ny, int nz, Vec3 spacing);
+
+struct StressSceneConfig
+{
+    // roughly sphereSegments^2 triangles
+    int sphereSegments = 256;
+
+    // 2 * terrainResolution^2 triangles
+    int terrainResolution = 256;
+
+    int lightCount = 1000;
+
+    // gridSize^2 copies of a small sphere with gridSphereSegments^2 triangles each
+    int gridSize = 10;
+    int gridSphereSegments = 20;
+
+    // Places the grid spheres as instances of one shared mesh instead of copying their triangles
+    bool instanceGrid = false;
+
+    unsigned int seed = 1;
+
+    // Multiplies the triangle counts of every part (the light count is left alone)
+    double scale = 1.0;
+};
+
+// A terrain, a big mirror sphere, a grid of diffuse spheres and a field of lights in front of the default camera
+void generateStressScene(Scene& scene, const StressSceneConfig& config);
+
+enum class ObjContents { All, Emissive, NonEmissive };
+
+// Writes the scene's triangles as an obj file with positions and normals (colors and materials are not kept).
+// Instances are written out as world space copies of their mesh.
+// Emissive and non-emissive triangles can be written to separate files, since readObj gives one emission per file.
+bool writeObj(const Scene& scene, std::string filename, ObjContents contents = ObjContents::All);
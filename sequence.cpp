@@ -0,0 +1,189 @@
+/*
+Contains the sequence mode.
+
+*/
+
+#include "sequence.h"
+#include "benchmark.h"
+#include "renderer.h"
+#include "scene.h"
+#include "image.h"
+#include "trace.h"
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+static const double PI = 3.14159265358979323846;
+
+static double secondsSince(std::chrono::high_resolution_clock::time_point start)
+{
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    return elapsed.count();
+}
+
+// A group's vertices as they were loaded, which every frame's pose is computed from
+struct SpinningGroup
+{
+    size_t firstVertex;
+    vector<Vertex> rest;
+    Point center;
+};
+
+struct FrameRow
+{
+    int frame;
+    double update, render, write;
+    int rebuilt;
+};
+
+int runSequence(const SequenceConfig& config)
+{
+    Scene scene;
+    if (!loadBenchmarkScene(scene, config.scene, config.stressScale))
+        return 1;
+
+    vector<SpinningGroup> spinning;
+    for (const string& name : config.spinGroups)
+    {
+        ObjectGroup* group = scene.findGroup(name);
+        if (group == nullptr)
+        {
+            cerr << "Warning: No group " << name << " in the " << config.scene << " scene, it will not move\n";
+            continue;
+        }
+
+        SpinningGroup spin;
+        spin.firstVertex = group->firstVertex;
+        spin.rest.assign(scene.vertices.begin() + group->firstVertex,
+            scene.vertices.begin() + group->firstVertex + group->vertexCount);
+        AABB bounds;
+        for (const Vertex& v : spin.rest)
+            bounds.grow(v.pt);
+        spin.center = bounds.center();
+        spinning.push_back(spin);
+    }
+
+    vector<Transform> restTransforms;
+    for (const Instance& instance : scene.instances)
+        restTransforms.push_back(instance.objectToWorld);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    scene.build();
+    double buildTime = secondsSince(start);
+
+    cout << "Sequence: " << config.frames << " frames of " << config.scene << " at " << config.imageWidth << "x"
+        << config.imageHeight << ", " << config.sampleCount << " spp, " << describeIntegrator(config.integrator)
+        << ", initial build " << fixed << setprecision(4) << buildTime << defaultfloat << " s" << endl;
+
+    cout << setw(7) << "frame" << setw(11) << "update(s)" << setw(9) << "rebuilt" << setw(11) << "render(s)"
+        << setw(10) << "write(s)" << setw(11) << "overhead" << endl;
+
+    MISIntegrator integrator = config.integrator;
+
+    RenderSettings settings;
+    settings.imageWidth = config.imageWidth;
+    settings.imageHeight = config.imageHeight;
+    settings.sampleCount = config.sampleCount;
+    settings.threads = config.threads;
+    settings.deterministic = true;
+    settings.seed = config.seed;
+    settings.showProgress = config.showProgress;
+
+    // one buffer for every frame; the render overwrites each pixel
+    Image image(config.imageWidth, config.imageHeight);
+    Camera camera;
+
+    vector<FrameRow> rows;
+    double totalRender = 0;
+    auto sequenceStart = std::chrono::high_resolution_clock::now();
+
+    for (int frame = 0; frame < config.frames; frame++)
+    {
+        TRACE_SCOPE("frame", frame);
+        FrameRow row = {};
+        row.frame = frame;
+        double t = config.frames > 1 ? double(frame) / (config.frames - 1) : 0.0;
+
+        auto phase = std::chrono::high_resolution_clock::now();
+
+        camera.place(config.cameraMove * t, config.cameraYaw * t);
+
+        for (const SpinningGroup& spin : spinning)
+        {
+            Transform pose = Transform::translate(spin.center) * Transform::rotateY(config.spinDegrees * t)
+                * Transform::translate(-spin.center);
+            for (size_t v = 0; v < spin.rest.size(); v++)
+            {
+                Vertex& vertex = scene.vertices[spin.firstVertex + v];
+                vertex.pt = pose.applyPoint(spin.rest[v].pt);
+                vertex.n = pose.applyVector(spin.rest[v].n);
+            }
+        }
+
+        for (size_t k = 0; k < scene.instances.size(); k++)
+        {
+            // golden ratio phases, so neighbouring instances never move in step
+            double bob = config.instanceBob * std::sin(2 * PI * (t + k * 0.618034));
+            Instance& instance = scene.instances[k];
+            instance.objectToWorld = Transform::translate(Vec3(0, bob, 0)) * restTransforms[k];
+            instance.worldToObject = instance.objectToWorld.inverse();
+        }
+
+        if (frame > 0)
+        {
+            if (config.rebuildInterval > 0 && frame % config.rebuildInterval == 0)
+            {
+                scene.build();
+                row.rebuilt = -1;
+            }
+            else
+                row.rebuilt = scene.refit(config.maxCostRatio, !spinning.empty());
+        }
+        row.update = secondsSince(phase);
+
+        // each frame takes the next block of samples, so frames do not share their noise pattern
+        settings.firstSample = frame * config.sampleCount;
+        RenderStats stats = renderImage(scene, integrator, camera, settings, image);
+        row.render = stats.seconds;
+        totalRender += stats.seconds;
+
+        phase = std::chrono::high_resolution_clock::now();
+        char fileName[32];
+        std::snprintf(fileName, sizeof(fileName), "_%04d.bmp", frame);
+        image.saveImageBMP(config.outputPrefix + fileName);
+        row.write = secondsSince(phase);
+        rows.push_back(row);
+
+        double overhead = (row.update + row.write) / (row.update + row.render + row.write);
+        cout << setw(7) << frame << fixed << setprecision(4) << setw(11) << row.update
+            << setw(9) << (row.rebuilt < 0 ? string("all") : to_string(row.rebuilt))
+            << setw(11) << row.render << setw(10) << row.write << setprecision(2) << setw(10) << 100 * overhead << "%"
+            << defaultfloat << endl;
+    }
+
+    double total = secondsSince(sequenceStart);
+    cout << "Total " << fixed << setprecision(3) << total << " s for " << config.frames << " frames, "
+        << total / config.frames << " s per frame, " << setprecision(2) << 100 * (total - totalRender) / total
+        << "% outside the render" << defaultfloat << endl;
+
+    if (!config.csvFile.empty())
+    {
+        ofstream csv(config.csvFile);
+        if (!csv.is_open())
+        {
+            cerr << "Error: Could not open " << config.csvFile << " for writing\n";
+            return 1;
+        }
+        csv << "frame,update_s,rebuilt,render_s,write_s\n";
+        for (const FrameRow& row : rows)
+            csv << row.frame << "," << row.update << "," << row.rebuilt << "," << row.render << "," << row.write << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+Contains the sequence mode, which renders an animation (a camera move plus moving objects) as numbered frames in
+one process.
+
+The scene is loaded and built once. Between frames only positions change, so the BVHs are refitted instead of
+rebuilt, with a full rebuild whenever refitting has made a tree too slow (see Scene::refit). The image buffer and
+the OpenMP thread pool are reused from frame to frame, so the time per frame is mostly the render itself.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include "object.h"
+#include "lightTransport.h"
+
+struct SequenceConfig
+{
+    // See loadBenchmarkScene
+    std::string scene = "default";
+    double stressScale = 1.0;
+
+    int frames = 24;
+    int imageWidth = 256;
+    int imageHeight = 256;
+    int sampleCount = 8;
+    int threads = 0;
+    unsigned int seed = 12345;
+    MISIntegrator integrator;
+
+    // Over the whole sequence, the camera moves by cameraMove and turns cameraYaw degrees around its own origin
+    Vec3 cameraMove = Vec3(0, 0, -0.3);
+    double cameraYaw = 10;
+
+    // readObj groups (named after their file) that turn spinDegrees around their own vertical center line over
+    // the sequence. Only their vertices change, so their BVH is refitted.
+    std::vector<std::string> spinGroups = {"box1.obj"};
+    double spinDegrees = 90;
+
+    // Every instance bobs up and down by this much, each with its own phase. Only the top level BVH changes.
+    double instanceBob = 0.1;
+
+    // A BVH that refitting made this many times as expensive as when it was built is rebuilt (see Scene::refit).
+    // If rebuildInterval is above 0, the whole scene is also rebuilt every that many frames.
+    double maxCostRatio = 1.5;
+    int rebuildInterval = 0;
+
+    // Frames are saved as <outputPrefix>_0000.bmp, <outputPrefix>_0001.bmp, ...
+    std::string outputPrefix = "frame";
+
+    bool showProgress = false;
+
+    // If not empty, the per frame timings are also written here as csv
+    std::string csvFile;
+};
+
+// Renders every frame with deterministic seeds (each frame gets different ones) and prints how the time of each
+// frame splits into scene update, render and image write
+int runSequence(const SequenceConfig& config);
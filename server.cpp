@@ -0,0 +1,633 @@
+/*
+Contains the render server and client.
+
+*/
+
+#include "server.h"
+#include "benchmark.h"
+#include "renderer.h"
+#include "scene.h"
+#include "image.h"
+#include "trace.h"
+#include "gbuffer.h"
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+
+// A change to the look of a group of the scene (see ObjectGroup), which stays in the loaded scene
+struct SceneEdit
+{
+    string key;         // color, emission or material
+    string group;
+    Color color;
+    string material;    // diffuse, mirror or phong
+    int phongExponent = 10;
+};
+
+struct RenderRequest
+{
+    int id = 0;
+    string scene = "default";
+    double stressScale = 1.0;
+    int width = 256;
+    int height = 256;
+    int sampleCount = 16;
+    unsigned int seed = 12345;
+    int maxDepth = 6;
+    int cropX = 0, cropY = 0, cropWidth = 0, cropHeight = 0;
+    Vec3 cameraMove;
+    double cameraYaw = 0;
+    vector<SceneEdit> edits;
+};
+
+static bool sendAll(int fd, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+    while (size > 0)
+    {
+        // MSG_NOSIGNAL: a client that went away shows up as an error here instead of killing the server
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool receiveAll(int fd, void* data, size_t size)
+{
+    char* bytes = (char*)data;
+    while (size > 0)
+    {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+// parses "key=value" tokens after "render <id>"; returns an error message, or an empty string
+static string parseRequest(istringstream& iss, RenderRequest& request)
+{
+    if (!(iss >> request.id))
+        return "missing request id";
+
+    string token;
+    while (iss >> token)
+    {
+        size_t equals = token.find('=');
+        if (equals == string::npos)
+            return "expected key=value, got " + token;
+        string key = token.substr(0, equals);
+        string value = token.substr(equals + 1);
+
+        // edits start with a group name, so they are not all numbers
+        if (key == "color" || key == "emission" || key == "material")
+        {
+            vector<string> items;
+            stringstream ss(value);
+            string item;
+            while (getline(ss, item, ','))
+                items.push_back(item);
+
+            SceneEdit edit;
+            edit.key = key;
+            edit.group = items.empty() ? "" : items[0];
+            if (key == "material" && (items.size() == 2 || items.size() == 3))
+            {
+                edit.material = items[1];
+                if (edit.material != "diffuse" && edit.material != "mirror" && edit.material != "phong")
+                    return "unknown material " + edit.material;
+                if (items.size() == 3)
+                    edit.phongExponent = atoi(items[2].c_str());
+            }
+            else if (key != "material" && items.size() == 4)
+                edit.color = Color(atof(items[1].c_str()), atof(items[2].c_str()), atof(items[3].c_str()));
+            else
+                return "bad edit " + token;
+            request.edits.push_back(edit);
+            continue;
+        }
+
+        vector<double> numbers;
+        stringstream ss(value);
+        string item;
+        while (getline(ss, item, ','))
+            numbers.push_back(atof(item.c_str()));
+        if (numbers.empty())
+            return "missing value for " + key;
+
+        if (key == "scene") request.scene = value;
+        else if (key == "scale") request.stressScale = numbers[0];
+        else if (key == "width") request.width = int(numbers[0]);
+        else if (key == "height") request.height = int(numbers[0]);
+        else if (key == "spp") request.sampleCount = int(numbers[0]);
+        else if (key == "seed") request.seed = (unsigned int)numbers[0];
+        else if (key == "depth") request.maxDepth = int(numbers[0]);
+        else if (key == "yaw") request.cameraYaw = numbers[0];
+        else if (key == "camera" && numbers.size() == 3) request.cameraMove = Vec3(numbers[0], numbers[1], numbers[2]);
+        else if (key == "crop" && numbers.size() == 4)
+        {
+            request.cropX = int(numbers[0]);
+            request.cropY = int(numbers[1]);
+            request.cropWidth = int(numbers[2]);
+            request.cropHeight = int(numbers[3]);
+        }
+        else
+            return "bad option " + token;
+    }
+
+    if (request.width <= 0 || request.height <= 0 || request.sampleCount <= 0)
+        return "width, height and spp must be positive";
+    if (request.cropWidth > 0 && (request.cropX < 0 || request.cropY < 0
+        || request.cropX + request.cropWidth > request.width || request.cropY + request.cropHeight > request.height))
+        return "crop window is outside the image";
+    return "";
+}
+
+// Applies edits to the scene. groupMask gets the Scene::groupBit of every group whose color or material changed,
+// and lightsChanged is set if any emission did. Returns an error message, or an empty string; nothing is changed
+// if an edit names a group the scene does not have.
+// Material edits take their material from editMaterials (by group and type), so a group gets at most one material
+// of each type however often it is edited, and the scene's materials stop growing once every type was tried.
+static string applyEdits(Scene& scene, const vector<SceneEdit>& edits, map<string, BSDF*>& editMaterials,
+    unsigned long long& groupMask, bool& lightsChanged)
+{
+    groupMask = 0;
+    lightsChanged = false;
+    for (const SceneEdit& edit : edits)
+    {
+        if (scene.findGroup(edit.group) == nullptr)
+            return "no group " + edit.group;
+    }
+
+    for (const SceneEdit& edit : edits)
+    {
+        const ObjectGroup& group = *scene.findGroup(edit.group);
+        if (edit.key == "color")
+        {
+            for (size_t v = group.firstVertex; v < group.firstVertex + group.vertexCount; v++)
+                scene.vertices[v].c = edit.color;
+        }
+        else if (edit.key == "emission")
+        {
+            for (size_t t = group.firstTriangle; t < group.firstTriangle + group.triangleCount; t++)
+                scene.objects[t].emission = edit.color;
+            lightsChanged = true;
+        }
+        else
+        {
+            BSDF*& material = editMaterials[edit.group + " " + edit.material];
+            if (material == nullptr)
+            {
+                if (edit.material == "mirror")
+                    material = scene.addMaterial<mirrorBSDF>();
+                else if (edit.material == "phong")
+                    material = scene.addMaterial<phongBSDF>();
+                else
+                    material = scene.addMaterial<simpleDiffuseBSDF>();
+            }
+            if (edit.material == "phong")
+                static_cast<phongBSDF*>(material)->phongExponent = edit.phongExponent;
+
+            for (size_t t = group.firstTriangle; t < group.firstTriangle + group.triangleCount; t++)
+                scene.objects[t].material = material;
+        }
+
+        if (edit.key != "emission" && group.triangleCount > 0)
+        {
+            Intersection hit;
+            hit.primitive = int(group.firstTriangle);
+            groupMask |= scene.groupBit(hit);
+        }
+    }
+
+    // the copies of the emissive triangles that light sampling uses have to follow
+    if (!edits.empty())
+        scene.collectLights();
+    return "";
+}
+
+class RenderServer
+{
+    public:
+
+    RenderServer(const ServerConfig& config) : config(config) {}
+
+    // Serves one client until it disconnects. Returns false once a client asked the server to shut down.
+    bool serve(int client);
+
+    private:
+
+    ServerConfig config;
+    int clientFd = -1;
+
+    // loaded and built scenes, by name and scale, and the materials edits gave their groups (see applyEdits); only
+    // the render thread touches them
+    map<string, unique_ptr<Scene>> scenes;
+    map<string, map<string, BSDF*>> editMaterials;
+
+    // The first hits of the last view rendered (see gbuffer.h), so requests that only edit colors, materials and
+    // emission are shaded again without tracing camera rays. gbufferKey names the scene and view it was recorded
+    // for; resultKey adds the depth and spp of the colors it keeps, and is empty while it keeps none.
+    GBuffer gbuffer;
+    string gbufferKey;
+    string resultKey;
+
+    thread renderThread;
+    atomic<bool> cancel{false};
+    atomic<bool> running{false};
+    int runningId = -1;
+
+    mutex sendMutex;
+
+    void sendLine(const string& line);
+    void startRender(const RenderRequest& request);
+    void stopRender();
+    void render(RenderRequest request);
+};
+
+void RenderServer::sendLine(const string& line)
+{
+    lock_guard<mutex> lock(sendMutex);
+    string text = line + "\n";
+    sendAll(clientFd, text.data(), text.size());
+}
+
+void RenderServer::stopRender()
+{
+    if (renderThread.joinable())
+    {
+        cancel = true;
+        renderThread.join();
+    }
+    cancel = false;
+}
+
+void RenderServer::startRender(const RenderRequest& request)
+{
+    // a new request supersedes whatever is still rendering
+    stopRender();
+    runningId = request.id;
+    running = true;
+    sendLine("accepted " + to_string(request.id));
+    renderThread = thread(&RenderServer::render, this, request);
+}
+
+void RenderServer::render(RenderRequest request)
+{
+    TRACE_SCOPE("request", request.id);
+    auto start = chrono::high_resolution_clock::now();
+
+    string key = request.scene + " " + to_string(request.stressScale);
+    auto found = scenes.find(key);
+    if (found == scenes.end())
+    {
+        auto scene = make_unique<Scene>();
+        if (!loadBenchmarkScene(*scene, request.scene, request.stressScale))
+        {
+            sendLine("error " + to_string(request.id) + " could not load scene " + request.scene);
+            running = false;
+            return;
+        }
+        scene->build();
+        found = scenes.emplace(key, std::move(scene)).first;
+        cout << "Loaded scene " << request.scene << " (" << found->second->instancedTriangleCount() << " triangles)"
+            << endl;
+    }
+    Scene& scene = *found->second;
+
+    unsigned long long editedGroups;
+    bool lightsEdited;
+    string error = applyEdits(scene, request.edits, editMaterials[key], editedGroups, lightsEdited);
+    if (!error.empty())
+    {
+        sendLine("error " + to_string(request.id) + " " + error);
+        running = false;
+        return;
+    }
+
+    Camera camera;
+    camera.place(request.cameraMove, request.cameraYaw);
+
+    MISIntegrator integrator;
+    integrator.maxDepth = request.maxDepth;
+
+    RenderSettings settings;
+    settings.imageWidth = request.width;
+    settings.imageHeight = request.height;
+    settings.cropX = request.cropX;
+    settings.cropY = request.cropY;
+    settings.cropWidth = request.cropWidth;
+    settings.cropHeight = request.cropHeight;
+    settings.threads = config.threads;
+    settings.deterministic = true;
+    settings.seed = request.seed;
+    settings.showProgress = false;
+    settings.cancel = &cancel;
+
+    int width = request.cropWidth > 0 ? request.cropWidth : request.width;
+    int height = request.cropHeight > 0 ? request.cropHeight : request.height;
+
+    // first hits stay valid while the scene (and so its geometry) and everything about the camera rays stay the
+    // same. Kept colors also need the same depth and spp, and only survive edits of groups their paths missed.
+    ostringstream view;
+    view << key << " " << request.cameraMove << " " << request.cameraYaw << " " << request.width << " "
+        << request.height << " " << request.cropX << " " << request.cropY << " " << width << " " << height << " "
+        << request.seed;
+    string renderKey = view.str() + " " + to_string(request.maxDepth) + " " + to_string(request.sampleCount);
+    if (view.str() != gbufferKey)
+    {
+        gbuffer.reset(width, height);
+        gbufferKey = view.str();
+        resultKey.clear();
+    }
+    if (renderKey != resultKey || lightsEdited)
+        gbuffer.invalidateAll();
+    else
+        gbuffer.invalidate(editedGroups);
+    resultKey.clear();
+    settings.gbuffer = &gbuffer;
+
+    Image pass(width, height);
+    Image result(width, height);
+    vector<double> sum(3 * width * height, 0.0);
+    vector<float> pixels(3 * width * height);
+
+    // 1 sample first for a quick first image, then double the total every pass
+    int done = 0;
+    while (done < request.sampleCount)
+    {
+        int passSamples = std::min(std::max(done, 1), request.sampleCount - done);
+        settings.sampleCount = passSamples;
+        settings.firstSample = done;
+
+        RenderStats stats = renderImage(scene, integrator, camera, settings, pass);
+        if (stats.cancelled)
+        {
+            sendLine("cancelled " + to_string(request.id));
+            running = false;
+            return;
+        }
+        done += passSamples;
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                int p = y * width + x;
+                Color c = pass.getColor(x, y);
+                for (int k = 0; k < 3; k++)
+                {
+                    sum[3 * p + k] += c[k] * passSamples;
+                    pixels[3 * p + k] = float(sum[3 * p + k] / done);
+                }
+                result.setColor(x, y, Color(sum[3 * p] / done, sum[3 * p + 1] / done, sum[3 * p + 2] / done));
+            }
+        }
+
+        lock_guard<mutex> lock(sendMutex);
+        string header = "image " + to_string(request.id) + " " + to_string(width) + " " + to_string(height) + " "
+            + to_string(done) + "\n";
+        if (!sendAll(clientFd, header.data(), header.size())
+            || !sendAll(clientFd, pixels.data(), pixels.size() * sizeof(float)))
+        {
+            running = false;
+            return;
+        }
+    }
+
+    gbuffer.keepResult(result);
+    resultKey = renderKey;
+
+    chrono::duration<double> elapsed = chrono::high_resolution_clock::now() - start;
+    sendLine("done " + to_string(request.id) + " " + to_string(elapsed.count()));
+    running = false;
+}
+
+bool RenderServer::serve(int client)
+{
+    clientFd = client;
+    string buffer;
+    bool keepServing = true;
+
+    while (true)
+    {
+        // a finished render thread is joined here, so the next request does not have to
+        if (!running && renderThread.joinable())
+            renderThread.join();
+
+        pollfd p = {client, POLLIN, 0};
+        int ready = poll(&p, 1, 100);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0)
+            continue;
+
+        char chunk[4096];
+        ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+        if (received <= 0)
+            break;
+        buffer.append(chunk, received);
+
+        size_t newline;
+        while ((newline = buffer.find('\n')) != string::npos)
+        {
+            string line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+
+            istringstream iss(line);
+            string command;
+            iss >> command;
+
+            if (command == "render")
+            {
+                RenderRequest request;
+                string error = parseRequest(iss, request);
+                if (!error.empty())
+                    sendLine("error " + to_string(request.id) + " " + error);
+                else
+                    startRender(request);
+            }
+            else if (command == "cancel")
+            {
+                int id = -1;
+                iss >> id;
+                if (running && id == runningId)
+                    stopRender();
+            }
+            else if (command == "shutdown")
+            {
+                keepServing = false;
+                break;
+            }
+            else if (!command.empty())
+                sendLine("error - unknown command " + command);
+        }
+        if (!keepServing)
+            break;
+    }
+
+    stopRender();
+    close(client);
+    clientFd = -1;
+    return keepServing;
+}
+
+int runServer(const ServerConfig& config)
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        cerr << "Error: Could not create socket: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (config.socketPath.size() >= sizeof(address.sun_path))
+    {
+        cerr << "Error: Socket path " << config.socketPath << " is too long\n";
+        return 1;
+    }
+    strcpy(address.sun_path, config.socketPath.c_str());
+
+    // a socket file left behind by a server that did not shut down cleanly would make bind fail
+    unlink(config.socketPath.c_str());
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 4) != 0)
+    {
+        cerr << "Error: Could not listen on " << config.socketPath << ": " << strerror(errno) << "\n";
+        close(listener);
+        return 1;
+    }
+
+    cout << "Listening on " << config.socketPath << endl;
+    RenderServer server(config);
+    while (true)
+    {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            cerr << "Error: accept failed: " << strerror(errno) << "\n";
+            break;
+        }
+        if (!server.serve(client))
+            break;
+    }
+
+    close(listener);
+    unlink(config.socketPath.c_str());
+    cout << "Server shut down" << endl;
+    return 0;
+}
+
+// reads one '\n' terminated line, one byte at a time so nothing after it is consumed
+static bool receiveLine(int fd, string& line)
+{
+    line.clear();
+    char c;
+    while (receiveAll(fd, &c, 1))
+    {
+        if (c == '\n')
+            return true;
+        line += c;
+    }
+    return false;
+}
+
+int runClient(const string& socketPath, const string& request, const string& output)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
+    {
+        cerr << "Error: Could not connect to " << socketPath << ": " << strerror(errno) << "\n";
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    auto start = chrono::high_resolution_clock::now();
+    string line = "render 1 " + request + "\n";
+    if (!sendAll(fd, line.data(), line.size()))
+    {
+        cerr << "Error: Could not send the request\n";
+        close(fd);
+        return 1;
+    }
+
+    int result = 1;
+    unique_ptr<Image> image;
+    while (receiveLine(fd, line))
+    {
+        chrono::duration<double> elapsed = chrono::high_resolution_clock::now() - start;
+        istringstream iss(line);
+        string reply;
+        int id;
+        iss >> reply >> id;
+
+        if (reply == "image")
+        {
+            int width, height, samples;
+            iss >> width >> height >> samples;
+            vector<float> pixels(3 * width * height);
+            if (!receiveAll(fd, pixels.data(), pixels.size() * sizeof(float)))
+                break;
+
+            image = make_unique<Image>(width, height);
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    int p = y * width + x;
+                    image->setColor(x, y, Color(pixels[3 * p], pixels[3 * p + 1], pixels[3 * p + 2]));
+                }
+            }
+            cout << "Image with " << samples << " spp after " << elapsed.count() * 1000 << " ms" << endl;
+        }
+        else if (reply == "done")
+        {
+            cout << "Done after " << elapsed.count() * 1000 << " ms" << endl;
+            result = 0;
+            break;
+        }
+        else if (reply == "cancelled" || reply == "error")
+        {
+            cerr << line << "\n";
+            break;
+        }
+    }
+    close(fd);
+
+    if (image)
+        image->saveImageBMP(output + ".bmp");
+    return result;
+}
@@ -0,0 +1,46 @@
+/*
+Contains the render server, a long running process that keeps scenes loaded and built between requests, and the
+client that talks to it.
+
+The server listens on a Unix socket and serves one connection at a time. Requests and replies are text lines,
+except that an image line is followed by the raw pixels:
+
+    client: render <id> [scene=default] [scale=1] [width=256] [height=256] [spp=16] [seed=12345] [depth=6]
+                  [crop=x,y,w,h] [camera=x,y,z] [yaw=degrees]
+                  [color=group,r,g,b] [emission=group,r,g,b] [material=group,diffuse|mirror|phong[,exponent]]
+    client: cancel <id>
+    client: shutdown
+    server: accepted <id>
+    server: image <id> <width> <height> <samples>   then width * height * 3 little endian floats, rows bottom to top
+    server: done <id> <seconds> | cancelled <id> | error <id> <message>
+
+A render is sent back progressively: the first image has 1 sample per pixel, and every later one doubles the
+total, until spp is reached. A new render request supersedes the one in flight, which is cancelled within a
+column's worth of work, so tools can send a request for every tweak without waiting.
+
+Edits (color, emission and material, which may be repeated) change a group of the scene, named after the obj file
+it was read from, and stay in the loaded scene for later requests. The server keeps the first hits of the last
+view it rendered (see gbuffer.h), so a request that only edits, or changes depth or spp, does not trace camera
+rays again; it is still the same image a full render would give. If only colors and materials were edited and
+depth and spp did not change, only the pixels whose paths hit an edited group are rendered again, and the rest are
+sent as they were the last time.
+
+*/
+
+#pragma once
+
+#include <string>
+
+struct ServerConfig
+{
+    std::string socketPath = "/tmp/pathtracer.sock";
+
+    // as in RenderSettings
+    int threads = 0;
+};
+
+int runServer(const ServerConfig& config);
+
+// Sends one request line (without the "render <id>" part) and saves the last image it gets back as
+// <output>.bmp, printing when each progressive image arrived
+int runClient(const std::string& socketPath, const std::string& request, const std::string& output);
@@ -0,0 +1,404 @@
+/*
+Contains the texture cache files, the shared tile cache and the filtered lookups.
+
+*/
+
+#include "texture.h"
+#include "image.h"
+#include "trace.h"
+#include <fstream>
+#include <iomanip>
+#include <filesystem>
+#include <list>
+#include <unordered_map>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using Tile = std::vector<float>;
+
+// A tile's key packs the texture, the level and the tile's position
+static unsigned long long tileKey(int texture, int level, int tileX, int tileY)
+{
+    return ((unsigned long long)texture << 45) | ((unsigned long long)level << 40)
+        | ((unsigned long long)tileY << 20) | (unsigned long long)tileX;
+}
+
+// splitmix64's finalizer, which spreads neighbouring tiles over the shards
+static unsigned long long mixBits(unsigned long long x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+const int shardCount = 16;
+
+struct TileShard
+{
+    struct Entry
+    {
+        std::shared_ptr<const Tile> tile;
+        std::list<unsigned long long>::iterator position;  // in lru, most recently used at the front
+    };
+
+    std::mutex lock;
+    std::unordered_map<unsigned long long, Entry> tiles;
+    std::list<unsigned long long> lru;
+    size_t residentBytes = 0;
+
+    unsigned long long lookups = 0;
+    unsigned long long hits = 0;
+    unsigned long long evictions = 0;
+    unsigned long long bytesRead = 0;
+};
+
+static TileShard shards[shardCount];
+static std::atomic<size_t> budget{size_t(256) << 20};
+static std::atomic<size_t> residentBytes{0};
+static std::atomic<size_t> peakResidentBytes{0};
+
+static size_t tileBytes(const Tile& tile)
+{
+    return tile.size() * sizeof(float) + sizeof(Tile);
+}
+
+// The tile from the cache, calling read() for it on a miss
+template <typename Read>
+static std::shared_ptr<const Tile> fetchTile(unsigned long long key, Read read)
+{
+    TileShard& shard = shards[mixBits(key) % shardCount];
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        shard.lookups++;
+        auto it = shard.tiles.find(key);
+        if (it != shard.tiles.end())
+        {
+            shard.hits++;
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second.position);
+            return it->second.tile;
+        }
+    }
+
+    // read without holding the lock, so other threads keep using the shard meanwhile
+    std::shared_ptr<const Tile> loaded = read();
+    if (!loaded)
+        return loaded;
+
+    std::lock_guard<std::mutex> lock(shard.lock);
+    shard.bytesRead += loaded->size() * sizeof(float);
+    auto it = shard.tiles.find(key);
+    if (it != shard.tiles.end())
+        return it->second.tile; // another thread loaded it in the meantime
+
+    shard.lru.push_front(key);
+    shard.tiles[key] = {loaded, shard.lru.begin()};
+    shard.residentBytes += tileBytes(*loaded);
+    size_t total = residentBytes.fetch_add(tileBytes(*loaded), std::memory_order_relaxed) + tileBytes(*loaded);
+
+    // evicted tiles that a sample still holds stay alive until it lets go of them
+    const size_t shardBudget = budget.load(std::memory_order_relaxed) / shardCount;
+    while (shard.residentBytes > shardBudget && shard.lru.size() > 1)
+    {
+        unsigned long long victim = shard.lru.back();
+        shard.lru.pop_back();
+        size_t bytes = tileBytes(*shard.tiles[victim].tile);
+        shard.residentBytes -= bytes;
+        total = residentBytes.fetch_sub(bytes, std::memory_order_relaxed) - bytes;
+        shard.tiles.erase(victim);
+        shard.evictions++;
+    }
+
+    size_t peak = peakResidentBytes.load(std::memory_order_relaxed);
+    while (total > peak && !peakResidentBytes.compare_exchange_weak(peak, total, std::memory_order_relaxed)) {}
+    return loaded;
+}
+
+void setTextureCacheBudget(size_t bytes)
+{
+    budget.store(bytes, std::memory_order_relaxed);
+}
+
+size_t textureCacheBudget()
+{
+    return budget.load(std::memory_order_relaxed);
+}
+
+// Every texture loaded so far, by the image file it was loaded from
+static std::mutex registryLock;
+static std::map<std::string, std::unique_ptr<Texture>> registry;
+
+TextureCacheStats textureCacheStats()
+{
+    TextureCacheStats stats;
+    for (TileShard& shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        stats.lookups += shard.lookups;
+        stats.hits += shard.hits;
+        stats.evictions += shard.evictions;
+        stats.bytesRead += shard.bytesRead;
+        stats.residentBytes += shard.residentBytes;
+    }
+    stats.peakResidentBytes = peakResidentBytes.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(registryLock);
+    stats.textures = int(registry.size());
+    return stats;
+}
+
+void printTextureCacheStats(std::ostream& out, const TextureCacheStats& stats)
+{
+    const double MB = 1024.0 * 1024.0;
+    out << "Texture cache: " << stats.textures << " textures, " << stats.lookups << " tile lookups, " << std::fixed
+        << std::setprecision(1) << 100.0 * stats.hitRate() << "% hits, " << stats.evictions << " evictions, "
+        << stats.bytesRead / MB << " MB read, peak " << stats.peakResidentBytes / MB << " MB of "
+        << textureCacheBudget() / MB << " MB" << std::defaultfloat << std::endl;
+}
+
+bool writeTextureCacheFile(const std::string& imageFile, const std::string& cacheFile, int tileSize)
+{
+    TRACE_SCOPE(imageFile.c_str());
+    Image image(1, 1);
+    const bool pfm = imageFile.size() >= 4 && imageFile.compare(imageFile.size() - 4, 4, ".pfm") == 0;
+    if (!(pfm ? image.loadImagePFM(imageFile) : image.loadImageBMP(imageFile)))
+    {
+        std::cerr << "Error: Could not load texture " << imageFile << "\n";
+        return false;
+    }
+    tileSize = std::max(tileSize, 1);
+
+    // the pyramid halves every level (rounding down) until a level is one texel, each texel the average of the
+    // 2x2 texels under it
+    std::vector<std::vector<float>> levels;
+    std::vector<std::pair<int, int>> sizes;
+    int width = image.getWidth(), height = image.getHeight();
+    levels.emplace_back(size_t(3) * width * height);
+    sizes.push_back({width, height});
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            Color c = image.getColor(x, y);
+            for (int k = 0; k < 3; k++)
+                levels[0][3 * (size_t(y) * width + x) + k] = float(c[k]);
+        }
+    }
+    while (width > 1 || height > 1)
+    {
+        const std::vector<float>& above = levels.back();
+        int aboveWidth = width, aboveHeight = height;
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+
+        std::vector<float> level(size_t(3) * width * height);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    float sum = 0;
+                    for (int dy = 0; dy < 2; dy++)
+                    {
+                        for (int dx = 0; dx < 2; dx++)
+                        {
+                            int sx = std::min(2 * x + dx, aboveWidth - 1), sy = std::min(2 * y + dy, aboveHeight - 1);
+                            sum += above[3 * (size_t(sy) * aboveWidth + sx) + k];
+                        }
+                    }
+                    level[3 * (size_t(y) * width + x) + k] = sum * 0.25f;
+                }
+            }
+        }
+        levels.push_back(std::move(level));
+        sizes.push_back({width, height});
+    }
+
+    // written under another name and renamed, so a render loading the same texture never reads half a file
+    std::string temporary = cacheFile + ".tmp" + std::to_string(getpid());
+    std::ofstream out(temporary, std::ios::binary);
+    if (!out.is_open())
+    {
+        std::cerr << "Error: Could not write " << temporary << "\n";
+        return false;
+    }
+    out << "PT " << sizes[0].first << " " << sizes[0].second << " " << tileSize << " " << levels.size() << "\n";
+
+    // every tile is whole, the texels past the level's edge repeating its last row and column
+    std::vector<float> tile(size_t(3) * tileSize * tileSize);
+    for (size_t l = 0; l < levels.size(); l++)
+    {
+        auto [w, h] = sizes[l];
+        for (int ty = 0; ty * tileSize < h; ty++)
+        {
+            for (int tx = 0; tx * tileSize < w; tx++)
+            {
+                for (int y = 0; y < tileSize; y++)
+                {
+                    for (int x = 0; x < tileSize; x++)
+                    {
+                        int sx = std::min(tx * tileSize + x, w - 1), sy = std::min(ty * tileSize + y, h - 1);
+                        for (int k = 0; k < 3; k++)
+                            tile[3 * (size_t(y) * tileSize + x) + k] = levels[l][3 * (size_t(sy) * w + sx) + k];
+                    }
+                }
+                out.write((const char*)tile.data(), tile.size() * sizeof(float));
+            }
+        }
+    }
+    out.close();
+    if (!out.good())
+    {
+        std::cerr << "Error: Could not write " << temporary << "\n";
+        std::remove(temporary.c_str());
+        return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary, cacheFile, error);
+    if (error)
+    {
+        std::cerr << "Error: Could not write " << cacheFile << "\n";
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+const Texture* loadTexture(const std::string& imageFile)
+{
+    std::lock_guard<std::mutex> lock(registryLock);
+    auto found = registry.find(imageFile);
+    if (found != registry.end())
+        return found->second.get();
+
+    // a cache file without its image is fine, so scenes can ship the converted textures only
+    const std::string cacheFile = imageFile + ".tiles";
+    std::error_code error;
+    bool haveImage = std::filesystem::exists(imageFile, error);
+    bool haveCache = std::filesystem::exists(cacheFile, error);
+    bool stale = !haveCache || (haveImage && std::filesystem::last_write_time(cacheFile, error)
+        < std::filesystem::last_write_time(imageFile, error));
+    if (stale && !writeTextureCacheFile(imageFile, cacheFile))
+        return nullptr;
+
+    std::ifstream in(cacheFile, std::ios::binary);
+    std::string type;
+    int width = 0, height = 0, tileSize = 0, levelCount = 0;
+    in >> type >> width >> height >> tileSize >> levelCount;
+    in.get(); // single whitespace character before the data
+    if (type != "PT" || !in.good() || width <= 0 || height <= 0 || tileSize <= 0 || levelCount <= 0)
+    {
+        std::cerr << "Error: " << cacheFile << " is not a texture cache file\n";
+        return nullptr;
+    }
+
+    std::unique_ptr<Texture> texture(new Texture());
+    texture->name = imageFile;
+    texture->id = int(registry.size());
+    texture->tileSize = tileSize;
+
+    unsigned long long offset = (unsigned long long)in.tellg();
+    const unsigned long long bytesPerTile = 3ULL * tileSize * tileSize * sizeof(float);
+    for (int l = 0; l < levelCount; l++)
+    {
+        Texture::Level level;
+        level.width = width;
+        level.height = height;
+        level.tilesX = (width + tileSize - 1) / tileSize;
+        level.tilesY = (height + tileSize - 1) / tileSize;
+        level.offset = offset;
+        texture->levels.push_back(level);
+
+        offset += bytesPerTile * level.tilesX * level.tilesY;
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+    }
+
+    texture->file = ::open(cacheFile.c_str(), O_RDONLY);
+    if (texture->file < 0)
+    {
+        std::cerr << "Error: Could not open " << cacheFile << "\n";
+        return nullptr;
+    }
+
+    const Texture* result = texture.get();
+    registry[imageFile] = std::move(texture);
+    return result;
+}
+
+Texture::~Texture()
+{
+    if (file >= 0)
+        close(file);
+}
+
+std::shared_ptr<const Tile> Texture::readTile(int level, int tileX, int tileY) const
+{
+    TRACE_SCOPE("load texture tile", level);
+    const Level& l = levels[level];
+    const size_t size = size_t(3) * tileSize * tileSize * sizeof(float);
+    const unsigned long long offset = l.offset + size * (size_t(tileY) * l.tilesX + tileX);
+
+    std::shared_ptr<Tile> tile = std::make_shared<Tile>(size_t(3) * tileSize * tileSize);
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t count = pread(file, (char*)tile->data() + done, size - done, off_t(offset + done));
+        if (count <= 0)
+            break;
+        done += size_t(count);
+    }
+
+    if (done < size)
+    {
+        std::cerr << "Error: Could not read a tile of " << name << " from its cache file\n";
+        return nullptr;
+    }
+    return tile;
+}
+
+Color Texture::sample(double u, double v, double footprint) const
+{
+    // the level whose texels are as wide as the footprint, rounded to the nearest
+    double texels = footprint * std::max(width(), height());
+    int level = texels > 1.0 ? std::min(int(std::log2(texels) + 0.5), levelCount() - 1) : 0;
+    const Level& l = levels[level];
+
+    // texel centers sit half a texel in, like pixel centers
+    double x = (u - std::floor(u)) * l.width - 0.5;
+    double y = (v - std::floor(v)) * l.height - 0.5;
+    int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+    double fx = x - x0, fy = y - y0;
+
+    // neighbouring texels are mostly in the same tile, so the last one fetched is kept
+    std::shared_ptr<const Tile> tile;
+    unsigned long long current = ~0ULL;
+    auto texel = [&](int tx, int ty) {
+        tx = ((tx % l.width) + l.width) % l.width;
+        ty = ((ty % l.height) + l.height) % l.height;
+        int tileX = tx / tileSize, tileY = ty / tileSize;
+        unsigned long long key = tileKey(id, level, tileX, tileY);
+        if (key != current)
+        {
+            tile = fetchTile(key, [&]() { return readTile(level, tileX, tileY); });
+            current = key;
+        }
+        if (!tile)
+            return Color(0, 0, 0);
+        const float* t = tile->data() + 3 * (size_t(ty % tileSize) * tileSize + tx % tileSize);
+        return Color(t[0], t[1], t[2]);
+    };
+
+    return texel(x0, y0) * ((1 - fx) * (1 - fy)) + texel(x0 + 1, y0) * (fx * (1 - fy))
+        + texel(x0, y0 + 1) * ((1 - fx) * fy) + texel(x0 + 1, y0 + 1) * (fx * fy);
+}
@@ -0,0 +1,96 @@
+/*
+Contains the textures, which are stored as tiled MIP pyramids in cache files and read a tile at a time through one
+cache that every thread shares.
+
+A texture is never held in memory whole. The first time an image is used it is converted into a cache file next to
+it (image.bmp.tiles), which holds every level of its MIP pyramid cut into square tiles of floating point texels.
+Samples then read single tiles out of that file as they need them. The tiles live in one cache with a fixed byte
+budget, split into shards that each have their own lock and least recently used list, so threads reading different
+tiles rarely wait for each other. A shard that goes over its share of the budget drops its least recently used
+tiles, so the memory textures take stays bounded by the budget however many and however large they are (plus the
+few tiles the threads are reading at that moment).
+
+The level a sample reads is picked by the ray's footprint (see Ray::footprint): how wide the ray's cone is where it
+hits, in texels. Distant surfaces and surfaces only seen after a bounce read small levels, and the tiles of the full
+resolution only get loaded where the camera looks closely.
+
+Scene::intersect multiplies the vertex color by the texture at the hit's UV. The out of core renderer packs no UVs
+and renders without textures.
+
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include "object.h"
+
+class Texture
+{
+    public:
+
+    ~Texture();
+    Texture(const Texture&) = delete;
+    Texture& operator=(const Texture&) = delete;
+
+    // The color at (u, v), bilinearly filtered in the level whose texels are as wide as `footprint` (in texture
+    // space, where 1 is the whole texture). Textures repeat outside [0, 1).
+    Color sample(double u, double v, double footprint) const;
+
+    int width() const { return levels.empty() ? 0 : levels[0].width; }
+    int height() const { return levels.empty() ? 0 : levels[0].height; }
+    int levelCount() const { return int(levels.size()); }
+    const std::string& fileName() const { return name; }
+
+    private:
+
+    friend const Texture* loadTexture(const std::string& imageFile);
+    Texture() {}
+
+    struct Level
+    {
+        int width, height;
+        int tilesX, tilesY;
+        unsigned long long offset;  // of the level's first tile in the cache file
+    };
+
+    // Reads one tile from the cache file, which the tile cache does on a miss. nullptr if the read fails.
+    std::shared_ptr<const std::vector<float>> readTile(int level, int tileX, int tileY) const;
+
+    std::string name;
+    int id = 0;             // in the tile cache's keys
+    int file = -1;
+    int tileSize = 0;
+    std::vector<Level> levels;
+};
+
+// Opens the texture of a BMP or PFM image, writing its cache file first if there is none or the image is newer.
+// Textures stay open for the rest of the program and are shared by everything that loads the same file. Returns
+// nullptr after printing an error.
+const Texture* loadTexture(const std::string& imageFile);
+
+// Writes the MIP pyramid of an image to a cache file, in tiles of tileSize x tileSize texels. Returns false on
+// errors. loadTexture calls this itself; it is exposed to convert textures ahead of a render.
+bool writeTextureCacheFile(const std::string& imageFile, const std::string& cacheFile, int tileSize = 32);
+
+struct TextureCacheStats
+{
+    unsigned long long lookups = 0;     // tile fetches by samples
+    unsigned long long hits = 0;        // fetches that found the tile in memory
+    unsigned long long evictions = 0;
+    unsigned long long bytesRead = 0;
+    size_t residentBytes = 0;
+    size_t peakResidentBytes = 0;
+    int textures = 0;
+
+    double hitRate() const { return lookups > 0 ? double(hits) / lookups : 0.0; }
+};
+
+// The byte budget of the tile cache, 256 MB unless set. Lowering it evicts on the next loads, not at once.
+void setTextureCacheBudget(size_t bytes);
+size_t textureCacheBudget();
+
+TextureCacheStats textureCacheStats();
+void printTextureCacheStats(std::ostream& out, const TextureCacheStats& stats);
@@ -0,0 +1,328 @@
+/*
+Contains the thread governor: reading the CPU topology and cgroup quota from procfs and sysfs, placing threads
+on CPUs, and loading the per node scene copies.
+
+*/
+
+#include "threadGovernor.h"
+#include "scene.h"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+// parses a sysfs CPU list like "0-3,8-11"
+static std::vector<int> parseCpuList(const std::string& text)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (item.empty() || !isdigit((unsigned char)item[0]))
+            continue;
+        size_t dash = item.find('-');
+        int first = std::stoi(item);
+        int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static bool readFirstLine(const std::string& fileName, std::string& line)
+{
+    std::ifstream file(fileName);
+    return file.is_open() && std::getline(file, line);
+}
+
+// The limit in CPUs from a cgroup v2 cpu.max ("max 100000" or "<quota> <period>"), 0 if there is none
+static double readCpuMax(const std::string& directory)
+{
+    std::string line;
+    if (!readFirstLine(directory + "/cpu.max", line))
+        return 0;
+    std::stringstream ss(line);
+    std::string quota;
+    double period = 0;
+    if (!(ss >> quota >> period) || quota == "max" || period <= 0)
+        return 0;
+    return std::stod(quota) / period;
+}
+
+// The same from cgroup v1, where an unlimited quota is -1
+static double readCfsQuota(const std::string& directory)
+{
+    std::string quota, period;
+    if (!readFirstLine(directory + "/cpu.cfs_quota_us", quota) || !readFirstLine(directory + "/cpu.cfs_period_us", period))
+        return 0;
+    double q = std::stod(quota), p = std::stod(period);
+    return q > 0 && p > 0 ? q / p : 0;
+}
+
+// Every cgroup from `path` up to the root can carry a limit, and the tightest one applies. Inside a container the
+// path in /proc/self/cgroup may not exist under the mount, since the container sees its own cgroup as the root,
+// so missing directories are simply skipped.
+static double tightestQuota(const std::string& mount, std::string path, double (*readQuota)(const std::string&))
+{
+    double quota = 0;
+    while (true)
+    {
+        double q = readQuota(mount + (path == "/" ? "" : path));
+        if (q > 0 && (quota == 0 || q < quota))
+            quota = q;
+        if (path.empty() || path == "/")
+            break;
+        path = path.substr(0, path.rfind('/'));
+        if (path.empty())
+            path = "/";
+    }
+    return quota;
+}
+
+// Lines of /proc/self/cgroup look like "0::/path" for cgroup v2 and "4:cpu,cpuacct:/path" for v1
+static double readCgroupQuota()
+{
+    std::ifstream file("/proc/self/cgroup");
+    std::string line;
+    double quota = 0;
+    while (std::getline(file, line))
+    {
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos)
+            continue;
+        std::string controllers = line.substr(first + 1, second - first - 1);
+        std::string path = line.substr(second + 1);
+
+        double q = 0;
+        if (controllers.empty())
+            q = tightestQuota("/sys/fs/cgroup", path, readCpuMax);
+        else if (("," + controllers + ",").find(",cpu,") != std::string::npos)
+        {
+            q = tightestQuota("/sys/fs/cgroup/" + controllers, path, readCfsQuota);
+            if (q == 0)
+                q = tightestQuota("/sys/fs/cgroup/cpu", path, readCfsQuota);
+        }
+        if (q > 0 && (quota == 0 || q < quota))
+            quota = q;
+    }
+    return quota;
+}
+
+static std::vector<int> allowedCpuList()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+    if (cpus.empty())
+    {
+        for (int cpu = 0; cpu < int(std::max(1u, std::thread::hardware_concurrency())); cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static CpuTopology readTopology()
+{
+    CpuTopology topology;
+    std::vector<int> allowed = allowedCpuList();
+    std::vector<bool> placed(allowed.size(), false);
+
+    std::vector<int> nodeIds;
+    if (DIR* dir = opendir("/sys/devices/system/node"))
+    {
+        while (dirent* entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && name.compare(0, 4, "node") == 0 && isdigit((unsigned char)name[4]))
+                nodeIds.push_back(std::stoi(name.substr(4)));
+        }
+        closedir(dir);
+    }
+    std::sort(nodeIds.begin(), nodeIds.end());
+
+    for (int id : nodeIds)
+    {
+        std::string line;
+        if (!readFirstLine("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist", line))
+            continue;
+
+        std::vector<int> cpus;
+        for (int cpu : parseCpuList(line))
+        {
+            auto it = std::find(allowed.begin(), allowed.end(), cpu);
+            if (it != allowed.end() && !placed[it - allowed.begin()])
+            {
+                placed[it - allowed.begin()] = true;
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty())
+        {
+            topology.nodeCpus.push_back(cpus);
+            topology.nodeIds.push_back(id);
+        }
+    }
+
+    // no NUMA information (or CPUs it does not mention): those CPUs share one node
+    std::vector<int> rest;
+    for (size_t i = 0; i < allowed.size(); i++)
+    {
+        if (!placed[i])
+            rest.push_back(allowed[i]);
+    }
+    if (!rest.empty())
+    {
+        if (topology.nodeCpus.empty())
+        {
+            topology.nodeCpus.push_back(rest);
+            topology.nodeIds.push_back(0);
+        }
+        else
+            topology.nodeCpus[0].insert(topology.nodeCpus[0].end(), rest.begin(), rest.end());
+    }
+
+    topology.quota = readCgroupQuota();
+    return topology;
+}
+
+int CpuTopology::allowedCpus() const
+{
+    int count = 0;
+    for (const std::vector<int>& cpus : nodeCpus)
+        count += int(cpus.size());
+    return count;
+}
+
+int CpuTopology::usableCpus() const
+{
+    int count = std::max(allowedCpus(), 1);
+    if (quota > 0)
+        count = std::min(count, std::max(1, int(std::ceil(quota - 1e-9))));
+    return count;
+}
+
+const CpuTopology& cpuTopology()
+{
+    static const CpuTopology topology = readTopology();
+    return topology;
+}
+
+void printTopology(std::ostream& out, const CpuTopology& topology)
+{
+    for (size_t n = 0; n < topology.nodeCpus.size(); n++)
+    {
+        const std::vector<int>& cpus = topology.nodeCpus[n];
+        out << "NUMA node " << topology.nodeIds[n] << ": " << cpus.size() << " CPUs (" << cpus.front();
+        if (cpus.size() > 1)
+            out << " ... " << cpus.back();
+        out << ")\n";
+    }
+    out << "CPU quota: ";
+    if (topology.quota > 0)
+        out << topology.quota << " CPUs";
+    else
+        out << "none";
+    out << ", " << topology.usableCpus() << " usable CPUs" << std::endl;
+}
+
+ThreadPlacement placeThreads(const CpuTopology& topology, int threads)
+{
+    ThreadPlacement placement;
+    const int nodeCount = int(topology.nodeCpus.size());
+    if (nodeCount == 0)
+        return placement;
+
+    std::vector<size_t> next(nodeCount, 0);
+    int node = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        // the next node in turn that still has a free CPU. Once every CPU has a thread, start over.
+        int tries = 0;
+        while (next[node] >= topology.nodeCpus[node].size() && tries < nodeCount)
+        {
+            node = (node + 1) % nodeCount;
+            tries++;
+        }
+        if (tries == nodeCount)
+            std::fill(next.begin(), next.end(), 0);
+
+        placement.cpus.push_back(topology.nodeCpus[node][next[node]++]);
+        placement.nodes.push_back(node);
+        node = (node + 1) % nodeCount;
+    }
+    return placement;
+}
+
+static bool setCurrentThreadCpus(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool pinCurrentThread(int cpu)
+{
+    return setCurrentThreadCpus({cpu});
+}
+
+void unpinCurrentThread()
+{
+    std::vector<int> all;
+    for (const std::vector<int>& cpus : cpuTopology().nodeCpus)
+        all.insert(all.end(), cpus.begin(), cpus.end());
+    setCurrentThreadCpus(all);
+}
+
+SceneReplicas::SceneReplicas() {}
+SceneReplicas::~SceneReplicas() {}
+
+bool SceneReplicas::load(const CpuTopology& topology, const std::function<bool(Scene&)>& loadScene)
+{
+    const int nodeCount = std::max(1, int(topology.nodeCpus.size()));
+    scenes.clear();
+    for (int n = 0; n < nodeCount; n++)
+        scenes.push_back(std::make_unique<Scene>());
+
+    if (nodeCount == 1)
+        return loadScene(*scenes[0]);
+
+    // the loads run at the same time, each on a thread that may only run on its node
+    std::vector<char> loaded(nodeCount, 0);
+    std::vector<std::thread> loaders;
+    for (int n = 0; n < nodeCount; n++)
+    {
+        loaders.emplace_back([&, n]()
+        {
+            setCurrentThreadCpus(topology.nodeCpus[n]);
+            loaded[n] = loadScene(*scenes[n]);
+        });
+    }
+    for (std::thread& loader : loaders)
+        loader.join();
+
+    return std::all_of(loaded.begin(), loaded.end(), [](char ok) {return ok != 0;});
+}
+
+const Scene& SceneReplicas::forNode(int node) const
+{
+    return *scenes[std::min(node, int(scenes.size()) - 1)];
+}
@@ -0,0 +1,82 @@
+/*
+Contains the thread governor, which decides how many render threads the machine can really run and where to put
+them.
+
+The CPUs come from the process's affinity mask, grouped by the NUMA nodes in /sys/devices/system/node, and the
+cgroup CPU quota (cgroup v2 cpu.max or v1 cpu.cfs_quota_us) caps how many of them are used, so a render inside a
+container with a 4 CPU limit does not start 64 threads. Machines without node information in sysfs are treated
+as a single node.
+
+Threads can be pinned to single CPUs, spread across the nodes, and the scene can be loaded once per node
+(SceneReplicas) so every pinned thread traces geometry that lives in its own node's memory.
+
+*/
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <iostream>
+
+class Scene;
+
+struct CpuTopology
+{
+    // The CPUs this process may run on, grouped by NUMA node. Nodes with none of them are left out.
+    std::vector<std::vector<int>> nodeCpus;
+    std::vector<int> nodeIds;
+
+    // CPUs worth of time the cgroup allows per period, 0 if it is not limited
+    double quota = 0;
+
+    int allowedCpus() const;
+
+    // The allowed CPUs, limited by the quota (rounded up, at least 1)
+    int usableCpus() const;
+};
+
+// Reads the topology the first time it is called and returns the same one after that
+const CpuTopology& cpuTopology();
+
+// One line per node, plus the quota, for the start of a render's output
+void printTopology(std::ostream& out, const CpuTopology& topology);
+
+// Where thread t of a pinned render goes: CPU cpus[t] on node nodes[t] (an index into CpuTopology::nodeCpus).
+// Threads go round robin over the nodes, so a render with fewer threads than CPUs still uses every node.
+struct ThreadPlacement
+{
+    std::vector<int> cpus;
+    std::vector<int> nodes;
+};
+
+ThreadPlacement placeThreads(const CpuTopology& topology, int threads);
+
+// Pins the calling thread to one CPU. Returns false (and leaves it unpinned) if the system refuses.
+bool pinCurrentThread(int cpu);
+
+// Lets the calling thread run on every allowed CPU again
+void unpinCurrentThread();
+
+// One copy of the scene per NUMA node. Each copy is loaded and built on a thread pinned to its node, so with the
+// kernel's first touch policy its vertices, triangles and BVH nodes are allocated in that node's memory.
+class SceneReplicas
+{
+    public:
+
+    SceneReplicas();
+    ~SceneReplicas();
+
+    // Calls load once per node of the topology, on a thread pinned to that node. Returns false if any load fails.
+    // With a single node this is just one load on the calling thread.
+    bool load(const CpuTopology& topology, const std::function<bool(Scene&)>& loadScene);
+
+    int nodeCount() const {return int(scenes.size());}
+
+    // The copy for a node index of the topology the replicas were loaded with
+    const Scene& forNode(int node) const;
+
+    private:
+
+    std::vector<std::unique_ptr<Scene>> scenes;
+};
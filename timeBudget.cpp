@@ -0,0 +1,179 @@
+/*
+Contains the deadline driven render loop.
+
+*/
+
+#include "timeBudget.h"
+#include "trace.h"
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsBetween(Clock::time_point a, Clock::time_point b)
+{
+    return std::chrono::duration<double>(b - a).count();
+}
+
+RenderStats renderWithBudget(const Scene& scene, MISIntegrator& integrator, const Camera& camera,
+    RenderSettings settings, const BudgetSettings& budget, Image& image)
+{
+    TRACE_SCOPE("budget render");
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(budget.seconds));
+
+    const int width = settings.imageWidth;
+    const int height = settings.imageHeight;
+
+    // stops whatever pass is running at the deadline; woken early once the loop is done
+    std::atomic<bool> expired(false);
+    std::mutex timerMutex;
+    std::condition_variable timerWake;
+    bool finished = false;
+    std::thread timer([&]() {
+        std::unique_lock<std::mutex> lock(timerMutex);
+        if (!timerWake.wait_until(lock, deadline, [&]() { return finished; }))
+            expired = true;
+    });
+
+    const bool denoise = settings.denoise;
+    settings.denoise = false;
+    settings.cancel = &expired;
+    settings.progressiveOutput.clear();
+    settings.heatmapPrefix.clear();
+    settings.showProgress = false;
+    settings.sampleCount = 1;
+
+    RenderStats total;
+    total.threads = resolveThreadCount(settings.threads);
+
+    Clock::time_point lastSnapshot = start;
+    auto snapshot = [&](Image& current) {
+        if (budget.snapshotFile.empty())
+            return;
+        current.saveImageBMP(budget.snapshotFile);
+        lastSnapshot = Clock::now();
+    };
+
+    // coarse preview: the same view at a fraction of the resolution, scaled back up
+    int scale = std::max(1, budget.previewScale);
+    RenderSettings previewSettings = settings;
+    previewSettings.imageWidth = std::max(1, width / scale);
+    previewSettings.imageHeight = std::max(1, height / scale);
+    Image preview(previewSettings.imageWidth, previewSettings.imageHeight);
+    RenderStats previewStats = renderImage(scene, integrator, camera, previewSettings, preview);
+    total.rays += previewStats.rays;
+
+    if (!previewStats.cancelled)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+                image.setColor(x, y, preview.getColor(std::min(x / scale, preview.getWidth() - 1),
+                    std::min(y / scale, preview.getHeight() - 1)));
+        }
+        snapshot(image);
+    }
+
+    // full resolution passes, averaged in `sum`
+    std::vector<Color> sum(width * height);
+    std::unique_ptr<AuxiliaryImages> aux, auxSum;
+    if (denoise)
+    {
+        aux = std::make_unique<AuxiliaryImages>(width, height);
+        auxSum = std::make_unique<AuxiliaryImages>(width, height);
+    }
+
+    Image pass(width, height);
+    int passes = 0;
+    double longestPass = 0;
+
+    while (!expired)
+    {
+        // do not start a pass that would most likely be thrown away
+        double remaining = secondsBetween(Clock::now(), deadline);
+        if (passes > 0 && remaining < longestPass)
+            break;
+
+        Clock::time_point passStart = Clock::now();
+        settings.firstSample = passes;
+        RenderStats stats = renderImage(scene, integrator, camera, settings, pass, aux.get());
+        total.rays += stats.rays;
+        if (stats.cancelled)
+            break;
+
+        passes++;
+        longestPass = std::max(longestPass, secondsBetween(passStart, Clock::now()));
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                sum[y * width + x] += pass.getColor(x, y);
+                if (aux)
+                {
+                    auxSum->albedo.setColor(x, y, auxSum->albedo.getColor(x, y) + aux->albedo.getColor(x, y));
+                    auxSum->normal.setColor(x, y, auxSum->normal.getColor(x, y) + aux->normal.getColor(x, y));
+                    auxSum->depth.setColor(x, y, auxSum->depth.getColor(x, y) + aux->depth.getColor(x, y));
+                }
+            }
+        }
+
+        if (!budget.snapshotFile.empty() && secondsBetween(lastSnapshot, Clock::now()) >= budget.snapshotInterval)
+        {
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                    pass.setColor(x, y, sum[y * width + x] / passes);
+            }
+            snapshot(pass);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        finished = true;
+    }
+    timerWake.notify_one();
+    timer.join();
+
+    if (passes == 0)
+    {
+        std::cerr << "Warning: The time budget ran out before a full resolution pass finished, "
+            << (previewStats.cancelled ? "the image is empty" : "keeping the preview") << "\n";
+    }
+    else
+    {
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+                image.setColor(x, y, sum[y * width + x] / passes);
+        }
+
+        if (denoise)
+        {
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    auxSum->albedo.setColor(x, y, auxSum->albedo.getColor(x, y) / passes);
+                    auxSum->normal.setColor(x, y, auxSum->normal.getColor(x, y) / passes);
+                    auxSum->depth.setColor(x, y, auxSum->depth.getColor(x, y) / passes);
+                }
+            }
+            denoiseImage(image, *auxSum, settings.denoiseSettings);
+        }
+    }
+
+    total.seconds = secondsBetween(start, Clock::now());
+    total.samples = (unsigned long long)passes * width * height;
+    return total;
+}
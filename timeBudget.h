@@ -0,0 +1,34 @@
+/*
+Contains deadline driven rendering, which makes the best image it can within a wall clock budget instead of taking
+a fixed number of samples.
+
+It first renders a coarse preview (one sample for every block of pixels), then adds full resolution passes of one
+sample per pixel until the budget runs out. A pass that would not finish in time is not started, and one that
+runs past the deadline anyway is stopped and thrown away, so every pixel of the result has the same number of
+samples.
+
+*/
+
+#pragma once
+
+#include <string>
+#include "renderer.h"
+
+struct BudgetSettings
+{
+    // Wall clock time for the whole render, preview included
+    double seconds = 30;
+
+    // The preview renders one pixel for every previewScale x previewScale block
+    int previewScale = 4;
+
+    // If not empty, the current image is saved here after the preview and then at most every snapshotInterval
+    // seconds, so it can be watched while rendering
+    std::string snapshotFile;
+    double snapshotInterval = 2.0;
+};
+
+// Renders into image (the full image size) until the budget runs out. settings.sampleCount is ignored, and
+// everything else (threads, seeds, denoising) applies as usual. The returned samples are full resolution ones.
+RenderStats renderWithBudget(const Scene& scene, MISIntegrator& integrator, const Camera& camera,
+    RenderSettings settings, const BudgetSettings& budget, Image& image);
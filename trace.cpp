@@ -0,0 +1,135 @@
+/*
+Contains the per-thread trace buffers and the Chrome trace event JSON export.
+
+*/
+
+#include "trace.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <iomanip>
+
+const size_t TRACE_BUFFER_EVENTS = 1 << 16;
+
+struct TraceBuffer
+{
+    std::vector<TraceEvent> events;
+    std::atomic<unsigned long long> written;
+    int threadIndex;
+
+    TraceBuffer(int index) : events(TRACE_BUFFER_EVENTS), written(0), threadIndex(index) {}
+};
+
+std::atomic<bool> tracingEnabled(false);
+
+static std::chrono::steady_clock::time_point traceEpoch = std::chrono::steady_clock::now();
+
+// buffers belong to the registry rather than to their thread, so they can still be exported after it exits
+static std::mutex registryMutex;
+static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+static thread_local TraceBuffer* localBuffer = nullptr;
+
+long long traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+void startTracing()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (auto& buffer : buffers)
+        buffer->written.store(0);
+    traceEpoch = std::chrono::steady_clock::now();
+    tracingEnabled = true;
+}
+
+void stopTracing()
+{
+    tracingEnabled = false;
+}
+
+void recordTraceEvent(const char* name, long long arg, long long start, long long end)
+{
+    if (localBuffer == nullptr)
+    {
+        // first event on this thread; the only time recording locks
+        std::lock_guard<std::mutex> lock(registryMutex);
+        buffers.push_back(std::make_unique<TraceBuffer>(buffers.size()));
+        localBuffer = buffers.back().get();
+    }
+
+    unsigned long long slot = localBuffer->written.load(std::memory_order_relaxed);
+    TraceEvent& event = localBuffer->events[slot % TRACE_BUFFER_EVENTS];
+    std::strncpy(event.name, name, TRACE_NAME_LENGTH - 1);
+    event.name[TRACE_NAME_LENGTH - 1] = '\0';
+    event.arg = arg;
+    event.start = start;
+    event.duration = end - start;
+
+    // publish the event only after it is fully written
+    localBuffer->written.store(slot + 1, std::memory_order_release);
+}
+
+static void writeEscaped(std::ostream& out, const char* text)
+{
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+            out << '\\';
+        if ((unsigned char)*text >= 0x20)
+            out << *text;
+    }
+}
+
+bool writeTrace(const std::string& fileName)
+{
+    std::ofstream out(fileName);
+    if (!out.is_open())
+    {
+        std::cerr << "Error: Could not open " << fileName << " for writing\n";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    size_t dropped = 0;
+
+    for (const auto& buffer : buffers)
+    {
+        unsigned long long written = buffer->written.load(std::memory_order_acquire);
+        if (written == 0)
+            continue;
+
+        if (!first) out << ",\n";
+        first = false;
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadIndex
+            << ",\"args\":{\"name\":\"thread " << buffer->threadIndex << "\"}}";
+
+        // once the ring wrapped, only the newest TRACE_BUFFER_EVENTS events are still there
+        unsigned long long begin = written > TRACE_BUFFER_EVENTS ? written - TRACE_BUFFER_EVENTS : 0;
+        dropped += begin;
+        for (unsigned long long k = begin; k < written; k++)
+        {
+            const TraceEvent& event = buffer->events[k % TRACE_BUFFER_EVENTS];
+            out << ",\n{\"name\":\"";
+            writeEscaped(out, event.name);
+            // timestamps are in microseconds
+            out << "\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadIndex
+                << ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << event.duration / 1000.0;
+            if (event.arg != -1)
+                out << ",\"args\":{\"index\":" << event.arg << "}";
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+
+    if (dropped > 0)
+        std::cerr << "Warning: " << dropped << " trace events were overwritten before being written out\n";
+    return out.good();
+}
@@ -0,0 +1,74 @@
+/*
+Contains the optional timeline tracing, which records when each thread was busy with what (scene loading, building,
+render columns, image writes) and exports it in the Chrome trace event format. The file can be opened offline in
+chrome://tracing or https://ui.perfetto.dev.
+
+Tracing is off unless startTracing is called, and then costs one branch per TRACE_SCOPE. Each thread writes its
+events into its own fixed size ring buffer, so recording never takes a lock; when a buffer fills up, the oldest
+events are overwritten.
+
+*/
+
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+const int TRACE_NAME_LENGTH = 40;
+
+struct TraceEvent
+{
+    char name[TRACE_NAME_LENGTH];
+    long long arg;      // shown in the viewer as "index" unless it is -1
+    long long start;    // nanoseconds since startTracing
+    long long duration;
+};
+
+extern std::atomic<bool> tracingEnabled;
+
+void startTracing();
+void stopTracing();
+
+// Writes every recorded event to a Chrome trace event JSON file. Only call it while nothing is being traced.
+bool writeTrace(const std::string& fileName);
+
+long long traceNow();
+void recordTraceEvent(const char* name, long long arg, long long start, long long end);
+
+// Records the time between its construction and destruction as one event on the current thread.
+// The name is copied when tracing is on (and cut to TRACE_NAME_LENGTH), so it does not have to outlive the scope.
+class TraceScope
+{
+    public:
+    TraceScope(const char* name, long long arg = -1) : active(tracingEnabled.load(std::memory_order_relaxed))
+    {
+        if (active)
+        {
+            std::strncpy(eventName, name, TRACE_NAME_LENGTH - 1);
+            eventName[TRACE_NAME_LENGTH - 1] = '\0';
+            eventArg = arg;
+            start = traceNow();
+        }
+    }
+
+    ~TraceScope()
+    {
+        if (active)
+            recordTraceEvent(eventName, eventArg, start, traceNow());
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    private:
+    bool active;
+    char eventName[TRACE_NAME_LENGTH];
+    long long eventArg = -1;
+    long long start = 0;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)